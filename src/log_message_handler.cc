@@ -32,6 +32,7 @@
 #include "base/debug/stack_trace.h"
 #include "base/logging.h"
 #include "net/instaweb/public/version.h"
+#include "ngx_log_ring.h"
 #include "pagespeed/kernel/base/string_util.h"
 
 // Make sure we don't attempt to use LOG macros here, since doing so
@@ -42,6 +43,7 @@
 namespace {
 
 ngx_log_t* ngx_log = NULL;
+net_instaweb::NgxLogRing* log_ring = NULL;
 
 ngx_uint_t GetNgxLogLevel(int severity) {
   switch (severity) {
@@ -63,27 +65,35 @@ bool LogMessageHandler(int severity, const char* file, int line,
                        size_t message_start, const GoogleString& str) {
   ngx_uint_t this_log_level = GetNgxLogLevel(severity);
 
-  GoogleString message = str;
+  // Only a fatal message needs a copy, to add the stack trace to.
+  GoogleString fatal_message;
+  StringPiece message(str);
   if (severity == logging::LOG_FATAL) {
+    fatal_message = str;
     if (base::debug::BeingDebugged()) {
       base::debug::BreakDebugger();
     } else {
       base::debug::StackTrace trace;
       std::ostringstream stream;
       trace.OutputToStream(&stream);
-      message.append(stream.str());
+      fatal_message.append(stream.str());
     }
+    message = fatal_message;
   }
 
   // Trim the newline off the end of the message string.
-  size_t last_msg_character_index = message.length() - 1;
-  if (message[last_msg_character_index] == '\n') {
-    message.resize(last_msg_character_index);
+  if (message.ends_with("\n")) {
+    message.remove_suffix(1);
   }
 
-  ngx_log_error(this_log_level, ngx_log, 0, "[ngx_pagespeed %s] %s",
-                net_instaweb::kModPagespeedVersion,
-                message.c_str());
+  if (log_ring == NULL ||
+      !log_ring->Log(ngx_log, this_log_level, "[ngx_pagespeed %s] %*s",
+                     net_instaweb::kModPagespeedVersion, message.size(),
+                     message.data())) {
+    ngx_log_error(this_log_level, ngx_log, 0, "[ngx_pagespeed %s] %*s",
+                  net_instaweb::kModPagespeedVersion, message.size(),
+                  message.data());
+  }
 
   if (severity == logging::LOG_FATAL) {
     // Crash the process to generate a dump.
@@ -112,6 +122,10 @@ void Install(ngx_log_t* log_in) {
   }
 }
 
+void SetLogRing(NgxLogRing* ring) {
+  log_ring = ring;
+}
+
 }  // namespace log_message_handler
 
 }  // namespace net_instaweb
@@ -31,6 +31,8 @@ extern "C" {
 
 namespace net_instaweb {
 
+class NgxLogRing;
+
 namespace log_message_handler {
 
 // Install a log message handler that routes LOG() messages to the
@@ -40,6 +42,9 @@ namespace log_message_handler {
 // isn't possible.
 void Install(ngx_log_t* log_in);
 
+// Queues the LOG() messages of threads other than nginx's on ring, when set.
+void SetLogRing(NgxLogRing* ring);
+
 }  // namespace log_message_handler
 
 }  // namespace net_instaweb
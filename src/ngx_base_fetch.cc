@@ -32,6 +32,9 @@
 #include "pagespeed/kernel/base/google_message_handler.h"
 #include "pagespeed/kernel/base/message_handler.h"
 #include "pagespeed/kernel/base/posix_timer.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/writer.h"
+#include "pagespeed/kernel/html/html_keywords.h"
 #include "pagespeed/kernel/http/response_headers.h"
 
 namespace net_instaweb {
@@ -40,8 +43,13 @@ const char kHeadersComplete = 'H';
 const char kFlush = 'F';
 const char kDone = 'D';
 
+const char kEventHandoffLatencyHistogram[] =
+    "Event Handoff Latency us Histogram";
+
 NgxEventConnection* NgxBaseFetch::event_connection = NULL;
 int NgxBaseFetch::active_base_fetches = 0;
+NgxBaseFetch* NgxBaseFetch::first_active = NULL;
+pthread_mutex_t NgxBaseFetch::active_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 NgxBaseFetch::NgxBaseFetch(StringPiece url,
                            ngx_http_request_t* r,
@@ -62,19 +70,49 @@ NgxBaseFetch::NgxBaseFetch(StringPiece url,
       base_fetch_type_(base_fetch_type),
       preserve_caching_headers_(preserve_caching_headers),
       detached_(false),
-      suppress_(false) {
+      suppress_(false),
+      prev_active_(NULL),
+      next_active_(NULL),
+      start_msec_(ngx_current_msec),
+      last_event_(0) {
   if (pthread_mutex_init(&mutex_, NULL)) CHECK(0);
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, 1);
+  pthread_mutex_lock(&active_mutex);
+  next_active_ = first_active;
+  if (first_active != NULL) {
+    first_active->prev_active_ = this;
+  }
+  first_active = this;
+  pthread_mutex_unlock(&active_mutex);
 }
 
 NgxBaseFetch::~NgxBaseFetch() {
+  // Unlink first: WriteActive() may be looking at us.
+  pthread_mutex_lock(&active_mutex);
+  if (prev_active_ != NULL) {
+    prev_active_->next_active_ = next_active_;
+  } else {
+    first_active = next_active_;
+  }
+  if (next_active_ != NULL) {
+    next_active_->prev_active_ = prev_active_;
+  }
+  pthread_mutex_unlock(&active_mutex);
   pthread_mutex_destroy(&mutex_);
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, -1);
 }
 
-bool NgxBaseFetch::Initialize(ngx_cycle_t* cycle) {
+void NgxBaseFetch::InitStats(Statistics* statistics) {
+  statistics->AddHistogram(kEventHandoffLatencyHistogram);
+}
+
+bool NgxBaseFetch::Initialize(ngx_cycle_t* cycle, Statistics* statistics,
+                              int handoff_sample_rate) {
   CHECK(event_connection == NULL) << "event connection already set";
   event_connection = new NgxEventConnection(ReadCallback);
+  event_connection->RecordHandoffLatency(
+      statistics->GetHistogram(kEventHandoffLatencyHistogram),
+      handoff_sample_rate);
   return event_connection->Init(cycle);
 }
 
@@ -128,6 +166,49 @@ const char* BaseFetchTypeToCStr(NgxBaseFetchType type) {
   return "can't get here";
 }
 
+const char* EventTypeToCStr(char type) {
+  switch (type) {
+    case kHeadersComplete:
+      return "headers complete";
+    case kFlush:
+      return "flush";
+    case kDone:
+      return "done";
+  }
+  return "none";
+}
+
+void NgxBaseFetch::WriteActive(Writer* writer, MessageHandler* handler) {
+  pthread_mutex_lock(&active_mutex);
+  writer->Write(StrCat("<p>", IntegerToString(active_base_fetches),
+                       " base fetches in flight</p>\n"),
+                handler);
+  writer->Write("<table>\n<tr><th>Type</th><th>Url</th><th>Age ms</th>"
+                "<th>Refcount</th><th>Buffered bytes</th><th>Last event</th>"
+                "<th>Detached</th></tr>\n", handler);
+  for (NgxBaseFetch* p = first_active; p != NULL; p = p->next_active_) {
+    p->Lock();
+    size_t buffered = p->buffer_.size();
+    char last_event = p->last_event_;
+    p->Unlock();
+    GoogleString escaped;
+    HtmlKeywords::Escape(p->url_, &escaped);
+    writer->Write(
+        StrCat("<tr><td>", BaseFetchTypeToCStr(p->base_fetch_type_),
+               "</td><td>", escaped, "</td><td>",
+               Integer64ToString(
+                   static_cast<int64>(ngx_current_msec - p->start_msec_)),
+               "</td><td>",
+               IntegerToString(__sync_add_and_fetch(&p->references_, 0)),
+               "</td><td>", Integer64ToString(buffered), "</td><td>",
+               EventTypeToCStr(last_event), "</td><td>",
+               p->detached_ ? "yes" : "no", "</td></tr>\n"),
+        handler);
+  }
+  pthread_mutex_unlock(&active_mutex);
+  writer->Write("</table>\n", handler);
+}
+
 // TODO(oschaaf): replace the ngx_log_error with VLOGS or pass in a
 // MessageHandler and use that.
 void NgxBaseFetch::ReadCallback(const ps_event_data& data) {
@@ -291,6 +372,9 @@ void NgxBaseFetch::RequestCollection(char type) {
   // both pagespeed and nginx will release their refcount -- destructing
   // this NgxBaseFetch instance.
   IncrementRefCount();
+  Lock();
+  last_event_ = type;
+  Unlock();
   if (!event_connection->WriteEvent(type, this)) {
     DecrementRefCount();
   }
@@ -303,7 +387,8 @@ void NgxBaseFetch::HandleHeadersComplete() {
   if ((base_fetch_type_ != kIproLookup) || status_ok) {
     // If this is a 404 response we need to count it in the stats.
     if (response_headers()->status_code() == HttpStatus::kNotFound) {
-      server_context_->rewrite_stats()->resource_404_count()->Add(1);
+      server_context_->IncrementCounter(
+          NgxServerContext::kResource404Count);
     }
   }
 
@@ -71,6 +71,9 @@ extern "C" {
 
 namespace net_instaweb {
 
+class Statistics;
+class Writer;
+
 enum NgxBaseFetchType {
   kIproLookup,
   kHtmlTransform,
@@ -89,9 +92,13 @@ class NgxBaseFetch : public AsyncFetch {
                const RewriteOptions* options);
   virtual ~NgxBaseFetch();
 
+  static void InitStats(Statistics* statistics);
+
   // Statically initializes event_connection, require for PSOL and nginx to
-  // communicate.
-  static bool Initialize(ngx_cycle_t* cycle);
+  // communicate.  The event handoff latency of one in handoff_sample_rate
+  // events is recorded in statistics.
+  static bool Initialize(ngx_cycle_t* cycle, Statistics* statistics,
+                         int handoff_sample_rate);
 
   // Attempts to finish up request processing queued up in the named pipe and
   // PSOL for a fixed amount of time. If time is up, a fast and rough shutdown
@@ -101,6 +108,11 @@ class NgxBaseFetch : public AsyncFetch {
 
   static void ReadCallback(const ps_event_data& data);
 
+  // Writes a table of the NgxBaseFetch instances alive in this process: their
+  // type, url, age, refcount, buffered bytes and the last event they sent.
+  // Only on the nginx thread.
+  static void WriteActive(Writer* writer, MessageHandler* handler);
+
   // Puts a chain in link_ptr if we have any output data buffered.  Returns
   // NGX_OK on success, NGX_ERROR on errors.  If there's no data to send, sends
   // data only if Done() has been called.  Indicates the end of output by
@@ -166,6 +178,10 @@ class NgxBaseFetch : public AsyncFetch {
 
   // Live count of NgxBaseFetch instances that are currently in use.
   static int active_base_fetches;
+  // The instances in use, linked through prev_active_ and next_active_.
+  // Guarded by active_mutex.
+  static NgxBaseFetch* first_active;
+  static pthread_mutex_t active_mutex;
 
   GoogleString url_;
   ngx_http_request_t* request_;
@@ -186,6 +202,12 @@ class NgxBaseFetch : public AsyncFetch {
   // Set to true just before the nginx side releases its reference
   bool detached_;
   bool suppress_;
+  NgxBaseFetch* prev_active_;
+  NgxBaseFetch* next_active_;
+  // When nginx created us, for WriteActive().
+  ngx_msec_t start_msec_;
+  // The type of the last event we sent to nginx, 0 for none yet.
+  char last_event_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxBaseFetch);
 };
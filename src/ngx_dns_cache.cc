@@ -0,0 +1,267 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+extern "C" {
+#include <nginx.h>
+}
+
+#include "ngx_dns_cache.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Used when the resolver doesn't tell us how long its answer is valid.
+const ngx_msec_t kDefaultTtlMs = 30 * 1000;
+const ngx_msec_t kMinTtlMs = 1000;
+const ngx_msec_t kMaxTtlMs = 60 * 60 * 1000;
+// How long a failure to resolve a host is remembered.
+const ngx_msec_t kNegativeTtlMs = 5 * 1000;
+// Entries are refreshed when looked up during the last 1/kRefreshFraction of
+// their ttl.
+const ngx_msec_t kRefreshFraction = 5;
+const size_t kMaxEntries = 1024;
+
+const char kDnsCacheHits[] = "native_fetch_dns_cache_hits";
+const char kDnsCacheMisses[] = "native_fetch_dns_cache_misses";
+const char kDnsCacheNegativeHits[] = "native_fetch_dns_cache_negative_hits";
+const char kDnsCacheRefreshes[] = "native_fetch_dns_cache_refreshes";
+
+// Whether the ngx_current_msec based time a is past b.
+bool After(ngx_msec_t a, ngx_msec_t b) {
+  return static_cast<ngx_msec_int_t>(a - b) >= 0;
+}
+
+}  // namespace
+
+NgxDnsCache::NgxDnsCache(ngx_resolver_t* resolver,
+                         ngx_msec_t resolver_timeout,
+                         Statistics* statistics)
+    : resolver_(resolver),
+      resolver_timeout_(resolver_timeout),
+      hits_(statistics->GetVariable(kDnsCacheHits)),
+      misses_(statistics->GetVariable(kDnsCacheMisses)),
+      negative_hits_(statistics->GetVariable(kDnsCacheNegativeHits)),
+      refreshes_started_(statistics->GetVariable(kDnsCacheRefreshes)) {
+}
+
+NgxDnsCache::~NgxDnsCache() {
+  for (std::set<Refresh*>::iterator p = refreshes_.begin(),
+       e = refreshes_.end(); p != e; ++p) {
+    ngx_resolve_name_done((*p)->ctx);
+    delete *p;
+  }
+  refreshes_.clear();
+}
+
+void NgxDnsCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kDnsCacheHits);
+  statistics->AddVariable(kDnsCacheMisses);
+  statistics->AddVariable(kDnsCacheNegativeHits);
+  statistics->AddVariable(kDnsCacheRefreshes);
+}
+
+NgxDnsCache::LookupResult NgxDnsCache::Lookup(StringPiece host,
+                                              AddressVector* addresses) {
+  EntryMap::iterator iter = entries_.find(host.as_string());
+  if (iter == entries_.end()) {
+    misses_->Add(1);
+    return kMiss;
+  }
+  Entry* entry = &iter->second;
+  ngx_msec_t now = ngx_current_msec;
+  if (After(now, entry->expires)) {
+    if (entry->refreshing) {
+      // Leave the entry to the refresh that is under way.
+      misses_->Add(1);
+      return kMiss;
+    }
+    entries_.erase(iter);
+    misses_->Add(1);
+    return kMiss;
+  }
+  if (entry->addresses.empty()) {
+    negative_hits_->Add(1);
+    return kNegativeHit;
+  }
+
+  hits_->Add(1);
+  *addresses = entry->addresses;
+  if (!entry->refreshing &&
+      After(now, entry->expires - entry->ttl_ms / kRefreshFraction)) {
+    StartRefresh(iter->first, entry);
+  }
+  return kHit;
+}
+
+void NgxDnsCache::Insert(StringPiece host, ngx_resolver_ctx_t* ctx,
+                         AddressVector* addresses) {
+  addresses->clear();
+  if (ctx->state == NGX_OK) {
+    GetAddresses(ctx, addresses);
+  }
+  Entry* entry = NewEntry(host);
+  entry->addresses = *addresses;
+  entry->ttl_ms = addresses->empty() ? kNegativeTtlMs : TtlMs(ctx);
+  entry->expires = ngx_current_msec + entry->ttl_ms;
+}
+
+NgxDnsCache::Entry* NgxDnsCache::NewEntry(StringPiece host) {
+  GoogleString key = host.as_string();
+  EntryMap::iterator iter = entries_.find(key);
+  if (iter != entries_.end()) {
+    return &iter->second;
+  }
+
+  if (entries_.size() >= kMaxEntries) {
+    // Drop what has expired, and if that's not enough the entry that is
+    // closest to expiring.  Entries being refreshed are left alone, as their
+    // refresh refers to them.
+    ngx_msec_t now = ngx_current_msec;
+    EntryMap::iterator victim = entries_.end();
+    for (EntryMap::iterator p = entries_.begin(); p != entries_.end();) {
+      if (p->second.refreshing) {
+        ++p;
+      } else if (After(now, p->second.expires)) {
+        entries_.erase(p++);
+      } else {
+        if (victim == entries_.end() ||
+            After(victim->second.expires, p->second.expires)) {
+          victim = p;
+        }
+        ++p;
+      }
+    }
+    if (entries_.size() >= kMaxEntries && victim != entries_.end()) {
+      entries_.erase(victim);
+    }
+  }
+
+  Entry* entry = &entries_[key];
+  entry->ttl_ms = 0;
+  entry->expires = ngx_current_msec;
+  entry->refreshing = false;
+  return entry;
+}
+
+void NgxDnsCache::StartRefresh(const GoogleString& host, Entry* entry) {
+  ngx_resolver_ctx_t temp;
+  temp.name.data = reinterpret_cast<u_char*>(const_cast<char*>(host.data()));
+  temp.name.len = host.size();
+  ngx_resolver_ctx_t* ctx = ngx_resolve_start(resolver_, &temp);
+  if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+    return;
+  }
+
+  Refresh* refresh = new Refresh;
+  refresh->cache = this;
+  refresh->host = host;
+  refresh->ctx = ctx;
+  refreshes_.insert(refresh);
+  entry->refreshing = true;
+  refreshes_started_->Add(1);
+
+  ctx->name.data = reinterpret_cast<u_char*>(
+      const_cast<char*>(refresh->host.data()));
+  ctx->name.len = refresh->host.size();
+#if (nginx_version < 1005008)
+  ctx->type = NGX_RESOLVE_A;
+#endif
+  ctx->handler = NgxDnsCache::RefreshDoneHandler;
+  ctx->data = refresh;
+  ctx->timeout = resolver_timeout_;
+
+  // The handler may well run before this returns.
+  if (ngx_resolve_name(ctx) != NGX_OK) {
+    refreshes_.erase(refresh);
+    entry->refreshing = false;
+    delete refresh;
+  }
+}
+
+void NgxDnsCache::RefreshDoneHandler(ngx_resolver_ctx_t* ctx) {
+  Refresh* refresh = static_cast<Refresh*>(ctx->data);
+  NgxDnsCache* cache = refresh->cache;
+
+  EntryMap::iterator iter = cache->entries_.find(refresh->host);
+  CHECK(iter != cache->entries_.end());
+  Entry* entry = &iter->second;
+  entry->refreshing = false;
+
+  AddressVector addresses;
+  if (ctx->state == NGX_OK) {
+    GetAddresses(ctx, &addresses);
+  }
+  // A failed refresh leaves the entry as is; it will expire on its own.
+  if (!addresses.empty()) {
+    entry->addresses = addresses;
+    entry->ttl_ms = TtlMs(ctx);
+    entry->expires = ngx_current_msec + entry->ttl_ms;
+  }
+
+  ngx_resolve_name_done(ctx);
+  cache->refreshes_.erase(refresh);
+  delete refresh;
+}
+
+void NgxDnsCache::GetAddresses(ngx_resolver_ctx_t* ctx,
+                               AddressVector* addresses) {
+  for (ngx_uint_t i = 0; i < ctx->naddrs; ++i) {
+    Address address;
+    ngx_memzero(&address, sizeof(address));
+#if (nginx_version < 1005008)
+    struct sockaddr_in* sin =
+        reinterpret_cast<struct sockaddr_in*>(address.sockaddr);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = ctx->addrs[i];
+    address.socklen = sizeof(struct sockaddr_in);
+#else
+    if (ctx->addrs[i].socklen > sizeof(address.sockaddr)) {
+      continue;
+    }
+    ngx_memcpy(address.sockaddr, ctx->addrs[i].sockaddr,
+               ctx->addrs[i].socklen);
+    address.socklen = ctx->addrs[i].socklen;
+#endif
+    addresses->push_back(address);
+  }
+}
+
+ngx_msec_t NgxDnsCache::TtlMs(ngx_resolver_ctx_t* ctx) {
+  ngx_msec_t ttl_ms = kDefaultTtlMs;
+#if (nginx_version >= 1011000)
+  // valid is when the resolver's own cache entry expires, which honors both
+  // the record's TTL and the valid= parameter of the resolver directive.
+  time_t valid_s = ctx->valid - ngx_time();
+  if (valid_s > 0) {
+    ttl_ms = static_cast<ngx_msec_t>(valid_s) * 1000;
+  } else {
+    ttl_ms = kMinTtlMs;
+  }
+#endif
+  return std::max(kMinTtlMs, std::min(kMaxTtlMs, ttl_ms));
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,122 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxDnsCache remembers the addresses nginx's resolver returned for the hosts
+// the native fetcher talks to, so that most fetches can connect right away
+// instead of setting up a resolver context and waiting for its callback.
+// Entries expire with the TTL the resolver reports, and failures to resolve a
+// host are cached for a short while too.  When a host is looked up while its
+// entry is about to expire, it is re-resolved in the background, so fetches to
+// busy origins don't stall on the resolver.
+//
+// There is one cache per NgxUrlAsyncFetcher, and so per worker.  It is only
+// used on the nginx thread.
+
+#ifndef NGX_DNS_CACHE_H_
+#define NGX_DNS_CACHE_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class Statistics;
+class Variable;
+
+class NgxDnsCache {
+ public:
+  struct Address {
+    socklen_t socklen;
+    u_char sockaddr[NGX_SOCKADDRLEN];
+  };
+  typedef std::vector<Address> AddressVector;
+
+  enum LookupResult {
+    kMiss,
+    kHit,
+    // Resolving the host failed recently, don't try again yet.
+    kNegativeHit,
+  };
+
+  NgxDnsCache(ngx_resolver_t* resolver, ngx_msec_t resolver_timeout,
+              Statistics* statistics);
+  ~NgxDnsCache();
+
+  static void InitStats(Statistics* statistics);
+
+  // On a hit, fills addresses with the cached addresses of host.  Ports are
+  // left unset.
+  LookupResult Lookup(StringPiece host, AddressVector* addresses);
+
+  // Caches the outcome of resolving host with ctx, which must have completed,
+  // and returns the addresses it yielded.
+  void Insert(StringPiece host, ngx_resolver_ctx_t* ctx,
+              AddressVector* addresses);
+
+ private:
+  struct Entry {
+    AddressVector addresses;
+    ngx_msec_t ttl_ms;
+    ngx_msec_t expires;
+    bool refreshing;
+  };
+  typedef std::map<GoogleString, Entry> EntryMap;
+
+  // A background lookup of a host whose entry is about to expire.
+  struct Refresh {
+    NgxDnsCache* cache;
+    GoogleString host;
+    ngx_resolver_ctx_t* ctx;
+  };
+
+  static void GetAddresses(ngx_resolver_ctx_t* ctx, AddressVector* addresses);
+  static ngx_msec_t TtlMs(ngx_resolver_ctx_t* ctx);
+  static void RefreshDoneHandler(ngx_resolver_ctx_t* ctx);
+
+  Entry* NewEntry(StringPiece host);
+  void StartRefresh(const GoogleString& host, Entry* entry);
+
+  ngx_resolver_t* resolver_;
+  ngx_msec_t resolver_timeout_;
+  EntryMap entries_;
+  std::set<Refresh*> refreshes_;
+
+  Variable* hits_;
+  Variable* misses_;
+  Variable* negative_hits_;
+  Variable* refreshes_started_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxDnsCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_DNS_CACHE_H_
@@ -29,11 +29,31 @@ extern "C" {
 
 #include "pagespeed/kernel/base/google_message_handler.h"
 #include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/statistics.h"
 
 namespace net_instaweb {
 
   NgxEventConnection::NgxEventConnection(callbackPtr callback)
-    : event_handler_(callback) {
+    : event_handler_(callback),
+      handoff_histogram_(NULL),
+      handoff_sample_rate_(0),
+      handoff_sample_count_(0) {
+}
+
+void NgxEventConnection::RecordHandoffLatency(Histogram* histogram,
+                                              int sample_rate) {
+  if (sample_rate > 0) {
+    handoff_histogram_ = histogram;
+    handoff_sample_rate_ = sample_rate;
+  }
+}
+
+// Events are written from PSOL's threads, where nginx's cached time is not
+// maintained, so ask the system clock.
+int64 NgxEventConnection::NowUs() {
+  struct timeval tv;
+  ngx_gettimeofday(&tv);
+  return static_cast<int64>(tv.tv_sec) * 1000000 + tv.tv_usec;
 }
 
 bool NgxEventConnection::Init(ngx_cycle_t* cycle) {
@@ -130,6 +150,9 @@ bool NgxEventConnection::ReadAndNotify(ngx_fd_t fd) {
       return false;
     }
 
+    if (data.sent_us != 0) {
+      data.connection->handoff_histogram_->Add(NowUs() - data.sent_us);
+    }
     data.connection->event_handler_(data);
     return true;
   }
@@ -147,6 +170,13 @@ bool NgxEventConnection::WriteEvent(char type, void* sender) {
   data.type = type;
   data.sender = sender;
   data.connection = this;
+  // Reading the clock and adding to the shared histogram, under its
+  // cross-process lock, is too much to do for every event.
+  if (handoff_sample_rate_ > 0 &&
+      __sync_add_and_fetch(&handoff_sample_count_, 1) %
+          handoff_sample_rate_ == 0) {
+    data.sent_us = NowUs();
+  }
 
   while (true) {
     size = write(pipe_write_fd_,
@@ -33,21 +33,25 @@ extern "C" {
 
 #include <pthread.h>
 
+#include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/http/headers.h"
 
 namespace net_instaweb {
 
+class Histogram;
 class NgxEventConnection;
 
 // Represents a single event that can be written to or read from the pipe.
 // Technically, sender is the only data we need to send. type and connection are
 // included to provide a means to trace the events along with some more
-// info.
+// info.  sent_us is only filled in for the events the connection samples for
+// the handoff latency histogram, and is 0 otherwise.
 typedef struct {
   char type;
   void* sender;
   NgxEventConnection* connection;
+  int64 sent_us;
 } ps_event_data;
 
 // Handler signature for receiving events
@@ -58,6 +62,10 @@ class NgxEventConnection {
  public:
   explicit NgxEventConnection(callbackPtr handler);
 
+  // Records the time between writing an event and nginx picking it up in
+  // histogram, for one in sample_rate events.  0 records none.
+  void RecordHandoffLatency(Histogram* histogram, int sample_rate);
+
   // Creates the file descriptors and ngx_connection_t required for event
   // messaging between pagespeed and nginx.
   bool Init(ngx_cycle_t* cycle);
@@ -73,8 +81,13 @@ class NgxEventConnection {
   static bool CreateNgxConnection(ngx_cycle_t* cycle, ngx_fd_t pipe_fd);
   static void ReadEventHandler(ngx_event_t* e);
   static bool ReadAndNotify(ngx_fd_t fd);
+  static int64 NowUs();
 
   callbackPtr event_handler_;
+  Histogram* handoff_histogram_;
+  int handoff_sample_rate_;
+  // Counts written events, to pick the ones to sample.
+  volatile int handoff_sample_count_;
   // We own these file descriptors
   ngx_fd_t pipe_write_fd_;
   ngx_fd_t pipe_read_fd_;
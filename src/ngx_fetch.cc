@@ -27,25 +27,22 @@
 //  - The read handler parses the response. Add the response to the buffer at
 //    last.
 
-// TODO(oschaaf): Currently the first applicable connection is picked from the
-// pool when re-using connections. Perhaps it would be worth it to pick the one
-// that was active the longest time ago to keep a larger pool available.
 // TODO(oschaaf): style: reindent namespace according to google C++ style guide
-// TODO(oschaaf): Retry mechanism for failures on a re-used k-a connection.
-// Currently we don't think it's going to be an issue, see the comments at
-// https://github.com/apache/incubator-pagespeed-ngx/pull/781.
 
 extern "C" {
 #include <nginx.h>
 }
 
 #include "ngx_fetch.h"
+#include "ngx_dns_cache.h"
+#include "ngx_http2_session.h"
+#include "ngx_server_context.h"
+#include "ngx_shared_inflight.h"
 
 #include "base/logging.h"
 
 #include <algorithm>
 #include <string>
-#include <typeinfo>
 #include <vector>
 
 #include "net/instaweb/http/public/async_fetch.h"
@@ -64,25 +61,332 @@ extern "C" {
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/base/writer.h"
+#include "pagespeed/kernel/http/content_type.h"
+#include "pagespeed/kernel/http/google_url.h"
 #include "pagespeed/kernel/http/request_headers.h"
 #include "pagespeed/kernel/http/response_headers.h"
 #include "pagespeed/kernel/http/response_headers_parser.h"
 
 namespace net_instaweb {
 
-NgxConnection::NgxConnectionPool NgxConnection::connection_pool;
-PthreadMutex NgxConnection::connection_pool_mutex;
 // Default keepalive 60s.
 const int64 NgxConnection::keepalive_timeout_ms = 60000;
 const GoogleString NgxConnection::ka_header =
     StrCat("keep-alive ",
            Integer64ToString(NgxConnection::keepalive_timeout_ms));
 
-NgxConnection::NgxConnection(MessageHandler* handler,
+namespace {
+
+// Closes c, without waiting for the origin to acknowledge an ssl shutdown.
+void CloseConnection(ngx_connection_t* c) {
+#if (NGX_SSL)
+  if (c->ssl != NULL) {
+    c->ssl->no_wait_shutdown = 1;
+    (void) ngx_ssl_shutdown(c);
+  }
+#endif
+  ngx_close_connection(c);
+}
+
+// Request headers that don't select a different response, and so don't keep
+// identical fetches from sharing a single origin request.
+const char* const kCoalesceIgnoredHeaders[] = {
+  "Connection", "Keep-Alive", "Referer", "Via", "X-Forwarded-For",
+};
+
+bool IgnoredForCoalescing(StringPiece name) {
+  for (size_t i = 0; i < arraysize(kCoalesceIgnoredHeaders); ++i) {
+    if (StringCaseEqual(name, kCoalesceIgnoredHeaders[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Request headers that are about the HTTP/1 connection, which HTTP/2 does
+// without, and Host, which becomes the :authority pseudo-header.
+const char* const kHttp2IgnoredHeaders[] = {
+  "Connection", "Host", "Keep-Alive", "Proxy-Connection", "TE",
+  "Transfer-Encoding", "Upgrade",
+};
+
+bool IgnoredForHttp2(StringPiece name) {
+  for (size_t i = 0; i < arraysize(kHttp2IgnoredHeaders); ++i) {
+    if (StringCaseEqual(name, kHttp2IgnoredHeaders[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Responses are first read into a buffer this large, which grows from there.
+const size_t kInitialReceiveBufferSize = 4096;
+
+// How often a fetch looks whether the worker it waits for is done.
+const ngx_msec_t kSharedPollIntervalMs = 10;
+
+// How long a connection attempt gets before the next address is tried
+// alongside it, as recommended by RFC 8305.
+const ngx_msec_t kConnectAttemptDelayMs = 250;
+
+// The host of url, without the brackets around an IPv6 address.
+StringPiece UrlHost(const ngx_url_t* url) {
+  StringPiece host(reinterpret_cast<char*>(url->host.data), url->host.len);
+  if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  return host;
+}
+
+// Fills address when host is an IPv4 or IPv6 address rather than a name.
+bool ParseAddress(StringPiece host, NgxDnsCache::Address* address) {
+  ngx_memzero(address, sizeof(*address));
+  u_char* text = reinterpret_cast<u_char*>(const_cast<char*>(host.data()));
+  in_addr_t addr = ngx_inet_addr(text, host.size());
+  if (addr != INADDR_NONE) {
+    struct sockaddr_in* sin =
+        reinterpret_cast<struct sockaddr_in*>(address->sockaddr);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = addr;
+    address->socklen = sizeof(struct sockaddr_in);
+    return true;
+  }
+#if (NGX_HAVE_INET6)
+  struct sockaddr_in6* sin6 =
+      reinterpret_cast<struct sockaddr_in6*>(address->sockaddr);
+  if (ngx_inet6_addr(text, host.size(), sin6->sin6_addr.s6_addr) == NGX_OK) {
+    sin6->sin6_family = AF_INET6;
+    address->socklen = sizeof(struct sockaddr_in6);
+    return true;
+  }
+#endif
+  return false;
+}
+
+int AddressFamily(const NgxDnsCache::Address& address) {
+  return reinterpret_cast<const struct sockaddr*>(address.sockaddr)->sa_family;
+}
+
+void SetAddressPort(NgxDnsCache::Address* address, in_port_t port) {
+  switch (AddressFamily(*address)) {
+    case AF_INET:
+      reinterpret_cast<struct sockaddr_in*>(address->sockaddr)->sin_port =
+          htons(port);
+      break;
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+      reinterpret_cast<struct sockaddr_in6*>(address->sockaddr)->sin6_port =
+          htons(port);
+      break;
+#endif
+  }
+}
+
+// Whether the connect() on c succeeded, see ngx_http_upstream_test_connect().
+bool TestConnect(ngx_connection_t* c) {
+  int err = 0;
+#if (NGX_HAVE_KQUEUE)
+  if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+    if (c->write->pending_eof || c->read->pending_eof) {
+      err = c->write->pending_eof ? c->write->kq_errno : c->read->kq_errno;
+    }
+  } else  // NOLINT
+#endif
+  {
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR,
+                   reinterpret_cast<void*>(&err), &len) == -1) {
+      err = ngx_socket_errno;
+    }
+  }
+  if (err != 0) {
+    ngx_log_error(NGX_LOG_DEBUG, c->log, err, "NgxFetch: connect() failed");
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+NgxConnectionPool::NgxConnectionPool()
+    : size_(0),
+      max_idle_per_origin_(16),
+      idle_timeout_ms_(NgxConnection::keepalive_timeout_ms) {
+}
+
+NgxConnectionPool::~NgxConnectionPool() {
+  Terminate();
+}
+
+GoogleString NgxConnectionPool::OriginKey(const ngx_peer_connection_t* pc,
+                                          StringPiece ssl_host) {
+  u_char text[NGX_SOCKADDR_STRLEN];
+#if (nginx_version < 1005003)
+  size_t len = ngx_sock_ntop(pc->sockaddr, text, NGX_SOCKADDR_STRLEN,
+                             1 /* port */);
+#else
+  size_t len = ngx_sock_ntop(pc->sockaddr, pc->socklen, text,
+                             NGX_SOCKADDR_STRLEN, 1 /* port */);
+#endif
+  StringPiece address(reinterpret_cast<char*>(text), len);
+  if (ssl_host.empty()) {
+    return address.as_string();
+  }
+  return StrCat("ssl:", ssl_host, "@", address);
+}
+
+NgxConnection* NgxConnectionPool::Take(const GoogleString& key) {
+  OriginMap::iterator it = idle_.find(key);
+  if (it == idle_.end() || it->second->empty()) {
+    return NULL;
+  }
+  // Hand out the connection that was added last: it is the least likely to
+  // have been closed by the origin in the meantime.
+  IdleList* list = it->second;
+  IdleList::iterator newest = list->end();
+  --newest;
+  NgxConnection* nc = *newest;
+  RemoveFromList(it, nc);
+  return nc;
+}
+
+bool NgxConnectionPool::Put(NgxConnection* nc) {
+  CHECK(!nc->pooled_) << "NgxConnection added to the pool twice";
+  if (max_idle_per_origin_ <= 0) {
+    return false;
+  }
+  IdleList*& list = idle_[nc->origin_key()];
+  if (list == NULL) {
+    list = new IdleList();
+  }
+  if (static_cast<int>(list->size()) >= max_idle_per_origin_) {
+    return false;
+  }
+  list->Add(nc);
+  nc->pooled_ = true;
+  size_++;
+  return true;
+}
+
+bool NgxConnectionPool::HasIdle(const GoogleString& key) const {
+  OriginMap::const_iterator it = idle_.find(key);
+  return it != idle_.end() && !it->second->empty();
+}
+
+int NgxConnectionPool::NumIdle(const GoogleString& key) const {
+  int num_idle = 0;
+  OriginMap::const_iterator it = idle_.find(key);
+  if (it != idle_.end()) {
+    num_idle = static_cast<int>(it->second->size());
+  }
+  for (std::set<NgxConnection*>::const_iterator p = warming_.begin();
+       p != warming_.end(); ++p) {
+    if ((*p)->origin_key() == key) {
+      num_idle++;
+    }
+  }
+  return num_idle;
+}
+
+bool NgxConnectionPool::Prewarm(ngx_peer_connection_t* pc,
+                                const GoogleString& key,
+                                MessageHandler* handler,
+                                int max_keepalive_requests,
+                                ngx_msec_t timeout_ms) {
+  int rc = ngx_event_connect_peer(pc);
+  if (rc == NGX_ERROR || rc == NGX_DECLINED || rc == NGX_BUSY) {
+    return false;
+  }
+
+  // Pooling the connection counts as a request, see NgxConnection::Close().
+  NgxConnection* nc =
+      new NgxConnection(this, handler, max_keepalive_requests + 1);
+  nc->SetSock(reinterpret_cast<u_char*>(pc->sockaddr), pc->socklen);
+  nc->origin_key_ = key;
+  nc->c_ = pc->connection;
+  nc->prewarmed_ = true;
+  warming_.insert(nc);
+
+  ngx_log_error(NGX_LOG_DEBUG, pc->log, 0,
+                "NgxFetch: prewarming connection %p to %s", nc, key.c_str());
+  if (rc == NGX_OK) {
+    FinishPrewarm(nc, true);
+    return true;
+  }
+  nc->c_->data = nc;
+  nc->c_->read->handler = NgxConnection::PrewarmHandler;
+  nc->c_->write->handler = NgxConnection::PrewarmHandler;
+  ngx_add_timer(nc->c_->write, timeout_ms);
+  return true;
+}
+
+void NgxConnectionPool::FinishPrewarm(NgxConnection* nc, bool connected) {
+  warming_.erase(nc);
+  if (!connected) {
+    ngx_log_error(NGX_LOG_DEBUG, nc->c_->log, 0,
+                  "NgxFetch: prewarming connection %p to %s failed", nc,
+                  nc->origin_key().c_str());
+    nc->set_keepalive(false);
+  }
+  nc->Close();
+}
+
+void NgxConnectionPool::Remove(NgxConnection* nc) {
+  CHECK(nc->pooled_) << "NgxConnection is not pooled";
+  OriginMap::iterator it = idle_.find(nc->origin_key());
+  CHECK(it != idle_.end());
+  RemoveFromList(it, nc);
+}
+
+void NgxConnectionPool::RemoveFromList(OriginMap::iterator it,
+                                       NgxConnection* nc) {
+  IdleList* list = it->second;
+  list->Remove(nc);
+  nc->pooled_ = false;
+  size_--;
+  // Don't keep an entry around for every origin ever fetched from.
+  if (list->empty()) {
+    delete list;
+    idle_.erase(it);
+  }
+}
+
+void NgxConnectionPool::Terminate() {
+  for (std::set<NgxConnection*>::iterator p = warming_.begin();
+       p != warming_.end(); ++p) {
+    NgxConnection* nc = *p;
+    CloseConnection(nc->c_);
+    nc->c_ = NULL;
+    delete nc;
+  }
+  warming_.clear();
+  for (OriginMap::iterator it = idle_.begin(); it != idle_.end(); ++it) {
+    IdleList* list = it->second;
+    for (IdleList::iterator p = list->begin(); p != list->end(); ++p) {
+      NgxConnection* nc = *p;
+      CloseConnection(nc->c_);
+      nc->c_ = NULL;
+      nc->pooled_ = false;
+      delete nc;
+    }
+    list->Clear();
+    delete list;
+  }
+  idle_.clear();
+  size_ = 0;
+}
+
+NgxConnection::NgxConnection(NgxConnectionPool* pool,
+                             MessageHandler* handler,
                              int max_keepalive_requests) {
   c_ = NULL;
+  pool_ = pool;
+  pooled_ = false;
+  prewarmed_ = false;
   max_keepalive_requests_ = max_keepalive_requests;
   handler_ = handler;
+  receive_buffer_ = NULL;
+  receive_buffer_size_ = 0;
   // max_keepalive_requests specifies the number of http requests that are
   // allowed to be performed over a single connection. So, a
   // max_keepalive_requests of 1 effectively disables keepalive.
@@ -91,54 +395,52 @@ NgxConnection::NgxConnection(MessageHandler* handler,
 
 NgxConnection::~NgxConnection() {
   CHECK(c_ == NULL) << "NgxConnection: Underlying connection should be NULL";
+  delete[] receive_buffer_;
 }
 
-void NgxConnection::Terminate() {
-  for (NgxConnectionPool::iterator p = connection_pool.begin();
-       p != connection_pool.end(); ++p) {
-    NgxConnection* nc = *p;
-    ngx_close_connection(nc->c_);
-    nc->c_ = NULL;
-    delete nc;
+void NgxConnection::GetAddress(NgxDnsCache::Address* address) const {
+  address->socklen = socklen_;
+  ngx_memcpy(address->sockaddr, sockaddr_, socklen_);
+}
+
+u_char* NgxConnection::ReceiveBuffer(size_t size) {
+  if (receive_buffer_size_ < size) {
+    delete[] receive_buffer_;
+    receive_buffer_ = new u_char[size];
+    receive_buffer_size_ = size;
   }
-  connection_pool.Clear();
+  return receive_buffer_;
 }
 
 NgxConnection* NgxConnection::Connect(ngx_peer_connection_t* pc,
+                                      const GoogleString& key,
+                                      NgxConnectionPool* pool,
                                       MessageHandler* handler,
-                                      int max_keepalive_requests) {
-  NgxConnection* nc;
-  {
-    ScopedMutex lock(&NgxConnection::connection_pool_mutex);
-
-    for (NgxConnectionPool::iterator p = connection_pool.begin();
-         p != connection_pool.end(); ++p) {
-      nc = *p;
-
-      if (ngx_memn2cmp(static_cast<u_char*>(nc->sockaddr_),
-                       reinterpret_cast<u_char*>(pc->sockaddr),
-                       nc->socklen_, pc->socklen) == 0) {
-        CHECK(nc->c_->idle) << "Pool should only contain idle connections!";
-
-        nc->c_->idle = 0;
-        nc->c_->log = pc->log;
-        nc->c_->read->log = pc->log;
-        nc->c_->write->log = pc->log;
-        if (nc->c_->pool != NULL) {
-          nc->c_->pool->log = pc->log;
-        }
-
-        if (nc->c_->read->timer_set) {
-          ngx_del_timer(nc->c_->read);
-        }
-        connection_pool.Remove(nc);
+                                      int max_keepalive_requests,
+                                      bool fresh_only,
+                                      bool* reused) {
+  NgxConnection* nc = fresh_only ? NULL : pool->Take(key);
+  *reused = nc != NULL;
+
+  if (nc != NULL) {
+    CHECK(nc->c_->idle) << "Pool should only contain idle connections!";
+
+    nc->c_->idle = 0;
+    nc->c_->log = pc->log;
+    nc->c_->read->log = pc->log;
+    nc->c_->write->log = pc->log;
+    if (nc->c_->pool != NULL) {
+      nc->c_->pool->log = pc->log;
+    }
 
-        ngx_log_error(NGX_LOG_DEBUG, pc->log, 0,
-                      "NgxFetch: re-using connection %p (pool size: %l)",
-                      nc, connection_pool.size());
-        return nc;
-      }
+    if (nc->c_->read->timer_set) {
+      ngx_del_timer(nc->c_->read);
     }
+
+    ngx_log_error(NGX_LOG_DEBUG, pc->log, 0,
+                  "NgxFetch: re-using connection %p to %s (pool size: %d)",
+                  nc, key.c_str(), pool->size());
+    return nc;
   }
 
   int rc = ngx_event_connect_peer(pc);
@@ -147,8 +449,9 @@ NgxConnection* NgxConnection::Connect(ngx_peer_connection_t* pc,
   }
 
   // NgxConnection deletes itself if NgxConnection::Close()
-  nc = new NgxConnection(handler, max_keepalive_requests);
+  nc = new NgxConnection(pool, handler, max_keepalive_requests);
   nc->SetSock(reinterpret_cast<u_char*>(pc->sockaddr), pc->socklen);
+  nc->origin_key_ = key;
   nc->c_ = pc->connection;
   return nc;
 }
@@ -156,21 +459,14 @@ NgxConnection* NgxConnection::Connect(ngx_peer_connection_t* pc,
 void NgxConnection::Close() {
   bool removed_from_pool = false;
 
-  {
-    ScopedMutex lock(&NgxConnection::connection_pool_mutex);
-    for (NgxConnectionPool::iterator p = connection_pool.begin();
-         p != connection_pool.end(); ++p) {
-      if (*p == this) {
-        // When we get here, that means that the connection either has timed
-        // out or has been closed remotely.
-        connection_pool.Remove(this);
-        ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
-                      "NgxFetch: removed connection %p (pool size: %l)",
-                      this, connection_pool.size());
-        removed_from_pool = true;
-        break;
-      }
-    }
+  if (pooled_) {
+    // When we get here, that means that the connection either has timed
+    // out or has been closed remotely.
+    pool_->Remove(this);
+    ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
+                  "NgxFetch: removed connection %p (pool size: %d)",
+                  this, pool_->size());
+    removed_from_pool = true;
   }
 
   max_keepalive_requests_--;
@@ -183,15 +479,16 @@ void NgxConnection::Close() {
     ngx_del_timer(c_->write);
   }
 
-  if (!keepalive_ || max_keepalive_requests_ <= 0 || removed_from_pool) {
-    ngx_close_connection(c_);
+  // Allow this connection to be re-used, by adding it to the connection pool.
+  if (!keepalive_ || max_keepalive_requests_ <= 0 || removed_from_pool ||
+      !pool_->Put(this)) {
+    CloseConnection(c_);
     c_ = NULL;
     delete this;
     return;
   }
 
-  ngx_add_timer(c_->read, static_cast<ngx_msec_t>(
-      NgxConnection::keepalive_timeout_ms));
+  ngx_add_timer(c_->read, pool_->idle_timeout_ms());
 
   c_->data = this;
   c_->read->handler = NgxConnection::IdleReadHandler;
@@ -206,15 +503,18 @@ void NgxConnection::Close() {
     c_->pool->log = ngx_cycle->log;
   }
 
-  // Allow this connection to be re-used, by adding it to the connection pool.
-  {
-    ScopedMutex lock(&NgxConnection::connection_pool_mutex);
-    connection_pool.Add(this);
-    ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
-                  "NgxFetch: Added connection %p (pool size: %l - "
-                  " max_keepalive_requests_ %d)",
-                  this, connection_pool.size(), max_keepalive_requests_);
-  }
+  ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
+                "NgxFetch: Added connection %p to %s (pool size: %d - "
+                " max_keepalive_requests_ %d)",
+                this, origin_key_.c_str(), pool_->size(),
+                max_keepalive_requests_);
+}
+
+void NgxConnection::PrewarmHandler(ngx_event_t* ev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  NgxConnection* nc = static_cast<NgxConnection*>(c->data);
+  bool connected = !ev->timedout && TestConnect(c);
+  nc->pool_->FinishPrewarm(nc, connected);
 }
 
 void NgxConnection::IdleWriteHandler(ngx_event_t* ev) {
@@ -270,11 +570,77 @@ NgxFetch::NgxFetch(const GoogleString& url,
       bytes_received_(0),
       fetch_start_ms_(0),
       fetch_end_ms_(0),
+      dispatch_ms_(0),
+      resolved_ms_(0),
+      connected_ms_(0),
+      first_byte_ms_(0),
+      reused_connection_(false),
+      retried_(false),
+      timed_out_(false),
+      deadline_limited_(false),
+      cancelled_(false),
       done_(false),
       content_length_(-1),
       content_length_known_(false),
-      resolver_ctx_(NULL) {
+      https_(false),
+      priority_(NgxUrlAsyncFetcher::kNormalPriority),
+      circuit_probe_(false),
+      abort_oversized_(true),
+      request_context_(async_fetch->request_context()),
+      waiting_request_(NULL),
+      headers_forwarded_(false),
+      next_candidate_(0),
+      attempt_event_(NULL),
+      status_(NULL),
+      resolver_ctx_(NULL),
+      upstream_(NULL),
+      upstream_peer_(NULL),
+      http2_session_(NULL),
+      http2_connector_(false),
+      http2_waiting_(false),
+      shared_entry_(-1),
+      shared_generation_(0),
+      shared_leader_(false),
+      shared_overflow_(false),
+      shared_cacheable_(false),
+      shared_wait_event_(NULL),
+      shared_wait_deadline_ms_(0) {
+  GoogleUrl gurl(str_url_);
+  if (gurl.IsWebValid()) {
+    gurl.Origin().CopyToString(&origin_);
+  } else {
+    origin_ = str_url_;
+  }
+  NgxRequestContext* request =
+      NgxRequestContext::DynamicCast(request_context_.get());
+  if (request != NULL && request->client_waits()) {
+    waiting_request_ = request;
+  }
+  if (request != NULL && request->relays_fetches()) {
+    abort_oversized_ = false;
+  }
+  if (async_fetch->IsBackgroundFetch()) {
+    priority_ = NgxUrlAsyncFetcher::kBackgroundPriority;
+  } else if (gurl.IsWebValid()) {
+    const ContentType* type = NameExtensionToContentType(gurl.LeafSansQuery());
+    if (type != NULL && (type->IsCss() || type->IsJs())) {
+      priority_ = NgxUrlAsyncFetcher::kCriticalPriority;
+    }
+  }
+  const RequestHeaders* request_headers = async_fetch->request_headers();
+  if (request_headers->method() == RequestHeaders::kGet) {
+    coalesce_key_ = str_url_;
+    for (int i = 0; i < request_headers->NumAttributes(); ++i) {
+      GoogleString name = request_headers->Name(i);
+      if (!IgnoredForCoalescing(name)) {
+        LowerString(&name);
+        StrAppend(&coalesce_key_, "\n", name, ": ",
+                  request_headers->Value(i));
+      }
+    }
+  }
   ngx_memzero(&url_, sizeof(url_));
+  ngx_memzero(&upstream_pc_, sizeof(upstream_pc_));
   log_ = log;
   pool_ = NULL;
   timeout_event_ = NULL;
@@ -285,12 +651,20 @@ NgxFetch::~NgxFetch() {
   if (timeout_event_ != NULL && timeout_event_->timer_set) {
     ngx_del_timer(timeout_event_);
   }
+  if (attempt_event_ != NULL && attempt_event_->timer_set) {
+    ngx_del_timer(attempt_event_);
+  }
+  CloseConnectAttempts(NULL);
   if (connection_ != NULL) {
     connection_->Close();
     connection_ = NULL;
   }
+  if (http2_session_ != NULL) {
+    http2_session_->CancelStream(this);
+    http2_session_ = NULL;
+  }
   if (pool_ != NULL) {
-    ngx_destroy_pool(pool_);
+    fetcher_->ReleaseFetchPool(pool_);
     pool_ = NULL;
   }
 }
@@ -311,7 +685,17 @@ bool NgxFetch::Start(NgxUrlAsyncFetcher* fetcher) {
 // When this returns false, our caller (NgxUrlAsyncFetcher::StartFetch)
 // will call fetch->CallbackDone()
 bool NgxFetch::Init() {
-  pool_ = ngx_create_pool(12288, log_);
+  // Followers may have attached while we were queued, their clients still
+  // want the response.
+  if (fetcher_->cancel_orphaned_fetches_ && Orphaned() && !has_followers()) {
+    message_handler_->Message(
+        kInfo, "NgxFetch %p: nobody waits for [%s] anymore", this, str_url());
+    fetcher_->orphaned_count_->Add(1);
+    cancelled_ = true;
+    return false;
+  }
+
+  pool_ = fetcher_->AcquireFetchPool();
   if (pool_ == NULL) {
     message_handler_->Message(kError, "NgxFetch: ngx_create_pool failed");
     return false;
@@ -323,6 +707,20 @@ bool NgxFetch::Init() {
                               str_url_.c_str(), url_.err);
     return false;
   }
+  UrlHost(&url_).CopyToString(&host_);
+
+  if (https_) {
+    if (!fetcher_->SupportsHttps()) {
+      message_handler_->Message(
+          kError, "NgxFetch: https is not enabled for [%s]", str_url());
+      return false;
+    }
+#if (NGX_SSL)
+    if (fetcher_->GetSsl() == NULL) {
+      return false;
+    }
+#endif
+  }
 
   timeout_event_ = static_cast<ngx_event_t*>(
       ngx_pcalloc(pool_, sizeof(ngx_event_t)));
@@ -336,7 +734,25 @@ bool NgxFetch::Init() {
   timeout_event_->handler = NgxFetch::TimeoutHandler;
   timeout_event_->log = log_;
 
-  ngx_add_timer(timeout_event_, fetcher_->fetch_timeout_);
+  // A client waiting for a .pagespeed. resource won't wait forever.
+  ngx_msec_t timeout = fetcher_->fetch_timeout_;
+  int64 deadline_ms = DeadlineMs();
+  if (deadline_ms > 0) {
+    int64 remaining_ms = deadline_ms - fetcher_->timer_->NowMs();
+    if (remaining_ms <= 0) {
+      message_handler_->Message(
+          kWarning, "NgxFetch %p: the request for [%s] is past its deadline",
+          this, str_url());
+      timed_out_ = true;
+      cancelled_ = true;
+      return false;
+    }
+    if (static_cast<ngx_msec_t>(remaining_ms) < timeout) {
+      timeout = static_cast<ngx_msec_t>(remaining_ms);
+      deadline_limited_ = true;
+    }
+  }
+  ngx_add_timer(timeout_event_, timeout);
   r_ = static_cast<ngx_http_request_t*>(
       ngx_pcalloc(pool_, sizeof(ngx_http_request_t)));
 
@@ -354,6 +770,34 @@ bool NgxFetch::Init() {
     return false;
   }
 
+  // Another worker may be fetching the same already.
+  if (FollowSharedFetch()) {
+    return true;
+  }
+  return StartConnecting();
+}
+
+bool NgxFetch::StartConnecting() {
+  upstream_ = fetcher_->FindUpstream(
+      StringPiece(reinterpret_cast<char*>(url_.host.data), url_.host.len));
+  if (upstream_ != NULL) {
+    return ConnectToUpstream();
+  }
+
+  NgxDnsCache::Address unix_socket;
+  if (fetcher_->FindUnixSocket(host_, &unix_socket) ||
+      (IsSelfFetch() && fetcher_->LoopbackUnixSocket(&unix_socket))) {
+    candidates_.assign(1, unix_socket);
+    ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                  "NgxFetch %p: using unix socket for [%s]", this,
+                  str_url());
+    if (InitRequest() != NGX_OK) {
+      message_handler_->Message(kError, "NgxFetch: InitRequest failed");
+      return false;
+    }
+    return true;
+  }
+
   // The host is either a domain name or an IP address.  First check
   // if it's a valid IP address and only if that fails fall back to
   // using the DNS resolver.
@@ -364,16 +808,26 @@ bool NgxFetch::Init() {
     tmp_url = &fetcher_->proxy_;
   }
 
-  GoogleString s_ipaddress(reinterpret_cast<char*>(tmp_url->host.data),
-                           tmp_url->host.len);
-  ngx_memzero(&sin_, sizeof(sin_));
-  sin_.sin_family = AF_INET;
-  sin_.sin_port = htons(tmp_url->port);
-  sin_.sin_addr.s_addr = inet_addr(s_ipaddress.c_str());
+  StringPiece host = UrlHost(tmp_url);
+  GoogleString s_ipaddress = host.as_string();
+  NgxDnsCache::AddressVector addresses(1);
+  if (!ParseAddress(host, &addresses[0])) {
+    // The host isn't a valid IP address.  Check our cache, and then DNS.
+    // Since nginx 1.5.8 the resolver looks up IPv6 addresses as well, unless
+    // it is configured with ipv6=off.
+    addresses.clear();
+    switch (fetcher_->dns_cache_->Lookup(host, &addresses)) {
+      case NgxDnsCache::kHit:
+        return ConnectToResolved(addresses);
+      case NgxDnsCache::kNegativeHit:
+        message_handler_->Message(
+            kWarning, "NgxFetch %p: resolving host [%s] failed recently",
+            this, s_ipaddress.c_str());
+        return false;
+      case NgxDnsCache::kMiss:
+        break;
+    }
 
-  if (sin_.sin_addr.s_addr == INADDR_NONE) {
-    // inet_addr returned INADDR_NONE, which means the hostname
-    // isn't a valid IP address.  Check DNS.
     ngx_resolver_ctx_t temp;
     temp.name.data = tmp_url->host.data;
     temp.name.len = tmp_url->host.len;
@@ -408,10 +862,7 @@ bool NgxFetch::Init() {
       return false;
     }
   } else {
-    if (InitRequest() != NGX_OK) {
-      message_handler()->Message(kError, "NgxFetch: InitRequest failed");
-      return false;
-    }
+    return ConnectToResolved(addresses);
   }
   return true;
 }
@@ -435,11 +886,35 @@ void NgxFetch::CallbackDone(bool success) {
   }
 
   release_resolver();
+  if (attempt_event_ != NULL && attempt_event_->timer_set) {
+    ngx_del_timer(attempt_event_);
+  }
+  CloseConnectAttempts(NULL);
+  if (http2_session_ != NULL) {
+    NgxHttp2Session* session = http2_session_;
+    http2_session_ = NULL;
+    session->CancelStream(this);
+  }
+  if (http2_waiting_) {
+    std::vector<NgxFetch*>& waiters = fetcher_->http2_waiters_[origin_];
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), this),
+                  waiters.end());
+    http2_waiting_ = false;
+  }
+  // Like nginx's upstream module, only count failures to reach the server
+  // against it, not responses we didn't like.
+  ReleaseUpstreamPeer(!success && (status_ == NULL || status_->code == 0));
 
   if (timeout_event_ && timeout_event_->timer_set) {
     ngx_del_timer(timeout_event_);
     timeout_event_ = NULL;
   }
+  if (shared_wait_event_ != NULL && shared_wait_event_->timer_set) {
+    ngx_del_timer(shared_wait_event_);
+  }
+  if (shared_leader_) {
+    PublishSharedFetch(success);
+  }
 
   if (connection_ != NULL) {
     // Connection will be re-used only on responses that specify
@@ -464,6 +939,11 @@ void NgxFetch::CallbackDone(bool success) {
                     this, connection_, keepalive ? "Yes":"No");
     }
 
+#if (NGX_SSL)
+    if (success && connection_->c_->ssl != NULL) {
+      fetcher_->SaveSslSession(origin_, connection_->c_);
+    }
+#endif
     connection_->set_keepalive(keepalive);
     connection_->Close();
     connection_ = NULL;
@@ -476,10 +956,105 @@ void NgxFetch::CallbackDone(bool success) {
       async_fetch_->extra_response_headers()->SetOriginalContentLength(
           bytes_received_);
     }
-    fetcher_->FetchComplete(this);
+    fetcher_->FetchComplete(this, success);
   }
+  FinishFollowers(success);
   async_fetch_->Done(success);
   async_fetch_ = NULL;
+  // The others connect by themselves now.
+  if (http2_connector_) {
+    ReleaseHttp2Waiters();
+  }
+}
+
+bool NgxFetch::Orphaned() const {
+  return waiting_request_ != NULL && waiting_request_->finished();
+}
+
+int64 NgxFetch::DeadlineMs() const {
+  int64 request_deadline_ms = fetcher_->request_deadline_ms_;
+  if (request_deadline_ms <= 0 || waiting_request_ == NULL) {
+    return 0;
+  }
+  int64 deadline_ms = waiting_request_->start_ms() + request_deadline_ms;
+  for (size_t i = 0; i < followers_.size(); ++i) {
+    NgxRequestContext* request = followers_[i]->waiting_request_;
+    if (request == NULL) {
+      return 0;
+    }
+    deadline_ms = std::max(deadline_ms,
+                           request->start_ms() + request_deadline_ms);
+  }
+  return deadline_ms;
+}
+
+bool NgxFetch::AcceptsFollowers() const {
+  return async_fetch_ != NULL && !headers_forwarded_;
+}
+
+void NgxFetch::AddFollower(NgxFetch* follower, NgxUrlAsyncFetcher* fetcher) {
+  follower->fetcher_ = fetcher;
+  followers_.push_back(follower);
+  // The follower's bytes may go to a client, so we can't give up on a large
+  // response for the sake of our own cache insert anymore.
+  if (!follower->abort_oversized_) {
+    abort_oversized_ = false;
+  }
+  // Once started, our timer may be cut short to the deadline of our own
+  // client, which the follower's may outlast.
+  if (timeout_event_ != NULL && deadline_limited_) {
+    int64 now_ms = fetcher->timer_->NowMs();
+    int64 end_ms = dispatch_ms_ + fetcher->fetch_timeout_;
+    int64 deadline_ms = DeadlineMs();
+    deadline_limited_ = deadline_ms > 0 && deadline_ms < end_ms;
+    if (deadline_limited_) {
+      end_ms = deadline_ms;
+    }
+    if (end_ms > now_ms) {
+      ngx_add_timer(timeout_event_, static_cast<ngx_msec_t>(end_ms - now_ms));
+    }
+  }
+}
+
+void NgxFetch::ForwardHeaders() {
+  headers_forwarded_ = true;
+  const ResponseHeaders* headers = async_fetch_->response_headers();
+  for (size_t i = 0; i < followers_.size(); ++i) {
+    followers_[i]->async_fetch_->response_headers()->CopyFrom(*headers);
+  }
+}
+
+void NgxFetch::ForwardBody(StringPiece data) {
+  for (size_t i = 0; i < followers_.size();) {
+    NgxFetch* follower = followers_[i];
+    if (follower->async_fetch_->Write(data, follower->message_handler())) {
+      ++i;
+      continue;
+    }
+    // Only this follower is done for, the others may still want the rest.
+    followers_.erase(followers_.begin() + i);
+    follower->async_fetch_->Done(false);
+    follower->async_fetch_ = NULL;
+    follower->fetcher_->FollowerComplete(follower);
+  }
+}
+
+void NgxFetch::FinishFollowers(bool success) {
+  std::vector<NgxFetch*> followers;
+  followers.swap(followers_);
+  for (size_t i = 0; i < followers.size(); ++i) {
+    NgxFetch* follower = followers[i];
+    follower->bytes_received_ = bytes_received_;
+    if (success && follower->fetcher_->track_original_content_length() &&
+        follower->async_fetch_->response_headers()->Has(
+            HttpAttributes::kXOriginalContentLength)) {
+      follower->async_fetch_->extra_response_headers()
+          ->SetOriginalContentLength(bytes_received_);
+    }
+    follower->async_fetch_->Done(success);
+    follower->async_fetch_ = NULL;
+    follower->fetcher_->FollowerComplete(follower);
+  }
 }
 
 size_t NgxFetch::bytes_received() {
@@ -510,6 +1085,7 @@ MessageHandler* NgxFetch::message_handler() {
 }
 
 bool NgxFetch::ParseUrl() {
+  https_ = StringCaseStartsWith(str_url_, "https://");
   url_.url.len = str_url_.length();
   url_.url.data = static_cast<u_char*>(ngx_palloc(pool_, url_.url.len));
   if (url_.url.data == NULL) {
@@ -524,93 +1100,186 @@ bool NgxFetch::ParseUrl() {
 void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
   NgxFetch* fetch = static_cast<NgxFetch*>(resolver_ctx->data);
   NgxUrlAsyncFetcher* fetcher = fetch->fetcher_;
+  // name points into the url of the fetch, and outlives resolver_ctx.
+  StringPiece host(reinterpret_cast<char*>(resolver_ctx->name.data),
+                   resolver_ctx->name.len);
+  bool resolved = resolver_ctx->state == NGX_OK;
 
-  if (resolver_ctx->state != NGX_OK) {
-    if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
-      ngx_del_timer(fetch->timeout_event());
-      fetch->set_timeout_event(NULL);
-    }
+  NgxDnsCache::AddressVector addresses;
+  fetcher->dns_cache_->Insert(host, resolver_ctx, &addresses);
+  fetch->release_resolver();
+
+  if (!resolved) {
     fetch->message_handler()->Message(
-        kWarning, "NgxFetch %p: failed to resolve host [%.*s]", fetch,
-        static_cast<int>(resolver_ctx->name.len), resolver_ctx->name.data);
+        kWarning, "NgxFetch %p: failed to resolve host [%s]", fetch,
+        host.as_string().c_str());
     fetch->CallbackDone(false);
     return;
   }
 
-  ngx_uint_t i;
-  // Find the first ipv4 address. We don't support ipv6 yet.
-  for (i = 0; i < resolver_ctx->naddrs; i++) {
-    // Old versions of nginx and tengine have a different definition of addrs,
-    // work around to make sure we are using the right type (ngx_addr_t*).
-    ngx_addr_t* ngx_addrs = reinterpret_cast<ngx_addr_t*>(resolver_ctx->addrs);
-    if (typeid(*ngx_addrs) == typeid(*resolver_ctx->addrs)) {
-      if (reinterpret_cast<struct sockaddr_in*>(ngx_addrs[i].sockaddr)
-              ->sin_family == AF_INET) {
-        break;
-      }
-    } else {
-      // We're using an old version that uses in_addr_t* for addrs.
-      break;
-    }
-  }
-
-  // If no suitable ipv4 address was found, we fail.
-  if (i == resolver_ctx->naddrs) {
-    if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
-      ngx_del_timer(fetch->timeout_event());
-      fetch->set_timeout_event(NULL);
-    }
-    fetch->message_handler()->Message(
-        kWarning, "NgxFetch %p: no suitable address for host [%.*s]", fetch,
-        static_cast<int>(resolver_ctx->name.len), resolver_ctx->name.data);
+  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                "NgxFetch %p: Resolved host [%s]", fetch,
+                host.as_string().c_str());
+  if (!fetch->ConnectToResolved(addresses)) {
     fetch->CallbackDone(false);
   }
+}
 
-  ngx_memzero(&fetch->sin_, sizeof(fetch->sin_));
+bool NgxFetch::IsSelfFetch() {
+  // The unix socket nginx listens on doesn't speak ssl, and fetches through a
+  // proxy aren't ours to short-cut.
+  if (https_ || fetcher_->proxy_.url.len != 0) {
+    return false;
+  }
+  NgxDnsCache::Address address;
+  if (!ParseAddress(host_, &address)) {
+    return false;
+  }
+  SetAddressPort(&address, url_.port);
+  return fetcher_->IsOwnAddress(address);
+}
 
-#if (nginx_version < 1005008)
-  fetch->sin_.sin_addr.s_addr = resolver_ctx->addrs[i];
+bool NgxFetch::ConnectToResolved(const NgxDnsCache::AddressVector& addresses) {
+  // Alternate between address families, starting with the one that worked
+  // last time for this origin, so that a broken family costs a fetch at most
+  // one attempt delay.
+  int preferred = fetcher_->PreferredFamily(origin_);
+  NgxDnsCache::AddressVector first;
+  NgxDnsCache::AddressVector second;
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    int family = AddressFamily(addresses[i]);
+    if (family == preferred) {
+      first.push_back(addresses[i]);
+#if (NGX_HAVE_INET6)
+    } else if (family == AF_INET || family == AF_INET6) {
 #else
-  struct sockaddr_in* sin;
-
-  sin = reinterpret_cast<struct sockaddr_in*>(
-      resolver_ctx->addrs[i].sockaddr);
-
-  fetch->sin_.sin_family = sin->sin_family;
-  fetch->sin_.sin_addr.s_addr = sin->sin_addr.s_addr;
+    } else if (family == AF_INET) {
 #endif
-
-  fetch->sin_.sin_family = AF_INET;
-  fetch->sin_.sin_port = htons(fetch->url_.port);
+      second.push_back(addresses[i]);
+    }
+  }
+  candidates_.clear();
+  for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+    if (i < first.size()) {
+      candidates_.push_back(first[i]);
+    }
+    if (i < second.size()) {
+      candidates_.push_back(second[i]);
+    }
+  }
+  if (candidates_.empty()) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: no suitable address for [%s]", this,
+        str_url());
+    return false;
+  }
 
   // Maybe we have Proxy
-  if (0 != fetcher->proxy_.url.len) {
-    fetch->sin_.sin_port = htons(fetcher->proxy_.port);
+  in_port_t port = url_.port;
+  if (0 != fetcher_->proxy_.url.len) {
+    port = fetcher_->proxy_.port;
+  }
+  for (size_t i = 0; i < candidates_.size(); ++i) {
+    SetAddressPort(&candidates_[i], port);
   }
 
-  char* ip_address = inet_ntoa(fetch->sin_.sin_addr);
-
-  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
-                "NgxFetch %p: Resolved host [%V] to [%s]", fetch,
-                &resolver_ctx->name, ip_address);
-
-  fetch->release_resolver();
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: connecting to [%s] (%d addresses)", this,
+                str_url(), static_cast<int>(candidates_.size()));
 
-  if (fetch->InitRequest() != NGX_OK) {
-    fetch->message_handler()->Message(kError, "NgxFetch: InitRequest failed");
-    fetch->CallbackDone(false);
+  if (InitRequest() != NGX_OK) {
+    message_handler_->Message(kError, "NgxFetch: InitRequest failed");
+    return false;
   }
+  return true;
 }
 
-// Prepare the request data for this fetch, and hook the write event.
-int NgxFetch::InitRequest() {
-  in_ = ngx_create_temp_buf(pool_, 4096);
-  if (in_ == NULL) {
-    return NGX_ERROR;
+bool NgxFetch::ConnectToUpstream() {
+  ngx_http_upstream_rr_peers_t* peers =
+      static_cast<ngx_http_upstream_rr_peers_t*>(upstream_->peer.data);
+  ngx_http_upstream_rr_peer_data_t* rrp =
+      static_cast<ngx_http_upstream_rr_peer_data_t*>(
+          ngx_pcalloc(pool_, sizeof(ngx_http_upstream_rr_peer_data_t)));
+  if (rrp == NULL) {
+    return false;
   }
 
-  FixUserAgent();
-
+  // As ngx_http_upstream_init_round_robin_peer(), minus the request.
+  ngx_uint_t n = peers->number;
+  if (peers->next != NULL && peers->next->number > n) {
+    n = peers->next->number;
+  }
+  if (n <= 8 * sizeof(uintptr_t)) {
+    rrp->tried = &rrp->data;
+    rrp->data = 0;
+  } else {
+    n = (n + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+    rrp->tried = static_cast<uintptr_t*>(
+        ngx_pcalloc(pool_, n * sizeof(uintptr_t)));
+    if (rrp->tried == NULL) {
+      return false;
+    }
+  }
+  rrp->peers = peers;
+  rrp->current = NULL;
+
+  upstream_pc_.log = log_;
+  upstream_pc_.log_error = NGX_ERROR_ERR;
+  upstream_pc_.tries = 1;
+  if (ngx_http_upstream_get_round_robin_peer(&upstream_pc_, rrp) != NGX_OK) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: no live server in upstream [%.*s] for [%s]",
+        this, static_cast<int>(upstream_->host.len), upstream_->host.data,
+        str_url());
+    return false;
+  }
+  upstream_peer_ = rrp;
+
+  if (upstream_pc_.socklen > NGX_SOCKADDRLEN) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: bad address for upstream server [%.*s]", this,
+        static_cast<int>(upstream_pc_.name->len), upstream_pc_.name->data);
+    ReleaseUpstreamPeer(false);
+    return false;
+  }
+  NgxDnsCache::Address address;
+  ngx_memzero(&address, sizeof(address));
+  ngx_memcpy(address.sockaddr, upstream_pc_.sockaddr, upstream_pc_.socklen);
+  address.socklen = upstream_pc_.socklen;
+  candidates_.assign(1, address);
+
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: using upstream server [%V] for [%s]", this,
+                upstream_pc_.name, str_url());
+
+  if (InitRequest() != NGX_OK) {
+    message_handler_->Message(kError, "NgxFetch: InitRequest failed");
+    return false;
+  }
+  return true;
+}
+
+void NgxFetch::ReleaseUpstreamPeer(bool failed) {
+  if (upstream_peer_ == NULL) {
+    return;
+  }
+  ngx_http_upstream_free_round_robin_peer(&upstream_pc_, upstream_peer_,
+                                          failed ? NGX_PEER_FAILED : 0);
+  upstream_peer_ = NULL;
+}
+
+// Prepare the request data for this fetch, and connect.
+int NgxFetch::InitRequest() {
+  resolved_ms_ = fetcher_->timer_->NowMs();
+  // The memory is the receive buffer of the connection, see UseConnection().
+  in_ = ngx_calloc_buf(pool_);
+  if (in_ == NULL) {
+    return NGX_ERROR;
+  }
+  in_->temporary = 1;
+
+  FixUserAgent();
+
   RequestHeaders* request_headers = async_fetch_->request_headers();
   ConstStringStarVector v;
   size_t size = 0;
@@ -618,110 +1287,497 @@ int NgxFetch::InitRequest() {
   GoogleString port;
 
   response_handler = NgxFetch::HandleStatusLine;
-  int rc = Connect();
-  if (rc == NGX_AGAIN || rc == NGX_OK) {
-    if (connection_->keepalive()) {
-      request_headers->Add(HttpAttributes::kConnection,
-                           NgxConnection::ka_header);
-    }
-    const char* method = request_headers->method_string();
-    size_t method_len = strlen(method);
-
-    size = (method_len +
-            1 /* for the space */ +
-            url_.uri.len +
-            sizeof(" HTTP/1.0\r\n") - 1);
-
-    for (int i = 0; i < request_headers->NumAttributes(); i++) {
-      // if no explicit host header is given in the request headers,
-      // we need to derive it from the url.
-      if (StringCaseEqual(request_headers->Name(i), "Host")) {
-        have_host = true;
-      }
-
-      // name: value\r\n
-      size += request_headers->Name(i).length()
-          + request_headers->Value(i).length() + 4;  // 4 for ": \r\n"
+  // Connections start out with keepalive enabled unless it is turned off for
+  // the fetcher, pooled ones only exist when it is on.
+  if (fetcher_->max_keepalive_requests_ > 1) {
+    request_headers->Add(HttpAttributes::kConnection,
+                         NgxConnection::ka_header);
+  }
+  const char* method = request_headers->method_string();
+  size_t method_len = strlen(method);
+
+  size = (method_len +
+          1 /* for the space */ +
+          url_.uri.len +
+          sizeof(" HTTP/1.0\r\n") - 1);
+
+  for (int i = 0; i < request_headers->NumAttributes(); i++) {
+    // if no explicit host header is given in the request headers,
+    // we need to derive it from the url.
+    if (StringCaseEqual(request_headers->Name(i), "Host")) {
+      have_host = true;
     }
 
-    if (!have_host) {
-      port = StrCat(":", IntegerToString(url_.port));
-      // for "Host: " + host + ":" + port + "\r\n"
-      size += url_.host.len + 8 + port.size();
-    }
+    // name: value\r\n
+    size += request_headers->Name(i).length()
+        + request_headers->Value(i).length() + 4;  // 4 for ": \r\n"
+  }
 
-    size += 2;  // "\r\n";
-    out_ = ngx_create_temp_buf(pool_, size);
+  if (!have_host) {
+    port = StrCat(":", IntegerToString(url_.port));
+    // for "Host: " + host + ":" + port + "\r\n"
+    size += url_.host.len + 8 + port.size();
+  }
 
-    if (out_ == NULL) {
-      return NGX_ERROR;
-    }
+  size += 2;  // "\r\n";
+  out_ = ngx_create_temp_buf(pool_, size);
+
+  if (out_ == NULL) {
+    return NGX_ERROR;
+  }
 
-    out_->last = ngx_cpymem(out_->last, method, method_len);
-    out_->last = ngx_cpymem(out_->last, " ", 1);
-    out_->last = ngx_cpymem(out_->last, url_.uri.data, url_.uri.len);
-    out_->last = ngx_cpymem(out_->last, " HTTP/1.0\r\n", 11);
+  out_->last = ngx_cpymem(out_->last, method, method_len);
+  out_->last = ngx_cpymem(out_->last, " ", 1);
+  out_->last = ngx_cpymem(out_->last, url_.uri.data, url_.uri.len);
+  out_->last = ngx_cpymem(out_->last, " HTTP/1.0\r\n", 11);
 
-    if (!have_host) {
-      out_->last = ngx_cpymem(out_->last, "Host: ", 6);
-      out_->last = ngx_cpymem(out_->last, url_.host.data, url_.host.len);
-      out_->last = ngx_cpymem(out_->last, port.c_str(), port.size());
-      out_->last = ngx_cpymem(out_->last, "\r\n", 2);
-    }
+  if (!have_host) {
+    out_->last = ngx_cpymem(out_->last, "Host: ", 6);
+    out_->last = ngx_cpymem(out_->last, url_.host.data, url_.host.len);
+    out_->last = ngx_cpymem(out_->last, port.c_str(), port.size());
+    out_->last = ngx_cpymem(out_->last, "\r\n", 2);
+  }
 
-    for (int i = 0; i < request_headers->NumAttributes(); i++) {
-      const GoogleString& name = request_headers->Name(i);
-      const GoogleString& value = request_headers->Value(i);
-      out_->last = ngx_cpymem(out_->last, name.c_str(), name.length());
-      *(out_->last++) = ':';
-      *(out_->last++) = ' ';
-      out_->last = ngx_cpymem(out_->last, value.c_str(), value.length());
-      *(out_->last++) = CR;
-      *(out_->last++) = LF;
-    }
+  for (int i = 0; i < request_headers->NumAttributes(); i++) {
+    const GoogleString& name = request_headers->Name(i);
+    const GoogleString& value = request_headers->Value(i);
+    out_->last = ngx_cpymem(out_->last, name.c_str(), name.length());
+    *(out_->last++) = ':';
+    *(out_->last++) = ' ';
+    out_->last = ngx_cpymem(out_->last, value.c_str(), value.length());
     *(out_->last++) = CR;
     *(out_->last++) = LF;
-    if (rc == NGX_AGAIN) {
+  }
+  *(out_->last++) = CR;
+  *(out_->last++) = LF;
+
+  return Connect();
+}
+
+void NgxFetch::InitPeerConnection(const NgxDnsCache::Address& address,
+                                  ngx_peer_connection_t* pc) {
+  ngx_memzero(pc, sizeof(*pc));
+  pc->sockaddr = reinterpret_cast<struct sockaddr*>(
+      const_cast<u_char*>(address.sockaddr));
+  pc->socklen = address.socklen;
+  // The port is right after the host in the url.
+  peer_name_ = url_.host;
+  if (url_.port_text.len != 0) {
+    peer_name_.len = url_.port_text.data + url_.port_text.len - url_.host.data;
+  }
+  pc->name = &peer_name_;
+
+  // get callback is dummy function, it just returns NGX_OK
+  pc->get = ngx_event_get_peer;
+  pc->log_error = NGX_ERROR_ERR;
+  pc->log = fetcher_->log_;
+  pc->rcvbuf = -1;
+}
+
+GoogleString NgxFetch::PoolKey(const ngx_peer_connection_t* pc) {
+  StringPiece ssl_host;
+  if (https_) {
+    ssl_host = host_;
+  }
+  return NgxConnectionPool::OriginKey(pc, ssl_host);
+}
+
+int NgxFetch::Connect() {
+  NgxConnectionPool* pool = fetcher_->connection_pool_.get();
+
+  // A stream on an HTTP/2 session to any of the addresses beats even an idle
+  // connection.  Retries go out on a connection of their own.
+  if (!retried_ && MayUseHttp2()) {
+    for (size_t i = 0; i < candidates_.size(); ++i) {
+      ngx_peer_connection_t pc;
+      InitPeerConnection(candidates_[i], &pc);
+      NgxHttp2Session* session = fetcher_->FindHttp2Session(PoolKey(&pc));
+      if (session != NULL) {
+        reused_connection_ = true;
+        connected_ms_ = fetcher_->timer_->NowMs();
+        AddHttp2Stream(session);
+        return NGX_OK;
+      }
+    }
+    // When the origin is known to speak HTTP/2, a single fetch connects to
+    // it, and the others wait to share its session.
+    if (!http2_connector_ &&
+        (!https_ || fetcher_->KnownHttp2Origin(origin_))) {
+      std::map<GoogleString, std::vector<NgxFetch*> >::iterator iter =
+          fetcher_->http2_waiters_.find(origin_);
+      if (iter != fetcher_->http2_waiters_.end()) {
+        iter->second.push_back(this);
+        http2_waiting_ = true;
+        return NGX_OK;
+      }
+      fetcher_->http2_waiters_[origin_];
+      http2_connector_ = true;
+    }
+  }
+
+  // An idle connection to any of the addresses beats connecting anew.  Not
+  // when retrying after a stale one though: the other idle connections to
+  // the origin are likely stale too.
+  for (size_t i = 0; !retried_ && i < candidates_.size(); ++i) {
+    ngx_peer_connection_t pc;
+    InitPeerConnection(candidates_[i], &pc);
+    GoogleString key = PoolKey(&pc);
+    if (pool->HasIdle(key)) {
+      bool reused;
+      NgxConnection* nc = NgxConnection::Connect(
+          &pc, key, pool, message_handler(),
+          fetcher_->max_keepalive_requests_, false /* fresh_only */,
+          &reused);
+      CHECK(reused);
+      ReuseConnection(nc);
       return NGX_OK;
     }
-  } else if (rc < NGX_OK) {
-    return rc;
   }
-  CHECK(rc == NGX_OK);
-  NgxFetch::ConnectionWriteHandler(connection_->c_->write);
-  return NGX_OK;
+
+  if (attempt_event_ == NULL) {
+    attempt_event_ = static_cast<ngx_event_t*>(
+        ngx_pcalloc(pool_, sizeof(ngx_event_t)));
+    if (attempt_event_ == NULL) {
+      return NGX_ERROR;
+    }
+    attempt_event_->data = this;
+    attempt_event_->handler = NgxFetch::ConnectAttemptTimerHandler;
+    attempt_event_->log = log_;
+  }
+  next_candidate_ = 0;
+  return StartConnectAttempt();
 }
 
-int NgxFetch::Connect() {
-  ngx_peer_connection_t pc;
-  ngx_memzero(&pc, sizeof(pc));
-  pc.sockaddr = (struct sockaddr*)&sin_;
-  pc.socklen = sizeof(struct sockaddr_in);
-  pc.name = &url_.host;
+int NgxFetch::StartConnectAttempt() {
+  while (next_candidate_ < candidates_.size()) {
+    ngx_peer_connection_t pc;
+    InitPeerConnection(candidates_[next_candidate_++], &pc);
+    GoogleString key = PoolKey(&pc);
+    // A retry after a stale connection has to go out on a new one.
+    bool reused;
+    NgxConnection* nc = NgxConnection::Connect(
+        &pc, key, fetcher_->connection_pool_.get(), message_handler(),
+        fetcher_->max_keepalive_requests_, retried_ /* fresh_only */,
+        &reused);
+    if (nc == NULL) {
+      ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                    "NgxFetch %p: failed to connect to %s", this,
+                    key.c_str());
+      continue;
+    }
+    if (reused) {
+      // Pooled for this address after Connect() looked.
+      ReuseConnection(nc);
+      return NGX_OK;
+    }
 
-  // get callback is dummy function, it just returns NGX_OK
-  pc.get = ngx_event_get_peer;
-  pc.log_error = NGX_ERROR_ERR;
-  pc.log = fetcher_->log_;
-  pc.rcvbuf = -1;
+    ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                  "NgxFetch %p: connecting to %s (attempt %d)", this,
+                  key.c_str(), static_cast<int>(next_candidate_));
+    if (nc->c_->write->ready) {
+      // Connected right away, as happens on loopback.
+      UseConnection(nc);
+      return NGX_OK;
+    }
+
+    nc->c_->data = this;
+    nc->c_->write->handler = NgxFetch::ConnectAttemptHandler;
+    nc->c_->read->handler = NgxFetch::ConnectAttemptHandler;
+    attempts_.push_back(nc);
+    if (next_candidate_ < candidates_.size()) {
+      ngx_add_timer(attempt_event_, kConnectAttemptDelayMs);
+    } else if (attempt_event_->timer_set) {
+      ngx_del_timer(attempt_event_);
+    }
+    // Timer set in Init() is still in effect.
+    return NGX_OK;
+  }
+  return attempts_.empty() ? NGX_ERROR : NGX_OK;
+}
 
+void NgxFetch::ReuseConnection(NgxConnection* nc) {
+  reused_connection_ = true;
+  if (nc->prewarmed()) {
+    nc->set_prewarmed(false);
+    fetcher_->prewarmed_used_count_->Add(1);
+  }
+  UseConnection(nc);
+}
 
-  connection_ = NgxConnection::Connect(&pc, message_handler(),
-                                       fetcher_->max_keepalive_requests_);
+void NgxFetch::UseConnection(NgxConnection* nc) {
+  if (attempt_event_ != NULL && attempt_event_->timer_set) {
+    ngx_del_timer(attempt_event_);
+  }
+  CloseConnectAttempts(nc);
+  connection_ = nc;
+  connected_ms_ = fetcher_->timer_->NowMs();
   ngx_log_error(NGX_LOG_DEBUG, fetcher_->log_, 0,
                 "NgxFetch %p Connect() connection %p for [%s]",
                 this, connection_, str_url());
 
-  if (connection_ == NULL) {
-    return NGX_ERROR;
-  }
+  // A reused connection may come with a larger buffer already.
+  in_->start = connection_->ReceiveBuffer(kInitialReceiveBufferSize);
+  in_->end = in_->start + connection_->receive_buffer_size();
+  in_->pos = in_->start;
+  in_->last = in_->start;
 
+  if (upstream_ == NULL &&
+      (nc->family() == AF_INET || nc->family() == AF_INET6)) {
+    fetcher_->SetPreferredFamily(origin_, nc->family());
+  }
+  // Ssl connections only become useful after a handshake, which prewarming
+  // doesn't do, and HTTP/2 connections are never pooled.
+  if (!https_ && !MayUseHttp2()) {
+    fetcher_->RecordConnectionUse(nc);
+  }
   connection_->c_->write->handler = NgxFetch::ConnectionWriteHandler;
   connection_->c_->read->handler = NgxFetch::ConnectionReadHandler;
   connection_->c_->data = this;
+  StartRequest();
+}
+
+void NgxFetch::StartRequest() {
+  ngx_connection_t* c = connection_->c_;
+#if (NGX_SSL)
+  // The handshake comes first, SslHandshakeHandler() gets back here.
+  if (https_ && c->ssl == NULL) {
+    NgxFetch::ConnectionWriteHandler(c->write);
+    return;
+  }
+  if (https_ && fetcher_->http2_) {
+    fetcher_->SetKnownHttp2Origin(origin_, SpeaksHttp2(c));
+  }
+#endif
+  if (SpeaksHttp2(c)) {
+    StartHttp2Session();
+    return;
+  }
+  if (http2_connector_) {
+    ReleaseHttp2Waiters();
+  }
+  NgxFetch::ConnectionWriteHandler(c->write);
+}
+
+bool NgxFetch::MayUseHttp2() {
+  return https_ ? fetcher_->http2_ : fetcher_->Http2PriorKnowledge(host_);
+}
+
+bool NgxFetch::SpeaksHttp2(ngx_connection_t* c) {
+#if (NGX_SSL)
+  if (c->ssl != NULL) {
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    const unsigned char* protocol;
+    unsigned int len;
+    SSL_get0_alpn_selected(c->ssl->connection, &protocol, &len);
+    return len == 2 && ngx_memcmp(protocol, "h2", 2) == 0;
+#else
+    return false;
+#endif
+  }
+#endif
+  return !https_ && fetcher_->Http2PriorKnowledge(host_);
+}
+
+void NgxFetch::StartHttp2Session() {
+  NgxConnection* nc = connection_;
+  connection_ = NULL;
+#if (NGX_SSL)
+  if (nc->c_->ssl != NULL) {
+    fetcher_->SaveSslSession(origin_, nc->c_);
+  }
+#endif
+  NgxHttp2Session* session = fetcher_->StartHttp2Session(nc);
+  if (session == NULL) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: failed to start HTTP/2 for [%s]", this,
+        str_url());
+    CallbackDone(false);
+    return;
+  }
+  AddHttp2Stream(session);
+  // Unless this fetch is done already, the session may be, so the waiters
+  // look it up again.
+  if (http2_connector_) {
+    ReleaseHttp2Waiters();
+  }
+}
+
+void NgxFetch::AddHttp2Stream(NgxHttp2Session* session) {
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: sending [%s] over HTTP/2 session %p", this,
+                str_url(), session);
+  http2_session_ = session;
+  session->AddStream(this);
+}
+
+void NgxFetch::ReleaseHttp2Waiters() {
+  http2_connector_ = false;
+  std::map<GoogleString, std::vector<NgxFetch*> >::iterator iter =
+      fetcher_->http2_waiters_.find(origin_);
+  if (iter == fetcher_->http2_waiters_.end()) {
+    return;
+  }
+  std::vector<NgxFetch*> waiters;
+  waiters.swap(iter->second);
+  fetcher_->http2_waiters_.erase(iter);
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    NgxFetch* waiter = waiters[i];
+    // Fetches may fail while earlier ones go on, and then they stop waiting.
+    if (!waiter->http2_waiting_) {
+      continue;
+    }
+    waiter->http2_waiting_ = false;
+    if (waiter->Connect() != NGX_OK) {
+      waiter->CallbackDone(false);
+    }
+  }
+}
+
+void NgxFetch::Http2RequestHeaders(NgxHpackHeaders* headers) {
+  RequestHeaders* request_headers = async_fetch_->request_headers();
+  GoogleString authority;
+  const char* host = request_headers->Lookup1(HttpAttributes::kHost);
+  if (host != NULL) {
+    authority = host;
+  } else {
+    authority = StrCat(
+        StringPiece(reinterpret_cast<char*>(url_.host.data), url_.host.len),
+        ":", IntegerToString(url_.port));
+  }
+  StringPiece path(reinterpret_cast<char*>(url_.uri.data), url_.uri.len);
+  if (path.empty()) {
+    path = "/";
+  }
+  headers->push_back(std::make_pair(GoogleString(":method"),
+                                    request_headers->method_string()));
+  headers->push_back(std::make_pair(GoogleString(":scheme"),
+                                    https_ ? "https" : "http"));
+  headers->push_back(std::make_pair(GoogleString(":authority"), authority));
+  headers->push_back(std::make_pair(GoogleString(":path"),
+                                    path.as_string()));
+  for (int i = 0; i < request_headers->NumAttributes(); ++i) {
+    GoogleString name = request_headers->Name(i);
+    if (!IgnoredForHttp2(name)) {
+      LowerString(&name);
+      headers->push_back(std::make_pair(name, request_headers->Value(i)));
+    }
+  }
+}
+
+bool NgxFetch::HandleHttp2Headers(const NgxHpackHeaders& headers) {
+  if (status_->code != 0) {
+    // Trailers, which we have no use for.
+    return true;
+  }
+  if (first_byte_ms_ == 0) {
+    first_byte_ms_ = fetcher_->timer_->NowMs();
+  }
+  int status = 0;
+  for (size_t i = 0; i < headers.size(); ++i) {
+    if (headers[i].first == ":status" &&
+        !StringToInt(headers[i].second, &status)) {
+      break;
+    }
+  }
+  if (status < 100 || status > 999) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: no valid :status in the HTTP/2 response for "
+        "[%s]", this, str_url());
+    return false;
+  }
+  if (status < 200) {
+    // Informational, the final headers follow.
+    return true;
+  }
+  status_->code = status;
+  status_->http_version = 2000;  // NGX_HTTP_VERSION_20
+
+  ResponseHeaders* response_headers = async_fetch_->response_headers();
+  response_headers->SetStatusAndReason(static_cast<HttpStatus::Code>(status));
+  // What comes after us only knows HTTP/1.
+  response_headers->set_major_version(1);
+  response_headers->set_minor_version(1);
+  for (size_t i = 0; i < headers.size(); ++i) {
+    if (headers[i].first.empty() || headers[i].first[0] != ':') {
+      response_headers->Add(headers[i].first, headers[i].second);
+    }
+  }
+  response_headers->ComputeCaching();
+  return HeadersComplete();
+}
 
-  // Timer set in Init() is still in effect.
-  return NGX_OK;
+bool NgxFetch::HandleHttp2Data(StringPiece data) {
+  if (status_->code == 0) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: HTTP/2 response body before the headers for "
+        "[%s]", this, str_url());
+    return false;
+  }
+  return ReceiveBody(data);
+}
+
+void NgxFetch::Http2StreamDone() {
+  // A response shorter than its content length was cut short.
+  bool ok = status_->code != 0 &&
+      (!content_length_known_ || content_length_ == bytes_received_);
+  done_ = true;
+  CallbackDone(ok);
+}
+
+void NgxFetch::Http2StreamFailed(bool unprocessed) {
+  // Like an HTTP/1 keepalive connection, an HTTP/2 session may have been
+  // closed by the server just as we sent the request.
+  if ((unprocessed || reused_connection_) && RetryRequest(unprocessed)) {
+    return;
+  }
+  CallbackDone(false);
+}
+
+void NgxFetch::CloseConnectAttempts(NgxConnection* keep) {
+  for (size_t i = 0; i < attempts_.size(); ++i) {
+    if (attempts_[i] != keep) {
+      attempts_[i]->set_keepalive(false);
+      attempts_[i]->Close();
+    }
+  }
+  attempts_.clear();
+}
+
+void NgxFetch::ConnectAttemptHandler(ngx_event_t* ev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  std::vector<NgxConnection*>::iterator iter = fetch->attempts_.begin();
+  while (iter != fetch->attempts_.end() && (*iter)->c_ != c) {
+    ++iter;
+  }
+  CHECK(iter != fetch->attempts_.end());
+  NgxConnection* nc = *iter;
+
+  if (TestConnect(c)) {
+    fetch->UseConnection(nc);
+    return;
+  }
+
+  fetch->attempts_.erase(iter);
+  nc->set_keepalive(false);
+  nc->Close();
+  // Move on to the next address without waiting for the attempt delay.
+  if (fetch->StartConnectAttempt() != NGX_OK) {
+    fetch->message_handler()->Message(
+        kWarning, "NgxFetch %p: failed to connect for [%s]", fetch,
+        fetch->str_url());
+    fetch->CallbackDone(false);
+  }
+}
+
+void NgxFetch::ConnectAttemptTimerHandler(ngx_event_t* tev) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(tev->data);
+  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                "NgxFetch %p: connection attempt is slow, trying the next "
+                "address", fetch);
+  if (fetch->StartConnectAttempt() != NGX_OK) {
+    fetch->CallbackDone(false);
+  }
 }
 
 // When the fetch sends the request completely, it will hook the read event,
@@ -729,6 +1785,19 @@ int NgxFetch::Connect() {
 void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
   ngx_connection_t* c = static_cast<ngx_connection_t*>(wev->data);
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+
+#if (NGX_SSL)
+  // New https connections need their handshake before anything is written,
+  // pooled ones have it done already.
+  if (fetch->https_ && c->ssl == NULL) {
+    if (!fetch->StartSslHandshake(c)) {
+      c->error = 1;
+      fetch->CallbackDone(false);
+    }
+    return;
+  }
+#endif
+
   ngx_buf_t* out = fetch->out_;
   bool ok = true;
   while (wev->ready && out->pos < out->last) {
@@ -755,7 +1824,7 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
     }
   }
 
-  if (!ok) {
+  if (!ok && !fetch->RetryStaleConnection()) {
     fetch->message_handler()->Message(
         kWarning, "NgxFetch %p: failed to hook next event", fetch);
     c->error = 1;
@@ -763,15 +1832,18 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
   }
 }
 
-// Timer set in Init() is still in effect.
+// Timer set in Init() is still in effect.  Reads all that is available,
+// filling in_ before passing it on, so that large bodies are written to the
+// AsyncFetch in a few large pieces.
 void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
   ngx_connection_t* c = static_cast<ngx_connection_t*>(rev->data);
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  ngx_buf_t* in = fetch->in_;
   bool ok = true;
+  bool eof = false;
 
-  while(rev->ready) {
-    int n = c->recv(
-        c, fetch->in_->start, fetch->in_->end - fetch->in_->start);
+  while (ok && !fetch->done_ && rev->ready) {
+    int n = c->recv(c, in->last, in->end - in->last);
 
     ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                   "NgxFetch %p: ConnectionReadHandler "
@@ -780,26 +1852,36 @@ void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
     if (n == NGX_AGAIN) {
       break;
     } else if (n == 0) {
-      // If the content length was not known, we assume that we have read
-      // all if we at least parsed the headers.
-      // If we do know the content length, having a mismatch on the bytes read
-      // will be interpreted as an error.
-      ok = (fetch->content_length_known_ && fetch->content_length_ == fetch->bytes_received_)
-          || fetch->parser_.headers_complete();
-      fetch->done_ = true;
+      eof = true;
+      break;
+    } else if (n < 0) {
+      ok = false;
       break;
-    } else if (n > 0) {
-      fetch->in_->pos = fetch->in_->start;
-      fetch->in_->last = fetch->in_->start + n;
-      ok = fetch->response_handler(c);
-      if (fetch->done_ || !ok) {
-        break;
-      }
     }
+    in->last += n;
+    if (in->last == in->end) {
+      ok = fetch->ProcessReceived(c, true);
+    }
+  }
+
+  if (ok && in->last > in->pos) {
+    ok = fetch->ProcessReceived(c, false);
+  }
+  if (ok && eof && !fetch->done_) {
+    // If the content length was not known, we assume that we have read
+    // all if we at least parsed the headers.
+    // If we do know the content length, having a mismatch on the bytes read
+    // will be interpreted as an error.
+    ok = (fetch->content_length_known_ &&
+          fetch->content_length_ == fetch->bytes_received_) ||
+        fetch->parser_.headers_complete();
+    fetch->done_ = true;
   }
 
   if (!ok) {
-    fetch->CallbackDone(false);
+    if (!fetch->RetryStaleConnection()) {
+      fetch->CallbackDone(false);
+    }
   } else if (fetch->done_) {
     fetch->CallbackDone(true);
   } else if (ngx_handle_read_event(rev, 0) != NGX_OK) {
@@ -807,11 +1889,98 @@ void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
   }
 }
 
+bool NgxFetch::RetryStaleConnection() {
+  // An origin may close an idle keepalive connection just as we reuse it, and
+  // then nothing comes back at all.  Anything else is a real failure.
+  return reused_connection_ && RetryRequest(false /* unprocessed */);
+}
+
+bool NgxFetch::RetryRequest(bool unprocessed) {
+  RequestHeaders::Method method = async_fetch_->request_headers()->method();
+  if (retried_ || first_byte_ms_ != 0 || timed_out_ || cancelled_ ||
+      (!unprocessed && method != RequestHeaders::kGet &&
+       method != RequestHeaders::kHead)) {
+    return false;
+  }
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: stale connection %p, retrying [%s]",
+                this, connection_, str_url());
+  if (connection_ != NULL) {
+    connection_->set_keepalive(false);
+    connection_->Close();
+    connection_ = NULL;
+  }
+  out_->pos = out_->start;
+  // The read handler takes an eof for the end of the response.
+  done_ = false;
+  reused_connection_ = false;
+  retried_ = true;
+  fetcher_->stale_retry_count_->Add(1);
+  if (Connect() != NGX_OK) {
+    CallbackDone(false);
+  }
+  return true;
+}
+
+bool NgxFetch::ResponseTooLarge(int64 size) {
+  int64 max_bytes = fetcher_->max_response_bytes_;
+  if (!abort_oversized_ || max_bytes < 0 || size <= max_bytes) {
+    return false;
+  }
+  message_handler_->Message(
+      kInfo, "NgxFetch %p: response for [%s] is larger than %s bytes, "
+      "giving up on it", this, str_url(),
+      Integer64ToString(max_bytes).c_str());
+  fetcher_->oversized_count_->Add(1);
+  cancelled_ = true;
+  return true;
+}
+
+bool NgxFetch::ProcessReceived(ngx_connection_t* c, bool filled) {
+  bool ok = response_handler(c);
+  in_->pos = in_->start;
+  in_->last = in_->start;
+  if (ok && !done_) {
+    ResizeReceiveBuffer(filled);
+  }
+  return ok;
+}
+
+void NgxFetch::ResizeReceiveBuffer(bool filled) {
+  size_t size = in_->end - in_->start;
+  size_t wanted;
+  if (content_length_known_) {
+    int64 remaining = std::max(content_length_ - bytes_received_,
+                               static_cast<int64>(0));
+    wanted = std::max(kInitialReceiveBufferSize,
+                      static_cast<size_t>(remaining));
+  } else if (filled) {
+    // The origin sends faster than we read, read more at a time.
+    wanted = 2 * size;
+  } else {
+    return;
+  }
+  wanted = std::min(wanted, fetcher_->max_receive_buffer_size_);
+  if (wanted <= size) {
+    return;
+  }
+  in_->start = connection_->ReceiveBuffer(wanted);
+  in_->end = in_->start + connection_->receive_buffer_size();
+  in_->pos = in_->start;
+  in_->last = in_->start;
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: receive buffer grown to %uz bytes", this,
+                connection_->receive_buffer_size());
+}
+
 // Parse the status line: "HTTP/1.1 200 OK\r\n"
 bool NgxFetch::HandleStatusLine(ngx_connection_t* c) {
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
   ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                 "NgxFetch %p: Handle status line", fetch);
+  if (fetch->first_byte_ms_ == 0) {
+    fetch->first_byte_ms_ = fetch->fetcher_->timer_->NowMs();
+  }
 
   // This function only works after Nginx-1.1.4. Before nginx-1.1.4,
   // ngx_http_parse_status_line didn't save http_version.
@@ -854,28 +2023,8 @@ bool NgxFetch::HandleHeader(ngx_connection_t* c) {
   if (n > size) {
     return false;
   } else if (fetch->parser_.headers_complete()) {
-    // TODO(oschaaf): We should also check if the request method was HEAD
-    // - but I don't think PSOL uses that at this point.
-    if (fetch->get_status_code() == 304 || fetch->get_status_code() == 204) {
-      fetch->done_ = true;
-    } else if (fetch->async_fetch_->response_headers()->FindContentLength(
-            &fetch->content_length_)) {
-      if (fetch->content_length_ < 0) {
-        fetch->message_handler_->Message(
-            kError, "Negative content-length in response header");
-        return false;
-      } else {
-        fetch->content_length_known_ = true;
-        if (fetch->content_length_ == 0) {
-          fetch->done_ = true;
-        }
-      }
-    }
-
-    if (fetch->fetcher_->track_original_content_length()
-        && fetch->content_length_known_) {
-      fetch->async_fetch_->response_headers()->SetOriginalContentLength(
-          fetch->content_length_);
+    if (!fetch->HeadersComplete()) {
+      return false;
     }
 
     fetch->in_->pos += n;
@@ -891,35 +2040,283 @@ bool NgxFetch::HandleHeader(ngx_connection_t* c) {
   return true;
 }
 
+bool NgxFetch::HeadersComplete() {
+  // The other workers get the headers as the origin sent them.
+  if (shared_leader_) {
+    ResponseHeaders* response_headers = async_fetch_->response_headers();
+    StringWriter writer(&shared_headers_);
+    response_headers->WriteAsBinary(&writer, message_handler_);
+    response_headers->ComputeCaching();
+    shared_cacheable_ = response_headers->IsBrowserCacheable();
+  }
+  // TODO(oschaaf): We should also check if the request method was HEAD
+  // - but I don't think PSOL uses that at this point.
+  if (get_status_code() == 304 || get_status_code() == 204) {
+    done_ = true;
+  } else if (async_fetch_->response_headers()->FindContentLength(
+          &content_length_)) {
+    if (content_length_ < 0) {
+      message_handler_->Message(
+          kError, "Negative content-length in response header");
+      return false;
+    } else {
+      content_length_known_ = true;
+      if (content_length_ == 0) {
+        done_ = true;
+      } else if (ResponseTooLarge(content_length_)) {
+        return false;
+      }
+    }
+  }
+
+  if (fetcher_->track_original_content_length() && content_length_known_) {
+    async_fetch_->response_headers()->SetOriginalContentLength(
+        content_length_);
+  }
+  ForwardHeaders();
+  return true;
+}
+
 // Read the response body
 bool NgxFetch::HandleBody(ngx_connection_t* c) {
   NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
   char* data = reinterpret_cast<char*>(fetch->in_->pos);
   size_t size = fetch->in_->last - fetch->in_->pos;
 
-  fetch->bytes_received_add(size);
-
   ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                 "NgxFetch %p: Handle body (%d bytes)", fetch, size);
 
-  if ( fetch->async_fetch_->Write(StringPiece(data, size),
-                                  fetch->message_handler()) ) {
-    if (fetch->bytes_received_ == fetch->content_length_) {
-      fetch->done_ = true;
+  if (!fetch->ReceiveBody(StringPiece(data, size))) {
+    return false;
+  }
+  if (fetch->bytes_received_ == fetch->content_length_) {
+    fetch->done_ = true;
+  }
+  fetch->in_->pos += size;
+  return true;
+}
+
+bool NgxFetch::ReceiveBody(StringPiece data) {
+  bytes_received_add(data.size());
+  if (ResponseTooLarge(bytes_received_)) {
+    return false;
+  }
+  if (!async_fetch_->Write(data, message_handler())) {
+    ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                  "NgxFetch %p: async fetch write failure", this);
+    return false;
+  }
+  ForwardBody(data);
+  if (shared_leader_ && !shared_overflow_) {
+    if (shared_headers_.size() + shared_body_.size() + data.size() >
+        NgxSharedInflight::kMaxResponseSize) {
+      // Let the others fetch it themselves now, rather than when we're done.
+      shared_overflow_ = true;
+      shared_body_.clear();
+      fetcher_->shared_inflight_->Abandon(shared_entry_, shared_generation_);
+    } else {
+      shared_body_.append(data.data(), data.size());
     }
-    fetch->in_->pos += size;
+  }
+  return true;
+}
+
+bool NgxFetch::FollowSharedFetch() {
+  NgxSharedInflight* shared = fetcher_->shared_inflight_;
+  // Probes must get their own response, see ScheduleFetch().
+  if (shared == NULL || coalesce_key_.empty() || circuit_probe_) {
+    return false;
+  }
+  int64 now_ms = fetcher_->timer_->NowMs();
+  // A leader that hasn't finished by its timeout is gone.
+  int64 expires_ms = now_ms + fetcher_->fetch_timeout_;
+  switch (shared->Claim(coalesce_key_, now_ms, expires_ms, &shared_entry_,
+                        &shared_generation_)) {
+    case NgxSharedInflight::kLeading:
+      shared_leader_ = true;
+      return false;
+    case NgxSharedInflight::kFetching:
+    case NgxSharedInflight::kDone:
+      break;
+    case NgxSharedInflight::kNone:
+      shared_entry_ = -1;
+      return false;
+  }
+  shared_wait_event_ = static_cast<ngx_event_t*>(
+      ngx_pcalloc(pool_, sizeof(ngx_event_t)));
+  if (shared_wait_event_ == NULL) {
+    shared_entry_ = -1;
+    return false;
+  }
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: waiting for another worker to fetch [%s]",
+                this, str_url());
+  shared_wait_event_->data = this;
+  shared_wait_event_->handler = NgxFetch::SharedWaitHandler;
+  shared_wait_event_->log = log_;
+  shared_wait_deadline_ms_ = now_ms + fetcher_->shared_inflight_wait_ms_;
+  ngx_add_timer(shared_wait_event_, kSharedPollIntervalMs);
+  return true;
+}
+
+void NgxFetch::SharedWaitHandler(ngx_event_t* ev) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(ev->data);
+  NgxUrlAsyncFetcher* fetcher = fetch->fetcher_;
+  int64 now_ms = fetcher->timer_->NowMs();
+  GoogleString headers;
+  GoogleString body;
+  switch (fetcher->shared_inflight_->Poll(fetch->shared_entry_,
+                                          fetch->shared_generation_, now_ms,
+                                          &headers, &body)) {
+    case NgxSharedInflight::kFetching:
+      if (now_ms < fetch->shared_wait_deadline_ms_) {
+        ngx_add_timer(ev, kSharedPollIntervalMs);
+        return;
+      }
+      break;
+    case NgxSharedInflight::kDone:
+      if (fetch->FinishFromSharedFetch(headers, body)) {
+        return;
+      }
+      break;
+    case NgxSharedInflight::kLeading:
+    case NgxSharedInflight::kNone:
+      break;
+  }
+  // The other worker won't share a response, or takes too long.
+  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                "NgxFetch %p: fetching [%s] ourselves after all", fetch,
+                fetch->str_url());
+  fetch->shared_entry_ = -1;
+  if (!fetch->StartConnecting()) {
+    fetch->CallbackDone(false);
+  }
+}
+
+bool NgxFetch::FinishFromSharedFetch(StringPiece headers, StringPiece body) {
+  ResponseHeaders* response_headers = async_fetch_->response_headers();
+  if (!response_headers->ReadFromBinary(headers, message_handler_)) {
+    response_headers->Clear();
+    return false;
+  }
+  fetcher_->shared_coalesced_count_->Add(1);
+  first_byte_ms_ = fetcher_->timer_->NowMs();
+  status_->code = response_headers->status_code();
+  status_->http_version = response_headers->major_version() * 1000 +
+      response_headers->minor_version();
+  response_headers->ComputeCaching();
+  if (!HeadersComplete() || (!done_ && !ReceiveBody(body))) {
+    CallbackDone(false);
+    return true;
+  }
+  done_ = true;
+  CallbackDone(true);
+  return true;
+}
+
+void NgxFetch::PublishSharedFetch(bool success) {
+  shared_leader_ = false;
+  NgxSharedInflight* shared = fetcher_->shared_inflight_;
+  if (success && !shared_overflow_ && !shared_headers_.empty()) {
+    // Only fetches waiting now get a response that can't be cached.
+    int64 expires_ms = fetcher_->timer_->NowMs();
+    if (shared_cacheable_) {
+      expires_ms += fetcher_->shared_inflight_wait_ms_;
+    }
+    shared->Finish(shared_entry_, shared_generation_, shared_headers_,
+                   shared_body_, expires_ms);
   } else {
-    ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
-                  "NgxFetch %p: async fetch write failure", fetch);
+    shared->Abandon(shared_entry_, shared_generation_);
+  }
+  shared_headers_.clear();
+  shared_body_.clear();
+}
+
+#if (NGX_SSL)
+bool NgxFetch::StartSslHandshake(ngx_connection_t* c) {
+  if (ngx_ssl_create_connection(fetcher_->GetSsl(), c,
+                                NGX_SSL_BUFFER | NGX_SSL_CLIENT) != NGX_OK) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: failed to create ssl connection", this);
     return false;
   }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  // Send the host name (SNI) unless it is an IP address.
+  NgxDnsCache::Address address;
+  if (!ParseAddress(host_, &address) &&
+      SSL_set_tlsext_host_name(c->ssl->connection,
+                               const_cast<char*>(host_.c_str())) == 0) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: failed to set SNI for [%s]", this,
+        host_.c_str());
+    return false;
+  }
+#endif
+
+  ngx_ssl_session_t* session = fetcher_->GetSslSession(origin_);
+  if (session != NULL && ngx_ssl_set_session(c, session) != NGX_OK) {
+    return false;
+  }
+
+  ngx_int_t rc = ngx_ssl_handshake(c);
+  if (rc == NGX_AGAIN) {
+    c->ssl->handler = NgxFetch::SslHandshakeHandler;
+    return true;
+  }
+  NgxFetch::SslHandshakeHandler(c);
   return true;
 }
 
+void NgxFetch::SslHandshakeHandler(ngx_connection_t* c) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  if (!c->ssl->handshaked || !fetch->VerifySslPeer(c)) {
+    fetch->message_handler()->Message(
+        kWarning, "NgxFetch %p: ssl handshake failed for [%s]", fetch,
+        fetch->str_url());
+    c->error = 1;
+    fetch->CallbackDone(false);
+    return;
+  }
+  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                "NgxFetch %p: ssl handshake done (session reused: %d)",
+                fetch, SSL_session_reused(c->ssl->connection));
+
+  // The handshake took over our event handlers.
+  c->write->handler = NgxFetch::ConnectionWriteHandler;
+  c->read->handler = NgxFetch::ConnectionReadHandler;
+  fetch->StartRequest();
+}
+
+bool NgxFetch::VerifySslPeer(ngx_connection_t* c) {
+  long rc = SSL_get_verify_result(c->ssl->connection);  // NOLINT
+  if (!fetcher_->SslVerifyResultOk(rc)) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: certificate verify error for [%s]: %ld (%s)",
+        this, str_url(), rc, X509_verify_cert_error_string(rc));
+    return false;
+  }
+#if (nginx_version >= 1007000)
+  ngx_str_t host;
+  host.data = reinterpret_cast<u_char*>(const_cast<char*>(host_.data()));
+  host.len = host_.size();
+  if (ngx_ssl_check_host(c, &host) != NGX_OK) {
+    message_handler_->Message(
+        kWarning, "NgxFetch %p: certificate does not match host [%s]",
+        this, str_url());
+    return false;
+  }
+#endif
+  return true;
+}
+#endif
+
 void NgxFetch::TimeoutHandler(ngx_event_t* tev) {
   NgxFetch* fetch = static_cast<NgxFetch*>(tev->data);
   ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                 "NgxFetch %p: TimeoutHandler called", fetch);
+  fetch->timed_out_ = true;
+  fetch->cancelled_ = fetch->deadline_limited_;
   fetch->CallbackDone(false);
 }
 
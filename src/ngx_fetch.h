@@ -40,15 +40,19 @@ extern "C" {
 #include <ngx_http.h>
 }
 
+#include "ngx_dns_cache.h"
+#include "ngx_hpack.h"
 #include "ngx_url_async_fetcher.h"
+#include <map>
+#include <set>
 #include <vector>
+#include "net/instaweb/http/public/request_context.h"
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/pool.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/http/response_headers.h"
 #include "pagespeed/kernel/http/response_headers_parser.h"
-#include "pagespeed/kernel/thread/pthread_mutex.h"
 
 
 namespace net_instaweb {
@@ -57,10 +61,14 @@ typedef bool (*response_handler_pt)(ngx_connection_t* c);
 
 class NgxUrlAsyncFetcher;
 class NgxConnection;
+class NgxConnectionPool;
+class NgxHttp2Session;
+class NgxRequestContext;
 
 class NgxConnection : public PoolElement<NgxConnection> {
  public:
-  NgxConnection(MessageHandler* handler, int max_keepalive_requests);
+  NgxConnection(NgxConnectionPool* pool, MessageHandler* handler,
+                int max_keepalive_requests);
   ~NgxConnection();
   void SetSock(u_char *sockaddr, socklen_t socklen) {
     socklen_ = socklen;
@@ -75,18 +83,40 @@ class NgxConnection : public PoolElement<NgxConnection> {
   void set_keepalive(bool k) { keepalive_ = keepalive_ && k; }
   bool keepalive() { return keepalive_; }
 
-  typedef Pool<NgxConnection> NgxConnectionPool;
+  // The key of the origin this connection was established to, see
+  // NgxConnectionPool::OriginKey().
+  const GoogleString& origin_key() const { return origin_key_; }
+  // Returns a buffer of at least size bytes to read responses into, of
+  // receive_buffer_size() bytes.  It stays with the connection, so fetches
+  // reusing the connection don't allocate again.  The previous contents are
+  // lost when the buffer has to grow.
+  u_char* ReceiveBuffer(size_t size);
+  size_t receive_buffer_size() const { return receive_buffer_size_; }
 
+  // The address family of the peer, e.g. AF_INET6.
+  int family() const {
+    return reinterpret_cast<const struct sockaddr*>(sockaddr_)->sa_family;
+  }
+  // The address of the peer, including the port.
+  void GetAddress(NgxDnsCache::Address* address) const;
+  // Whether the connection was opened ahead of time by
+  // NgxConnectionPool::Prewarm(), and no fetch used it yet.
+  bool prewarmed() const { return prewarmed_; }
+  void set_prewarmed(bool x) { prewarmed_ = x; }
+
+  // Returns an idle connection pooled under key if there is one, unless
+  // fresh_only, or else starts a new connection to the peer in pc.  Sets
+  // reused when the connection came from the pool.
   static NgxConnection* Connect(ngx_peer_connection_t* pc,
+                                const GoogleString& key,
+                                NgxConnectionPool* pool,
                                 MessageHandler* handler,
-                                int max_keepalive_requests);
+                                int max_keepalive_requests,
+                                bool fresh_only,
+                                bool* reused);
   static void IdleWriteHandler(ngx_event_t* ev);
   static void IdleReadHandler(ngx_event_t* ev);
-  // Terminate will cleanup any idle connections upon shutdown.
-  static void Terminate();
-
-  static NgxConnectionPool connection_pool;
-  static PthreadMutex connection_pool_mutex;
+  static void PrewarmHandler(ngx_event_t* ev);
 
   // c_ is owned by NgxConnection and freed in ::Close()
   ngx_connection_t* c_;
@@ -94,15 +124,90 @@ class NgxConnection : public PoolElement<NgxConnection> {
   static const GoogleString ka_header;
 
  private:
+  friend class NgxConnectionPool;
+
+  NgxConnectionPool* pool_;
+  GoogleString origin_key_;
+  // Set while this connection sits idle in pool_.
+  bool pooled_;
+  bool prewarmed_;
   int max_keepalive_requests_;
   bool keepalive_;
   socklen_t socklen_;
   u_char sockaddr_[NGX_SOCKADDRLEN];
   MessageHandler* handler_;
+  u_char* receive_buffer_;
+  size_t receive_buffer_size_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxConnection);
 };
 
+// Holds the idle keepalive connections of a worker, indexed by origin.  Each
+// origin has its own idle list from which the most recently used connection is
+// handed out first, so that rarely used connections can time out.  The pool is
+// only ever touched from the nginx event loop, and so needs no locking.
+class NgxConnectionPool {
+ public:
+  NgxConnectionPool();
+  ~NgxConnectionPool();
+
+  // Returns the key under which connections to the peer in pc are pooled.
+  // Ssl connections are only shared between fetches for the same ssl_host,
+  // as they are bound to the name that was sent and verified.
+  static GoogleString OriginKey(const ngx_peer_connection_t* pc,
+                                StringPiece ssl_host);
+
+  // Removes and returns the most recently added idle connection for key, or
+  // NULL when there is none.
+  NgxConnection* Take(const GoogleString& key);
+  // Whether there is an idle connection for key.
+  bool HasIdle(const GoogleString& key) const;
+  // The number of idle connections for key, including those Prewarm() is
+  // still opening.
+  int NumIdle(const GoogleString& key) const;
+  // Starts opening a connection to the peer in pc, which is added to the
+  // pool under key once established, so that a later fetch doesn't have to
+  // wait for the connect.  Gives up after timeout_ms.  Returns false when the
+  // connection couldn't be started.
+  bool Prewarm(ngx_peer_connection_t* pc, const GoogleString& key,
+               MessageHandler* handler, int max_keepalive_requests,
+               ngx_msec_t timeout_ms);
+  // Adds an idle connection to the pool.  Returns false, without taking
+  // ownership, when its origin already has max_idle_per_origin() connections.
+  bool Put(NgxConnection* nc);
+  // Removes a pooled connection, e.g. when it was closed remotely.
+  void Remove(NgxConnection* nc);
+  // Closes and deletes all idle connections.
+  void Terminate();
+
+  int size() const { return size_; }
+
+  int max_idle_per_origin() const { return max_idle_per_origin_; }
+  void set_max_idle_per_origin(int x) { max_idle_per_origin_ = x; }
+  ngx_msec_t idle_timeout_ms() const { return idle_timeout_ms_; }
+  void set_idle_timeout_ms(ngx_msec_t x) { idle_timeout_ms_ = x; }
+
+ private:
+  typedef Pool<NgxConnection> IdleList;
+  typedef std::map<GoogleString, IdleList*> OriginMap;
+
+  friend class NgxConnection;
+
+  // Pools nc when connected, or else closes it.
+  void FinishPrewarm(NgxConnection* nc, bool connected);
+  // Takes nc out of the idle list at it, dropping the list once empty.
+  void RemoveFromList(OriginMap::iterator it, NgxConnection* nc);
+
+  OriginMap idle_;
+  // Connections Prewarm() is opening.
+  std::set<NgxConnection*> warming_;
+  int size_;
+  int max_idle_per_origin_;
+  ngx_msec_t idle_timeout_ms_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxConnectionPool);
+};
+
 class NgxFetch : public PoolElement<NgxFetch> {
  public:
   NgxFetch(const GoogleString& url,
@@ -115,6 +220,26 @@ class NgxFetch : public PoolElement<NgxFetch> {
   bool Start(NgxUrlAsyncFetcher* fetcher);
   // Show the completed url, for logging purposes.
   const char* str_url();
+  // The origin (scheme://host:port) of the url, which fetches are queued by.
+  const GoogleString& origin() const { return origin_; }
+  // Identifies the fetches that can share a single origin request: the url
+  // and the request headers that may affect the response.  Empty for fetches
+  // that must not be shared, like POSTs.
+  const GoogleString& coalesce_key() const { return coalesce_key_; }
+  // Background when async_fetch is, critical for css and javascript.
+  NgxUrlAsyncFetcher::FetchPriority priority() const { return priority_; }
+  // Set for the fetch that probes whether an origin recovered, see
+  // NgxUrlAsyncFetcher::AdmitFetch().
+  bool circuit_probe() const { return circuit_probe_; }
+  void set_circuit_probe(bool x) { circuit_probe_ = x; }
+  // Whether follower fetches can still be attached: they must get the whole
+  // response, so not once its headers have been received.
+  bool AcceptsFollowers() const;
+  // Makes follower complete along with this fetch, with a copy of its
+  // response.  follower is never started itself.  When follower relays its
+  // response, this fetch no longer aborts oversized responses, and when its
+  // client has a later deadline, this fetch gets until then.
+  void AddFollower(NgxFetch* follower, NgxUrlAsyncFetcher* fetcher);
   // This fetch task is done. Call Done() on the async_fetch. It will copy the
   // buffer to cache.
   void CallbackDone(bool success);
@@ -126,6 +251,32 @@ class NgxFetch : public PoolElement<NgxFetch> {
   void set_fetch_start_ms(int64 start_ms);
   int64 fetch_end_ms();
   void set_fetch_end_ms(int64 end_ms);
+  // When the fetch left its origin queue and was actually started.
+  int64 dispatch_ms() const { return dispatch_ms_; }
+  void set_dispatch_ms(int64 x) { dispatch_ms_ = x; }
+  // When the address to connect to was known, a connection was established,
+  // and the first response byte arrived.  0 when the fetch didn't get there.
+  int64 resolved_ms() const { return resolved_ms_; }
+  int64 connected_ms() const { return connected_ms_; }
+  int64 first_byte_ms() const { return first_byte_ms_; }
+  // Whether the fetch went over an idle keepalive connection.
+  bool reused_connection() const { return reused_connection_; }
+  // Whether the fetch failed because it ran out of time.
+  bool timed_out() const { return timed_out_; }
+  // The request whose client waits for this fetch, or NULL.
+  NgxRequestContext* waiting_request() const { return waiting_request_; }
+  // Whether the client that waited for this fetch is gone.  Only for use on
+  // the nginx thread.
+  bool Orphaned() const;
+  // When the last of the clients waiting for this fetch or its followers
+  // gives up on it, or 0 when one of them has no deadline.
+  int64 DeadlineMs() const;
+  bool has_followers() const { return !followers_.empty(); }
+  // Whether the fetch was given up on for some reason other than its origin
+  // failing: the client went away, its deadline passed, or the response was
+  // too large to cache.
+  bool cancelled() const { return cancelled_; }
+  void set_cancelled() { cancelled_ = true; }
   MessageHandler* message_handler();
 
   int get_major_version() {
@@ -137,6 +288,13 @@ class NgxFetch : public PoolElement<NgxFetch> {
   int get_status_code() {
     return static_cast<int>(status_->code);
   }
+  // 0 until the status line has been received.
+  int status_code() const {
+    return status_ == NULL ? 0 : static_cast<int>(status_->code);
+  }
+  ResponseHeaders* response_headers() {
+    return async_fetch_->response_headers();
+  }
   ngx_event_t* timeout_event() {
     return timeout_event_;
   }
@@ -151,14 +309,60 @@ class NgxFetch : public PoolElement<NgxFetch> {
   }
 
  private:
+  friend class NgxHttp2Session;
+
   response_handler_pt response_handler;
   // Do the initialized work and start the resolver work.
   bool Init();
+  // Finds the servers for the url and connects to one, or starts resolving
+  // its host.
+  bool StartConnecting();
   bool ParseUrl();
+  // Connects to one of the addresses of the host, see Connect().
+  bool ConnectToResolved(const NgxDnsCache::AddressVector& addresses);
+  // Connects to a server of upstream_ picked by its round robin balancer.
+  bool ConnectToUpstream();
+  // Reports the outcome to the balancer of upstream_, once.
+  void ReleaseUpstreamPeer(bool failed);
   // Prepare the request and write it to remote server.
   int InitRequest();
-  // Create the connection with remote server.
+  // Create the connection with remote server.  Reuses an idle connection to
+  // any of candidates_, or else races connections to them "happy eyeballs"
+  // style (RFC 8305): when an attempt hasn't succeeded after a short delay,
+  // the next address is tried alongside it, and the first to connect wins.
   int Connect();
+  // Starts connecting to the next of candidates_, over a new connection when
+  // retrying after a stale one.  Returns NGX_ERROR when there is none left
+  // and no attempt is in flight.
+  int StartConnectAttempt();
+  // Sends the request over nc, closing any other connection attempts.
+  void UseConnection(NgxConnection* nc);
+  // Like UseConnection(), for an idle connection taken from the pool.
+  void ReuseConnection(NgxConnection* nc);
+  // Closes all connection attempts but keep.
+  void CloseConnectAttempts(NgxConnection* keep);
+  // Sends the request over connection_ once it is ready for it: over HTTP/2
+  // when the origin speaks it, and else over HTTP/1.
+  void StartRequest();
+  // Called when the connection failed.  When it was a reused keepalive
+  // connection that the origin had closed before sending anything, sends an
+  // idempotent request again over a new connection, once, and returns true.
+  // Otherwise returns false, and the caller fails the fetch.
+  bool RetryStaleConnection();
+  // Sends the request again over a new connection, once, unless the origin
+  // may have acted on it: when it sent something back, or the request isn't
+  // idempotent and wasn't known to be left unprocessed.  Returns false when
+  // it won't.
+  bool RetryRequest(bool unprocessed);
+  // Whether the response, of size bytes so far, is too large to be cached.
+  // Counts it and marks the fetch cancelled when so.
+  bool ResponseTooLarge(int64 size);
+  // Whether the url points at an address this nginx listens on, as the ones
+  // the loopback route fetcher rewrites urls to do.
+  bool IsSelfFetch();
+  void InitPeerConnection(const NgxDnsCache::Address& address,
+                          ngx_peer_connection_t* pc);
+  GoogleString PoolKey(const ngx_peer_connection_t* pc);
   void set_response_handler(response_handler_pt handler) {
     response_handler = handler;
   }
@@ -174,15 +378,83 @@ class NgxFetch : public PoolElement<NgxFetch> {
   static bool HandleHeader(ngx_connection_t* c);
   // Read the response body.
   static bool HandleBody(ngx_connection_t* c);
+  // Passes what was read into in_ to the response handler, and empties it.
+  bool ProcessReceived(ngx_connection_t* c, bool filled);
+  // Grows in_ when the buffer was filled by a single read event, or to fit
+  // the rest of a body of known length, up to the configured maximum.
+  void ResizeReceiveBuffer(bool filled);
   // Cancel the fetch when it's timeout.
   static void TimeoutHandler(ngx_event_t* tev);
+  // Called when a connection attempt connected or failed.
+  static void ConnectAttemptHandler(ngx_event_t* ev);
+  // Starts the next connection attempt when the current one takes too long.
+  static void ConnectAttemptTimerHandler(ngx_event_t* tev);
+#if (NGX_SSL)
+  // Sets up ssl on a new connection and starts the handshake.
+  bool StartSslHandshake(ngx_connection_t* c);
+  // Continues with writing the request once the handshake is done.
+  static void SslHandshakeHandler(ngx_connection_t* c);
+  // Checks the certificate of the origin against its host name and our CAs.
+  bool VerifySslPeer(ngx_connection_t* c);
+#endif
+
+  // Checks the length of the response once its headers are in, and passes
+  // them on to the followers.  Returns false when giving up on the response.
+  bool HeadersComplete();
+  // Takes in a piece of the response body.  Returns false when giving up on
+  // the response.
+  bool ReceiveBody(StringPiece data);
+
+  // Whether we may talk HTTP/2 to the origin.
+  bool MayUseHttp2();
+  // Whether c, which is ready for the request, speaks HTTP/2.
+  bool SpeaksHttp2(ngx_connection_t* c);
+  // Starts an HTTP/2 session over connection_ and sends the request on it.
+  void StartHttp2Session();
+  // Sends the request as a stream of session.
+  void AddHttp2Stream(NgxHttp2Session* session);
+  // Lets the fetches that waited for this one to connect go on, see
+  // Connect().
+  void ReleaseHttp2Waiters();
+  // Callbacks of NgxHttp2Session for the stream of this fetch.
+  void Http2RequestHeaders(NgxHpackHeaders* headers);
+  // These return false when giving up on the response, and then the stream
+  // is reset.
+  bool HandleHttp2Headers(const NgxHpackHeaders& headers);
+  bool HandleHttp2Data(StringPiece data);
+  void Http2StreamDone();
+  // The stream or the whole session failed.  unprocessed when the server
+  // said it didn't act on the request.
+  void Http2StreamFailed(bool unprocessed);
+
+  // When another worker fetches the same, waits for its response instead of
+  // connecting, and returns true.  Otherwise this fetch may become the one
+  // the other workers wait for.  See NgxSharedInflight.
+  bool FollowSharedFetch();
+  static void SharedWaitHandler(ngx_event_t* ev);
+  // Completes the fetch with the response of another worker.  Returns false
+  // when its headers can't be read.
+  bool FinishFromSharedFetch(StringPiece headers, StringPiece body);
+  // Hands the response, or the failure to get one, to the other workers.
+  void PublishSharedFetch(bool success);
+
+  // Pass the response on to the followers.
+  void ForwardHeaders();
+  void ForwardBody(StringPiece data);
+  void FinishFollowers(bool success);
 
   // Add the pagespeed User-Agent.
   void FixUserAgent();
   void FixHost();
 
   const GoogleString str_url_;
+  GoogleString origin_;
   ngx_url_t url_;
+  // The host and port of url_, which nginx's connect() errors name.
+  ngx_str_t peer_name_;
+  // The host of url_, without the brackets around an IPv6 address.
+  GoogleString host_;
+  GoogleString coalesce_key_;
   NgxUrlAsyncFetcher* fetcher_;
   AsyncFetch* async_fetch_;
   ResponseHeadersParser parser_;
@@ -190,11 +462,40 @@ class NgxFetch : public PoolElement<NgxFetch> {
   int64 bytes_received_;
   int64 fetch_start_ms_;
   int64 fetch_end_ms_;
+  int64 dispatch_ms_;
+  int64 resolved_ms_;
+  int64 connected_ms_;
+  int64 first_byte_ms_;
+  bool reused_connection_;
+  // Set once the request was sent again after a stale keepalive connection.
+  bool retried_;
+  bool timed_out_;
+  // Set when the timeout was shortened to the deadline of waiting_request_.
+  bool deadline_limited_;
+  bool cancelled_;
   bool done_;
   int64 content_length_;
   bool content_length_known_;
+  bool https_;
+  NgxUrlAsyncFetcher::FetchPriority priority_;
+  bool circuit_probe_;
+  // Whether the fetch is given up on as soon as the response turns out to be
+  // too large to cache, which it isn't when the bytes may go to a client.
+  bool abort_oversized_;
+  // Keeps waiting_request_ alive.
+  RequestContextPtr request_context_;
+  NgxRequestContext* waiting_request_;
+  std::vector<NgxFetch*> followers_;
+  bool headers_forwarded_;
 
-  struct sockaddr_in sin_;
+  // The addresses to connect to, in the order they are tried, and the index
+  // of the next one to try.
+  NgxDnsCache::AddressVector candidates_;
+  size_t next_candidate_;
+  // Connections that are being established, and the timer that starts the
+  // next one.
+  std::vector<NgxConnection*> attempts_;
+  ngx_event_t* attempt_event_;
   ngx_log_t* log_;
   ngx_buf_t* out_;
   ngx_buf_t* in_;
@@ -204,6 +505,32 @@ class NgxFetch : public PoolElement<NgxFetch> {
   ngx_event_t* timeout_event_;
   NgxConnection* connection_;
   ngx_resolver_ctx_t* resolver_ctx_;
+  // Set when the host is mapped to an upstream{} block.  The peer data is
+  // the per-fetch state of the round robin balancer.
+  ngx_http_upstream_srv_conf_t* upstream_;
+  ngx_http_upstream_rr_peer_data_t* upstream_peer_;
+  ngx_peer_connection_t upstream_pc_;
+  // Set while the request is a stream of an HTTP/2 session.
+  NgxHttp2Session* http2_session_;
+  // Set while this fetch connects to an HTTP/2 origin that others wait for,
+  // and while it is one of those waiting.
+  bool http2_connector_;
+  bool http2_waiting_;
+  // The entry of NgxSharedInflight this fetch leads, or waits for, or -1.
+  int shared_entry_;
+  uint32 shared_generation_;
+  bool shared_leader_;
+  // What the leader has of the response for the other workers, which it
+  // stops collecting once it gets too large to share.
+  GoogleString shared_headers_;
+  GoogleString shared_body_;
+  bool shared_overflow_;
+  // Whether fetches that come in after the leader is done may get the
+  // response too.
+  bool shared_cacheable_;
+  // Polls the entry while waiting, until shared_wait_deadline_ms_.
+  ngx_event_t* shared_wait_event_;
+  int64 shared_wait_deadline_ms_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxFetch);
 };
@@ -0,0 +1,306 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+extern "C" {
+#include <ngx_http.h>
+#include <nginx.h>
+}
+
+#include "ngx_hpack.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// An entry takes this much on top of its name and value, RFC 7541 4.1.
+const size_t kEntryOverhead = 32;
+
+// The static table, RFC 7541 Appendix A.  Index 1 is the first entry.
+const char* const kStaticTable[][2] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""},
+};
+
+// Bounds decoded integers, well above anything a sane peer sends.
+const uint32 kMaxInteger = 1 << 24;
+
+void EncodeInteger(uint8 first_byte, int prefix_bits, uint32 value,
+                   GoogleString* out) {
+  uint32 prefix_max = (1 << prefix_bits) - 1;
+  if (value < prefix_max) {
+    out->push_back(static_cast<char>(first_byte | value));
+    return;
+  }
+  out->push_back(static_cast<char>(first_byte | prefix_max));
+  value -= prefix_max;
+  while (value >= 128) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool HuffmanDecode(const u_char* src, size_t len, GoogleString* out,
+                   ngx_log_t* log) {
+#if (NGX_HTTP_V2)
+  // The shortest code is 5 bits.
+  out->resize(len * 8 / 5 + 1);
+  u_char* start = reinterpret_cast<u_char*>(&(*out)[0]);
+  u_char* dst = start;
+  u_char state = 0;
+#if (nginx_version >= 1025000)
+  ngx_int_t rc = ngx_http_huff_decode(&state, const_cast<u_char*>(src), len,
+                                      &dst, 1 /* last */, log);
+#else
+  ngx_int_t rc = ngx_http_v2_huff_decode(&state, const_cast<u_char*>(src),
+                                         len, &dst, 1 /* last */, log);
+#endif
+  if (rc != NGX_OK) {
+    return false;
+  }
+  out->resize(dst - start);
+  return true;
+#else
+  ngx_log_error(NGX_LOG_ERR, log, 0,
+                "HPACK: huffman coded header, but nginx is built without "
+                "the http_v2 module");
+  return false;
+#endif
+}
+
+}  // namespace
+
+NgxHpackDecoder::NgxHpackDecoder(ngx_log_t* log)
+    : log_(log),
+      pos_(NULL),
+      end_(NULL),
+      size_(0),
+      max_size_(kDefaultTableSize) {
+}
+
+NgxHpackDecoder::~NgxHpackDecoder() {
+}
+
+bool NgxHpackDecoder::Decode(StringPiece block, NgxHpackHeaders* headers) {
+  pos_ = reinterpret_cast<const u_char*>(block.data());
+  end_ = pos_ + block.size();
+  while (pos_ < end_) {
+    u_char first = *pos_;
+    uint32 index;
+    GoogleString name;
+    GoogleString value;
+    if (first & 0x80) {
+      // Indexed header field.
+      if (!DecodeInteger(7, &index) || index == 0 ||
+          !Lookup(index, &name, &value)) {
+        return false;
+      }
+    } else if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update.
+      uint32 size;
+      if (!DecodeInteger(5, &size) || size > kDefaultTableSize) {
+        return false;
+      }
+      max_size_ = size;
+      Evict();
+      continue;
+    } else {
+      // A literal, with incremental indexing (01), without indexing (0000) or
+      // never indexed (0001).
+      bool indexing = (first & 0x40) != 0;
+      if (!DecodeInteger(indexing ? 6 : 4, &index)) {
+        return false;
+      }
+      GoogleString unused;
+      if (index == 0 ? !DecodeString(&name) :
+          !Lookup(index, &name, &unused)) {
+        return false;
+      }
+      if (!DecodeString(&value)) {
+        return false;
+      }
+      if (indexing) {
+        Insert(name, value);
+      }
+    }
+    headers->push_back(std::make_pair(name, value));
+  }
+  return true;
+}
+
+bool NgxHpackDecoder::DecodeInteger(int prefix_bits, uint32* value) {
+  if (pos_ >= end_) {
+    return false;
+  }
+  uint32 prefix_max = (1 << prefix_bits) - 1;
+  *value = *pos_++ & prefix_max;
+  if (*value < prefix_max) {
+    return true;
+  }
+  for (int shift = 0; pos_ < end_; shift += 7) {
+    // Zero continuation bytes don't add to the value, but would take the
+    // shift past the width of a uint32.
+    if (shift > 28) {
+      return false;
+    }
+    u_char b = *pos_++;
+    *value += static_cast<uint32>(b & 0x7f) << shift;
+    if (*value > kMaxInteger) {
+      return false;
+    }
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool NgxHpackDecoder::DecodeString(GoogleString* value) {
+  if (pos_ >= end_) {
+    return false;
+  }
+  bool huffman = (*pos_ & 0x80) != 0;
+  uint32 len;
+  if (!DecodeInteger(7, &len) || len > static_cast<uint32>(end_ - pos_)) {
+    return false;
+  }
+  const u_char* data = pos_;
+  pos_ += len;
+  if (huffman) {
+    return HuffmanDecode(data, len, value, log_);
+  }
+  value->assign(reinterpret_cast<const char*>(data), len);
+  return true;
+}
+
+bool NgxHpackDecoder::Lookup(uint32 index, GoogleString* name,
+                             GoogleString* value) const {
+  if (index == 0) {
+    return false;
+  }
+  if (index <= arraysize(kStaticTable)) {
+    *name = kStaticTable[index - 1][0];
+    *value = kStaticTable[index - 1][1];
+    return true;
+  }
+  index -= arraysize(kStaticTable) + 1;
+  if (index >= table_.size()) {
+    return false;
+  }
+  *name = table_[index].name;
+  *value = table_[index].value;
+  return true;
+}
+
+void NgxHpackDecoder::Insert(const GoogleString& name,
+                             const GoogleString& value) {
+  size_t size = name.size() + value.size() + kEntryOverhead;
+  if (size > max_size_) {
+    // Larger than the whole table: it ends up empty, RFC 7541 4.4.
+    table_.clear();
+    size_ = 0;
+    return;
+  }
+  Entry entry;
+  entry.name = name;
+  entry.value = value;
+  table_.push_front(entry);
+  size_ += size;
+  Evict();
+}
+
+void NgxHpackDecoder::Evict() {
+  while (size_ > max_size_ && !table_.empty()) {
+    const Entry& oldest = table_.back();
+    size_ -= oldest.name.size() + oldest.value.size() + kEntryOverhead;
+    table_.pop_back();
+  }
+}
+
+void NgxHpackEncode(StringPiece name, StringPiece value, GoogleString* out) {
+  // Without indexing, new name: a zero byte, then the two strings as plain
+  // octets.
+  out->push_back('\0');
+  EncodeInteger(0, 7, name.size(), out);
+  out->append(name.data(), name.size());
+  EncodeInteger(0, 7, value.size(), out);
+  out->append(value.data(), value.size());
+}
+
+}  // namespace net_instaweb
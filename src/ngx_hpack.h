@@ -0,0 +1,98 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// HPACK (RFC 7541), the header compression of HTTP/2, as far as the native
+// fetcher's HTTP/2 client needs it: a full decoder for the response headers
+// servers send, and an encoder that sends request headers as plain literals,
+// which keeps the server's decoder state out of the picture.
+//
+// Huffman coded strings are decoded with nginx's decoder, which is only there
+// when nginx is built with the http_v2 module.
+
+#ifndef NGX_HPACK_H_
+#define NGX_HPACK_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+typedef std::vector<std::pair<GoogleString, GoogleString> > NgxHpackHeaders;
+
+class NgxHpackDecoder {
+ public:
+  // The dynamic table size we announce, which is the HPACK default.
+  static const size_t kDefaultTableSize = 4096;
+
+  explicit NgxHpackDecoder(ngx_log_t* log);
+  ~NgxHpackDecoder();
+
+  // Decodes a complete header block, appending its fields to headers.
+  // Returns false on a compression error, which is fatal to the connection.
+  bool Decode(StringPiece block, NgxHpackHeaders* headers);
+
+ private:
+  struct Entry {
+    GoogleString name;
+    GoogleString value;
+  };
+
+  bool DecodeInteger(int prefix_bits, uint32* value);
+  bool DecodeString(GoogleString* value);
+  // Fills in the name and value at index of the static and dynamic tables.
+  bool Lookup(uint32 index, GoogleString* name, GoogleString* value) const;
+  void Insert(const GoogleString& name, const GoogleString& value);
+  // Drops the oldest entries until the table fits in max_size_.
+  void Evict();
+
+  ngx_log_t* log_;
+  // Where Decode() is at in the block.
+  const u_char* pos_;
+  const u_char* end_;
+  // Newest entry first.
+  std::deque<Entry> table_;
+  // The size of table_ as HPACK counts it: 32 bytes per entry on top of the
+  // name and value.
+  size_t size_;
+  // The limit the server set with a table size update, up to
+  // kDefaultTableSize.
+  size_t max_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxHpackDecoder);
+};
+
+// Appends a literal header field without indexing, with a literal name, to
+// out.  name must be lowercase.
+void NgxHpackEncode(StringPiece name, StringPiece value, GoogleString* out);
+
+}  // namespace net_instaweb
+
+#endif  // NGX_HPACK_H_
@@ -0,0 +1,764 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+extern "C" {
+#include <nginx.h>
+}
+
+#include "ngx_http2_session.h"
+#include "ngx_fetch.h"
+#include "ngx_url_async_fetcher.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t kFrameHeaderSize = 9;
+
+// Frame types, RFC 7540 6.
+const uint8 kDataFrame = 0x0;
+const uint8 kHeadersFrame = 0x1;
+const uint8 kPriorityFrame = 0x2;
+const uint8 kRstStreamFrame = 0x3;
+const uint8 kSettingsFrame = 0x4;
+const uint8 kPushPromiseFrame = 0x5;
+const uint8 kPingFrame = 0x6;
+const uint8 kGoawayFrame = 0x7;
+const uint8 kWindowUpdateFrame = 0x8;
+const uint8 kContinuationFrame = 0x9;
+
+const uint8 kFlagEndStream = 0x1;
+const uint8 kFlagAck = 0x1;
+const uint8 kFlagEndHeaders = 0x4;
+const uint8 kFlagPadded = 0x8;
+const uint8 kFlagPriority = 0x20;
+
+const uint16 kSettingsEnablePush = 0x2;
+const uint16 kSettingsMaxConcurrentStreams = 0x3;
+const uint16 kSettingsInitialWindowSize = 0x4;
+const uint16 kSettingsMaxFrameSize = 0x5;
+
+// Error codes, RFC 7540 7.
+const uint32 kNoError = 0x0;
+const uint32 kProtocolError = 0x1;
+const uint32 kFrameSizeError = 0x6;
+const uint32 kRefusedStream = 0x7;
+const uint32 kCancel = 0x8;
+const uint32 kCompressionError = 0x9;
+
+// The window every connection and stream starts out with.
+const uint32 kDefaultWindow = 65535;
+// The windows we give the server.  Responses are mostly read as fast as they
+// come, so these only need to cover the bandwidth-delay product.
+const uint32 kStreamWindow = 1 << 20;
+const uint32 kConnectionWindow = 16 << 20;
+// The frame size every peer must accept, which is all we accept.
+const uint32 kMaxFrameSize = 16384;
+// The largest frames the server may accept.
+const uint32 kMaxMaxFrameSize = (1 << 24) - 1;
+// Bounds the streams we open at a time, whatever the server allows.
+const uint32 kMaxConcurrentStreams = 100;
+// Stream ids are odd and 31 bits.
+const int kMaxStreams = 1 << 30;
+// Bounds the response headers of a stream.
+const size_t kMaxHeaderBlockSize = 256 * 1024;
+const size_t kReceiveBufferSize = 16384;
+
+void AppendUint32(uint32 value, GoogleString* out) {
+  out->push_back(static_cast<char>(value >> 24));
+  out->push_back(static_cast<char>(value >> 16));
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value));
+}
+
+uint32 ReadUint32(const char* data) {
+  const u_char* p = reinterpret_cast<const u_char*>(data);
+  return (static_cast<uint32>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+      p[3];
+}
+
+void AppendSetting(uint16 id, uint32 value, GoogleString* out) {
+  out->push_back(static_cast<char>(id >> 8));
+  out->push_back(static_cast<char>(id));
+  AppendUint32(value, out);
+}
+
+// The stream weight for fetches of priority, 1 to 256.
+int StreamWeight(NgxUrlAsyncFetcher::FetchPriority priority) {
+  switch (priority) {
+    case NgxUrlAsyncFetcher::kCriticalPriority:
+      return 256;
+    case NgxUrlAsyncFetcher::kBackgroundPriority:
+      return 8;
+    default:
+      return 64;
+  }
+}
+
+}  // namespace
+
+NgxHttp2Session::NgxHttp2Session(NgxUrlAsyncFetcher* fetcher,
+                                 NgxConnection* nc, int max_streams,
+                                 ngx_msec_t idle_timeout_ms)
+    : fetcher_(fetcher),
+      nc_(nc),
+      key_(nc->origin_key()),
+      log_(fetcher->log_),
+      idle_timeout_ms_(idle_timeout_ms),
+      decoder_(fetcher->log_),
+      buffer_(new u_char[kReceiveBufferSize]),
+      next_stream_id_(1),
+      streams_left_(std::max(1, std::min(max_streams, kMaxStreams))),
+      max_concurrent_streams_(kMaxConcurrentStreams),
+      max_frame_size_(kMaxFrameSize),
+      connection_unacked_(0),
+      goaway_(false),
+      last_stream_id_(0x7fffffff),
+      closed_(false),
+      busy_(0),
+      frame_header_len_(0),
+      frame_length_(0),
+      frame_type_(0),
+      frame_flags_(0),
+      frame_stream_id_(0),
+      frame_remaining_(0),
+      data_pad_known_(false),
+      data_left_(0),
+      in_header_block_(false),
+      header_stream_id_(0),
+      header_end_stream_(false),
+      out_pos_(0) {
+}
+
+NgxHttp2Session::~NgxHttp2Session() {
+  CHECK(nc_ == NULL);
+}
+
+void NgxHttp2Session::Release() {
+  if (--busy_ == 0 && closed_) {
+    delete this;
+  }
+}
+
+bool NgxHttp2Session::Start() {
+  Acquire();
+  ngx_connection_t* c = nc_->c_;
+  c->data = this;
+  c->read->handler = NgxHttp2Session::ReadHandler;
+  c->write->handler = NgxHttp2Session::WriteHandler;
+
+  out_.append(kPreface, sizeof(kPreface) - 1);
+  GoogleString settings;
+  AppendSetting(kSettingsEnablePush, 0, &settings);
+  AppendSetting(kSettingsInitialWindowSize, kStreamWindow, &settings);
+  AppendFrame(kSettingsFrame, 0, 0, settings);
+  AppendWindowUpdate(0, kConnectionWindow - kDefaultWindow);
+  Flush();
+  if (!closed_ && ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    Fail("failed to hook the read event");
+  }
+  bool ok = !closed_;
+  if (ok && c->read->ready) {
+    // The server's settings may have come along with the end of the ssl
+    // handshake, and then there won't be another read event for them.
+    ngx_post_event(c->read, &ngx_posted_events);
+  }
+  Release();
+  return ok;
+}
+
+bool NgxHttp2Session::Accepts() const {
+  return !closed_ && !goaway_ && streams_left_ > 0;
+}
+
+void NgxHttp2Session::AddStream(NgxFetch* fetch) {
+  DCHECK(Accepts());
+  Acquire();
+  if (--streams_left_ <= 0) {
+    // Later fetches get a new session.
+    fetcher_->ForgetHttp2Session(this);
+  }
+  if (streams_.size() < max_concurrent_streams_) {
+    SendRequest(fetch);
+  } else {
+    queued_.push_back(fetch);
+  }
+  CheckIdle();
+  Release();
+}
+
+void NgxHttp2Session::CancelStream(NgxFetch* fetch) {
+  Acquire();
+  std::deque<NgxFetch*>::iterator queued =
+      std::find(queued_.begin(), queued_.end(), fetch);
+  if (queued != queued_.end()) {
+    queued_.erase(queued);
+  }
+  for (StreamMap::iterator iter = streams_.begin(); iter != streams_.end();
+       ++iter) {
+    if (iter->second.fetch == fetch) {
+      uint32 id = iter->first;
+      streams_.erase(iter);
+      GoogleString error;
+      AppendUint32(kCancel, &error);
+      AppendFrame(kRstStreamFrame, 0, id, error);
+      Flush();
+      break;
+    }
+  }
+  OpenQueuedStreams();
+  CheckIdle();
+  Release();
+}
+
+void NgxHttp2Session::Close() {
+  Acquire();
+  if (!closed_) {
+    SendGoaway(kNoError);
+    Fail("closed");
+  }
+  Release();
+}
+
+void NgxHttp2Session::ReadHandler(ngx_event_t* rev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(rev->data);
+  NgxHttp2Session* session = static_cast<NgxHttp2Session*>(c->data);
+  session->Acquire();
+  if (rev->timedout || c->close) {
+    // Idle for too long, or the worker is shutting down.
+    session->SendGoaway(kNoError);
+    session->Fail("idle");
+  } else {
+    session->Receive();
+  }
+  session->Release();
+}
+
+void NgxHttp2Session::WriteHandler(ngx_event_t* wev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(wev->data);
+  NgxHttp2Session* session = static_cast<NgxHttp2Session*>(c->data);
+  session->Acquire();
+  session->Flush();
+  session->Release();
+}
+
+void NgxHttp2Session::Receive() {
+  while (!closed_ && nc_->c_->read->ready) {
+    ngx_connection_t* c = nc_->c_;
+    ssize_t n = c->recv(c, buffer_.get(), kReceiveBufferSize);
+    if (n == NGX_AGAIN) {
+      break;
+    } else if (n <= 0) {
+      Fail("connection closed by the server");
+      return;
+    }
+    if (!Process(buffer_.get(), n)) {
+      return;
+    }
+  }
+  if (!closed_ && ngx_handle_read_event(nc_->c_->read, 0) != NGX_OK) {
+    Fail("failed to hook the read event");
+  }
+}
+
+bool NgxHttp2Session::Process(const u_char* data, size_t len) {
+  while (len > 0 && !closed_) {
+    if (frame_header_len_ < kFrameHeaderSize) {
+      size_t n = std::min(len, kFrameHeaderSize - frame_header_len_);
+      ngx_memcpy(frame_header_ + frame_header_len_, data, n);
+      frame_header_len_ += n;
+      data += n;
+      len -= n;
+      if (frame_header_len_ < kFrameHeaderSize) {
+        break;
+      }
+      if (!BeginFrame()) {
+        return false;
+      }
+    } else {
+      size_t n = std::min(len, static_cast<size_t>(frame_remaining_));
+      if (frame_type_ == kDataFrame) {
+        if (!HandleData(data, n)) {
+          return false;
+        }
+      } else {
+        payload_.append(reinterpret_cast<const char*>(data), n);
+      }
+      data += n;
+      len -= n;
+      frame_remaining_ -= n;
+    }
+    if (frame_remaining_ == 0) {
+      frame_header_len_ = 0;
+      if (!EndFrame()) {
+        return false;
+      }
+    }
+  }
+  return !closed_;
+}
+
+bool NgxHttp2Session::BeginFrame() {
+  const u_char* h = frame_header_;
+  frame_length_ = (h[0] << 16) | (h[1] << 8) | h[2];
+  frame_type_ = h[3];
+  frame_flags_ = h[4];
+  frame_stream_id_ = ReadUint32(reinterpret_cast<const char*>(h + 5)) &
+      0x7fffffff;
+  frame_remaining_ = frame_length_;
+  payload_.clear();
+  if (frame_length_ > kMaxFrameSize) {
+    return ConnectionError(kFrameSizeError, "frame too large");
+  }
+  // A header block must not be interleaved with other frames.
+  if (in_header_block_ != (frame_type_ == kContinuationFrame) ||
+      (in_header_block_ && frame_stream_id_ != header_stream_id_)) {
+    return ConnectionError(kProtocolError, "unexpected frame");
+  }
+  if (frame_type_ == kDataFrame) {
+    if (frame_stream_id_ == 0) {
+      return ConnectionError(kProtocolError, "DATA on stream 0");
+    }
+    // Flow control counts the padding too.
+    connection_unacked_ += frame_length_;
+    StreamMap::iterator iter = streams_.find(frame_stream_id_);
+    if (iter != streams_.end()) {
+      iter->second.unacked += frame_length_;
+    }
+    data_pad_known_ = (frame_flags_ & kFlagPadded) == 0;
+    data_left_ = data_pad_known_ ? frame_length_ : 0;
+  }
+  return true;
+}
+
+bool NgxHttp2Session::HandleData(const u_char* data, size_t len) {
+  if (!data_pad_known_ && len > 0) {
+    uint32 pad = *data++;
+    --len;
+    if (pad >= frame_length_) {
+      return ConnectionError(kProtocolError, "bad DATA padding");
+    }
+    data_pad_known_ = true;
+    data_left_ = frame_length_ - 1 - pad;
+  }
+  size_t n = std::min(len, static_cast<size_t>(data_left_));
+  data_left_ -= n;
+  StreamMap::iterator iter = streams_.find(frame_stream_id_);
+  if (n == 0 || iter == streams_.end()) {
+    // Padding, or a stream we reset.
+    return true;
+  }
+  if (!iter->second.fetch->HandleHttp2Data(
+          StringPiece(reinterpret_cast<const char*>(data), n))) {
+    ResetStream(frame_stream_id_, kCancel);
+  }
+  return true;
+}
+
+bool NgxHttp2Session::EndFrame() {
+  switch (frame_type_) {
+    case kDataFrame: {
+      if (frame_flags_ & kFlagEndStream) {
+        NgxFetch* fetch = TakeStream(frame_stream_id_);
+        if (fetch != NULL) {
+          fetch->Http2StreamDone();
+        }
+      }
+      if (closed_) {
+        return false;
+      }
+      // Open the windows back up once half of them are used.
+      if (connection_unacked_ >= kConnectionWindow / 2) {
+        AppendWindowUpdate(0, connection_unacked_);
+        connection_unacked_ = 0;
+      }
+      StreamMap::iterator iter = streams_.find(frame_stream_id_);
+      if (iter != streams_.end() &&
+          iter->second.unacked >= kStreamWindow / 2) {
+        AppendWindowUpdate(frame_stream_id_, iter->second.unacked);
+        iter->second.unacked = 0;
+      }
+      Flush();
+      OpenQueuedStreams();
+      CheckIdle();
+      return !closed_;
+    }
+    case kHeadersFrame: {
+      if (frame_stream_id_ == 0 || (frame_stream_id_ & 1) == 0) {
+        return ConnectionError(kProtocolError, "HEADERS on a bad stream");
+      }
+      size_t start = 0;
+      size_t end = payload_.size();
+      if (frame_flags_ & kFlagPadded) {
+        if (end < 1 || static_cast<u_char>(payload_[0]) >= end) {
+          return ConnectionError(kProtocolError, "bad HEADERS padding");
+        }
+        end -= static_cast<u_char>(payload_[0]);
+        start = 1;
+      }
+      if (frame_flags_ & kFlagPriority) {
+        start += 5;
+        if (start > end) {
+          return ConnectionError(kFrameSizeError, "short HEADERS");
+        }
+      }
+      in_header_block_ = true;
+      header_stream_id_ = frame_stream_id_;
+      header_end_stream_ = (frame_flags_ & kFlagEndStream) != 0;
+      header_block_.assign(payload_, start, end - start);
+      if (frame_flags_ & kFlagEndHeaders) {
+        return HandleHeaderBlock();
+      }
+      return true;
+    }
+    case kContinuationFrame:
+      if (header_block_.size() + payload_.size() > kMaxHeaderBlockSize) {
+        return ConnectionError(kProtocolError, "header block too large");
+      }
+      header_block_.append(payload_);
+      if (frame_flags_ & kFlagEndHeaders) {
+        return HandleHeaderBlock();
+      }
+      return true;
+    case kRstStreamFrame: {
+      if (payload_.size() != 4) {
+        return ConnectionError(kFrameSizeError, "bad RST_STREAM");
+      }
+      NgxFetch* fetch = TakeStream(frame_stream_id_);
+      if (fetch != NULL) {
+        ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                      "NgxHttp2Session %p: stream %uD reset with error %uD",
+                      this, frame_stream_id_, ReadUint32(payload_.data()));
+        fetch->Http2StreamFailed(ReadUint32(payload_.data()) ==
+                                 kRefusedStream);
+        OpenQueuedStreams();
+        CheckIdle();
+      }
+      return !closed_;
+    }
+    case kSettingsFrame:
+      return HandleSettings();
+    case kPushPromiseFrame:
+      return ConnectionError(kProtocolError, "PUSH_PROMISE with push off");
+    case kPingFrame:
+      if (payload_.size() != 8 || frame_stream_id_ != 0) {
+        return ConnectionError(kFrameSizeError, "bad PING");
+      }
+      if ((frame_flags_ & kFlagAck) == 0) {
+        AppendFrame(kPingFrame, kFlagAck, 0, payload_);
+        Flush();
+      }
+      return !closed_;
+    case kGoawayFrame:
+      return HandleGoaway();
+    case kPriorityFrame:
+    case kWindowUpdateFrame:
+    default:
+      // We don't send DATA, so the send windows don't matter, nor does the
+      // priority the server wants its streams to have.  Unknown frames are
+      // ignored, RFC 7540 4.1.
+      return true;
+  }
+}
+
+bool NgxHttp2Session::HandleHeaderBlock() {
+  in_header_block_ = false;
+  NgxHpackHeaders headers;
+  // Blocks of streams we reset are decoded anyway, to keep the table right.
+  bool ok = decoder_.Decode(header_block_, &headers);
+  header_block_.clear();
+  if (!ok) {
+    return ConnectionError(kCompressionError, "bad header block");
+  }
+  StreamMap::iterator iter = streams_.find(header_stream_id_);
+  if (iter == streams_.end()) {
+    return true;
+  }
+  if (!iter->second.fetch->HandleHttp2Headers(headers)) {
+    ResetStream(header_stream_id_, kCancel);
+    return !closed_;
+  }
+  if (header_end_stream_) {
+    NgxFetch* fetch = TakeStream(header_stream_id_);
+    if (fetch != NULL) {
+      fetch->Http2StreamDone();
+    }
+    OpenQueuedStreams();
+    CheckIdle();
+  }
+  return !closed_;
+}
+
+bool NgxHttp2Session::HandleSettings() {
+  if (frame_stream_id_ != 0) {
+    return ConnectionError(kProtocolError, "SETTINGS on a stream");
+  }
+  if (frame_flags_ & kFlagAck) {
+    return payload_.empty() ||
+        ConnectionError(kFrameSizeError, "SETTINGS ack with a payload");
+  }
+  if (payload_.size() % 6 != 0) {
+    return ConnectionError(kFrameSizeError, "bad SETTINGS");
+  }
+  for (size_t i = 0; i < payload_.size(); i += 6) {
+    const u_char* p = reinterpret_cast<const u_char*>(payload_.data() + i);
+    uint16 id = (p[0] << 8) | p[1];
+    uint32 value = ReadUint32(payload_.data() + i + 2);
+    if (id == kSettingsMaxConcurrentStreams) {
+      max_concurrent_streams_ = std::min(value, kMaxConcurrentStreams);
+    } else if (id == kSettingsMaxFrameSize) {
+      if (value < kMaxFrameSize || value > kMaxMaxFrameSize) {
+        return ConnectionError(kProtocolError, "bad SETTINGS_MAX_FRAME_SIZE");
+      }
+      max_frame_size_ = value;
+    }
+  }
+  AppendFrame(kSettingsFrame, kFlagAck, 0, StringPiece());
+  Flush();
+  OpenQueuedStreams();
+  return !closed_;
+}
+
+bool NgxHttp2Session::HandleGoaway() {
+  if (frame_stream_id_ != 0 || payload_.size() < 8) {
+    return ConnectionError(kFrameSizeError, "bad GOAWAY");
+  }
+  last_stream_id_ = ReadUint32(payload_.data()) & 0x7fffffff;
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxHttp2Session %p: GOAWAY from %s, last stream %uD, "
+                "error %uD", this, key_.c_str(), last_stream_id_,
+                ReadUint32(payload_.data() + 4));
+  goaway_ = true;
+  fetcher_->ForgetHttp2Session(this);
+
+  // The server won't answer the streams after last_stream_id_, nor those we
+  // didn't even send, so they can go elsewhere.
+  std::vector<NgxFetch*> unprocessed(queued_.begin(), queued_.end());
+  queued_.clear();
+  for (StreamMap::iterator iter = streams_.upper_bound(last_stream_id_);
+       iter != streams_.end(); ++iter) {
+    unprocessed.push_back(iter->second.fetch);
+  }
+  streams_.erase(streams_.upper_bound(last_stream_id_), streams_.end());
+  for (size_t i = 0; i < unprocessed.size(); ++i) {
+    unprocessed[i]->http2_session_ = NULL;
+    unprocessed[i]->Http2StreamFailed(true /* unprocessed */);
+  }
+  CheckIdle();
+  return !closed_;
+}
+
+void NgxHttp2Session::SendRequest(NgxFetch* fetch) {
+  uint32 id = next_stream_id_;
+  next_stream_id_ += 2;
+
+  NgxHpackHeaders headers;
+  fetch->Http2RequestHeaders(&headers);
+  GoogleString block;
+  for (size_t i = 0; i < headers.size(); ++i) {
+    NgxHpackEncode(headers[i].first, headers[i].second, &block);
+  }
+
+  // No stream dependency, and a weight by the priority of the fetch.
+  GoogleString payload;
+  AppendUint32(0, &payload);
+  payload.push_back(static_cast<char>(StreamWeight(fetch->priority()) - 1));
+  size_t n = std::min(block.size(),
+                      static_cast<size_t>(max_frame_size_) - payload.size());
+  payload.append(block, 0, n);
+  // The request has no body.
+  uint8 flags = kFlagEndStream | kFlagPriority;
+  if (n == block.size()) {
+    flags |= kFlagEndHeaders;
+  }
+  AppendFrame(kHeadersFrame, flags, id, payload);
+  for (size_t pos = n; pos < block.size(); pos += n) {
+    n = std::min(block.size() - pos, static_cast<size_t>(max_frame_size_));
+    AppendFrame(kContinuationFrame,
+                pos + n == block.size() ? kFlagEndHeaders : 0, id,
+                StringPiece(block.data() + pos, n));
+  }
+
+  streams_[id].fetch = fetch;
+  fetcher_->http2_stream_count_->Add(1);
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxHttp2Session %p: stream %uD for [%s]", this, id,
+                fetch->str_url());
+  Flush();
+}
+
+void NgxHttp2Session::OpenQueuedStreams() {
+  while (!closed_ && !goaway_ && !queued_.empty() &&
+         streams_.size() < max_concurrent_streams_) {
+    NgxFetch* fetch = queued_.front();
+    queued_.pop_front();
+    SendRequest(fetch);
+  }
+}
+
+NgxFetch* NgxHttp2Session::TakeStream(uint32 id) {
+  StreamMap::iterator iter = streams_.find(id);
+  if (iter == streams_.end()) {
+    return NULL;
+  }
+  NgxFetch* fetch = iter->second.fetch;
+  streams_.erase(iter);
+  fetch->http2_session_ = NULL;
+  return fetch;
+}
+
+void NgxHttp2Session::ResetStream(uint32 id, uint32 error) {
+  NgxFetch* fetch = TakeStream(id);
+  if (fetch == NULL) {
+    return;
+  }
+  GoogleString payload;
+  AppendUint32(error, &payload);
+  AppendFrame(kRstStreamFrame, 0, id, payload);
+  Flush();
+  fetch->CallbackDone(false);
+  OpenQueuedStreams();
+  CheckIdle();
+}
+
+void NgxHttp2Session::AppendFrame(uint8 type, uint8 flags, uint32 stream_id,
+                                  StringPiece payload) {
+  uint32 len = payload.size();
+  out_.push_back(static_cast<char>(len >> 16));
+  out_.push_back(static_cast<char>(len >> 8));
+  out_.push_back(static_cast<char>(len));
+  out_.push_back(static_cast<char>(type));
+  out_.push_back(static_cast<char>(flags));
+  AppendUint32(stream_id, &out_);
+  out_.append(payload.data(), payload.size());
+}
+
+void NgxHttp2Session::AppendWindowUpdate(uint32 stream_id,
+                                         uint32 increment) {
+  GoogleString payload;
+  AppendUint32(increment, &payload);
+  AppendFrame(kWindowUpdateFrame, 0, stream_id, payload);
+}
+
+void NgxHttp2Session::Flush() {
+  if (closed_) {
+    return;
+  }
+  ngx_connection_t* c = nc_->c_;
+  while (out_pos_ < out_.size()) {
+    ssize_t n = c->send(c, reinterpret_cast<u_char*>(&out_[out_pos_]),
+                        out_.size() - out_pos_);
+    if (n == NGX_AGAIN || n == 0) {
+      break;
+    } else if (n < 0) {
+      Fail("failed to write to the server");
+      return;
+    }
+    out_pos_ += n;
+  }
+  if (out_pos_ == out_.size()) {
+    out_.clear();
+    out_pos_ = 0;
+  }
+  if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+    Fail("failed to hook the write event");
+  }
+}
+
+void NgxHttp2Session::CheckIdle() {
+  if (closed_) {
+    return;
+  }
+  ngx_connection_t* c = nc_->c_;
+  if (!streams_.empty() || !queued_.empty()) {
+    if (c->read->timer_set) {
+      ngx_del_timer(c->read);
+    }
+    c->idle = 0;
+    return;
+  }
+  if (goaway_ || streams_left_ <= 0) {
+    SendGoaway(kNoError);
+    Fail("done");
+    return;
+  }
+  if (!c->read->timer_set) {
+    ngx_add_timer(c->read, idle_timeout_ms_);
+  }
+  // Lets a graceful shutdown of the worker close the connection.
+  c->idle = 1;
+}
+
+void NgxHttp2Session::SendGoaway(uint32 error) {
+  if (closed_) {
+    return;
+  }
+  // We never accept streams from the server.
+  GoogleString payload;
+  AppendUint32(0, &payload);
+  AppendUint32(error, &payload);
+  AppendFrame(kGoawayFrame, 0, 0, payload);
+  Flush();
+}
+
+bool NgxHttp2Session::ConnectionError(uint32 error, const char* reason) {
+  SendGoaway(error);
+  Fail(reason);
+  return false;
+}
+
+void NgxHttp2Session::Fail(const char* reason) {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxHttp2Session %p: closing the connection to %s: %s",
+                this, key_.c_str(), reason);
+  fetcher_->Http2SessionClosed(this);
+  nc_->set_keepalive(false);
+  nc_->Close();
+  nc_ = NULL;
+
+  std::vector<std::pair<NgxFetch*, bool> > failed;
+  for (StreamMap::iterator iter = streams_.begin(); iter != streams_.end();
+       ++iter) {
+    failed.push_back(std::make_pair(iter->second.fetch,
+                                    iter->first > last_stream_id_));
+  }
+  for (size_t i = 0; i < queued_.size(); ++i) {
+    failed.push_back(std::make_pair(queued_[i], true));
+  }
+  streams_.clear();
+  queued_.clear();
+  for (size_t i = 0; i < failed.size(); ++i) {
+    failed[i].first->http2_session_ = NULL;
+    failed[i].first->Http2StreamFailed(failed[i].second);
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,198 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// An HTTP/2 (RFC 7540) client connection of the native fetcher.  Fetches to
+// an origin that speaks HTTP/2, learned over ALPN or configured for h2c with
+// prior knowledge, share a single connection per address, each on its own
+// stream, instead of taking a connection each.
+//
+// Request headers go out as one HEADERS frame, plus CONTINUATION frames when
+// large, carrying the priority of the fetch as stream weight.  The session
+// reads frames as they come, hands response headers and DATA to the fetches,
+// and opens the receive windows back up once half of them are used.  Streams
+// beyond what the server allows at a time wait in a queue.
+//
+// Sessions are owned by NgxUrlAsyncFetcher and only used on the nginx thread.
+// A session deletes itself once it is closed and no call into it is under
+// way.
+
+#ifndef NGX_HTTP2_SESSION_H_
+#define NGX_HTTP2_SESSION_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+}
+
+#include <deque>
+#include <map>
+
+#include "ngx_hpack.h"
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class NgxConnection;
+class NgxFetch;
+class NgxUrlAsyncFetcher;
+
+class NgxHttp2Session {
+ public:
+  // Takes over nc, which is connected and, for https, done with its
+  // handshake.  At most max_streams fetches are sent over it in total, and it
+  // is closed when it had no streams for idle_timeout_ms.
+  NgxHttp2Session(NgxUrlAsyncFetcher* fetcher, NgxConnection* nc,
+                  int max_streams, ngx_msec_t idle_timeout_ms);
+
+  // Sends the connection preface and our settings.  Returns false when that
+  // failed, after which the session is gone.
+  bool Start();
+
+  // The connection pool key of the peer, see NgxConnectionPool::OriginKey().
+  const GoogleString& key() const { return key_; }
+  // Whether another fetch can be sent over the session.
+  bool Accepts() const;
+  int num_streams() const { return streams_.size() + queued_.size(); }
+
+  // Sends the request of fetch on a new stream, or queues it until the
+  // server allows another stream.  The response is passed to the fetch with
+  // NgxFetch::HandleHttp2Headers() and friends.  When the session fails, the
+  // fetch hears so from NgxFetch::Http2StreamFailed().
+  void AddStream(NgxFetch* fetch);
+  // Forgets fetch, which gave up on its response: resets its stream, or takes
+  // it out of the queue.  Its callbacks won't be called anymore.
+  void CancelStream(NgxFetch* fetch);
+  // Says goodbye to the server and fails the streams.  The session is gone
+  // afterwards.
+  void Close();
+
+ private:
+  struct Stream {
+    Stream() : fetch(NULL), unacked(0) {}
+    NgxFetch* fetch;
+    // DATA bytes received since we last opened the stream's window.
+    uint32 unacked;
+  };
+  typedef std::map<uint32, Stream> StreamMap;
+
+  // Deletes the session once it was closed and nothing uses it anymore.
+  ~NgxHttp2Session();
+  void Acquire() { ++busy_; }
+  void Release();
+
+  static void ReadHandler(ngx_event_t* rev);
+  static void WriteHandler(ngx_event_t* wev);
+  void Receive();
+  // Parses frames out of data.  Returns false on a connection error, after
+  // which the session is closed.
+  bool Process(const u_char* data, size_t len);
+  bool BeginFrame();
+  bool EndFrame();
+  // Passes a piece of the payload of a DATA frame to its stream.
+  bool HandleData(const u_char* data, size_t len);
+  bool HandleHeaderBlock();
+  bool HandleSettings();
+  bool HandleGoaway();
+
+  void SendRequest(NgxFetch* fetch);
+  // Opens queued streams as far as the server permits.
+  void OpenQueuedStreams();
+  // Forgets the stream of id, and returns its fetch, or NULL when there is
+  // no such stream.
+  NgxFetch* TakeStream(uint32 id);
+  // Fails the stream of id: resets it with error, and fails its fetch.
+  void ResetStream(uint32 id, uint32 error);
+
+  void AppendFrame(uint8 type, uint8 flags, uint32 stream_id,
+                   StringPiece payload);
+  void AppendWindowUpdate(uint32 stream_id, uint32 increment);
+  // Writes out what is buffered.
+  void Flush();
+  // Closes the session when it was told to go away or is used up and has
+  // nothing left to do, or else keeps it open for idle_timeout_ms_.
+  void CheckIdle();
+  // Tells the server we are done with the connection, and why.  Doesn't wait
+  // for the frame to be written.
+  void SendGoaway(uint32 error);
+  // Sends GOAWAY with error, and closes the session.  Always returns false.
+  bool ConnectionError(uint32 error, const char* reason);
+  // Closes the connection and fails the streams: those the server said it
+  // didn't process can be retried elsewhere.
+  void Fail(const char* reason);
+
+  NgxUrlAsyncFetcher* fetcher_;
+  NgxConnection* nc_;
+  GoogleString key_;
+  ngx_log_t* log_;
+  ngx_msec_t idle_timeout_ms_;
+  NgxHpackDecoder decoder_;
+  scoped_array<u_char> buffer_;
+
+  StreamMap streams_;
+  std::deque<NgxFetch*> queued_;
+  uint32 next_stream_id_;
+  int streams_left_;
+  uint32 max_concurrent_streams_;
+  uint32 max_frame_size_;
+  // DATA bytes received on the connection since we last opened its window.
+  uint32 connection_unacked_;
+  // Set once either side sent GOAWAY, streams above last_stream_id_ were not
+  // processed by the server.
+  bool goaway_;
+  uint32 last_stream_id_;
+  bool closed_;
+  int busy_;
+
+  // The frame being parsed.
+  u_char frame_header_[9];
+  size_t frame_header_len_;
+  uint32 frame_length_;
+  uint8 frame_type_;
+  uint8 frame_flags_;
+  uint32 frame_stream_id_;
+  uint32 frame_remaining_;
+  // The payload of frames other than DATA.
+  GoogleString payload_;
+  // For DATA frames: whether the pad length is known, and the data bytes left
+  // before the padding.
+  bool data_pad_known_;
+  uint32 data_left_;
+  // The header block HEADERS and CONTINUATION frames are adding up to.
+  bool in_header_block_;
+  uint32 header_stream_id_;
+  bool header_end_stream_;
+  GoogleString header_block_;
+
+  // Frames waiting to be written, from out_pos_ on.
+  GoogleString out_;
+  size_t out_pos_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxHttp2Session);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_HTTP2_SESSION_H_
@@ -0,0 +1,197 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+#include "ngx_pagespeed.h"  // Must come first, see ngx_base_fetch.cc.
+
+#include "ngx_inflight_snapshots.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include "ngx_base_fetch.h"
+#include "ngx_rewrite_driver_factory.h"
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/base/writer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How often workers check whether a snapshot was asked for.
+const ngx_msec_t kCheckIntervalMs = 250;
+
+const char kTruncated[] = "</table>\n<p>Truncated.</p>\n";
+
+}  // namespace
+
+NgxInflightSnapshots::NgxInflightSnapshots(int num_workers,
+                                           NgxRewriteDriverFactory* factory)
+    : num_workers_(num_workers > 0 ? num_workers : 1),
+      factory_(factory),
+      segment_(NULL),
+      slot_(NULL),
+      started_(false) {
+  ngx_memzero(&shm_, sizeof(shm_));
+  ngx_memzero(&timer_event_, sizeof(timer_event_));
+  timer_event_.data = this;
+  timer_event_.handler = NgxInflightSnapshots::TimerHandler;
+#if (nginx_version >= 1011011)
+  // Don't hold up a graceful shutdown of the worker.
+  timer_event_.cancelable = 1;
+#endif
+}
+
+NgxInflightSnapshots::~NgxInflightSnapshots() {
+  DCHECK(!started_);
+  if (shm_.addr != NULL) {
+    ngx_shm_free(&shm_);
+  }
+}
+
+bool NgxInflightSnapshots::Allocate(ngx_log_t* log) {
+  shm_.size = offsetof(Segment, slots) + num_workers_ * sizeof(Slot);
+  shm_.name.data = reinterpret_cast<u_char*>(
+      const_cast<char*>("pagespeed_inflight_snapshots"));
+  shm_.name.len = ngx_strlen(shm_.name.data);
+  shm_.log = log;
+  if (ngx_shm_alloc(&shm_) != NGX_OK) {
+    shm_.addr = NULL;
+    return false;
+  }
+  ngx_memzero(shm_.addr, shm_.size);
+  segment_ = reinterpret_cast<Segment*>(shm_.addr);
+  return true;
+}
+
+void NgxInflightSnapshots::Start(ngx_log_t* log) {
+  if (segment_ == NULL) {
+    return;
+  }
+  slot_ = &segment_->slots[ps_worker_index(num_workers_)];
+  timer_event_.log = log;
+  started_ = true;
+  ngx_add_timer(&timer_event_, kCheckIntervalMs);
+}
+
+void NgxInflightSnapshots::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  if (timer_event_.timer_set) {
+    ngx_del_timer(&timer_event_);
+  }
+}
+
+void NgxInflightSnapshots::TimerHandler(ngx_event_t* ev) {
+  NgxInflightSnapshots* snapshots = static_cast<NgxInflightSnapshots*>(
+      ev->data);
+  if (snapshots->slot_->answered != snapshots->segment_->requested) {
+    snapshots->Publish(snapshots->factory_->message_handler());
+  }
+  if (snapshots->started_ && !ngx_exiting) {
+    ngx_add_timer(ev, kCheckIntervalMs);
+  }
+}
+
+int64 NgxInflightSnapshots::NowMs() {
+  ngx_time_t* tp = ngx_timeofday();
+  return static_cast<int64>(tp->sec) * 1000 + tp->msec;
+}
+
+void NgxInflightSnapshots::Publish(MessageHandler* handler) {
+  ngx_atomic_uint_t requested = segment_->requested;
+  GoogleString html;
+  StringWriter writer(&html);
+  NgxBaseFetch::WriteActive(&writer, handler);
+  factory_->WriteNativeFetches(&writer);
+
+  size_t max_len = sizeof(slot_->data);
+  if (html.size() > max_len) {
+    // Cut after the last row that fits along with the note.
+    size_t cut = html.rfind("</tr>\n", max_len - STATIC_STRLEN(kTruncated));
+    html.resize(cut == GoogleString::npos ? 0 : cut + STATIC_STRLEN("</tr>\n"));
+    html.append(kTruncated);
+  }
+
+  ++slot_->sequence;
+  ngx_memory_barrier();
+  ngx_memcpy(slot_->data, html.data(), html.size());
+  slot_->len = html.size();
+  slot_->pid = ngx_pid;
+  slot_->taken_ms = NowMs();
+  slot_->answered = requested;
+  ngx_memory_barrier();
+  ++slot_->sequence;
+}
+
+bool NgxInflightSnapshots::CopySlot(const Slot* slot, Writer* writer,
+                                    MessageHandler* handler) {
+  ngx_atomic_uint_t sequence = slot->sequence;
+  ngx_memory_barrier();
+  if ((sequence & 1) != 0) {
+    return false;
+  }
+  ngx_pid_t pid = slot->pid;
+  int64 taken_ms = slot->taken_ms;
+  size_t len = std::min(slot->len, sizeof(slot->data));
+  GoogleString html(reinterpret_cast<const char*>(slot->data), len);
+  ngx_memory_barrier();
+  if (slot->sequence != sequence) {
+    return false;
+  }
+  if (pid == 0) {
+    writer->Write("<p>No snapshot yet, reload to see it.</p>\n", handler);
+    return true;
+  }
+  writer->Write(StrCat("<h3>Worker process ", IntegerToString(pid),
+                       ", ", Integer64ToString(NowMs() - taken_ms),
+                       " ms ago</h3>\n", html),
+                handler);
+  return true;
+}
+
+void NgxInflightSnapshots::Write(Writer* writer, MessageHandler* handler) {
+  if (segment_ == NULL || slot_ == NULL) {
+    writer->Write(StrCat("<h3>Worker process ", IntegerToString(ngx_pid),
+                         "</h3>\n"),
+                  handler);
+    NgxBaseFetch::WriteActive(writer, handler);
+    factory_->WriteNativeFetches(writer);
+    return;
+  }
+  ngx_atomic_fetch_add(&segment_->requested, 1);
+  Publish(handler);
+  CopySlot(slot_, writer, handler);
+  for (int i = 0; i < num_workers_; ++i) {
+    Slot* slot = &segment_->slots[i];
+    if (slot != slot_ && !CopySlot(slot, writer, handler)) {
+      writer->Write("<p>A worker is updating its snapshot, reload to see "
+                    "it.</p>\n", handler);
+    }
+  }
+}
+
+}  // namespace net_instaweb
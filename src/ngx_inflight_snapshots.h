@@ -0,0 +1,105 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxInflightSnapshots shows what every worker has in flight on a single admin
+// page: its NgxBaseFetch instances and its native fetches.  Each worker owns a
+// slot in shared memory where it publishes an html snapshot of that state.
+// Workers only collect a snapshot when asked: the page bumps a shared request
+// counter, and a timer in every worker, which otherwise only compares two
+// integers, notices and publishes.  The page shows the state of the worker
+// serving it as of now, and the latest snapshots of the others with their age,
+// so reloading it shows every worker's answer.
+//
+// The segment is laid out in the master process before forking.
+
+#ifndef NGX_INFLIGHT_SNAPSHOTS_H_
+#define NGX_INFLIGHT_SNAPSHOTS_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+}
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+class MessageHandler;
+class NgxRewriteDriverFactory;
+class Writer;
+
+class NgxInflightSnapshots {
+ public:
+  NgxInflightSnapshots(int num_workers, NgxRewriteDriverFactory* factory);
+  ~NgxInflightSnapshots();
+
+  // Maps the shared memory for the slots.  Called in the master process.
+  bool Allocate(ngx_log_t* log);
+
+  // Starts answering requests for snapshots.  Called in workers.
+  void Start(ngx_log_t* log);
+  void Stop();
+
+  // Writes the page: a fresh snapshot of this worker, followed by the latest
+  // ones of the other workers, and asks those for new snapshots.  Only on the
+  // nginx thread.
+  void Write(Writer* writer, MessageHandler* handler);
+
+ private:
+  struct Slot {
+    // Odd while the owner is writing the slot.
+    ngx_atomic_t sequence;
+    // The request counter as of the last snapshot.
+    ngx_atomic_uint_t answered;
+    ngx_pid_t pid;
+    int64 taken_ms;
+    size_t len;
+    u_char data[64 * 1024];
+  };
+  struct Segment {
+    // Bumped by each page view.
+    ngx_atomic_t requested;
+    Slot slots[1];
+  };
+
+  static void TimerHandler(ngx_event_t* ev);
+  static int64 NowMs();
+
+  // Collects a snapshot of this worker into its slot.
+  void Publish(MessageHandler* handler);
+  // Copies slot into writer, unless it is being written to.
+  bool CopySlot(const Slot* slot, Writer* writer, MessageHandler* handler);
+
+  const int num_workers_;
+  NgxRewriteDriverFactory* factory_;
+  ngx_shm_t shm_;
+  Segment* segment_;
+  Slot* slot_;
+  ngx_event_t timer_event_;
+  bool started_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxInflightSnapshots);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_INFLIGHT_SNAPSHOTS_H_
@@ -0,0 +1,181 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+extern "C" {
+#include <nginx.h>
+}
+
+#include "ngx_log_ring.h"
+
+#include <cstdarg>
+
+#include "base/logging.h"
+#include "net/instaweb/public/version.h"
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How long a message may wait in the ring.
+const ngx_msec_t kFlushIntervalMs = 100;
+
+const char kLogRingDroppedMessages[] = "log_ring_dropped_messages";
+
+}  // namespace
+
+NgxLogRing::NgxLogRing(int capacity, Statistics* statistics)
+    : slots_(NULL),
+      mask_(0),
+      enqueue_pos_(0),
+      dequeue_pos_(0),
+      dropped_(0),
+      dropped_reported_(0),
+      started_(false),
+      log_(NULL) {
+  ngx_atomic_uint_t size = 1;
+  while (size < static_cast<ngx_atomic_uint_t>(capacity)) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  slots_ = new Slot[size];
+  for (ngx_atomic_uint_t i = 0; i < size; ++i) {
+    slots_[i].sequence = i;
+  }
+  ngx_memzero(&flush_event_, sizeof(flush_event_));
+  flush_event_.data = this;
+  flush_event_.handler = NgxLogRing::FlushTimerHandler;
+#if (nginx_version >= 1011011)
+  // Don't hold up a graceful shutdown of the worker.
+  flush_event_.cancelable = 1;
+#endif
+  dropped_count_ = statistics->GetVariable(kLogRingDroppedMessages);
+}
+
+NgxLogRing::~NgxLogRing() {
+  DCHECK(!started_);
+  delete [] slots_;
+}
+
+void NgxLogRing::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kLogRingDroppedMessages);
+}
+
+void NgxLogRing::Start(ngx_log_t* log) {
+  log_ = log;
+  flush_event_.log = log;
+  nginx_thread_ = pthread_self();
+#if (NGX_HAVE_ATOMIC_OPS)
+  // Without atomic operations nginx's fallbacks aren't thread safe, and
+  // everything is written out right away.
+  started_ = true;
+  ngx_add_timer(&flush_event_, kFlushIntervalMs);
+#endif
+}
+
+void NgxLogRing::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  if (flush_event_.timer_set) {
+    ngx_del_timer(&flush_event_);
+  }
+  Flush();
+}
+
+bool NgxLogRing::Log(ngx_log_t* log, ngx_uint_t level, const char* fmt, ...) {
+  if (!started_ || level <= NGX_LOG_ERR ||
+      pthread_equal(pthread_self(), nginx_thread_)) {
+    return false;
+  }
+  if (log->log_level < level) {
+    // ngx_log_error() wouldn't write it either.
+    return true;
+  }
+
+  ngx_atomic_uint_t pos = enqueue_pos_;
+  Slot* slot;
+  for (;;) {
+    slot = &slots_[pos & mask_];
+    ngx_atomic_int_t diff =
+        static_cast<ngx_atomic_int_t>(slot->sequence - pos);
+    if (diff == 0) {
+      if (ngx_atomic_cmp_set(&enqueue_pos_, pos, pos + 1)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The nginx thread hasn't caught up with the ring yet.
+      ngx_atomic_fetch_add(&dropped_, 1);
+      return true;
+    }
+    pos = enqueue_pos_;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  u_char* end = slot->data + sizeof(slot->data);
+  u_char* last = ngx_vslprintf(slot->data, end, fmt, args);
+  va_end(args);
+  // A message that filled the slot may have been cut short.
+  bool fits = last < end;
+  slot->log = log;
+  slot->level = level;
+  slot->len = fits ? last - slot->data : 0;
+  ngx_memory_barrier();
+  slot->sequence = pos + 1;
+  return fits;
+}
+
+void NgxLogRing::FlushTimerHandler(ngx_event_t* ev) {
+  NgxLogRing* ring = static_cast<NgxLogRing*>(ev->data);
+  ring->Flush();
+  if (ring->started_ && !ngx_exiting) {
+    ngx_add_timer(ev, kFlushIntervalMs);
+  }
+}
+
+void NgxLogRing::Flush() {
+  for (;;) {
+    Slot* slot = &slots_[dequeue_pos_ & mask_];
+    if (slot->sequence != dequeue_pos_ + 1) {
+      break;
+    }
+    ngx_memory_barrier();
+    if (slot->len > 0) {
+      ngx_log_error(slot->level, slot->log, 0, "%*s", slot->len, slot->data);
+    }
+    ngx_memory_barrier();
+    slot->sequence = dequeue_pos_ + mask_ + 1;
+    ++dequeue_pos_;
+  }
+
+  ngx_atomic_uint_t dropped = dropped_;
+  if (dropped != dropped_reported_) {
+    ngx_log_error(NGX_LOG_WARN, log_, 0,
+                  "[ngx_pagespeed %s] dropped %uA log messages, the log "
+                  "ring was full", kModPagespeedVersion,
+                  dropped - dropped_reported_);
+    dropped_count_->Add(dropped - dropped_reported_);
+    dropped_reported_ = dropped;
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,107 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxLogRing takes the messages logged by threads other than nginx's, so that
+// rewrite threads don't wait on each other and on the error log to get them
+// written.  A thread claims a slot of the ring with a compare-and-swap and
+// formats its message right into it, and a timer on the nginx thread writes
+// out what was queued in batches.
+//
+// When the ring is full, messages are dropped and counted, and the count is
+// logged with the next batch.  Errors and worse, and messages too long for a
+// slot, are never queued: the caller writes those out itself, as before.
+//
+// There is one ring per worker.
+
+#ifndef NGX_LOG_RING_H_
+#define NGX_LOG_RING_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+}
+
+#include <pthread.h>
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+class Statistics;
+class Variable;
+
+class NgxLogRing {
+ public:
+  // capacity is rounded up to a power of two.
+  NgxLogRing(int capacity, Statistics* statistics);
+  ~NgxLogRing();
+
+  static void InitStats(Statistics* statistics);
+
+  // Starts writing out queued messages from a timer.  The calling thread is
+  // taken for the nginx thread, whose messages aren't queued.
+  void Start(ngx_log_t* log);
+  // Stops the timer and writes out what is left.  Only call this once no
+  // other thread logs anymore.
+  void Stop();
+
+  // Queues a message, formatted like ngx_log_error() does, for log at level.
+  // Returns false when the caller should write it out itself: on the nginx
+  // thread, before Start(), for errors and for messages that don't fit.
+  bool Log(ngx_log_t* log, ngx_uint_t level, const char* fmt, ...);
+
+ private:
+  struct Slot {
+    // Vyukov's bounded queue: a slot is free for the producer of position p
+    // when sequence == p, and holds a message for the consumer when it is
+    // p + 1.
+    ngx_atomic_t sequence;
+    ngx_log_t* log;
+    ngx_uint_t level;
+    // 0 when the message didn't fit, and the slot is to be skipped.
+    size_t len;
+    u_char data[1024];
+  };
+
+  static void FlushTimerHandler(ngx_event_t* ev);
+  // Writes out the queued messages.  Only for use on the nginx thread.
+  void Flush();
+
+  Slot* slots_;
+  ngx_atomic_uint_t mask_;
+  ngx_atomic_t enqueue_pos_;
+  // Only touched by the nginx thread.
+  ngx_atomic_uint_t dequeue_pos_;
+  ngx_atomic_t dropped_;
+  ngx_atomic_uint_t dropped_reported_;
+  bool started_;
+  pthread_t nginx_thread_;
+  ngx_log_t* log_;
+  ngx_event_t flush_event_;
+  Variable* dropped_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxLogRing);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_LOG_RING_H_
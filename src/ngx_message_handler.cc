@@ -24,12 +24,18 @@
 
 #include <signal.h>
 
+#include <vector>
+
+#include "ngx_log_ring.h"
+
 #include "net/instaweb/public/version.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
 #include "pagespeed/kernel/base/debug.h"
 #include "pagespeed/kernel/base/posix_timer.h"
 #include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/time_util.h"
+#include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/sharedmem/shared_circular_buffer.h"
 
 namespace {
@@ -41,6 +47,10 @@ const char kModuleName[] = "ngx_pagespeed";
 // ngx_log_error.
 ngx_log_t* global_log = NULL;
 
+// Formats beyond this many aren't rate limited, to bound the memory used to
+// track them.
+const size_t kMaxRateLimitedFormats = 1024;
+
 }  // namespace
 
 extern "C" {
@@ -62,9 +72,125 @@ extern "C" {
 
 namespace net_instaweb {
 
-NgxMessageHandler::NgxMessageHandler(Timer* timer, AbstractMutex* mutex)
-    : SystemMessageHandler(timer, mutex),
-      log_(NULL) {
+namespace {
+
+GoogleString SuppressedSummary(int suppressed, const GoogleString& format) {
+  return StrCat("Suppressed ", IntegerToString(suppressed),
+                " similar messages: ", format);
+}
+
+}  // namespace
+
+NgxMessageHandler::NgxMessageHandler(Timer* timer,
+                                     ThreadSystem* thread_system)
+    : SystemMessageHandler(timer, thread_system->NewMutex()),
+      log_(NULL),
+      log_ring_(NULL),
+      timer_(timer),
+      rate_limit_interval_ms_(Timer::kMinuteMs),
+      rate_limit_sweep_ms_(0),
+      rate_limit_mutex_(thread_system->NewMutex()) {
+  for (int i = 0; i < kFatal; ++i) {
+    rate_limits_[i] = 0;
+  }
+}
+
+void NgxMessageHandler::set_rate_limit(MessageType type, int limit) {
+  if (type < kFatal) {
+    rate_limits_[type] = limit;
+  }
+}
+
+bool NgxMessageHandler::rate_limited() const {
+  for (int i = 0; i < kFatal; ++i) {
+    if (rate_limits_[i] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void NgxMessageHandler::SweepRateLimits() {
+  SummaryVector summaries;
+  {
+    ScopedMutex lock(rate_limit_mutex_.get());
+    if (rate_limit_windows_.empty()) {
+      return;
+    }
+    int64 now_ms = timer_->NowMs();
+    rate_limit_sweep_ms_ = now_ms;
+    SweepExpiredWindows(now_ms, &summaries);
+  }
+  WriteSummaries(summaries);
+}
+
+void NgxMessageHandler::SweepExpiredWindows(int64 now_ms,
+                                            SummaryVector* summaries) {
+  RateLimitMap::iterator iter = rate_limit_windows_.begin();
+  while (iter != rate_limit_windows_.end()) {
+    RateLimitWindow& window = iter->second;
+    if (now_ms - window.start_ms < rate_limit_interval_ms_) {
+      ++iter;
+      continue;
+    }
+    if (window.suppressed > 0) {
+      summaries->push_back(std::make_pair(
+          window.type, SuppressedSummary(window.suppressed, iter->first)));
+    }
+    rate_limit_windows_.erase(iter++);
+  }
+}
+
+void NgxMessageHandler::WriteSummaries(const SummaryVector& summaries) {
+  for (size_t i = 0; i < summaries.size(); ++i) {
+    MessageSImpl(summaries[i].first, summaries[i].second);
+  }
+}
+
+bool NgxMessageHandler::AllowMessage(MessageType type, const char* format) {
+  if (type >= kFatal || rate_limits_[type] <= 0) {
+    return true;
+  }
+
+  bool allow = true;
+  SummaryVector summaries;
+  {
+    ScopedMutex lock(rate_limit_mutex_.get());
+    int64 now_ms = timer_->NowMs();
+    if (now_ms - rate_limit_sweep_ms_ >= rate_limit_interval_ms_) {
+      rate_limit_sweep_ms_ = now_ms;
+      SweepExpiredWindows(now_ms, &summaries);
+    }
+
+    RateLimitMap::iterator iter = rate_limit_windows_.find(format);
+    if (iter == rate_limit_windows_.end() &&
+        rate_limit_windows_.size() < kMaxRateLimitedFormats) {
+      RateLimitWindow window = {now_ms, 0, 0, type};
+      iter = rate_limit_windows_.insert(
+          std::make_pair(GoogleString(format), window)).first;
+    }
+    if (iter != rate_limit_windows_.end()) {
+      RateLimitWindow& window = iter->second;
+      if (now_ms - window.start_ms >= rate_limit_interval_ms_) {
+        if (window.suppressed > 0) {
+          summaries.push_back(std::make_pair(
+              window.type, SuppressedSummary(window.suppressed, iter->first)));
+        }
+        window.start_ms = now_ms;
+        window.count = 0;
+        window.suppressed = 0;
+      }
+      if (window.count < rate_limits_[type]) {
+        ++window.count;
+      } else {
+        ++window.suppressed;
+        allow = false;
+      }
+    }
+  }
+
+  WriteSummaries(summaries);
+  return allow;
 }
 
 // Installs a signal handler for common crash signals, that tries to print
@@ -94,12 +220,31 @@ ngx_uint_t NgxMessageHandler::GetNgxLogLevel(MessageType type) {
   return NGX_LOG_ALERT;
 }
 
+void NgxMessageHandler::MessageVImpl(MessageType type, const char* msg,
+                                     va_list args) {
+  if (AllowMessage(type, msg)) {
+    SystemMessageHandler::MessageVImpl(type, msg, args);
+  }
+}
+
+void NgxMessageHandler::FileMessageVImpl(MessageType type, const char* file,
+                                         int line, const char* msg,
+                                         va_list args) {
+  if (AllowMessage(type, msg)) {
+    SystemMessageHandler::FileMessageVImpl(type, file, line, msg, args);
+  }
+}
+
 void NgxMessageHandler::MessageSImpl(MessageType type,
                                      const GoogleString& message) {
   if (log_ != NULL) {
     ngx_uint_t log_level = GetNgxLogLevel(type);
-    ngx_log_error(log_level, log_, 0/*ngx_err_t*/, "[%s %s] %s",
-                  kModuleName, kModPagespeedVersion, message.c_str());
+    if (log_ring_ == NULL ||
+        !log_ring_->Log(log_, log_level, "[%s %s] %s", kModuleName,
+                        kModPagespeedVersion, message.c_str())) {
+      ngx_log_error(log_level, log_, 0/*ngx_err_t*/, "[%s %s] %s",
+                    kModuleName, kModPagespeedVersion, message.c_str());
+    }
   } else {
     GoogleMessageHandler::MessageSImpl(type, message);
   }
@@ -110,9 +255,13 @@ void NgxMessageHandler::FileMessageSImpl(
     MessageType type, const char* file, int line, const GoogleString& message) {
   if (log_ != NULL) {
     ngx_uint_t log_level = GetNgxLogLevel(type);
-    ngx_log_error(log_level, log_, 0/*ngx_err_t*/, "[%s %s] %s:%d:%s",
-                  kModuleName, kModPagespeedVersion, file, line,
-                  message.c_str());
+    if (log_ring_ == NULL ||
+        !log_ring_->Log(log_, log_level, "[%s %s] %s:%d:%s", kModuleName,
+                        kModPagespeedVersion, file, line, message.c_str())) {
+      ngx_log_error(log_level, log_, 0/*ngx_err_t*/, "[%s %s] %s:%d:%s",
+                    kModuleName, kModPagespeedVersion, file, line,
+                    message.c_str());
+    }
   } else {
     GoogleMessageHandler::FileMessageSImpl(type, file, line, message);
   }
@@ -33,9 +33,13 @@ extern "C" {
 }
 
 #include <cstdarg>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/system/system_message_handler.h"
@@ -43,13 +47,15 @@ extern "C" {
 namespace net_instaweb {
 
 class AbstractMutex;
+class NgxLogRing;
+class ThreadSystem;
 class Timer;
 
 // Implementation of a message handler that uses ngx_log_error()
 // logging to emit messages, with a fallback to GoogleMessageHandler
 class NgxMessageHandler : public SystemMessageHandler {
  public:
-  explicit NgxMessageHandler(Timer* timer, AbstractMutex* mutex);
+  NgxMessageHandler(Timer* timer, ThreadSystem* thread_system);
 
   // Installs a signal handler for common crash signals that tries to print
   // out a backtrace.
@@ -57,16 +63,60 @@ class NgxMessageHandler : public SystemMessageHandler {
 
   void set_log(ngx_log_t* log) { log_ = log; }
   ngx_log_t* log() { return log_; }
+  // Messages of threads other than nginx's are queued on ring, if set.
+  void set_log_ring(NgxLogRing* ring) { log_ring_ = ring; }
+  // Lets messages of type with the same format through at most limit times
+  // per rate limit interval.  The rest are counted, and summarized once the
+  // interval is over.  0, the default, doesn't limit.  Fatal messages are
+  // never limited.
+  void set_rate_limit(MessageType type, int limit);
+  void set_rate_limit_interval_ms(int64 x) { rate_limit_interval_ms_ = x; }
+  bool rate_limited() const;
+  // Summarizes what was held back in intervals that are over, so that a
+  // burst of messages gets its summary even when no message follows it.
+  // Called from a timer on the nginx thread.
+  void SweepRateLimits();
 
  protected:
+  virtual void MessageVImpl(MessageType type, const char* msg, va_list args);
   virtual void MessageSImpl(MessageType type, const GoogleString& message);
 
+  virtual void FileMessageVImpl(MessageType type, const char* file, int line,
+                                const char* msg, va_list args);
+
   virtual void FileMessageSImpl(MessageType type, const char* file,
                                 int line, const GoogleString& message);
 
  private:
+  // How often messages with a format were let through lately.
+  struct RateLimitWindow {
+    int64 start_ms;
+    int count;
+    int suppressed;
+    MessageType type;
+  };
+  typedef std::map<GoogleString, RateLimitWindow> RateLimitMap;
+  typedef std::vector<std::pair<MessageType, GoogleString> > SummaryVector;
+
   ngx_uint_t GetNgxLogLevel(MessageType type);
+  // Whether a message with format should be written, counting it when not.
+  // Summarizes what was held back in intervals that are over.
+  bool AllowMessage(MessageType type, const char* format);
+  // Drops the windows that are over, adding summaries for those that held
+  // messages back.  Call with rate_limit_mutex_ held.
+  void SweepExpiredWindows(int64 now_ms, SummaryVector* summaries);
+  void WriteSummaries(const SummaryVector& summaries);
+
   ngx_log_t* log_;
+  NgxLogRing* log_ring_;
+  Timer* timer_;
+  // Indexed by MessageType, fatal messages excluded.
+  int rate_limits_[kFatal];
+  int64 rate_limit_interval_ms_;
+  // When windows that are over were last summarized.
+  int64 rate_limit_sweep_ms_;
+  scoped_ptr<AbstractMutex> rate_limit_mutex_;
+  RateLimitMap rate_limit_windows_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxMessageHandler);
 };
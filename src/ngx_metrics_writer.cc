@@ -0,0 +1,264 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+#include "ngx_metrics_writer.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kHistogramSuffix[] = " Histogram";
+const char kTotalSuffix[] = "_total";
+
+// Escapes a label value as the exposition format asks for.
+GoogleString EscapeLabelValue(StringPiece value) {
+  GoogleString escaped;
+  for (size_t i = 0; i < value.size(); ++i) {
+    switch (value[i]) {
+      case '\\': escaped.append("\\\\"); break;
+      case '"': escaped.append("\\\""); break;
+      case '\n': escaped.append("\\n"); break;
+      default: escaped.push_back(value[i]); break;
+    }
+  }
+  return escaped;
+}
+
+GoogleString FormatDouble(double value) {
+  return StringPrintf("%.15g", value);
+}
+
+}  // namespace
+
+NgxChainWriter::NgxChainWriter(ngx_pool_t* pool)
+    : pool_(pool),
+      out_(NULL),
+      last_link_(&out_),
+      buf_(NULL),
+      failed_(false) {
+}
+
+NgxChainWriter::~NgxChainWriter() {
+}
+
+bool NgxChainWriter::AddBuffer() {
+  ngx_buf_t* b = ngx_create_temp_buf(pool_, ngx_pagesize);
+  ngx_chain_t* link = ngx_alloc_chain_link(pool_);
+  if (b == NULL || link == NULL) {
+    failed_ = true;
+    return false;
+  }
+  link->buf = b;
+  link->next = NULL;
+  *last_link_ = link;
+  last_link_ = &link->next;
+  buf_ = b;
+  return true;
+}
+
+bool NgxChainWriter::Write(const StringPiece& str, MessageHandler* handler) {
+  const char* data = str.data();
+  size_t remaining = str.size();
+  while (remaining > 0) {
+    if (failed_ || ((buf_ == NULL || buf_->last == buf_->end) &&
+                    !AddBuffer())) {
+      return false;
+    }
+    size_t size = std::min(remaining,
+                           static_cast<size_t>(buf_->end - buf_->last));
+    buf_->last = ngx_cpymem(buf_->last, data, size);
+    data += size;
+    remaining -= size;
+  }
+  return true;
+}
+
+ngx_chain_t* NgxChainWriter::Finish() {
+  if (failed_ || (buf_ == NULL && !AddBuffer())) {
+    return NULL;
+  }
+  buf_->last_buf = 1;
+  buf_->last_in_chain = 1;
+  return out_;
+}
+
+// Statistics can only enumerate their variables by dumping them as
+// "name: value" lines, so we parse those as they come and write each one out
+// as a metric right away.  Only the current line is buffered.
+class NgxMetricsWriter::DumpParser : public Writer {
+ public:
+  explicit DumpParser(NgxMetricsWriter* metrics) : metrics_(metrics) {}
+
+  virtual bool Write(const StringPiece& str, MessageHandler* handler) {
+    for (size_t i = 0; i < str.size(); ++i) {
+      if (str[i] == '\n') {
+        ParseLine();
+        line_.clear();
+      } else {
+        line_.push_back(str[i]);
+      }
+    }
+    return metrics_->ok_;
+  }
+
+  virtual bool Flush(MessageHandler* handler) {
+    ParseLine();
+    line_.clear();
+    return metrics_->ok_;
+  }
+
+ private:
+  void ParseLine() {
+    size_t colon = StringPiece(line_).rfind(':');
+    if (colon == StringPiece::npos) {
+      return;
+    }
+    StringPiece name(line_.data(), colon);
+    StringPiece value(line_.data() + colon + 1, line_.size() - colon - 1);
+    TrimWhitespace(&name);
+    TrimWhitespace(&value);
+    if (!name.empty() && !value.empty()) {
+      metrics_->WriteScalar(name, value);
+    }
+  }
+
+  NgxMetricsWriter* metrics_;
+  GoogleString line_;
+
+  DISALLOW_COPY_AND_ASSIGN(DumpParser);
+};
+
+const char NgxMetricsWriter::kContentType[] =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+NgxMetricsWriter::NgxMetricsWriter(Statistics* statistics, StringPiece vhost,
+                                   Writer* writer, MessageHandler* handler)
+    : statistics_(statistics),
+      writer_(writer),
+      handler_(handler),
+      ok_(true) {
+  if (!vhost.empty()) {
+    vhost_label_ = StrCat("vhost=\"", EscapeLabelValue(vhost), "\"");
+  }
+}
+
+NgxMetricsWriter::~NgxMetricsWriter() {
+}
+
+GoogleString NgxMetricsWriter::MetricName(StringPiece statistic) {
+  GoogleString name("pagespeed_");
+  for (size_t i = 0; i < statistic.size(); ++i) {
+    char c = LowerChar(statistic[i]);
+    name.push_back(IsAsciiAlphaNumeric(c) ? c : '_');
+  }
+  return name;
+}
+
+bool NgxMetricsWriter::Write() {
+  DumpParser parser(this);
+  statistics_->Dump(&parser, handler_);
+  parser.Flush(handler_);
+
+  const StringVector& histograms = statistics_->HistogramNames();
+  for (int i = 0, n = histograms.size(); ok_ && i < n; ++i) {
+    Histogram* histogram = statistics_->FindHistogram(histograms[i]);
+    if (histogram != NULL) {
+      WriteHistogram(histograms[i], histogram);
+    }
+  }
+
+  ok_ = ok_ && writer_->Write("# EOF\n", handler_);
+  return ok_;
+}
+
+void NgxMetricsWriter::WriteScalar(StringPiece statistic, StringPiece value) {
+  GoogleString name = MetricName(statistic);
+  if (statistics_->FindUpDownCounter(statistic) != NULL) {
+    ok_ = ok_ &&
+        writer_->Write(StrCat("# TYPE ", name, " gauge\n"), handler_);
+    WriteSample(name, "", value);
+  } else {
+    // Counter samples carry a _total suffix the family name must not have.
+    if (StringPiece(name).ends_with(kTotalSuffix)) {
+      name.resize(name.size() - STATIC_STRLEN(kTotalSuffix));
+    }
+    ok_ = ok_ &&
+        writer_->Write(StrCat("# TYPE ", name, " counter\n"), handler_);
+    WriteSample(StrCat(name, kTotalSuffix), "", value);
+  }
+}
+
+void NgxMetricsWriter::WriteHistogram(StringPiece statistic,
+                                      Histogram* histogram) {
+  if (statistic.ends_with(kHistogramSuffix)) {
+    statistic.remove_suffix(STATIC_STRLEN(kHistogramSuffix));
+  }
+  GoogleString name = MetricName(statistic);
+  GoogleString bucket = StrCat(name, "_bucket");
+  ok_ = ok_ &&
+      writer_->Write(StrCat("# TYPE ", name, " histogram\n"), handler_);
+
+  // Histograms have hundreds of buckets, most of them empty.  Like the
+  // histogram page, only write out those that have seen values: the
+  // cumulative counts stay correct.
+  double cumulative = 0;
+  double count = histogram->Count();
+  for (int i = 0, n = histogram->MaxBuckets(); ok_ && i < n; ++i) {
+    double bucket_count = histogram->BucketCount(i);
+    double limit = histogram->BucketLimit(i);
+    if (bucket_count == 0 ||
+        limit == std::numeric_limits<double>::infinity()) {
+      continue;
+    }
+    cumulative += bucket_count;
+    WriteSample(bucket, StrCat("le=\"", FormatDouble(limit), "\""),
+                FormatDouble(cumulative));
+  }
+  WriteSample(bucket, "le=\"+Inf\"", FormatDouble(count));
+  WriteSample(StrCat(name, "_count"), "", FormatDouble(count));
+  WriteSample(StrCat(name, "_sum"), "",
+              FormatDouble(histogram->Average() * count));
+}
+
+void NgxMetricsWriter::WriteSample(StringPiece name, StringPiece extra_label,
+                                   StringPiece value) {
+  if (!ok_) {
+    return;
+  }
+  GoogleString labels = vhost_label_;
+  if (!extra_label.empty()) {
+    StrAppend(&labels, labels.empty() ? "" : ",", extra_label);
+  }
+  GoogleString sample(name.data(), name.size());
+  if (!labels.empty()) {
+    StrAppend(&sample, "{", labels, "}");
+  }
+  StrAppend(&sample, " ", value, "\n");
+  ok_ = writer_->Write(sample, handler_);
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,109 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxMetricsWriter renders statistics in the OpenMetrics text format, for
+// Prometheus and other collectors to scrape.  Variables become counters,
+// UpDownCounters gauges and histograms histograms, all labelled with the
+// virtual host they belong to.  The values are read from the statistics (so
+// shared memory when it is enabled) while the output is written, and go
+// straight to the Writer, which for nginx is an NgxChainWriter filling the
+// response's buffers from the request pool.
+
+#ifndef NGX_METRICS_WRITER_H_
+#define NGX_METRICS_WRITER_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/writer.h"
+
+namespace net_instaweb {
+
+class Histogram;
+class MessageHandler;
+class Statistics;
+
+// Appends everything written to it to a chain of buffers allocated from pool.
+class NgxChainWriter : public Writer {
+ public:
+  explicit NgxChainWriter(ngx_pool_t* pool);
+  virtual ~NgxChainWriter();
+
+  virtual bool Write(const StringPiece& str, MessageHandler* handler);
+  virtual bool Flush(MessageHandler* handler) { return true; }
+
+  // Marks the end of the output and returns the chain, or NULL if we ran out
+  // of memory along the way.
+  ngx_chain_t* Finish();
+
+ private:
+  bool AddBuffer();
+
+  ngx_pool_t* pool_;
+  ngx_chain_t* out_;
+  ngx_chain_t** last_link_;
+  ngx_buf_t* buf_;
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxChainWriter);
+};
+
+class NgxMetricsWriter {
+ public:
+  static const char kContentType[];
+
+  // If vhost is empty the metrics are written without a vhost label.
+  NgxMetricsWriter(Statistics* statistics, StringPiece vhost, Writer* writer,
+                   MessageHandler* handler);
+  ~NgxMetricsWriter();
+
+  // Writes all metrics followed by the closing "# EOF" line.
+  bool Write();
+
+  // Metric name for a statistic: lower case, anything outside [a-z0-9_]
+  // replaced by '_' and prefixed with "pagespeed_".
+  static GoogleString MetricName(StringPiece statistic);
+
+ private:
+  class DumpParser;
+
+  void WriteScalar(StringPiece statistic, StringPiece value);
+  void WriteHistogram(StringPiece statistic, Histogram* histogram);
+  void WriteSample(StringPiece name, StringPiece extra_label,
+                   StringPiece value);
+
+  Statistics* statistics_;
+  GoogleString vhost_label_;
+  Writer* writer_;
+  MessageHandler* handler_;
+  bool ok_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxMetricsWriter);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_METRICS_WRITER_H_
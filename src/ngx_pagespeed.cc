@@ -36,9 +36,11 @@
 #include "ngx_gzip_setter.h"
 #include "ngx_list_iterator.h"
 #include "ngx_message_handler.h"
+#include "ngx_metrics_writer.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_sharded_counters.h"
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/cache_url_async_fetcher.h"
@@ -94,6 +96,10 @@ net_instaweb::NgxRewriteDriverFactory* active_driver_factory = NULL;
 namespace net_instaweb {
 
 const char* kInternalEtagName = "@psol-etag";
+// Appended to the (global) admin path to view the native fetcher's state.
+const char kNativeFetcherAdminSuffix[] = "/native_fetcher";
+// Appended to the (global) admin path to view what all workers have in flight.
+const char kInflightAdminSuffix[] = "/inflight";
 // The process context takes care of proactively initialising
 // a few libraries for us, some of which are not thread-safe
 // when they are initialized lazily.
@@ -122,6 +128,14 @@ char* string_piece_to_pool_string(ngx_pool_t* pool, StringPiece sp) {
   return s;
 }
 
+int ps_worker_index(int num_workers) {
+#if (nginx_version >= 1009001)
+  return ngx_worker % num_workers;
+#else
+  return ngx_process_slot % num_workers;
+#endif
+}
+
 // When passing the body of http responses between filters Nginx uses a linked
 // list of buffers ("buffer chain"), again like Apache.  This constructs one of
 // those lists from a StringPiece.  This is what you use when you need to pass a
@@ -277,6 +291,10 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "ps fetch handler: %V", &r->uri);
 
+  if (ctx->first_output_us == 0) {
+    ctx->first_output_us = ps_now_us();
+  }
+
   if (ngx_terminate || ngx_exiting) {
     ps_set_buffered(r, false);
     ps_release_base_fetch(ctx);
@@ -348,6 +366,7 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
     }
 
     ps_set_buffered(r, true);
+    ctx->first_byte_us = ps_now_us();
   }
 
   // collect response body from pagespeed
@@ -371,7 +390,11 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
     return NGX_AGAIN;
   }
 
+  for (ngx_chain_t* link = cl; link != NULL; link = link->next) {
+    ctx->bytes_out += ngx_buf_size(link->buf);
+  }
   if (rc == NGX_OK) {
+    ctx->done_us = ps_now_us();
     ps_set_buffered(r, false);
     ps_release_base_fetch(ctx);
   }
@@ -705,8 +728,12 @@ enum Response {
   kBeacon,
   kStatistics,
   kGlobalStatistics,
+  kMetrics,
+  kGlobalMetrics,
   kConsole,
   kMessages,
+  kNativeFetcher,
+  kInflight,
   kAdmin,
   kCachePurge,
   kGlobalAdmin,
@@ -834,6 +861,137 @@ ngx_int_t ps_dollar(
   return NGX_OK;
 }
 
+int64 ps_now_us() {
+  struct timeval tv;
+  ngx_gettimeofday(&tv);
+  return static_cast<int64>(tv.tv_sec) * Timer::kSecondUs + tv.tv_usec;
+}
+
+// The $pagespeed_* variables, which tell what we did with a request and where
+// the time went, so slow requests can be found with log_format.
+enum PsVariable {
+  kPsVarRoute,
+  kPsVarIproStatus,
+  kPsVarOptionsUs,
+  kPsVarQueueUs,
+  kPsVarFirstByteUs,
+  kPsVarTotalUs,
+  kPsVarBytesIn,
+  kPsVarBytesOut,
+  kNumPsVariables,
+};
+
+ngx_str_t ps_variable_names[kNumPsVariables] = {
+  ngx_string("pagespeed_route"),
+  ngx_string("pagespeed_ipro_status"),
+  ngx_string("pagespeed_options_us"),
+  ngx_string("pagespeed_queue_us"),
+  ngx_string("pagespeed_first_byte_us"),
+  ngx_string("pagespeed_total_us"),
+  ngx_string("pagespeed_bytes_in"),
+  ngx_string("pagespeed_bytes_out"),
+};
+
+// Indexes of the variables in r->variables, where their final values are
+// stored when we let go of the request, see ps_save_variables().
+ngx_int_t ps_variable_indexes[kNumPsVariables];
+
+// Fills v with the value of variable for ctx, or marks it not found when
+// the request didn't get that far.
+void ps_variable_value(ngx_http_request_t* r, ps_request_ctx_t* ctx,
+                       int variable, ngx_http_variable_value_t* v) {
+  const char* str = NULL;
+  int64 value = -1;
+  switch (variable) {
+    case kPsVarRoute:
+      str = ctx->route;
+      break;
+    case kPsVarIproStatus:
+      str = ctx->ipro_status;
+      break;
+    case kPsVarOptionsUs:
+      value = ctx->route != NULL ? ctx->options_us : -1;
+      break;
+    case kPsVarQueueUs:
+      if (ctx->dispatch_us != 0 && ctx->first_output_us != 0) {
+        value = ctx->first_output_us - ctx->dispatch_us;
+      }
+      break;
+    case kPsVarFirstByteUs:
+      if (ctx->first_byte_us != 0) {
+        value = ctx->first_byte_us - ctx->start_us;
+      }
+      break;
+    case kPsVarTotalUs:
+      if (ctx->done_us != 0) {
+        value = ctx->done_us - ctx->start_us;
+      }
+      break;
+    case kPsVarBytesIn:
+      value = ctx->route != NULL ? ctx->bytes_in : -1;
+      break;
+    case kPsVarBytesOut:
+      value = ctx->route != NULL ? ctx->bytes_out : -1;
+      break;
+  }
+
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+  if (str != NULL) {
+    v->data = reinterpret_cast<u_char*>(const_cast<char*>(str));
+    v->len = ngx_strlen(str);
+  } else if (value >= 0) {
+    v->data = static_cast<u_char*>(ngx_pnalloc(r->pool, NGX_INT64_LEN));
+    if (v->data == NULL) {
+      v->not_found = 1;
+      return;
+    }
+    v->len = ngx_sprintf(v->data, "%L", value) - v->data;
+  } else {
+    v->not_found = 1;
+  }
+}
+
+ngx_int_t ps_get_variable(
+    ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data) {
+  ps_request_ctx_t* ctx = ps_get_request_context(r->main);
+  if (ctx == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+  ps_variable_value(r, ctx, static_cast<int>(data), v);
+  // The request may not be done yet.
+  v->no_cacheable = 1;
+  return NGX_OK;
+}
+
+ngx_int_t ps_add_variables(ngx_conf_t* cf) {
+  for (int i = 0; i < kNumPsVariables; ++i) {
+    ngx_http_variable_t* var = ngx_http_add_variable(
+        cf, &ps_variable_names[i], NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+      return NGX_ERROR;
+    }
+    var->get_handler = ps_get_variable;
+    var->data = i;
+    ps_variable_indexes[i] = NGX_ERROR;
+  }
+  return NGX_OK;
+}
+
+// nginx runs the cleanup that frees ctx before it writes the access log, so
+// store what the variables ended up as with the request.
+void ps_save_variables(ps_request_ctx_t* ctx) {
+  ngx_http_request_t* r = ctx->r;
+  for (int i = 0; i < kNumPsVariables; ++i) {
+    if (ps_variable_indexes[i] != NGX_ERROR) {
+      ps_variable_value(r, ctx, i, &r->variables[ps_variable_indexes[i]]);
+    }
+  }
+  ngx_http_set_ctx(r, NULL, ngx_pagespeed);
+}
+
 // Parse the configuration option represented by cf and add it to options,
 // creating options if necessary.
 char* ps_configure(ngx_conf_t* cf,
@@ -1649,6 +1807,18 @@ void ps_release_base_fetch(ps_request_ctx_t* ctx) {
   // then HandleDone() hasn't been called yet and we need the base fetch to wait
   // for that and then delete itself.
   if (ctx->base_fetch != NULL) {
+    // Native fetches still running for a .pagespeed. resource have nobody to
+    // deliver to anymore.
+    NgxRequestContext* request_context = NgxRequestContext::DynamicCast(
+        ctx->base_fetch->request_context().get());
+    if (request_context != NULL && request_context->client_waits()) {
+      request_context->set_finished();
+      ps_srv_conf_t* cfg_s = ps_get_srv_config(ctx->r);
+      NgxRewriteDriverFactory* factory =
+          static_cast<NgxRewriteDriverFactory*>(
+              cfg_s->server_context->factory());
+      factory->CancelOrphanedFetches(request_context);
+    }
     ctx->base_fetch->Detach();
     ctx->base_fetch = NULL;
   }
@@ -1705,9 +1875,18 @@ void ps_release_request_context(void* data) {
   }
 
   ps_release_base_fetch(ctx);
+  ps_save_variables(ctx);
   delete ctx;
 }
 
+// The native fetcher's state and the in-flight page are served by us under the
+// (global) admin path, rather than by the shared admin site.
+bool ps_is_admin_subpath(StringPiece path, StringPiece admin_path,
+                         StringPiece suffix) {
+  return !admin_path.empty() &&
+      StringCaseEqual(path, StrCat(admin_path, suffix));
+}
+
 // Set us up for processing a request.  Creates a request context and determines
 // which handler should deal with the request.
 RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
@@ -1753,12 +1932,34 @@ RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
   } else if (StringCaseEqual(path, global_options->global_statistics_path()) &&
              global_options->GlobalStatisticsAccessAllowed(url)) {
     return RequestRouting::kGlobalStatistics;
+  } else if (StringCaseEqual(path, global_options->metrics_path()) &&
+             global_options->StatisticsAccessAllowed(url)) {
+    return RequestRouting::kMetrics;
+  } else if (StringCaseEqual(path, global_options->global_metrics_path()) &&
+             global_options->GlobalStatisticsAccessAllowed(url)) {
+    return RequestRouting::kGlobalMetrics;
   } else if (StringCaseEqual(path, global_options->console_path()) &&
              global_options->ConsoleAccessAllowed(url)) {
     return RequestRouting::kConsole;
   } else if (StringCaseEqual(path, global_options->messages_path()) &&
              global_options->MessagesAccessAllowed(url)) {
     return RequestRouting::kMessages;
+  } else if (ps_is_admin_subpath(path, global_options->admin_path(),
+                                 kNativeFetcherAdminSuffix) &&
+             global_options->AdminAccessAllowed(url)) {
+    return RequestRouting::kNativeFetcher;
+  } else if (ps_is_admin_subpath(path, global_options->global_admin_path(),
+                                 kNativeFetcherAdminSuffix) &&
+             global_options->GlobalAdminAccessAllowed(url)) {
+    return RequestRouting::kNativeFetcher;
+  } else if (ps_is_admin_subpath(path, global_options->admin_path(),
+                                 kInflightAdminSuffix) &&
+             global_options->AdminAccessAllowed(url)) {
+    return RequestRouting::kInflight;
+  } else if (ps_is_admin_subpath(path, global_options->global_admin_path(),
+                                 kInflightAdminSuffix) &&
+             global_options->GlobalAdminAccessAllowed(url)) {
+    return RequestRouting::kInflight;
   } else if (
       // The admin handlers get everything under a path (/path/*) while all the
       // other handlers only get exact matches (/path).  So match all paths
@@ -1799,6 +2000,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_DECLINED;
   }
 
+  int64 start_us = ps_now_us();
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
   ps_request_ctx_t* ctx = ps_get_request_context(r);
 
@@ -1837,8 +2039,9 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   copy_request_headers_from_ngx(r, request_headers.get());
   copy_response_headers_from_ngx(r, response_headers.get());
 
-  RequestContextPtr request_context(
-      cfg_s->server_context->NewRequestContext(r));
+  NgxRequestContext* ngx_request_context =
+      cfg_s->server_context->NewRequestContext(r);
+  RequestContextPtr request_context(ngx_request_context);
   GoogleString pagespeed_query_params;
   GoogleString pagespeed_option_cookies;
   RewriteOptions* options = ps_determine_remote_options(cfg_s);
@@ -1848,6 +2051,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
                             html_rewrite)) {
     return NGX_ERROR;
   }
+  int64 options_us = ps_now_us() - start_us;
 
   // Take ownership of custom_options.
   scoped_ptr<RewriteOptions> custom_options(options);
@@ -1873,6 +2077,8 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
 
   bool pagespeed_resource =
       !html_rewrite && cfg_s->server_context->IsPagespeedResource(url);
+  ngx_request_context->set_client_waits(pagespeed_resource);
+  ngx_request_context->set_relays_fetches(!html_rewrite);
   bool is_an_admin_handler =
       response_category == RequestRouting::kStatistics ||
       response_category == RequestRouting::kGlobalStatistics ||
@@ -1927,6 +2133,17 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     ctx->location_field_set = false;
     ctx->psol_vary_accept_only = false;
 
+    ctx->route = NULL;
+    ctx->ipro_status = NULL;
+    ctx->start_us = start_us;
+    ctx->options_us = 0;
+    ctx->dispatch_us = 0;
+    ctx->first_output_us = 0;
+    ctx->first_byte_us = 0;
+    ctx->done_us = 0;
+    ctx->bytes_in = 0;
+    ctx->bytes_out = 0;
+
     // Set up a cleanup handler on the request.
     ngx_http_cleanup_t* cleanup = ngx_http_cleanup_add(r, 0);
     if (cleanup == NULL) {
@@ -1938,7 +2155,12 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     ngx_http_set_ctx(r, ctx, ngx_pagespeed);
   }
 
+  // Html was looked at here once before, when it was still a request.
+  ctx->options_us += options_us;
+  ctx->dispatch_us = ps_now_us();
+
   if (pagespeed_resource) {
+    ctx->route = "resource";
     // TODO(jefftk): Set using_spdy appropriately.  See
     // ProxyInterface::ProxyRequestCallback
     ps_create_base_fetch(url.Spec(), ctx, request_context,
@@ -1950,6 +2172,10 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
         cfg_s->server_context, ctx->base_fetch);
     return ps_async_wait_response(r);
   } else if (is_an_admin_handler) {
+    ctx->route = "admin";
+    // Any of these pages may show statistics.
+    static_cast<NgxRewriteDriverFactory*>(
+        cfg_s->server_context->factory())->FoldShardedCounters();
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kAdminPage, options);
     QueryParams query_params;
@@ -1999,6 +2225,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
 
     if (options->domain_lawyer()->MapOriginUrl(
             url, &mapped_url, &host_header, &is_proxy) && is_proxy) {
+      ctx->route = "proxy";
       ps_create_base_fetch(url.Spec(), ctx, request_context,
                            request_headers.release(), kPageSpeedProxy, options);
 
@@ -2024,6 +2251,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   }
 
   if (html_rewrite && options->IsAllowed(url.Spec())) {
+    ctx->route = "html";
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kHtmlTransform, options);
     // Do not store driver in request_context, it's not safe.
@@ -2068,6 +2296,7 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   if (options->in_place_rewriting_enabled() &&
       options->enabled() &&
       options->IsAllowed(url.Spec())) {
+    ctx->route = "ipro";
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kIproLookup, options);
 
@@ -2123,6 +2352,7 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
     cur->buf->last_buf = 0;
 
     CHECK(ctx->proxy_fetch != NULL);
+    ctx->bytes_in += cur->buf->last - cur->buf->pos;
     if (ctx->inflater_ == NULL) {
       ctx->proxy_fetch->Write(
           StringPiece(reinterpret_cast<char*>(cur->buf->pos),
@@ -2490,8 +2720,9 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
   // continue process
   if (status_ok) {
     ctx->in_place = false;
+    ctx->ipro_status = "hit";
 
-    server_context->rewrite_stats()->ipro_served()->Add(1);
+    server_context->IncrementCounter(NgxServerContext::kIproServed);
     message_handler->Message(
         kInfo, "Serving rewritten resource in-place: %s",
         url.c_str());
@@ -2501,7 +2732,8 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
 
   if (status_code == CacheUrlAsyncFetcher::kNotInCacheStatus &&
       !r->header_only) {
-    server_context->rewrite_stats()->ipro_not_in_cache()->Add(1);
+    ctx->ipro_status = "miss";
+    server_context->IncrementCounter(NgxServerContext::kIproNotInCache);
     server_context->message_handler()->Message(
         kInfo,
         "Could not rewrite resource in-place "
@@ -2535,7 +2767,9 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
     // We don't have the response headers at all yet because we haven't yet gone
     // to the backend.
   } else {
-    server_context->rewrite_stats()->ipro_not_rewritable()->Add(1);
+    ctx->ipro_status = "not_rewritable";
+    server_context->IncrementCounter(
+        NgxServerContext::kIproNotRewritable);
     message_handler->Message(
         kInfo, "Could not rewrite resource in-place: %s", url.c_str());
   }
@@ -2561,6 +2795,7 @@ ngx_int_t ps_in_place_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
       StringPiece contents(reinterpret_cast<char*>(cl->buf->pos),
                            ngx_buf_size(cl->buf));
       recorder->Write(contents, recorder->handler());
+      ctx->bytes_in += contents.size();
     }
 
     if (cl->buf->flush) {
@@ -2593,10 +2828,10 @@ void ps_in_place_filter_init() {
 
 using in_place::ps_in_place_filter_init;
 
-ngx_int_t send_out_headers_and_body(
+ngx_int_t send_out_headers_and_chain(
     ngx_http_request_t* r,
     const ResponseHeaders& response_headers,
-    const GoogleString& output) {
+    ngx_chain_t* out) {
   ngx_int_t rc = copy_response_headers_to_ngx(
       r, response_headers, kDontPreserveHeaders);
 
@@ -2611,15 +2846,61 @@ ngx_int_t send_out_headers_and_body(
   }
 
   // Send the body.
+  return ngx_http_output_filter(r, out);
+}
+
+ngx_int_t send_out_headers_and_body(
+    ngx_http_request_t* r,
+    const ResponseHeaders& response_headers,
+    const GoogleString& output) {
   ngx_chain_t* out;
-  rc = string_piece_to_buffer_chain(
+  ngx_int_t rc = string_piece_to_buffer_chain(
       r->pool, output, &out, true /* send_last_buf */, false);
   if (rc == NGX_ERROR) {
     return NGX_ERROR;
   }
   CHECK(rc == NGX_OK);
 
-  return ngx_http_output_filter(r, out);
+  return send_out_headers_and_chain(r, response_headers, out);
+}
+
+// Writes the statistics of the server block, or the global ones, in the
+// OpenMetrics text format.  They go straight into the response's buffers.
+ngx_int_t ps_metrics_handler(ngx_http_request_t* r,
+                             NgxServerContext* server_context,
+                             bool global) {
+  NgxRewriteDriverFactory* factory =
+      static_cast<NgxRewriteDriverFactory*>(server_context->factory());
+  factory->FoldShardedCounters();
+  Statistics* statistics =
+      global ? factory->statistics() : server_context->statistics();
+
+  StringPiece vhost;
+  if (!global) {
+    ngx_http_core_srv_conf_t* cscf = static_cast<ngx_http_core_srv_conf_t*>(
+        ngx_http_get_module_srv_conf(r, ngx_http_core_module));
+    vhost = str_to_string_piece(cscf->server_name);
+  }
+
+  NgxChainWriter writer(r->pool);
+  NgxMetricsWriter metrics(statistics, vhost, &writer,
+                           factory->ngx_message_handler());
+  ngx_chain_t* out = metrics.Write() ? writer.Finish() : NULL;
+  if (out == NULL) {
+    return NGX_ERROR;
+  }
+
+  ResponseHeaders response_headers;
+  response_headers.SetStatusAndReason(HttpStatus::kOK);
+  response_headers.set_major_version(1);
+  response_headers.set_minor_version(1);
+  response_headers.Add(HttpAttributes::kContentType,
+                       NgxMetricsWriter::kContentType);
+  response_headers.Add("X-Content-Type-Options", "nosniff");
+  int64 now_ms = factory->timer()->NowMs();
+  response_headers.SetDateAndCaching(now_ms, 0 /* max-age */, ", no-cache");
+
+  return send_out_headers_and_chain(r, response_headers, out);
 }
 
 // Handle responses where we have the content we need in memory and can just
@@ -2670,6 +2951,14 @@ ngx_int_t ps_simple_handler(ngx_http_request_t* r,
       }
       break;
     }
+    case RequestRouting::kNativeFetcher: {
+      factory->WriteNativeFetcherStatus(&writer);
+      break;
+    }
+    case RequestRouting::kInflight: {
+      factory->WriteInflightSnapshots(&writer);
+      break;
+    }
     default:
       ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
                     "ps_simple_handler: unknown RequestRouting.");
@@ -2927,7 +3216,14 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
       return ps_beacon_handler(r);
     case RequestRouting::kStaticContent:
     case RequestRouting::kMessages:
+    case RequestRouting::kNativeFetcher:
+    case RequestRouting::kInflight:
       return ps_simple_handler(r, cfg_s->server_context, response_category);
+    case RequestRouting::kMetrics:
+    case RequestRouting::kGlobalMetrics:
+      return ps_metrics_handler(
+          r, cfg_s->server_context,
+          response_category == RequestRouting::kGlobalMetrics);
     case RequestRouting::kStatistics:
     case RequestRouting::kGlobalStatistics:
     case RequestRouting::kConsole:
@@ -3059,7 +3355,7 @@ ngx_int_t ps_pre_init(ngx_conf_t* cf) {
   // Setup an intervention setter for gzip configuration and check
   // gzip configuration command signatures.
   g_gzip_setter.Init(cf);
-  return NGX_OK;
+  return ps_add_variables(cf);
 }
 
 ngx_int_t ps_init(ngx_conf_t* cf) {
@@ -3103,6 +3399,16 @@ ngx_int_t ps_init(ngx_conf_t* cf) {
       return NGX_ERROR;
     }
     *h = ps_preaccess_handler;
+
+    // Give our variables a slot in each request, to keep their values in
+    // after we're done with it.
+    for (int i = 0; i < kNumPsVariables; ++i) {
+      ps_variable_indexes[i] =
+          ngx_http_get_variable_index(cf, &ps_variable_names[i]);
+      if (ps_variable_indexes[i] == NGX_ERROR) {
+        return NGX_ERROR;
+      }
+    }
   }
 
   return NGX_OK;
@@ -3183,6 +3489,27 @@ ngx_int_t ps_init_module(ngx_cycle_t* cycle) {
       NgxRewriteDriverFactory::InitStats(cfg_m->driver_factory->statistics());
     }
 
+    ngx_core_conf_t* ccf = reinterpret_cast<ngx_core_conf_t*>(
+        ngx_get_conf(cycle->conf_ctx, ngx_core_module));
+    if (!cfg_m->driver_factory->AllocateShardedCounters(
+            server_contexts, ccf->worker_processes, cycle->log)) {
+      cfg_m->handler->Message(
+          kError, "ShardedStatistics: could not allocate shared memory.");
+      return NGX_ERROR;
+    }
+    if (!cfg_m->driver_factory->AllocateInflightSnapshots(
+            ccf->worker_processes, cycle->log)) {
+      cfg_m->handler->Message(
+          kError, "Could not allocate shared memory for in-flight snapshots.");
+      return NGX_ERROR;
+    }
+    if (!cfg_m->driver_factory->AllocateSharedInflight(cycle->log)) {
+      cfg_m->handler->Message(
+          kError, "NativeFetcherSharedCoalescingWaitMs: could not allocate "
+          "shared memory.");
+      return NGX_ERROR;
+    }
+
     ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
         ngx_http_conf_get_module_loc_conf((*cscfp), ngx_http_core_module));
 
@@ -3224,7 +3551,9 @@ ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
     return NGX_OK;
   }
 
-  if (!NgxBaseFetch::Initialize(cycle)) {
+  if (!NgxBaseFetch::Initialize(
+          cycle, cfg_m->driver_factory->statistics(),
+          cfg_m->driver_factory->event_handoff_latency_sample_rate())) {
     return NGX_ERROR;
   }
 
@@ -3252,6 +3581,11 @@ ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
           cscfp[s]->ctx->loc_conf[ngx_http_core_module.ctx_index]);
       cfg_m->driver_factory->SetServerContextMessageHandler(
           cfg_s->server_context, clcf->error_log);
+      NgxShardedCounters* sharded_counters =
+          cfg_m->driver_factory->sharded_counters();
+      if (sharded_counters != NULL) {
+        cfg_s->server_context->InitShardedCounters(sharded_counters);
+      }
     }
   }
 
@@ -78,6 +78,10 @@ StringPiece str_to_string_piece(ngx_str_t s);
 // over.  Returns NULL if we can't get memory.
 char* string_piece_to_pool_string(ngx_pool_t* pool, StringPiece sp);
 
+// The index of this worker process among num_workers, for picking its slot in
+// shared memory laid out before forking.  Other processes share worker 0's.
+int ps_worker_index(int num_workers);
+
 enum PreserveCachingHeaders {
   kPreserveAllCachingHeaders,  // Cache-Control, ETag, Last-Modified, etc
   kPreserveOnlyCacheControl,   // Only Cache-Control.
@@ -113,6 +117,23 @@ typedef struct {
   bool location_field_set;
   bool psol_vary_accept_only;
   bool follow_flushes;
+
+  // What we did with the request and when, for the $pagespeed_* variables.
+  // Times are microseconds since the epoch, and 0 until reached.
+  const char* route;
+  const char* ipro_status;
+  int64 start_us;
+  // How long determining the options took.
+  int64 options_us;
+  // When the request was handed to PSOL, and when the first of its output
+  // reached us.
+  int64 dispatch_us;
+  int64 first_output_us;
+  int64 first_byte_us;
+  int64 done_us;
+  // Bytes passed to PSOL to rewrite or record, and bytes it gave back.
+  int64 bytes_in;
+  int64 bytes_out;
 } ps_request_ctx_t;
 
 ps_request_ctx_t* ps_get_request_context(ngx_http_request_t* r);
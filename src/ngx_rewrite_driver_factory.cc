@@ -19,14 +19,23 @@
 
 
 
+extern "C" {
+#include <nginx.h>
+}
+
 #include "ngx_rewrite_driver_factory.h"
 
 #include <cstdio>
 
 #include "log_message_handler.h"
+#include "ngx_base_fetch.h"
+#include "ngx_inflight_snapshots.h"
+#include "ngx_log_ring.h"
 #include "ngx_message_handler.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_inflight.h"
+#include "ngx_sharded_counters.h"
 #include "ngx_url_async_fetcher.h"
 
 #include "net/instaweb/http/public/rate_controller.h"
@@ -43,6 +52,7 @@
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/writer.h"
 #include "pagespeed/kernel/http/content_type.h"
 #include "pagespeed/kernel/sharedmem/shared_circular_buffer.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_statistics.h"
@@ -67,27 +77,62 @@ class Writer;
 
 class SharedCircularBuffer;
 
+namespace {
+
+// How many messages the threads of a worker may have waiting to be written.
+const int kLogRingCapacity = 1024;
+
+// How late the summary of rate limited messages may be written.
+const ngx_msec_t kRateLimitSweepIntervalMs = 1000;
+
+}  // namespace
+
 NgxRewriteDriverFactory::NgxRewriteDriverFactory(
     const ProcessContext& process_context,
     SystemThreadSystem* system_thread_system, StringPiece hostname, int port)
     : SystemRewriteDriverFactory(process_context, system_thread_system,
         NULL /* default shared memory runtime */, hostname, port),
       threads_started_(false),
+      sharded_statistics_(false),
       ngx_message_handler_(
-          new NgxMessageHandler(timer(), thread_system()->NewMutex())),
+          new NgxMessageHandler(timer(), thread_system())),
       ngx_html_parse_message_handler_(
-          new NgxMessageHandler(timer(), thread_system()->NewMutex())),
+          new NgxMessageHandler(timer(), thread_system())),
       log_(NULL),
       resolver_timeout_(NGX_CONF_UNSET_MSEC),
       use_native_fetcher_(false),
       // 100 Aligns to nginx's server-side default.
       native_fetcher_max_keepalive_requests_(100),
+      native_fetcher_max_idle_connections_per_origin_(16),
+      native_fetcher_idle_connection_timeout_ms_(60000),
+      native_fetcher_min_idle_connections_per_origin_(0),
+      native_fetcher_max_connections_per_origin_(0),
+      native_fetcher_max_receive_buffer_size_(65536),
+      native_fetcher_circuit_breaker_failures_(0),
+      native_fetcher_circuit_breaker_open_ms_(10000),
+      native_fetcher_request_deadline_ms_(0),
+      native_fetcher_cancel_orphaned_fetches_(false),
+      native_fetcher_http2_(false),
+      native_fetcher_shared_coalescing_wait_ms_(0),
+      event_handoff_latency_sample_rate_(0),
+      message_rate_limit_interval_ms_(Timer::kMinuteMs),
       ngx_shared_circular_buffer_(NULL),
       hostname_(hostname.as_string()),
       port_(port),
       process_script_variables_mode_(ProcessScriptVariablesMode::kOff),
       process_script_variables_set_(false),
       shut_down_(false) {
+  for (int i = 0; i < kFatal; ++i) {
+    message_rate_limits_[i] = 0;
+  }
+  ngx_memzero(&rate_limit_sweep_event_, sizeof(rate_limit_sweep_event_));
+  rate_limit_sweep_event_.data = this;
+  rate_limit_sweep_event_.handler =
+      NgxRewriteDriverFactory::RateLimitSweepHandler;
+#if (nginx_version >= 1011011)
+  // Don't hold up a graceful shutdown of the worker.
+  rate_limit_sweep_event_.cancelable = 1;
+#endif
   InitializeDefaultOptions();
   default_options()->set_beacon_url("/ngx_pagespeed_beacon");
   SystemRewriteOptions* system_options = dynamic_cast<SystemRewriteOptions*>(
@@ -119,7 +164,98 @@ UrlAsyncFetcher* NgxRewriteDriverFactory::AllocateFetcher(
         resolver_,
         native_fetcher_max_keepalive_requests_,
         thread_system(),
+        statistics(),
+        timer(),
         message_handler());
+    fetcher->set_max_idle_connections_per_origin(
+        native_fetcher_max_idle_connections_per_origin_);
+    fetcher->set_idle_connection_timeout_ms(
+        native_fetcher_idle_connection_timeout_ms_);
+    // The pool won't hold more prewarmed connections than this, any more
+    // would be opened and closed again on every prewarm round.
+    int min_idle_connections_per_origin =
+        native_fetcher_min_idle_connections_per_origin_;
+    if (min_idle_connections_per_origin >
+        native_fetcher_max_idle_connections_per_origin_) {
+      message_handler()->Message(
+          kWarning, "NativeFetcherMinIdleConnectionsPerOrigin %d is more than "
+          "NativeFetcherMaxIdleConnectionsPerOrigin %d, using %d.",
+          min_idle_connections_per_origin,
+          native_fetcher_max_idle_connections_per_origin_,
+          native_fetcher_max_idle_connections_per_origin_);
+      min_idle_connections_per_origin =
+          native_fetcher_max_idle_connections_per_origin_;
+    }
+    fetcher->set_min_idle_connections_per_origin(
+        min_idle_connections_per_origin);
+    fetcher->set_max_fetches_per_origin(
+        native_fetcher_max_connections_per_origin_);
+    fetcher->set_max_receive_buffer_size(
+        native_fetcher_max_receive_buffer_size_);
+    fetcher->set_circuit_breaker(native_fetcher_circuit_breaker_failures_,
+                                 native_fetcher_circuit_breaker_open_ms_);
+    fetcher->set_request_deadline_ms(native_fetcher_request_deadline_ms_);
+    fetcher->set_handoff_latency_sample_rate(
+        event_handoff_latency_sample_rate_);
+    fetcher->set_cancel_orphaned_fetches(
+        native_fetcher_cancel_orphaned_fetches_);
+    fetcher->set_max_response_bytes(
+        config->max_cacheable_response_content_length());
+    fetcher->SetHttpsOptions(config->https_options());
+    fetcher->set_ssl_certificates_dir(config->ssl_cert_directory());
+    fetcher->set_ssl_certificates_file(config->ssl_cert_file());
+    for (std::map<GoogleString, GoogleString>::const_iterator p =
+             native_fetcher_upstreams_.begin();
+         p != native_fetcher_upstreams_.end(); ++p) {
+      if (!fetcher->AddUpstream(p->first, p->second)) {
+        message_handler()->Message(
+            kError, "NativeFetcherUpstream %s: there is no upstream{} block "
+            "named %s, fetching from the host directly.",
+            p->first.c_str(), p->second.c_str());
+      }
+    }
+    for (std::map<GoogleString, GoogleString>::const_iterator p =
+             native_fetcher_unix_sockets_.begin();
+         p != native_fetcher_unix_sockets_.end(); ++p) {
+      if (!fetcher->AddUnixSocket(p->first, p->second)) {
+        message_handler()->Message(
+            kError, "NativeFetcherUnixSocket %s: can't use unix socket %s, "
+            "fetching from the host directly.",
+            p->first.c_str(), p->second.c_str());
+      }
+    }
+#if (NGX_HTTP_V2)
+    fetcher->set_http2(native_fetcher_http2_);
+    for (std::set<GoogleString>::const_iterator p =
+             native_fetcher_http2_prior_knowledge_hosts_.begin();
+         p != native_fetcher_http2_prior_knowledge_hosts_.end(); ++p) {
+      fetcher->AddHttp2PriorKnowledgeHost(*p);
+    }
+#else
+    // Responses come with huffman coded headers, which we decode with the
+    // code of the http_v2 module.
+    if (native_fetcher_http2_ ||
+        !native_fetcher_http2_prior_knowledge_hosts_.empty()) {
+      message_handler()->Message(
+          kWarning, "NativeFetcherHttp2: nginx is built without the http_v2 "
+          "module, fetching over HTTP/1.");
+    }
+#endif
+    // The table may only be laid out after the fetchers are, it is the same
+    // object either way.
+    if (native_fetcher_shared_coalescing_wait_ms_ > 0) {
+      if (shared_inflight_.get() == NULL) {
+        shared_inflight_.reset(new NgxSharedInflight());
+      }
+      fetcher->set_shared_inflight(shared_inflight_.get(),
+                                   native_fetcher_shared_coalescing_wait_ms_);
+    }
+    const GoogleString& loopback = native_fetcher_loopback_unix_socket_;
+    if (!loopback.empty() && !fetcher->SetLoopbackUnixSocket(loopback)) {
+      message_handler()->Message(
+          kError, "NativeFetcherLoopbackUnixSocket: nginx doesn't listen on "
+          "%s, fetching from nginx over tcp.", loopback.c_str());
+    }
     ngx_url_async_fetchers_.push_back(fetcher);
     return fetcher;
   } else {
@@ -127,6 +263,59 @@ UrlAsyncFetcher* NgxRewriteDriverFactory::AllocateFetcher(
   }
 }
 
+void NgxRewriteDriverFactory::AddNativeFetcherUpstream(StringPiece host,
+                                                       StringPiece upstream) {
+  GoogleString key = host.as_string();
+  LowerString(&key);
+  native_fetcher_upstreams_[key] = upstream.as_string();
+}
+
+void NgxRewriteDriverFactory::AddNativeFetcherUnixSocket(StringPiece host,
+                                                         StringPiece path) {
+  GoogleString key = host.as_string();
+  LowerString(&key);
+  native_fetcher_unix_sockets_[key] = path.as_string();
+}
+
+void NgxRewriteDriverFactory::AddNativeFetcherHttp2PriorKnowledgeHost(
+    StringPiece host) {
+  GoogleString key = host.as_string();
+  LowerString(&key);
+  native_fetcher_http2_prior_knowledge_hosts_.insert(key);
+}
+
+void NgxRewriteDriverFactory::CancelOrphanedFetches(
+    NgxRequestContext* request) {
+  for (size_t i = 0; i < ngx_url_async_fetchers_.size(); ++i) {
+    ngx_url_async_fetchers_[i]->CancelOrphanedFetches(request);
+  }
+}
+
+void NgxRewriteDriverFactory::WriteNativeFetcherStatus(Writer* writer) {
+  MessageHandler* handler = message_handler();
+  if (ngx_url_async_fetchers_.empty()) {
+    writer->Write("The native fetcher is not in use.\n", handler);
+    return;
+  }
+  writer->Write(StrCat("<p>Native fetcher state of worker process ",
+                       IntegerToString(ngx_pid), "</p>\n"),
+                handler);
+  for (size_t i = 0; i < ngx_url_async_fetchers_.size(); ++i) {
+    ngx_url_async_fetchers_[i]->WriteOriginStatus(writer, handler);
+  }
+}
+
+void NgxRewriteDriverFactory::WriteNativeFetches(Writer* writer) {
+  MessageHandler* handler = message_handler();
+  if (ngx_url_async_fetchers_.empty()) {
+    writer->Write("<p>The native fetcher is not in use.</p>\n", handler);
+    return;
+  }
+  for (size_t i = 0; i < ngx_url_async_fetchers_.size(); ++i) {
+    ngx_url_async_fetchers_[i]->WriteFetches(writer, handler);
+  }
+}
+
 MessageHandler* NgxRewriteDriverFactory::DefaultHtmlParseMessageHandler() {
   return ngx_html_parse_message_handler_;
 }
@@ -191,11 +380,68 @@ ServerContext* NgxRewriteDriverFactory::NewServerContext() {
 void NgxRewriteDriverFactory::ShutDown() {
   if (!shut_down_) {
     shut_down_ = true;
+    if (rate_limit_sweep_event_.timer_set) {
+      ngx_del_timer(&rate_limit_sweep_event_);
+    }
+    // Don't leave what this worker counted behind in the shards.
+    FoldShardedCounters();
+    if (inflight_snapshots_.get() != NULL) {
+      inflight_snapshots_->Stop();
+    }
     SystemRewriteDriverFactory::ShutDown();
+    // Our threads are gone now, write out what they left behind.
+    if (log_ring_.get() != NULL) {
+      SetLogRing(NULL);
+      log_ring_->Stop();
+    }
+  }
+}
+
+bool NgxRewriteDriverFactory::AllocateShardedCounters(
+    const std::vector<SystemServerContext*>& server_contexts,
+    int num_workers, ngx_log_t* log) {
+  if (!sharded_statistics_) {
+    return true;
+  }
+  sharded_counters_.reset(new NgxShardedCounters(num_workers));
+  for (int i = 0, n = server_contexts.size(); i < n; ++i) {
+    NgxServerContext* server_context =
+        dynamic_cast<NgxServerContext*>(server_contexts[i]);
+    server_context->AddShardedCounters(sharded_counters_.get());
+  }
+  return sharded_counters_->Allocate(log);
+}
+
+void NgxRewriteDriverFactory::FoldShardedCounters() {
+  if (sharded_counters_.get() != NULL) {
+    sharded_counters_->Fold();
+  }
+}
+
+bool NgxRewriteDriverFactory::AllocateInflightSnapshots(int num_workers,
+                                                        ngx_log_t* log) {
+  inflight_snapshots_.reset(new NgxInflightSnapshots(num_workers, this));
+  return inflight_snapshots_->Allocate(log);
+}
+
+bool NgxRewriteDriverFactory::AllocateSharedInflight(ngx_log_t* log) {
+  if (!use_native_fetcher_ || native_fetcher_shared_coalescing_wait_ms_ <= 0) {
+    return true;
+  }
+  if (shared_inflight_.get() == NULL) {
+    shared_inflight_.reset(new NgxSharedInflight());
+  }
+  return shared_inflight_->Allocate(log);
+}
+
+void NgxRewriteDriverFactory::WriteInflightSnapshots(Writer* writer) {
+  if (inflight_snapshots_.get() != NULL) {
+    inflight_snapshots_->Write(writer, message_handler());
   }
 }
 
 void NgxRewriteDriverFactory::ShutDownMessageHandlers() {
+  SetLogRing(NULL);
   ngx_message_handler_->set_buffer(NULL);
   ngx_html_parse_message_handler_->set_buffer(NULL);
   for (NgxMessageHandlerSet::iterator p =
@@ -206,10 +452,33 @@ void NgxRewriteDriverFactory::ShutDownMessageHandlers() {
   server_context_message_handlers_.clear();
 }
 
+void NgxRewriteDriverFactory::SetLogRing(NgxLogRing* ring) {
+  log_message_handler::SetLogRing(ring);
+  ngx_message_handler_->set_log_ring(ring);
+  ngx_html_parse_message_handler_->set_log_ring(ring);
+  for (NgxMessageHandlerSet::iterator p =
+           server_context_message_handlers_.begin();
+       p != server_context_message_handlers_.end(); ++p) {
+    (*p)->set_log_ring(ring);
+  }
+}
+
 void NgxRewriteDriverFactory::StartThreads() {
   if (threads_started_) {
     return;
   }
+  // From here on, messages of threads other than nginx's are queued for the
+  // nginx thread to write out.
+  log_ring_.reset(new NgxLogRing(kLogRingCapacity, statistics()));
+  log_ring_->Start(log_);
+  SetLogRing(log_ring_.get());
+  if (inflight_snapshots_.get() != NULL) {
+    inflight_snapshots_->Start(log_);
+  }
+  if (ngx_message_handler_->rate_limited()) {
+    rate_limit_sweep_event_.log = log_;
+    ngx_add_timer(&rate_limit_sweep_event_, kRateLimitSweepIntervalMs);
+  }
   // TODO(jefftk): use a native nginx timer instead of running our own thread.
   // See issue #111.
   SchedulerThread* thread = new SchedulerThread(thread_system(), scheduler());
@@ -236,6 +505,56 @@ void NgxRewriteDriverFactory::LoggingInit(
   }
   ngx_message_handler_->set_log(log);
   ngx_html_parse_message_handler_->set_log(log);
+  ApplyMessageRateLimits(ngx_message_handler_);
+  ApplyMessageRateLimits(ngx_html_parse_message_handler_);
+}
+
+bool NgxRewriteDriverFactory::SetMessageRateLimit(StringPiece type,
+                                                  StringPiece limit) {
+  MessageType message_type;
+  if (StringCaseEqual(type, "info")) {
+    message_type = kInfo;
+  } else if (StringCaseEqual(type, "warning")) {
+    message_type = kWarning;
+  } else if (StringCaseEqual(type, "error")) {
+    message_type = kError;
+  } else {
+    return false;
+  }
+  int value;
+  if (!StringToInt(limit, &value) || value < 0) {
+    return false;
+  }
+  message_rate_limits_[message_type] = value;
+  return true;
+}
+
+void NgxRewriteDriverFactory::ApplyMessageRateLimits(
+    NgxMessageHandler* handler) {
+  for (int i = 0; i < kFatal; ++i) {
+    handler->set_rate_limit(static_cast<MessageType>(i),
+                            message_rate_limits_[i]);
+  }
+  handler->set_rate_limit_interval_ms(message_rate_limit_interval_ms_);
+}
+
+void NgxRewriteDriverFactory::RateLimitSweepHandler(ngx_event_t* ev) {
+  NgxRewriteDriverFactory* factory =
+      static_cast<NgxRewriteDriverFactory*>(ev->data);
+  factory->SweepMessageRateLimits();
+  if (!factory->shut_down_ && !ngx_exiting) {
+    ngx_add_timer(ev, kRateLimitSweepIntervalMs);
+  }
+}
+
+void NgxRewriteDriverFactory::SweepMessageRateLimits() {
+  ngx_message_handler_->SweepRateLimits();
+  ngx_html_parse_message_handler_->SweepRateLimits();
+  for (NgxMessageHandlerSet::iterator p =
+           server_context_message_handlers_.begin();
+       p != server_context_message_handlers_.end(); ++p) {
+    (*p)->SweepRateLimits();
+  }
 }
 
 void NgxRewriteDriverFactory::SetCircularBuffer(
@@ -247,9 +566,10 @@ void NgxRewriteDriverFactory::SetCircularBuffer(
 
 void NgxRewriteDriverFactory::SetServerContextMessageHandler(
     ServerContext* server_context, ngx_log_t* log) {
-  NgxMessageHandler* handler = new NgxMessageHandler(
-      timer(), thread_system()->NewMutex());
+  NgxMessageHandler* handler =
+      new NgxMessageHandler(timer(), thread_system());
   handler->set_log(log);
+  ApplyMessageRateLimits(handler);
   // The ngx_shared_circular_buffer_ will be NULL if MessageBufferSize hasn't
   // been raised from its default of 0.
   handler->set_buffer(ngx_shared_circular_buffer_);
@@ -267,6 +587,9 @@ void NgxRewriteDriverFactory::InitStats(Statistics* statistics) {
   // Init Ngx-specific stats.
   NgxServerContext::InitStats(statistics);
   InPlaceResourceRecorder::InitStats(statistics);
+  NgxUrlAsyncFetcher::InitStats(statistics);
+  NgxLogRing::InitStats(statistics);
+  NgxBaseFetch::InitStats(statistics);
 }
 
 void NgxRewriteDriverFactory::PrepareForkedProcess(const char* name) {
@@ -28,28 +28,39 @@ extern "C" {
   #include <ngx_thread.h>
 #endif
   #include <ngx_core.h>
+  #include <ngx_event.h>
   #include <ngx_http.h>
   #include <ngx_config.h>
   #include <ngx_log.h>
 }
 
+#include <map>
 #include <set>
+#include <vector>
 
 #include "pagespeed/kernel/base/md5_hasher.h"
+#include "pagespeed/kernel/base/message_handler.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/system/system_rewrite_driver_factory.h"
 
 namespace net_instaweb {
 
+class NgxInflightSnapshots;
+class NgxSharedInflight;
+class NgxLogRing;
 class NgxMessageHandler;
+class NgxRequestContext;
 class NgxRewriteOptions;
 class NgxServerContext;
+class NgxShardedCounters;
 class NgxUrlAsyncFetcher;
 class SharedCircularBuffer;
 class SharedMemRefererStatistics;
 class SlowWorker;
 class Statistics;
+class SystemServerContext;
 class SystemThreadSystem;
+class Writer;
 
 enum ProcessScriptVariablesMode {
   kOff,
@@ -121,9 +132,134 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   void set_native_fetcher_max_keepalive_requests(int x) {
     native_fetcher_max_keepalive_requests_ = x;
   }
+  int native_fetcher_max_idle_connections_per_origin() {
+    return native_fetcher_max_idle_connections_per_origin_;
+  }
+  void set_native_fetcher_max_idle_connections_per_origin(int x) {
+    native_fetcher_max_idle_connections_per_origin_ = x;
+  }
+  int native_fetcher_idle_connection_timeout_ms() {
+    return native_fetcher_idle_connection_timeout_ms_;
+  }
+  void set_native_fetcher_idle_connection_timeout_ms(int x) {
+    native_fetcher_idle_connection_timeout_ms_ = x;
+  }
+  int native_fetcher_min_idle_connections_per_origin() {
+    return native_fetcher_min_idle_connections_per_origin_;
+  }
+  void set_native_fetcher_min_idle_connections_per_origin(int x) {
+    native_fetcher_min_idle_connections_per_origin_ = x;
+  }
+  int native_fetcher_max_connections_per_origin() {
+    return native_fetcher_max_connections_per_origin_;
+  }
+  void set_native_fetcher_max_connections_per_origin(int x) {
+    native_fetcher_max_connections_per_origin_ = x;
+  }
+  int native_fetcher_circuit_breaker_failures() {
+    return native_fetcher_circuit_breaker_failures_;
+  }
+  void set_native_fetcher_circuit_breaker_failures(int x) {
+    native_fetcher_circuit_breaker_failures_ = x;
+  }
+  int native_fetcher_circuit_breaker_open_ms() {
+    return native_fetcher_circuit_breaker_open_ms_;
+  }
+  void set_native_fetcher_circuit_breaker_open_ms(int x) {
+    native_fetcher_circuit_breaker_open_ms_ = x;
+  }
+  int native_fetcher_request_deadline_ms() {
+    return native_fetcher_request_deadline_ms_;
+  }
+  void set_native_fetcher_request_deadline_ms(int x) {
+    native_fetcher_request_deadline_ms_ = x;
+  }
+  // Records the event handoff latency of one in x events, 0 records none.
+  int event_handoff_latency_sample_rate() {
+    return event_handoff_latency_sample_rate_;
+  }
+  void set_event_handoff_latency_sample_rate(int x) {
+    event_handoff_latency_sample_rate_ = x;
+  }
+  bool native_fetcher_cancel_orphaned_fetches() {
+    return native_fetcher_cancel_orphaned_fetches_;
+  }
+  void set_native_fetcher_cancel_orphaned_fetches(bool x) {
+    native_fetcher_cancel_orphaned_fetches_ = x;
+  }
+  // Whether the native fetcher offers HTTP/2 to https origins.
+  bool native_fetcher_http2() {
+    return native_fetcher_http2_;
+  }
+  void set_native_fetcher_http2(bool x) {
+    native_fetcher_http2_ = x;
+  }
+  // How long a native fetch waits for another worker that fetches the same,
+  // see NgxSharedInflight.  0 keeps coalescing within each worker.
+  int native_fetcher_shared_coalescing_wait_ms() {
+    return native_fetcher_shared_coalescing_wait_ms_;
+  }
+  void set_native_fetcher_shared_coalescing_wait_ms(int x) {
+    native_fetcher_shared_coalescing_wait_ms_ = x;
+  }
+  // Makes the native fetcher talk HTTP/2 to host over plain http right away.
+  void AddNativeFetcherHttp2PriorKnowledgeHost(StringPiece host);
+  int native_fetcher_max_receive_buffer_size() {
+    return native_fetcher_max_receive_buffer_size_;
+  }
+  void set_native_fetcher_max_receive_buffer_size(int x) {
+    native_fetcher_max_receive_buffer_size_ = x;
+  }
+  // Makes the native fetcher send fetches for host to the servers of the
+  // upstream{} block named upstream.
+  void AddNativeFetcherUpstream(StringPiece host, StringPiece upstream);
+  // Makes the native fetcher send fetches for host to the unix domain socket
+  // at path.
+  void AddNativeFetcherUnixSocket(StringPiece host, StringPiece path);
+  // Makes the native fetcher send fetches this nginx serves itself to the
+  // unix domain socket at path, which nginx also listens on.
+  void set_native_fetcher_loopback_unix_socket(StringPiece path) {
+    path.CopyToString(&native_fetcher_loopback_unix_socket_);
+  }
+  // Lets the native fetchers know that nginx is done with request.
+  void CancelOrphanedFetches(NgxRequestContext* request);
+  // Writes the per-origin state of this worker's native fetchers.
+  void WriteNativeFetcherStatus(Writer* writer);
+  // Writes the fetches this worker's native fetchers have in flight or
+  // queued.
+  void WriteNativeFetches(Writer* writer);
   ProcessScriptVariablesMode process_script_variables() {
     return process_script_variables_mode_;
   }
+  // Lets at most limit messages of the severity named type ("info",
+  // "warning" or "error") with the same format through per rate limit
+  // interval.  Returns false when type or limit isn't valid.
+  bool SetMessageRateLimit(StringPiece type, StringPiece limit);
+  void set_message_rate_limit_interval_ms(int x) {
+    message_rate_limit_interval_ms_ = x;
+  }
+  bool sharded_statistics() { return sharded_statistics_; }
+  void set_sharded_statistics(bool x) { sharded_statistics_ = x; }
+  // With ShardedStatistics on, lays out the sharded counters of
+  // server_contexts for num_workers workers.  Called in the master process,
+  // before forking.  Returns false if we can't get the shared memory.
+  bool AllocateShardedCounters(
+      const std::vector<SystemServerContext*>& server_contexts,
+      int num_workers, ngx_log_t* log);
+  // NULL unless ShardedStatistics is on.
+  NgxShardedCounters* sharded_counters() { return sharded_counters_.get(); }
+  // Moves what was counted in the shards of all workers to the statistics.
+  // Call before reading statistics.
+  void FoldShardedCounters();
+  // Lays out the shared slots the workers publish their in-flight snapshots
+  // to.  Called in the master process, before forking.
+  bool AllocateInflightSnapshots(int num_workers, ngx_log_t* log);
+  // Writes the in-flight base fetches and native fetches of all workers.
+  void WriteInflightSnapshots(Writer* writer);
+  // With NativeFetcherSharedCoalescingWaitMs set, lays out the shared table
+  // of the fetches workers coalesce.  Called in the master process, before
+  // forking.
+  bool AllocateSharedInflight(ngx_log_t* log);
 
   void LoggingInit(ngx_log_t* log, bool may_install_crash_handler);
 
@@ -147,7 +283,21 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
  private:
   Timer* timer_;
 
+  // Points all our message handlers at ring.
+  void SetLogRing(NgxLogRing* ring);
+  void ApplyMessageRateLimits(NgxMessageHandler* handler);
+  static void RateLimitSweepHandler(ngx_event_t* ev);
+  // Writes the summaries of messages that were rate limited in intervals
+  // that are over.
+  void SweepMessageRateLimits();
+
   bool threads_started_;
+  // Queues the messages of our threads for the nginx thread to write out.
+  scoped_ptr<NgxLogRing> log_ring_;
+  bool sharded_statistics_;
+  scoped_ptr<NgxShardedCounters> sharded_counters_;
+  scoped_ptr<NgxInflightSnapshots> inflight_snapshots_;
+  scoped_ptr<NgxSharedInflight> shared_inflight_;
   NgxMessageHandler* ngx_message_handler_;
   NgxMessageHandler* ngx_html_parse_message_handler_;
 
@@ -157,6 +307,29 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   ngx_resolver_t* resolver_;
   bool use_native_fetcher_;
   int native_fetcher_max_keepalive_requests_;
+  int native_fetcher_max_idle_connections_per_origin_;
+  int native_fetcher_idle_connection_timeout_ms_;
+  int native_fetcher_min_idle_connections_per_origin_;
+  int native_fetcher_max_connections_per_origin_;
+  int native_fetcher_max_receive_buffer_size_;
+  int native_fetcher_circuit_breaker_failures_;
+  int native_fetcher_circuit_breaker_open_ms_;
+  int native_fetcher_request_deadline_ms_;
+  bool native_fetcher_cancel_orphaned_fetches_;
+  bool native_fetcher_http2_;
+  int native_fetcher_shared_coalescing_wait_ms_;
+  int event_handoff_latency_sample_rate_;
+  // Host name -> upstream{} block name.
+  std::map<GoogleString, GoogleString> native_fetcher_upstreams_;
+  std::map<GoogleString, GoogleString> native_fetcher_unix_sockets_;
+  GoogleString native_fetcher_loopback_unix_socket_;
+  std::set<GoogleString> native_fetcher_http2_prior_knowledge_hosts_;
+
+  // Indexed by MessageType, fatal messages are never limited.
+  int message_rate_limits_[kFatal];
+  int message_rate_limit_interval_ms_;
+  // Fires on the nginx thread to sweep the rate limits of our handlers.
+  ngx_event_t rate_limit_sweep_event_;
 
   typedef std::set<NgxMessageHandler*> NgxMessageHandlerSet;
   NgxMessageHandlerSet server_context_message_handlers_;
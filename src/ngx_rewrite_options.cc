@@ -43,6 +43,8 @@ namespace {
 
 const char kStatisticsPath[] = "StatisticsPath";
 const char kGlobalStatisticsPath[] = "GlobalStatisticsPath";
+const char kMetricsPath[] = "MetricsPath";
+const char kGlobalMetricsPath[] = "GlobalMetricsPath";
 const char kConsolePath[] = "ConsolePath";
 const char kMessagesPath[] = "MessagesPath";
 const char kAdminPath[] = "AdminPath";
@@ -76,13 +78,51 @@ const char* const server_only_options[] = {
   "LoadFromFileRule",
   "LoadFromFileRuleMatch",
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherMaxIdleConnectionsPerOrigin",
+  "NativeFetcherIdleConnectionTimeoutMs",
+  "NativeFetcherMinIdleConnectionsPerOrigin",
+  "NativeFetcherMaxConnectionsPerOrigin",
+  "NativeFetcherMaxReceiveBufferSize",
+  "NativeFetcherCircuitBreakerFailures",
+  "NativeFetcherCircuitBreakerOpenMs",
+  "NativeFetcherRequestDeadlineMs",
+  "NativeFetcherCancelOrphanedFetches",
+  "NativeFetcherUpstream",
+  "NativeFetcherUnixSocket",
+  "NativeFetcherLoopbackUnixSocket",
+  "NativeFetcherHttp2",
+  "NativeFetcherHttp2PriorKnowledge",
+  "NativeFetcherSharedCoalescingWaitMs",
+  "MessageRateLimit",
+  "MessageRateLimitIntervalMs",
+  "ShardedStatistics",
+  "EventHandoffLatencySampleRate"
 };
 
 // Options that can only be used in the main (http) option scope.
 const char* const main_only_options[] = {
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherMaxIdleConnectionsPerOrigin",
+  "NativeFetcherIdleConnectionTimeoutMs",
+  "NativeFetcherMinIdleConnectionsPerOrigin",
+  "NativeFetcherMaxConnectionsPerOrigin",
+  "NativeFetcherMaxReceiveBufferSize",
+  "NativeFetcherCircuitBreakerFailures",
+  "NativeFetcherCircuitBreakerOpenMs",
+  "NativeFetcherRequestDeadlineMs",
+  "NativeFetcherCancelOrphanedFetches",
+  "NativeFetcherUpstream",
+  "NativeFetcherUnixSocket",
+  "NativeFetcherLoopbackUnixSocket",
+  "NativeFetcherHttp2",
+  "NativeFetcherHttp2PriorKnowledge",
+  "NativeFetcherSharedCoalescingWaitMs",
+  "MessageRateLimit",
+  "MessageRateLimitIntervalMs",
+  "ShardedStatistics",
+  "EventHandoffLatencySampleRate"
 };
 
 }  // namespace
@@ -118,6 +158,17 @@ void NgxRewriteOptions::AddProperties() {
       kGlobalStatisticsPath, kProcessScopeStrict,
       "Set the global statistics path. Ex: /ngx_pagespeed_global_statistics",
       false);
+  add_ngx_option(
+      "", &NgxRewriteOptions::metrics_path_, "nmtp", kMetricsPath,
+      kServerScope,
+      "Set the OpenMetrics statistics path. Ex: /ngx_pagespeed_metrics",
+      false);
+  add_ngx_option(
+      "", &NgxRewriteOptions::global_metrics_path_, "ngmtp",
+      kGlobalMetricsPath, kProcessScopeStrict,
+      "Set the global OpenMetrics statistics path. "
+      "Ex: /ngx_pagespeed_global_metrics",
+      false);
   add_ngx_option(
       "", &NgxRewriteOptions::console_path_, "ncp", kConsolePath, kServerScope,
       "Set the console path. Ex: /pagespeed_console", false);
@@ -246,6 +297,23 @@ RewriteOptions::OptionSettingResult ParseAndSetOptionHelper(
   return RewriteOptions::kOptionOk;
 }
 
+// Like ParseAndSetOptionHelper, but for integer options that must be at least
+// min_value.
+template <class DriverFactoryT>
+RewriteOptions::OptionSettingResult ParseAndSetIntOptionHelper(
+    StringPiece option_value,
+    int min_value,
+    DriverFactoryT* driver_factory,
+    void (DriverFactoryT::*set_option_method)(int)) {
+  int parsed_value;
+  if (!StringToInt(option_value, &parsed_value) || parsed_value < min_value) {
+    return RewriteOptions::kOptionValueInvalid;
+  }
+
+  (driver_factory->*set_option_method)(parsed_value);
+  return RewriteOptions::kOptionOk;
+}
+
 namespace {
 
 const char* ps_error_string_for_option(
@@ -392,6 +460,87 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
       } else {
         result = RewriteOptions::kOptionValueInvalid;
       }
+    } else if (IsDirective(directive,
+                           "NativeFetcherMaxIdleConnectionsPerOrigin")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_max_idle_connections_per_origin);
+    } else if (IsDirective(directive,
+                           "NativeFetcherIdleConnectionTimeoutMs")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 1, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_idle_connection_timeout_ms);
+    } else if (IsDirective(directive,
+                           "NativeFetcherMinIdleConnectionsPerOrigin")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_min_idle_connections_per_origin);
+    } else if (IsDirective(directive,
+                           "NativeFetcherMaxConnectionsPerOrigin")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_max_connections_per_origin);
+    } else if (IsDirective(directive,
+                           "NativeFetcherMaxReceiveBufferSize")) {
+      // Anything smaller than the initial 4k buffer would have no effect.
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 4096, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_max_receive_buffer_size);
+    } else if (IsDirective(directive,
+                           "NativeFetcherCircuitBreakerFailures")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_circuit_breaker_failures);
+    } else if (IsDirective(directive,
+                           "NativeFetcherCircuitBreakerOpenMs")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 1, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_circuit_breaker_open_ms);
+    } else if (IsDirective(directive, "NativeFetcherRequestDeadlineMs")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::set_native_fetcher_request_deadline_ms);
+    } else if (IsDirective(directive,
+                           "NativeFetcherCancelOrphanedFetches")) {
+      result = ParseAndSetOptionHelper<NgxRewriteDriverFactory>(
+          arg, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_cancel_orphaned_fetches);
+    } else if (IsDirective(directive, "NativeFetcherHttp2")) {
+      result = ParseAndSetOptionHelper<NgxRewriteDriverFactory>(
+          arg, driver_factory,
+          &NgxRewriteDriverFactory::set_native_fetcher_http2);
+    } else if (IsDirective(directive, "NativeFetcherHttp2PriorKnowledge")) {
+      driver_factory->AddNativeFetcherHttp2PriorKnowledgeHost(arg);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive,
+                           "NativeFetcherSharedCoalescingWaitMs")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::
+              set_native_fetcher_shared_coalescing_wait_ms);
+    } else if (IsDirective(directive, "NativeFetcherLoopbackUnixSocket")) {
+      driver_factory->set_native_fetcher_loopback_unix_socket(arg);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive, "MessageRateLimitIntervalMs")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 1, driver_factory,
+          &NgxRewriteDriverFactory::set_message_rate_limit_interval_ms);
+    } else if (IsDirective(directive, "EventHandoffLatencySampleRate")) {
+      result = ParseAndSetIntOptionHelper<NgxRewriteDriverFactory>(
+          arg, 0, driver_factory,
+          &NgxRewriteDriverFactory::set_event_handoff_latency_sample_rate);
+    } else if (IsDirective(directive, "ShardedStatistics")) {
+      result = ParseAndSetOptionHelper<NgxRewriteDriverFactory>(
+          arg, driver_factory,
+          &NgxRewriteDriverFactory::set_sharded_statistics);
     } else if (StringCaseEqual("ProcessScriptVariables", args[0])) {
       if (scope == RewriteOptions::kProcessScopeStrict) {
         ProcessScriptVariablesMode mode;
@@ -427,8 +576,19 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
       }
     }
   } else if (n_args == 3) {
-    result = ParseAndSetOptionFromName2(directive, args[1], args[2],
-                                        &msg, handler);
+    if (IsDirective(directive, "NativeFetcherUpstream")) {
+      driver_factory->AddNativeFetcherUpstream(args[1], args[2]);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive, "NativeFetcherUnixSocket")) {
+      driver_factory->AddNativeFetcherUnixSocket(args[1], args[2]);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive, "MessageRateLimit")) {
+      result = driver_factory->SetMessageRateLimit(args[1], args[2]) ?
+          RewriteOptions::kOptionOk : RewriteOptions::kOptionValueInvalid;
+    } else {
+      result = ParseAndSetOptionFromName2(directive, args[1], args[2],
+                                          &msg, handler);
+    }
     if (result == RewriteOptions::kOptionNameUnknown) {
       result = driver_factory->ParseAndSetOption2(
           directive,
@@ -157,6 +157,12 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   const GoogleString& global_statistics_path() const {
     return global_statistics_path_.value();
   }
+  const GoogleString& metrics_path() const {
+    return metrics_path_.value();
+  }
+  const GoogleString& global_metrics_path() const {
+    return global_metrics_path_.value();
+  }
   const GoogleString& console_path() const {
     return console_path_.value();
   }
@@ -226,6 +232,8 @@ class NgxRewriteOptions : public SystemRewriteOptions {
 
   Option<GoogleString> statistics_path_;
   Option<GoogleString> global_statistics_path_;
+  Option<GoogleString> metrics_path_;
+  Option<GoogleString> global_metrics_path_;
   Option<GoogleString> console_path_;
   Option<GoogleString> messages_path_;
   Option<GoogleString> admin_path_;
@@ -29,7 +29,9 @@ extern "C" {
 #include "ngx_message_handler.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
+#include "ngx_sharded_counters.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_stats.h"
 #include "pagespeed/system/add_headers_fetcher.h"
 #include "pagespeed/system/loopback_route_fetcher.h"
 #include "pagespeed/system/system_request_context.h"
@@ -39,6 +41,8 @@ namespace net_instaweb {
 NgxServerContext::NgxServerContext(
     NgxRewriteDriverFactory* factory, StringPiece hostname, int port)
     : SystemServerContext(factory, hostname, port),
+      sharded_counters_(NULL),
+      first_sharded_counter_(-1),
       ngx_http2_variable_index_(NGX_ERROR) {
 }
 
@@ -48,7 +52,7 @@ NgxRewriteOptions* NgxServerContext::config() {
   return NgxRewriteOptions::DynamicCast(global_options());
 }
 
-SystemRequestContext* NgxServerContext::NewRequestContext(
+NgxRequestContext* NgxServerContext::NewRequestContext(
     ngx_http_request_t* r) {
   // Based on ngx_http_variable_server_port.
   bool port_set = false;
@@ -74,9 +78,11 @@ SystemRequestContext* NgxServerContext::NewRequestContext(
     local_ip.len = 0;
   }
 
-  SystemRequestContext* ctx = new SystemRequestContext(
+  int64 start_ms = static_cast<int64>(r->start_sec) * 1000 + r->start_msec;
+  NgxRequestContext* ctx = new NgxRequestContext(
       thread_system()->NewMutex(), timer(),
-      ps_determine_host(r), local_port, str_to_string_piece(local_ip));
+      ps_determine_host(r), local_port, str_to_string_piece(local_ip),
+      start_ms);
 
   // See if http2 is in use.
   if (ngx_http2_variable_index_ >= 0) {
@@ -98,4 +104,45 @@ GoogleString NgxServerContext::FormatOption(StringPiece option_name,
   return StrCat("pagespeed ", option_name, " ", args, ";");
 }
 
+Variable* NgxServerContext::CounterVariable(Counter counter) {
+  RewriteStats* stats = rewrite_stats();
+  switch (counter) {
+    case kResource404Count:
+      return stats->resource_404_count();
+    case kIproServed:
+      return stats->ipro_served();
+    case kIproNotInCache:
+      return stats->ipro_not_in_cache();
+    case kIproNotRewritable:
+      return stats->ipro_not_rewritable();
+    case kNumCounters:
+      break;
+  }
+  LOG(DFATAL) << "Unknown counter " << counter;
+  return NULL;
+}
+
+void NgxServerContext::IncrementCounter(Counter counter) {
+  if (sharded_counters_ != NULL) {
+    sharded_counters_->Add(first_sharded_counter_ + counter, 1);
+  } else {
+    CounterVariable(counter)->Add(1);
+  }
+}
+
+void NgxServerContext::AddShardedCounters(NgxShardedCounters* counters) {
+  first_sharded_counter_ = counters->AddCounters(kNumCounters);
+}
+
+void NgxServerContext::InitShardedCounters(NgxShardedCounters* counters) {
+  if (first_sharded_counter_ < 0) {
+    return;
+  }
+  for (int i = 0; i < kNumCounters; ++i) {
+    counters->set_target(first_sharded_counter_ + i,
+                         CounterVariable(static_cast<Counter>(i)));
+  }
+  sharded_counters_ = counters;
+}
+
 }  // namespace net_instaweb
@@ -25,6 +25,7 @@
 #define NGX_SERVER_CONTEXT_H_
 
 #include "ngx_message_handler.h"
+#include "pagespeed/system/system_request_context.h"
 #include "pagespeed/system/system_server_context.h"
 
 extern "C" {
@@ -33,12 +34,72 @@ extern "C" {
 
 namespace net_instaweb {
 
+class AbstractMutex;
 class NgxRewriteDriverFactory;
 class NgxRewriteOptions;
-class SystemRequestContext;
+class NgxShardedCounters;
+class Timer;
+class Variable;
+
+// The context of a request nginx passed to us.  It follows the fetches done
+// on behalf of the request, which lets the native fetcher tell when nobody
+// needs their results anymore.
+class NgxRequestContext : public SystemRequestContext {
+ public:
+  NgxRequestContext(AbstractMutex* logging_mutex, Timer* timer,
+                    StringPiece hostname, int local_port,
+                    StringPiece local_ip, int64 start_ms)
+      : SystemRequestContext(logging_mutex, timer, hostname, local_port,
+                             local_ip),
+        start_ms_(start_ms),
+        client_waits_(false),
+        relays_fetches_(false),
+        finished_(false) {}
+
+  // Returns ctx as an NgxRequestContext, or NULL when it is some other kind
+  // of request context, like the ones of background fetches.
+  static NgxRequestContext* DynamicCast(RequestContext* ctx) {
+    return dynamic_cast<NgxRequestContext*>(ctx);
+  }
+
+  // When nginx received the request.
+  int64 start_ms() const { return start_ms_; }
+  // Whether the client is waiting for the fetches done for the request, as
+  // for .pagespeed. resources.  It isn't for the fetches of an html rewrite,
+  // which mostly benefit later requests.  Set before handing the request to
+  // PSOL.
+  bool client_waits() const { return client_waits_; }
+  void set_client_waits(bool x) { client_waits_ = x; }
+  // Whether fetched bytes may reach the client as they are, as for proxied
+  // resources or the fallback of a .pagespeed. resource that can't be
+  // rewritten.  Such fetches aren't cut short for being too large to cache.
+  bool relays_fetches() const { return relays_fetches_; }
+  void set_relays_fetches(bool x) { relays_fetches_ = x; }
+  // Set when nginx is done with the request.  Only used on the nginx thread.
+  bool finished() const { return finished_; }
+  void set_finished() { finished_ = true; }
+
+ private:
+  const int64 start_ms_;
+  bool client_waits_;
+  bool relays_fetches_;
+  bool finished_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRequestContext);
+};
 
 class NgxServerContext : public SystemServerContext {
  public:
+  // Statistics we count on the request path, which ShardedStatistics moves
+  // to per-worker and per-thread shards.
+  enum Counter {
+    kResource404Count,
+    kIproServed,
+    kIproNotInCache,
+    kIproNotRewritable,
+    kNumCounters
+  };
+
   NgxServerContext(
       NgxRewriteDriverFactory* factory, StringPiece hostname, int port);
   virtual ~NgxServerContext();
@@ -53,7 +114,7 @@ class NgxServerContext : public SystemServerContext {
   NgxRewriteOptions* config();
 
   NgxRewriteDriverFactory* ngx_rewrite_driver_factory() { return ngx_factory_; }
-  SystemRequestContext* NewRequestContext(ngx_http_request_t* r);
+  NgxRequestContext* NewRequestContext(ngx_http_request_t* r);
 
   NgxMessageHandler* ngx_message_handler() {
     return dynamic_cast<NgxMessageHandler*>(message_handler());
@@ -61,6 +122,16 @@ class NgxServerContext : public SystemServerContext {
 
   virtual GoogleString FormatOption(StringPiece option_name, StringPiece args);
 
+  // Adds one to counter, through the sharded counters when we have them.
+  void IncrementCounter(Counter counter);
+
+  // Reserves our counters in counters.  In the master process, before it
+  // allocates them.
+  void AddShardedCounters(NgxShardedCounters* counters);
+  // Points our counters in counters at our statistics and starts counting
+  // through them.  In workers, after ChildInit.
+  void InitShardedCounters(NgxShardedCounters* counters);
+
   void set_ngx_http2_variable_index(ngx_int_t idx) {
     ngx_http2_variable_index_ = idx;
   }
@@ -70,7 +141,12 @@ class NgxServerContext : public SystemServerContext {
   }
 
  private:
+  Variable* CounterVariable(Counter counter);
+
   NgxRewriteDriverFactory* ngx_factory_;
+  NgxShardedCounters* sharded_counters_;
+  // Id of our first counter in sharded_counters_.
+  int first_sharded_counter_;
   // what index the "http2" var is, or NGX_ERROR.
   ngx_int_t ngx_http2_variable_index_;
 
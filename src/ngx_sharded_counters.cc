@@ -0,0 +1,123 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+#include "ngx_sharded_counters.h"
+
+#include "ngx_pagespeed.h"
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Threads of a worker are spread over this many shards.  More threads than
+// that share shards, which is still correct, only slower.
+const int kThreadShards = 8;
+
+// Shards are padded to whole cache lines.
+const size_t kCacheLineSize = 64;
+
+// Which of its worker's shards the calling thread increments.
+__thread int thread_shard = -1;
+int next_thread_shard = 0;
+
+}  // namespace
+
+NgxShardedCounters::NgxShardedCounters(int num_workers)
+    : num_workers_(num_workers > 0 ? num_workers : 1),
+      num_counters_(0),
+      shard_size_(0) {
+  ngx_memzero(&shm_, sizeof(shm_));
+}
+
+NgxShardedCounters::~NgxShardedCounters() {
+  if (shm_.addr != NULL) {
+    ngx_shm_free(&shm_);
+  }
+}
+
+int NgxShardedCounters::AddCounters(int count) {
+  CHECK(shm_.addr == NULL) << "counters added after allocation";
+  int first = num_counters_;
+  num_counters_ += count;
+  return first;
+}
+
+bool NgxShardedCounters::Allocate(ngx_log_t* log) {
+  shard_size_ = ngx_align(num_counters_ * sizeof(int64), kCacheLineSize);
+  shm_.size = shard_size_ * num_workers_ * kThreadShards;
+  if (shm_.size == 0) {
+    return true;
+  }
+  shm_.name.data = reinterpret_cast<u_char*>(
+      const_cast<char*>("pagespeed_sharded_counters"));
+  shm_.name.len = ngx_strlen(shm_.name.data);
+  shm_.log = log;
+  if (ngx_shm_alloc(&shm_) != NGX_OK) {
+    shm_.addr = NULL;
+    return false;
+  }
+  // Anonymous mappings come zeroed, but be explicit about it.
+  ngx_memzero(shm_.addr, shm_.size);
+  targets_.assign(num_counters_, NULL);
+  return true;
+}
+
+void NgxShardedCounters::set_target(int id, Variable* variable) {
+  CHECK(id >= 0 && id < num_counters_);
+  targets_[id] = variable;
+}
+
+void NgxShardedCounters::Add(int id, int64 delta) {
+  DCHECK(id >= 0 && id < num_counters_);
+  if (thread_shard < 0) {
+    thread_shard = __sync_fetch_and_add(&next_thread_shard, 1) % kThreadShards;
+  }
+  int64* shard = Shard(ps_worker_index(num_workers_) * kThreadShards +
+                       thread_shard);
+  __sync_fetch_and_add(&shard[id], delta);
+}
+
+void NgxShardedCounters::Fold() {
+  if (shm_.addr == NULL) {
+    return;
+  }
+  std::vector<int64> sums(num_counters_, 0);
+  for (int s = 0, n = num_workers_ * kThreadShards; s < n; ++s) {
+    int64* shard = Shard(s);
+    for (int id = 0; id < num_counters_; ++id) {
+      // Take the delta out of the shard, so concurrent folds in other workers
+      // don't count it again.
+      if (targets_[id] != NULL && shard[id] != 0) {
+        sums[id] += __sync_fetch_and_and(&shard[id], 0);
+      }
+    }
+  }
+  for (int id = 0; id < num_counters_; ++id) {
+    if (sums[id] != 0) {
+      targets_[id]->Add(sums[id]);
+    }
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,90 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxShardedCounters keeps the deltas of hot-path statistics in shared
+// memory, sharded by worker and by thread.  Each shard is padded out to its
+// own cache lines, so increments from different workers and threads don't
+// bounce a line shared by all of them the way shared-memory variables do.
+// When statistics are read the shards of all workers are summed and moved
+// over to the variables they count for, so the statistics pages, the global
+// statistics and the console see them like any other statistic.
+//
+// The segment is laid out in the master process, before forking, once all
+// counters are known.  Workers inherit it and, after ChildInit, point each
+// counter at the variable it counts for in their process.
+
+#ifndef NGX_SHARDED_COUNTERS_H_
+#define NGX_SHARDED_COUNTERS_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+class Variable;
+
+class NgxShardedCounters {
+ public:
+  explicit NgxShardedCounters(int num_workers);
+  ~NgxShardedCounters();
+
+  // Reserves count consecutive counters and returns the id of the first one.
+  // Only before Allocate().
+  int AddCounters(int count);
+
+  // Maps the shared memory for the counters.  Called in the master process.
+  bool Allocate(ngx_log_t* log);
+
+  // Called in workers: deltas of counter id get added to variable.
+  void set_target(int id, Variable* variable);
+
+  // Adds delta to counter id, in the shard of the calling worker and thread.
+  void Add(int id, int64 delta);
+
+  // Sums the shards of all workers and adds the sums to the target variables.
+  // Cheap enough to call before each statistics read.  Only on the nginx
+  // thread.
+  void Fold();
+
+ private:
+  int64* Shard(int index) {
+    return reinterpret_cast<int64*>(
+        shm_.addr + static_cast<size_t>(index) * shard_size_);
+  }
+
+  const int num_workers_;
+  int num_counters_;
+  size_t shard_size_;
+  ngx_shm_t shm_;
+  std::vector<Variable*> targets_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxShardedCounters);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SHARDED_COUNTERS_H_
@@ -0,0 +1,210 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#include "ngx_shared_inflight.h"
+
+#include <cstddef>
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How many fetches the workers can share at once, together.
+const int kNumEntries = 64;
+
+}  // namespace
+
+const size_t NgxSharedInflight::kMaxResponseSize;
+const size_t NgxSharedInflight::kMaxKeySize;
+
+NgxSharedInflight::NgxSharedInflight()
+    : segment_(NULL) {
+  ngx_memzero(&shm_, sizeof(shm_));
+}
+
+NgxSharedInflight::~NgxSharedInflight() {
+  if (segment_ != NULL) {
+    ngx_shmtx_destroy(&mutex_);
+  }
+  if (shm_.addr != NULL) {
+    ngx_shm_free(&shm_);
+  }
+}
+
+bool NgxSharedInflight::Allocate(ngx_log_t* log) {
+  shm_.size = offsetof(Segment, entries) + kNumEntries * sizeof(Entry);
+  shm_.name.data = reinterpret_cast<u_char*>(
+      const_cast<char*>("pagespeed_shared_inflight"));
+  shm_.name.len = ngx_strlen(shm_.name.data);
+  shm_.log = log;
+  if (ngx_shm_alloc(&shm_) != NGX_OK) {
+    shm_.addr = NULL;
+    return false;
+  }
+  // The mapping comes zeroed, which makes every entry free.  Clearing it
+  // would only touch all of its pages.
+  Segment* segment = reinterpret_cast<Segment*>(shm_.addr);
+  if (ngx_shmtx_create(&mutex_, &segment->lock,
+                       ngx_cycle->lock_file.data) != NGX_OK) {
+    ngx_shm_free(&shm_);
+    shm_.addr = NULL;
+    return false;
+  }
+  segment_ = segment;
+  return true;
+}
+
+NgxSharedInflight::State NgxSharedInflight::Claim(
+    StringPiece key, int64 now_ms, int64 expires_ms, int* entry,
+    uint32* generation) {
+  if (segment_ == NULL || key.size() > kMaxKeySize) {
+    return kNone;
+  }
+  Lock();
+  int free_index = -1;
+  for (int i = 0; i < kNumEntries; ++i) {
+    Entry* e = &segment_->entries[i];
+    if (e->state == kNone || e->expires_ms <= now_ms) {
+      if (free_index < 0) {
+        free_index = i;
+      }
+    } else if (e->key_len == key.size() &&
+               ngx_memcmp(e->key, key.data(), key.size()) == 0) {
+      if (e->state == kFetching && LeaderGone(e)) {
+        // Nobody will finish this fetch, so the caller takes it over.
+        e->state = kNone;
+        free_index = i;
+        break;
+      }
+      State state = e->state;
+      *entry = i;
+      *generation = e->generation;
+      Unlock();
+      return state;
+    }
+  }
+  if (free_index < 0) {
+    Unlock();
+    return kNone;
+  }
+  Entry* e = &segment_->entries[free_index];
+  e->generation++;
+  e->state = kFetching;
+  e->pid = ngx_pid;
+  e->expires_ms = expires_ms;
+  e->key_len = key.size();
+  ngx_memcpy(e->key, key.data(), key.size());
+  e->headers_len = 0;
+  e->body_len = 0;
+  *entry = free_index;
+  *generation = e->generation;
+  Unlock();
+  return kLeading;
+}
+
+NgxSharedInflight::State NgxSharedInflight::Poll(
+    int entry, uint32 generation, int64 now_ms, GoogleString* headers,
+    GoogleString* body) {
+  Lock();
+  Entry* e = Find(entry, generation);
+  State state = (e == NULL) ? kNone : e->state;
+  if (state == kFetching && (e->expires_ms <= now_ms || LeaderGone(e))) {
+    // The leader is gone, or taking too long.
+    state = kNone;
+  } else if (state == kDone) {
+    const char* data = reinterpret_cast<const char*>(e->data);
+    headers->assign(data, e->headers_len);
+    body->assign(data + e->headers_len, e->body_len);
+  }
+  Unlock();
+  return state;
+}
+
+void NgxSharedInflight::Finish(int entry, uint32 generation,
+                               StringPiece headers, StringPiece body,
+                               int64 expires_ms) {
+  Lock();
+  Entry* e = Find(entry, generation);
+  if (e != NULL && e->state == kFetching) {
+    if (headers.size() + body.size() <= kMaxResponseSize) {
+      ngx_memcpy(e->data, headers.data(), headers.size());
+      ngx_memcpy(e->data + headers.size(), body.data(), body.size());
+      e->headers_len = headers.size();
+      e->body_len = body.size();
+      e->state = kDone;
+      e->expires_ms = expires_ms;
+    } else {
+      e->state = kNone;
+    }
+  }
+  Unlock();
+}
+
+void NgxSharedInflight::Abandon(int entry, uint32 generation) {
+  Lock();
+  Entry* e = Find(entry, generation);
+  if (e != NULL) {
+    e->state = kNone;
+  }
+  Unlock();
+}
+
+NgxSharedInflight::Entry* NgxSharedInflight::Find(int entry,
+                                                  uint32 generation) {
+  if (segment_ == NULL || entry < 0 || entry >= kNumEntries) {
+    return NULL;
+  }
+  Entry* e = &segment_->entries[entry];
+  return e->generation == generation ? e : NULL;
+}
+
+bool NgxSharedInflight::LeaderGone(const Entry* e) {
+  return kill(e->pid, 0) == -1 && ngx_errno == NGX_ESRCH;
+}
+
+void NgxSharedInflight::Lock() {
+  if (segment_ == NULL) {
+    return;
+  }
+#if (NGX_HAVE_ATOMIC_OPS)
+  // nginx only frees the locks of a worker that died for its own zones.
+  // The lock holds the pid of its owner, so whoever waits for it frees it
+  // when that worker has exited.
+  while (!ngx_shmtx_trylock(&mutex_)) {
+    ngx_pid_t pid = static_cast<ngx_pid_t>(segment_->lock.lock);
+    if (pid != 0 && kill(pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+      ngx_shmtx_force_unlock(&mutex_, pid);
+    }
+    ngx_sched_yield();
+  }
+#else
+  ngx_shmtx_lock(&mutex_);
+#endif
+}
+
+void NgxSharedInflight::Unlock() {
+  if (segment_ != NULL) {
+    ngx_shmtx_unlock(&mutex_);
+  }
+}
+
+}  // namespace net_instaweb
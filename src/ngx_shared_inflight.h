@@ -0,0 +1,136 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+//
+// NgxSharedInflight lets the native fetchers of different workers coalesce
+// identical fetches, the way each worker already does for its own.  The first
+// worker to fetch a response claims an entry in shared memory for its
+// coalesce key.  Fetches for the same key in other workers wait a little
+// while for that fetch instead of going to the origin themselves.  When the
+// response is small enough, the leader copies it into the entry, and the
+// waiting fetches are served from there.  When it isn't, or the fetch fails,
+// the leader gives the entry up and the others fetch by themselves.  Fetches
+// that come in shortly after the leader finished are served from the entry
+// too, when the response is cacheable, which covers the time before it is in
+// the HTTP cache.
+//
+// The segment is laid out in the master process before forking.  Entries
+// are guarded by a single mutex; it is only held to copy a response in or
+// out.  A worker that dies holding it has it taken back by the next one that
+// waits for it, and an entry whose leader died is fetched again.
+
+#ifndef NGX_SHARED_INFLIGHT_H_
+#define NGX_SHARED_INFLIGHT_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class NgxSharedInflight {
+ public:
+  // What Claim() and Poll() find for a key.
+  enum State {
+    // Nobody else fetches the key, or the entry went to another key.
+    kNone,
+    // Claim(): the caller fetches the key for everyone.
+    kLeading,
+    // Another worker fetches the key.
+    kFetching,
+    // Another worker fetched the key, the response is in the entry.
+    kDone,
+  };
+
+  // Responses larger than this aren't shared, nor are the fetches of keys
+  // longer than kMaxKeySize.
+  static const size_t kMaxResponseSize = 128 * 1024;
+  static const size_t kMaxKeySize = 2048;
+
+  NgxSharedInflight();
+  ~NgxSharedInflight();
+
+  // Maps the shared memory for the entries.  Called in the master process.
+  bool Allocate(ngx_log_t* log);
+
+  // Looks up key.  When another worker is fetching or just fetched it,
+  // returns kFetching or kDone.  Otherwise claims an entry for the caller to
+  // fetch key, and returns kLeading, or kNone when all entries are in use.
+  // *entry and *generation name the entry for the calls below.  A leader is
+  // given up on after expires_ms.
+  State Claim(StringPiece key, int64 now_ms, int64 expires_ms, int* entry,
+              uint32* generation);
+
+  // Where the fetch of a kFetching entry is at.  On kDone, copies the
+  // response into headers and body.
+  State Poll(int entry, uint32 generation, int64 now_ms,
+             GoogleString* headers, GoogleString* body);
+
+  // The leader is done: fetches waiting for it get the response, and new
+  // ones until expires_ms.  headers are the response headers as written by
+  // ResponseHeaders::WriteAsBinary().
+  void Finish(int entry, uint32 generation, StringPiece headers,
+              StringPiece body, int64 expires_ms);
+  // The leader won't share its response, the others fetch by themselves.
+  void Abandon(int entry, uint32 generation);
+
+ private:
+  struct Entry {
+    // Bumped whenever the entry is claimed, so the calls for a former claim
+    // don't touch it.
+    uint32 generation;
+    State state;
+    // The leader's worker.
+    ngx_pid_t pid;
+    // When a fetching entry is given up on, and when a done entry goes away.
+    int64 expires_ms;
+    size_t key_len;
+    char key[kMaxKeySize];
+    size_t headers_len;
+    size_t body_len;
+    u_char data[kMaxResponseSize];
+  };
+  struct Segment {
+    ngx_shmtx_sh_t lock;
+    Entry entries[1];
+  };
+
+  // The entry named by entry and generation, when it is still theirs.
+  Entry* Find(int entry, uint32 generation);
+  // Whether the worker fetching for e has exited.
+  static bool LeaderGone(const Entry* e);
+  void Lock();
+  void Unlock();
+
+  ngx_shm_t shm_;
+  Segment* segment_;
+  ngx_shmtx_t mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedInflight);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SHARED_INFLIGHT_H_
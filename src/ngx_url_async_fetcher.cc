@@ -22,14 +22,19 @@
 extern "C" {
   #include <ngx_http.h>
   #include <ngx_core.h>
+  #include <nginx.h>
 }
 
 #include "ngx_url_async_fetcher.h"
+#include "ngx_dns_cache.h"
 #include "ngx_fetch.h"
+#include "ngx_http2_session.h"
+#include "ngx_server_context.h"
 
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <deque>
 #include <list>
 #include <map>
 #include <set>
@@ -47,12 +52,203 @@ extern "C" {
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/base/writer.h"
+#include "pagespeed/kernel/html/html_keywords.h"
+#include "pagespeed/kernel/http/http_names.h"
 #include "pagespeed/kernel/http/request_headers.h"
 #include "pagespeed/kernel/http/response_headers.h"
 #include "pagespeed/kernel/http/response_headers_parser.h"
 
 namespace net_instaweb {
 
+namespace {
+
+const char kNativeFetchRequestCount[] = "native_fetch_request_count";
+const char kNativeFetchBytesCount[] = "native_fetch_bytes_count";
+// Includes the time a fetch spent queued for its origin.
+const char kNativeFetchTimeDurationMs[] = "native_fetch_time_duration_ms";
+const char kNativeFetchQueueTimeMs[] = "native_fetch_queue_time_ms";
+const char kNativeFetchFailureCount[] = "native_fetch_failure_count";
+const char kNativeFetchQueuedCount[] = "native_fetch_queued_count";
+// Fetches that got their response from an identical fetch in flight.
+const char kNativeFetchCoalescedCount[] = "native_fetch_coalesced_count";
+// Fetches that got their response from an identical fetch of another worker.
+const char kNativeFetchSharedCoalescedCount[] =
+    "native_fetch_shared_coalesced_count";
+// 304 responses to conditional fetches, and an estimate of the bytes they
+// saved: the size of the last full response for the same url.
+const char kNativeFetchNotModifiedCount[] = "native_fetch_not_modified_count";
+const char kNativeFetchNotModifiedBytesSaved[] =
+    "native_fetch_not_modified_bytes_saved";
+// How often an origin's circuit breaker opened, the fetches it failed right
+// away, and the number of origins whose breaker is not closed.
+const char kNativeFetchCircuitOpenedCount[] =
+    "native_fetch_circuit_breaker_opened_count";
+const char kNativeFetchCircuitRejectedCount[] =
+    "native_fetch_circuit_breaker_rejected_count";
+const char kNativeFetchCircuitOpenOrigins[] =
+    "native_fetch_circuit_breaker_open_origins";
+// Fetch latency by phase, see NgxUrlAsyncFetcher::FetchPhase, and response
+// sizes.
+const char* const kNativeFetchPhaseHistograms[] = {
+  "Native Fetch DNS Latency Histogram",
+  "Native Fetch Connect Latency Histogram",
+  "Native Fetch First Byte Latency Histogram",
+  "Native Fetch Total Latency Histogram",
+};
+const char kNativeFetchResponseBytesHistogram[] =
+    "Native Fetch Response Size Histogram";
+const char kNativeFetchEventHandoffLatencyHistogram[] =
+    "Native Fetch Event Handoff Latency us Histogram";
+const char kNativeFetchTimeoutCount[] = "native_fetch_timeout_count";
+// Fetches cancelled because the client waiting for them went away.
+const char kNativeFetchOrphanedCount[] = "native_fetch_orphaned_count";
+// Connections opened ahead of time to hot origins, and how many of those a
+// fetch got to use.
+const char kNativeFetchPrewarmedCount[] =
+    "native_fetch_prewarmed_connection_count";
+const char kNativeFetchPrewarmedUsedCount[] =
+    "native_fetch_prewarmed_connection_used_count";
+const char kNativeFetchKeepaliveReusedCount[] =
+    "native_fetch_keepalive_reused_count";
+// Fetches sent again on a new connection because the keepalive connection
+// they went out on turned out to be closed by the origin.
+const char kNativeFetchStaleRetryCount[] =
+    "native_fetch_stale_keepalive_retry_count";
+// Fetches given up on because the response was too large to cache.
+const char kNativeFetchOversizedCount[] = "native_fetch_oversized_abort_count";
+// HTTP/2 connections opened, and the fetches sent over them.
+const char kNativeFetchHttp2SessionCount[] = "native_fetch_http2_session_count";
+const char kNativeFetchHttp2StreamCount[] = "native_fetch_http2_stream_count";
+const char* const kNativeFetchStatusClassCounts[] = {
+  "native_fetch_status_2xx_count",
+  "native_fetch_status_3xx_count",
+  "native_fetch_status_4xx_count",
+  "native_fetch_status_5xx_count",
+};
+
+bool ParseUnixSocket(StringPiece path, NgxDnsCache::Address* address) {
+#if (NGX_HAVE_UNIX_DOMAIN)
+  if (path.starts_with("unix:")) {
+    path.remove_prefix(5);
+  }
+  ngx_memzero(address, sizeof(*address));
+  struct sockaddr_un* saun =
+      reinterpret_cast<struct sockaddr_un*>(address->sockaddr);
+  // sun_path needs room for the terminating nul.
+  if (path.empty() || path.size() >= sizeof(saun->sun_path)) {
+    return false;
+  }
+  saun->sun_family = AF_UNIX;
+  ngx_memcpy(saun->sun_path, path.data(), path.size());
+  address->socklen = sizeof(struct sockaddr_un);
+  return true;
+#else
+  return false;
+#endif
+}
+
+in_port_t SockaddrPort(const struct sockaddr* sa) {
+  switch (sa->sa_family) {
+    case AF_INET:
+      return ntohs(reinterpret_cast<const struct sockaddr_in*>(sa)->sin_port);
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+      return ntohs(
+          reinterpret_cast<const struct sockaddr_in6*>(sa)->sin6_port);
+#endif
+  }
+  return 0;
+}
+
+bool IsWildcard(const struct sockaddr* sa) {
+  switch (sa->sa_family) {
+    case AF_INET:
+      return reinterpret_cast<const struct sockaddr_in*>(
+          sa)->sin_addr.s_addr == INADDR_ANY;
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+      return IN6_IS_ADDR_UNSPECIFIED(
+          &reinterpret_cast<const struct sockaddr_in6*>(sa)->sin6_addr);
+#endif
+  }
+  return false;
+}
+
+bool IsLoopback(const struct sockaddr* sa) {
+  switch (sa->sa_family) {
+    case AF_INET:
+      // 127.0.0.0/8
+      return (ntohl(reinterpret_cast<const struct sockaddr_in*>(
+          sa)->sin_addr.s_addr) >> 24) == 127;
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+      return IN6_IS_ADDR_LOOPBACK(
+          &reinterpret_cast<const struct sockaddr_in6*>(sa)->sin6_addr);
+#endif
+  }
+  return false;
+}
+
+// Bounds the number of origins we remember the address family for.
+const size_t kMaxPreferredFamilies = 1024;
+// Bounds the number of urls we remember the response size of.
+const size_t kMaxBodySizes = 4096;
+// How often we top up the idle connections to hot peers.
+const ngx_msec_t kPrewarmIntervalMs = 5000;
+// A peer is hot while its decayed use count is at least this.  Counts lose a
+// quarter each interval, so this takes about a fetch every 2.5 seconds.
+const int64 kHotPeerUses = 8;
+// Bounds the number of peers we track use counts of.
+const size_t kMaxHotPeers = 256;
+// Bounds the number of origins we keep fetch statistics for.  Fetches to
+// others still count in the shared histograms.
+const size_t kMaxOriginStats = 1024;
+// Upper bounds of the buckets of OriginStats::latency_buckets, the last one
+// takes the rest.
+const int64 kLatencyBucketsMs[] = {10, 50, 200, 1000, 5000};
+// Fetches put their request line and headers, the fake request the response
+// parser needs, and their events in this much memory.
+const size_t kFetchPoolSize = 12288;
+// Bounds the number of idle fetch pools we keep around for reuse.
+const size_t kMaxFreeFetchPools = 64;
+// Bounds the number of https origins we remember to speak HTTP/2.
+const size_t kMaxHttp2Origins = 1024;
+
+#if (NGX_SSL)
+// Certificates are checked after the handshake, in NgxFetch, where the
+// https options can waive selected verification errors.
+int SslVerifyCallback(int ok, X509_STORE_CTX* x509_store) {
+  return 1;
+}
+#endif
+
+// Where an in-flight fetch is at, judging by the milestones it reached.
+const char* FetchState(NgxFetch* fetch) {
+  if (fetch->resolved_ms() == 0) {
+    return "resolving";
+  } else if (fetch->connected_ms() == 0) {
+    return "connecting";
+  } else if (fetch->first_byte_ms() == 0) {
+    return "waiting";
+  }
+  return "receiving";
+}
+
+GoogleString FetchRow(NgxFetch* fetch, const char* state, int64 now_ms) {
+  GoogleString url;
+  GoogleString origin;
+  HtmlKeywords::Escape(fetch->str_url(), &url);
+  HtmlKeywords::Escape(fetch->origin(), &origin);
+  return StrCat("<tr><td>", state, "</td><td>", origin, "</td><td>", url,
+                "</td><td>",
+                Integer64ToString(now_ms - fetch->fetch_start_ms()),
+                "</td><td>",
+                Integer64ToString(fetch->bytes_received()),
+                "</td></tr>\n");
+}
+
+}  // namespace
+
   NgxUrlAsyncFetcher::NgxUrlAsyncFetcher(const char* proxy,
                                          ngx_log_t* log,
                                          ngx_msec_t resolver_timeout,
@@ -60,6 +256,8 @@ namespace net_instaweb {
                                          ngx_resolver_t* resolver,
                                          int max_keepalive_requests,
                                          ThreadSystem* thread_system,
+                                         Statistics* statistics,
+                                         Timer* timer,
                                          MessageHandler* handler)
     : fetchers_count_(0),
       shutdown_(false),
@@ -69,7 +267,77 @@ namespace net_instaweb {
       message_handler_(handler),
       mutex_(NULL),
       max_keepalive_requests_(max_keepalive_requests),
-      event_connection_(NULL) {
+      max_fetches_per_origin_(0),
+      circuit_breaker_failures_(0),
+      circuit_breaker_open_ms_(0),
+      request_deadline_ms_(0),
+      min_idle_connections_per_origin_(0),
+      cancel_orphaned_fetches_(false),
+      max_response_bytes_(-1),
+      max_receive_buffer_size_(65536),
+      statistics_(statistics),
+      event_connection_(NULL),
+      connection_pool_(new NgxConnectionPool()),
+      dns_cache_(new NgxDnsCache(resolver, resolver_timeout, statistics)),
+      shared_inflight_(NULL),
+      shared_inflight_wait_ms_(0),
+      dispatching_(false),
+      use_loopback_unix_socket_(false),
+      http2_(false),
+      https_options_(0),
+#if (NGX_SSL)
+      ssl_(NULL),
+      ssl_init_failed_(false),
+#endif
+      timer_(timer) {
+    request_count_ = statistics->GetVariable(kNativeFetchRequestCount);
+    byte_count_variable_ = statistics->GetVariable(kNativeFetchBytesCount);
+    time_duration_ms_ = statistics->GetVariable(kNativeFetchTimeDurationMs);
+    queue_time_ms_ = statistics->GetVariable(kNativeFetchQueueTimeMs);
+    failure_count_ = statistics->GetVariable(kNativeFetchFailureCount);
+    queued_fetches_ = statistics->GetUpDownCounter(kNativeFetchQueuedCount);
+    coalesced_count_ = statistics->GetVariable(kNativeFetchCoalescedCount);
+    shared_coalesced_count_ =
+        statistics->GetVariable(kNativeFetchSharedCoalescedCount);
+    not_modified_count_ =
+        statistics->GetVariable(kNativeFetchNotModifiedCount);
+    not_modified_bytes_saved_ =
+        statistics->GetVariable(kNativeFetchNotModifiedBytesSaved);
+    circuit_opened_count_ =
+        statistics->GetVariable(kNativeFetchCircuitOpenedCount);
+    circuit_rejected_count_ =
+        statistics->GetVariable(kNativeFetchCircuitRejectedCount);
+    circuit_open_origins_ =
+        statistics->GetUpDownCounter(kNativeFetchCircuitOpenOrigins);
+    for (int i = 0; i < kNumPhases; ++i) {
+      phase_histograms_[i] =
+          statistics->GetHistogram(kNativeFetchPhaseHistograms[i]);
+    }
+    response_bytes_histogram_ =
+        statistics->GetHistogram(kNativeFetchResponseBytesHistogram);
+    timeout_count_ = statistics->GetVariable(kNativeFetchTimeoutCount);
+    orphaned_count_ = statistics->GetVariable(kNativeFetchOrphanedCount);
+    prewarmed_count_ = statistics->GetVariable(kNativeFetchPrewarmedCount);
+    prewarmed_used_count_ =
+        statistics->GetVariable(kNativeFetchPrewarmedUsedCount);
+    ngx_memzero(&prewarm_event_, sizeof(prewarm_event_));
+    prewarm_event_.data = this;
+    prewarm_event_.handler = NgxUrlAsyncFetcher::PrewarmTimerHandler;
+#if (nginx_version >= 1011011)
+    // Don't hold up a graceful shutdown of the worker.
+    prewarm_event_.cancelable = 1;
+#endif
+    keepalive_reused_count_ =
+        statistics->GetVariable(kNativeFetchKeepaliveReusedCount);
+    stale_retry_count_ = statistics->GetVariable(kNativeFetchStaleRetryCount);
+    oversized_count_ = statistics->GetVariable(kNativeFetchOversizedCount);
+    http2_session_count_ =
+        statistics->GetVariable(kNativeFetchHttp2SessionCount);
+    http2_stream_count_ = statistics->GetVariable(kNativeFetchHttp2StreamCount);
+    for (int i = 0; i < kNumStatusClasses; ++i) {
+      status_class_counts_[i] =
+          statistics->GetVariable(kNativeFetchStatusClassCounts[i]);
+    }
     resolver_timeout_ = resolver_timeout;
     fetch_timeout_ = fetch_timeout;
     ngx_memzero(&proxy_, sizeof(proxy_));
@@ -98,7 +366,25 @@ namespace net_instaweb {
 
     CancelActiveFetches();
     active_fetches_.DeleteAll();
-    NgxConnection::Terminate();
+    completed_fetches_.DeleteAll();
+    for (size_t i = 0; i < free_fetch_pools_.size(); ++i) {
+      ngx_destroy_pool(free_fetch_pools_[i]);
+    }
+    free_fetch_pools_.clear();
+    CloseHttp2Sessions();
+    connection_pool_->Terminate();
+#if (NGX_SSL)
+    for (SslSessionMap::iterator p = ssl_sessions_.begin(),
+         e = ssl_sessions_.end(); p != e; ++p) {
+      ngx_ssl_free_session(p->second);
+    }
+    ssl_sessions_.clear();
+    if (ssl_ != NULL) {
+      // ssl_ itself lives in pool_.
+      SSL_CTX_free(ssl_->ctx);
+      ssl_ = NULL;
+    }
+#endif
 
     if (pool_ != NULL) {
       ngx_destroy_pool(pool_);
@@ -111,6 +397,40 @@ namespace net_instaweb {
   }
 
 
+  void NgxUrlAsyncFetcher::InitStats(Statistics* statistics) {
+    statistics->AddVariable(kNativeFetchRequestCount);
+    statistics->AddVariable(kNativeFetchBytesCount);
+    statistics->AddVariable(kNativeFetchTimeDurationMs);
+    statistics->AddVariable(kNativeFetchQueueTimeMs);
+    statistics->AddVariable(kNativeFetchFailureCount);
+    statistics->AddUpDownCounter(kNativeFetchQueuedCount);
+    statistics->AddVariable(kNativeFetchCoalescedCount);
+    statistics->AddVariable(kNativeFetchSharedCoalescedCount);
+    statistics->AddVariable(kNativeFetchNotModifiedCount);
+    statistics->AddVariable(kNativeFetchNotModifiedBytesSaved);
+    statistics->AddVariable(kNativeFetchCircuitOpenedCount);
+    statistics->AddVariable(kNativeFetchCircuitRejectedCount);
+    statistics->AddUpDownCounter(kNativeFetchCircuitOpenOrigins);
+    for (int i = 0; i < kNumPhases; ++i) {
+      statistics->AddHistogram(kNativeFetchPhaseHistograms[i]);
+    }
+    statistics->AddHistogram(kNativeFetchResponseBytesHistogram);
+    statistics->AddHistogram(kNativeFetchEventHandoffLatencyHistogram);
+    statistics->AddVariable(kNativeFetchTimeoutCount);
+    statistics->AddVariable(kNativeFetchOrphanedCount);
+    statistics->AddVariable(kNativeFetchPrewarmedCount);
+    statistics->AddVariable(kNativeFetchPrewarmedUsedCount);
+    statistics->AddVariable(kNativeFetchKeepaliveReusedCount);
+    statistics->AddVariable(kNativeFetchStaleRetryCount);
+    statistics->AddVariable(kNativeFetchOversizedCount);
+    statistics->AddVariable(kNativeFetchHttp2SessionCount);
+    statistics->AddVariable(kNativeFetchHttp2StreamCount);
+    for (int i = 0; i < kNumStatusClasses; ++i) {
+      statistics->AddVariable(kNativeFetchStatusClassCounts[i]);
+    }
+    NgxDnsCache::InitStats(statistics);
+  }
+
   bool NgxUrlAsyncFetcher::ParseUrl(ngx_url_t* url, ngx_pool_t* pool) {
     size_t scheme_offset;
     u_short port;
@@ -130,8 +450,9 @@ namespace net_instaweb {
     url->url.data += scheme_offset;
     url->url.len -= scheme_offset;
     url->default_port = port;
-    // See: http://lxr.evanmiller.org/http/source/core/ngx_inet.c#L875
-    url->no_resolve = 0;
+    // Host names are resolved with the nginx resolver (and cached by
+    // NgxDnsCache), not with the blocking lookup ngx_parse_url() would do.
+    url->no_resolve = 1;
     url->uri_part = 1;
 
     if (ngx_parse_url(pool, url) == NGX_OK) {
@@ -186,23 +507,40 @@ namespace net_instaweb {
 
   void NgxUrlAsyncFetcher::ShutDown() {
     shutdown_ = true;
-    if (!pending_fetches_.empty()) {
-      for (Pool<NgxFetch>::iterator p = pending_fetches_.begin(),
-           e = pending_fetches_.end(); p != e; p++) {
-        NgxFetch* fetch = *p;
-        fetch->CallbackDone(false);
+    if (prewarm_event_.timer_set) {
+      ngx_del_timer(&prewarm_event_);
+    }
+    // Followers complete along with the fetches they are attached to.
+    inflight_.clear();
+    // Fetches that never got started are failed through StartFetch(), which
+    // won't initiate anything anymore now that we are shutting down.
+    std::vector<NgxFetch*> to_fail;
+    {
+      ScopedMutex lock(mutex_);
+      to_fail.assign(pending_fetches_.begin(), pending_fetches_.end());
+      pending_fetches_.Clear();
+    }
+    for (OriginQueueMap::iterator p = origin_queues_.begin(),
+         e = origin_queues_.end(); p != e; ++p) {
+      for (int i = 0; i < kNumPriorities; ++i) {
+        std::deque<NgxFetch*>* waiting = &p->second.waiting[i];
+        queued_fetches_->Add(-static_cast<int64>(waiting->size()));
+        to_fail.insert(to_fail.end(), waiting->begin(), waiting->end());
+        waiting->clear();
       }
-      pending_fetches_.DeleteAll();
+    }
+    for (size_t i = 0; i < to_fail.size(); ++i) {
+      StartFetch(to_fail[i]);
     }
 
-    if (!active_fetches_.empty()) {
-      for (Pool<NgxFetch>::iterator p = active_fetches_.begin(),
-           e = active_fetches_.end(); p != e; p++) {
-        NgxFetch* fetch = *p;
-        fetch->CallbackDone(false);
-      }
-      active_fetches_.Clear();
+    // CallbackDone() removes the fetch from active_fetches_, so don't iterate
+    // over that directly.
+    std::vector<NgxFetch*> active(active_fetches_.begin(),
+                                  active_fetches_.end());
+    for (size_t i = 0; i < active.size(); ++i) {
+      active[i]->CallbackDone(false);
     }
+    CloseHttp2Sessions();
     if (event_connection_ != NULL) {
       event_connection_->Shutdown();
       delete event_connection_;
@@ -224,6 +562,7 @@ namespace net_instaweb {
     async_fetch = EnableInflation(async_fetch);
     NgxFetch* fetch = new NgxFetch(url, async_fetch,
           message_handler, log_);
+    fetch->set_fetch_start_ms(timer_->NowMs());
     ScopedMutex lock(mutex_);
     pending_fetches_.Add(fetch);
 
@@ -254,25 +593,236 @@ namespace net_instaweb {
     fetcher->mutex_->Unlock();
 
     for (size_t i = 0; i < to_start.size(); i++) {
-      fetcher->StartFetch(to_start[i]);
+      fetcher->ScheduleFetch(to_start[i]);
     }
 
     return;
   }
 
+  void NgxUrlAsyncFetcher::ScheduleFetch(NgxFetch* fetch) {
+    if (!AdmitFetch(fetch)) {
+      circuit_rejected_count_->Add(1);
+      RejectFetch(fetch);
+      return;
+    }
+    // A probe must get its own response from the origin.
+    if (!fetch->circuit_probe() && CoalesceFetch(fetch)) {
+      return;
+    }
+    OriginQueue* queue = &origin_queues_[fetch->origin()];
+    FetchPriority priority = fetch->priority();
+    // Don't overtake fetches that wait already, unless they are of a lower
+    // priority.
+    bool overtakes = false;
+    for (int i = 0; i <= priority; ++i) {
+      overtakes = overtakes || !queue->waiting[i].empty();
+    }
+    if (overtakes || !HasOriginSlot(*queue, priority)) {
+      queue->waiting[priority].push_back(fetch);
+      queued_fetches_->Add(1);
+      return;
+    }
+    TakeOriginSlot(queue, fetch);
+    StartFetch(fetch);
+  }
+
+  bool NgxUrlAsyncFetcher::HasOriginSlot(const OriginQueue& queue,
+                                         FetchPriority priority) const {
+    if (max_fetches_per_origin_ <= 0) {
+      return true;
+    }
+    if (queue.active >= max_fetches_per_origin_) {
+      return false;
+    }
+    if (priority == kBackgroundPriority) {
+      int max_background = std::max(1, max_fetches_per_origin_ * 3 / 4);
+      return queue.active_background < max_background;
+    }
+    return true;
+  }
+
+  void NgxUrlAsyncFetcher::TakeOriginSlot(OriginQueue* queue,
+                                          NgxFetch* fetch) {
+    queue->active++;
+    if (fetch->priority() == kBackgroundPriority) {
+      queue->active_background++;
+    }
+  }
+
+  bool NgxUrlAsyncFetcher::AdmitFetch(NgxFetch* fetch) {
+    OriginHealthMap::iterator iter = origin_health_.find(fetch->origin());
+    if (iter == origin_health_.end()) {
+      return true;
+    }
+    OriginHealth* health = &iter->second;
+    switch (health->state) {
+      case kCircuitClosed:
+        return true;
+      case kCircuitOpen:
+        if (timer_->NowMs() - health->opened_ms < circuit_breaker_open_ms_) {
+          return false;
+        }
+        SetCircuitState(iter->first, health, kCircuitHalfOpen);
+        break;
+      case kCircuitHalfOpen:
+        if (health->probe_in_flight) {
+          return false;
+        }
+        break;
+    }
+    health->probe_in_flight = true;
+    fetch->set_circuit_probe(true);
+    return true;
+  }
+
+  void NgxUrlAsyncFetcher::UpdateOriginHealth(NgxFetch* fetch,
+                                              bool success) {
+    if (circuit_breaker_failures_ <= 0) {
+      return;
+    }
+    if (fetch->cancelled()) {
+      // Cut short for the sake of its client, the fetch tells nothing about
+      // the origin.  A probe has to be retried.
+      OriginHealthMap::iterator iter = origin_health_.find(fetch->origin());
+      if (fetch->circuit_probe() && iter != origin_health_.end()) {
+        iter->second.probe_in_flight = false;
+      }
+      return;
+    }
+    // Failing to get a response, a server error, or taking over half the
+    // fetch timeout all count against the origin.
+    int status = fetch->status_code();
+    int64 elapsed_ms = fetch->fetch_end_ms() - fetch->dispatch_ms();
+    bool failed = (!success && status == 0) || status >= 500 ||
+        elapsed_ms >= static_cast<int64>(fetch_timeout_ / 2);
+
+    OriginHealthMap::iterator iter = origin_health_.find(fetch->origin());
+    if (iter == origin_health_.end()) {
+      if (!failed) {
+        return;
+      }
+      iter = origin_health_.insert(
+          std::make_pair(fetch->origin(), OriginHealth())).first;
+    }
+    OriginHealth* health = &iter->second;
+
+    if (fetch->circuit_probe()) {
+      health->probe_in_flight = false;
+      SetCircuitState(iter->first, health,
+                      failed ? kCircuitOpen : kCircuitClosed);
+    } else if (health->state == kCircuitClosed) {
+      // Fetches started before the breaker opened don't count either way.
+      if (failed) {
+        health->failures++;
+        if (health->failures >= circuit_breaker_failures_) {
+          SetCircuitState(iter->first, health, kCircuitOpen);
+        }
+      } else {
+        health->failures = 0;
+      }
+    }
+
+    if (health->state == kCircuitClosed && health->failures == 0) {
+      origin_health_.erase(iter);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::SetCircuitState(const GoogleString& origin,
+                                           OriginHealth* health,
+                                           CircuitState state) {
+    if (state == kCircuitOpen) {
+      health->opened_ms = timer_->NowMs();
+      if (health->state == kCircuitClosed) {
+        circuit_open_origins_->Add(1);
+      }
+      circuit_opened_count_->Add(1);
+      message_handler_->Message(
+          kWarning, "NgxUrlAsyncFetcher: %s is failing, not fetching from it "
+          "for %d ms", origin.c_str(),
+          static_cast<int>(circuit_breaker_open_ms_));
+
+      // Fail what is queued for the origin right away too.
+      std::vector<NgxFetch*> to_reject;
+      OriginQueueMap::iterator queue = origin_queues_.find(origin);
+      if (queue != origin_queues_.end()) {
+        for (int i = 0; i < kNumPriorities; ++i) {
+          std::deque<NgxFetch*>* waiting = &queue->second.waiting[i];
+          queued_fetches_->Add(-static_cast<int64>(waiting->size()));
+          to_reject.insert(to_reject.end(), waiting->begin(), waiting->end());
+          waiting->clear();
+        }
+      }
+      health->state = state;
+      circuit_rejected_count_->Add(to_reject.size());
+      for (size_t i = 0; i < to_reject.size(); ++i) {
+        RejectFetch(to_reject[i]);
+      }
+      return;
+    }
+
+    if (state == kCircuitClosed && health->state != kCircuitClosed) {
+      circuit_open_origins_->Add(-1);
+      health->failures = 0;
+      message_handler_->Message(
+          kInfo, "NgxUrlAsyncFetcher: %s recovered, fetching from it again",
+          origin.c_str());
+    } else if (state == kCircuitHalfOpen) {
+      message_handler_->Message(
+          kInfo, "NgxUrlAsyncFetcher: probing whether %s recovered",
+          origin.c_str());
+    }
+    health->state = state;
+  }
+
+  void NgxUrlAsyncFetcher::RejectFetch(NgxFetch* fetch) {
+    ForgetInflight(fetch);
+    // The fetch has no fetcher, so it won't report back through
+    // FetchComplete().
+    fetch->CallbackDone(false);
+    ScopedMutex lock(mutex_);
+    completed_fetches_.Add(fetch);
+  }
+
+  void NgxUrlAsyncFetcher::ForgetInflight(NgxFetch* fetch) {
+    std::map<GoogleString, NgxFetch*>::iterator iter =
+        inflight_.find(fetch->coalesce_key());
+    if (iter != inflight_.end() && iter->second == fetch) {
+      inflight_.erase(iter);
+    }
+  }
+
+  bool NgxUrlAsyncFetcher::CoalesceFetch(NgxFetch* fetch) {
+    const GoogleString& key = fetch->coalesce_key();
+    if (key.empty()) {
+      return false;
+    }
+    NgxFetch*& leader = inflight_[key];
+    if (leader != NULL && leader->AcceptsFollowers()) {
+      leader->AddFollower(fetch, this);
+      coalesced_count_->Add(1);
+      return true;
+    }
+    leader = fetch;
+    return false;
+  }
+
   // TODO(oschaaf): return value is ignored.
   bool NgxUrlAsyncFetcher::StartFetch(NgxFetch* fetch) {
-    mutex_->Lock();
-    active_fetches_.Add(fetch);
-    fetchers_count_++;
-    mutex_->Unlock();
-
-    // Don't initiate the fetch when we are shutting down
+    // Don't initiate the fetch when we are shutting down.  The fetch has no
+    // fetcher yet, so it won't report back through FetchComplete().
     if (shutdown_) {
       fetch->CallbackDone(false);
+      ScopedMutex lock(mutex_);
+      completed_fetches_.Add(fetch);
       return false;
     }
 
+    mutex_->Lock();
+    active_fetches_.Add(fetch);
+    fetchers_count_++;
+    mutex_->Unlock();
+
+    fetch->set_dispatch_ms(timer_->NowMs());
     bool started = fetch->Start(this);
 
     if (!started) {
@@ -284,14 +834,648 @@ namespace net_instaweb {
     return started;
   }
 
-  void NgxUrlAsyncFetcher::FetchComplete(NgxFetch* fetch) {
+  void NgxUrlAsyncFetcher::FetchComplete(NgxFetch* fetch, bool success) {
+    fetch->set_fetch_end_ms(timer_->NowMs());
+    ForgetInflight(fetch);
+    {
+      ScopedMutex lock(mutex_);
+      byte_count_ += fetch->bytes_received();
+      fetchers_count_--;
+      active_fetches_.Remove(fetch);
+      completed_fetches_.Add(fetch);
+    }
+
+    request_count_->Add(1);
+    byte_count_variable_->Add(fetch->bytes_received());
+    time_duration_ms_->Add(fetch->fetch_end_ms() - fetch->fetch_start_ms());
+    queue_time_ms_->Add(fetch->dispatch_ms() - fetch->fetch_start_ms());
+    if (!success) {
+      failure_count_->Add(1);
+    } else {
+      UpdateRevalidationStats(fetch);
+    }
+    UpdateFetchStats(fetch, success);
+    UpdateOriginHealth(fetch, success);
+    ReleaseOriginSlot(fetch);
+  }
+
+  // PSOL does the actual revalidation: for a stale cache entry with
+  // validators, the cache fetcher adds If-None-Match or If-Modified-Since to
+  // the request and turns a 304 into the cached response, with its freshness
+  // extended.  All we see is a 304 without a body.
+  void NgxUrlAsyncFetcher::UpdateRevalidationStats(NgxFetch* fetch) {
+    const GoogleString url = fetch->str_url();
+    if (fetch->status_code() == HttpStatus::kNotModified) {
+      not_modified_count_->Add(1);
+      std::map<GoogleString, int64>::const_iterator iter =
+          body_sizes_.find(url);
+      if (iter != body_sizes_.end()) {
+        not_modified_bytes_saved_->Add(iter->second);
+      }
+    } else if (fetch->status_code() == HttpStatus::kOK) {
+      ResponseHeaders* headers = fetch->response_headers();
+      if (!headers->Has(HttpAttributes::kEtag) &&
+          !headers->Has(HttpAttributes::kLastModified)) {
+        return;
+      }
+      std::map<GoogleString, int64>::iterator iter = body_sizes_.find(url);
+      if (iter == body_sizes_.end()) {
+        if (body_sizes_.size() >= kMaxBodySizes) {
+          // Make room by forgetting the url we have known the longest.
+          body_sizes_.erase(body_size_order_.front());
+          body_size_order_.pop_front();
+        }
+        iter = body_sizes_.insert(std::make_pair(url, 0)).first;
+        body_size_order_.push_back(url);
+      }
+      iter->second = fetch->bytes_received();
+    }
+  }
+
+  NgxUrlAsyncFetcher::OriginStats::OriginStats()
+      : fetches(0), failures(0), timeouts(0), reused_connections(0),
+        bytes(0) {
+    for (int i = 0; i < kNumStatusClasses; ++i) {
+      status_classes[i] = 0;
+    }
+    for (int i = 0; i < kNumPhases; ++i) {
+      phase_count[i] = 0;
+      phase_ms[i] = 0;
+    }
+    for (int i = 0; i < kNumLatencyBuckets; ++i) {
+      latency_buckets[i] = 0;
+    }
+  }
+
+  void NgxUrlAsyncFetcher::UpdateFetchStats(NgxFetch* fetch, bool success) {
+    int64 start_ms = fetch->dispatch_ms();
+    int64 reached_ms[kNumPhases];
+    reached_ms[kDnsPhase] = fetch->resolved_ms();
+    reached_ms[kConnectPhase] = fetch->connected_ms();
+    reached_ms[kFirstBytePhase] = fetch->first_byte_ms();
+    reached_ms[kTotalPhase] = fetch->fetch_end_ms();
+    int status_class = fetch->status_code() / 100 - 2;
+    bool known_status = status_class >= 0 && status_class < kNumStatusClasses;
+
+    for (int i = 0; i < kNumPhases; ++i) {
+      if (reached_ms[i] != 0) {
+        phase_histograms_[i]->Add(reached_ms[i] - start_ms);
+      }
+    }
+    if (success) {
+      response_bytes_histogram_->Add(fetch->bytes_received());
+    }
+    if (fetch->timed_out()) {
+      timeout_count_->Add(1);
+    }
+    if (fetch->reused_connection()) {
+      keepalive_reused_count_->Add(1);
+    }
+    if (known_status) {
+      status_class_counts_[status_class]->Add(1);
+    }
+
+    OriginStatsMap::iterator iter = origin_stats_.find(fetch->origin());
+    if (iter == origin_stats_.end()) {
+      if (origin_stats_.size() >= kMaxOriginStats) {
+        return;
+      }
+      iter = origin_stats_.insert(
+          std::make_pair(fetch->origin(), OriginStats())).first;
+    }
+    OriginStats* stats = &iter->second;
+    ++stats->fetches;
+    if (!success) {
+      ++stats->failures;
+    }
+    if (fetch->timed_out()) {
+      ++stats->timeouts;
+    }
+    if (fetch->reused_connection()) {
+      ++stats->reused_connections;
+    }
+    stats->bytes += fetch->bytes_received();
+    if (known_status) {
+      ++stats->status_classes[status_class];
+    }
+    for (int i = 0; i < kNumPhases; ++i) {
+      if (reached_ms[i] != 0) {
+        ++stats->phase_count[i];
+        stats->phase_ms[i] += reached_ms[i] - start_ms;
+      }
+    }
+    int64 total_ms = reached_ms[kTotalPhase] - start_ms;
+    int bucket = 0;
+    while (bucket < kNumLatencyBuckets - 1 &&
+           total_ms >= kLatencyBucketsMs[bucket]) {
+      ++bucket;
+    }
+    ++stats->latency_buckets[bucket];
+  }
+
+  void NgxUrlAsyncFetcher::FollowerComplete(NgxFetch* fetch) {
+    fetch->set_fetch_end_ms(timer_->NowMs());
     ScopedMutex lock(mutex_);
-    byte_count_ += fetch->bytes_received();
-    fetchers_count_--;
-    active_fetches_.Remove(fetch);
     completed_fetches_.Add(fetch);
   }
 
+  void NgxUrlAsyncFetcher::ReleaseOriginSlot(NgxFetch* fetch) {
+    OriginQueueMap::iterator iter = origin_queues_.find(fetch->origin());
+    if (iter == origin_queues_.end()) {
+      return;
+    }
+    OriginQueue* queue = &iter->second;
+    queue->active--;
+    if (fetch->priority() == kBackgroundPriority) {
+      queue->active_background--;
+    }
+    if (dispatching_) {
+      // A fetch we just started failed right away; the outer call will
+      // continue with the rest of the queue.
+      return;
+    }
+
+    dispatching_ = true;
+    for (int i = 0; i < kNumPriorities; ++i) {
+      FetchPriority priority = static_cast<FetchPriority>(i);
+      std::deque<NgxFetch*>* waiting = &queue->waiting[priority];
+      while (!waiting->empty() && HasOriginSlot(*queue, priority)) {
+        NgxFetch* next = waiting->front();
+        waiting->pop_front();
+        queued_fetches_->Add(-1);
+        TakeOriginSlot(queue, next);
+        StartFetch(next);
+      }
+      if (!waiting->empty() && priority != kBackgroundPriority) {
+        // Out of slots; lower priorities have to wait even longer.
+        break;
+      }
+    }
+    dispatching_ = false;
+
+    if (queue->active == 0 && queue->num_waiting() == 0) {
+      origin_queues_.erase(iter);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::set_max_idle_connections_per_origin(int x) {
+    connection_pool_->set_max_idle_per_origin(x);
+  }
+
+  void NgxUrlAsyncFetcher::set_idle_connection_timeout_ms(ngx_msec_t x) {
+    connection_pool_->set_idle_timeout_ms(x);
+  }
+
+  // The event connection is made by Init() in the constructor, so it is
+  // there to be told about the rate.
+  void NgxUrlAsyncFetcher::set_handoff_latency_sample_rate(int x) {
+    event_connection_->RecordHandoffLatency(
+        statistics_->GetHistogram(kNativeFetchEventHandoffLatencyHistogram),
+        x);
+  }
+
+  bool NgxUrlAsyncFetcher::AddUpstream(StringPiece host,
+                                       StringPiece upstream_name) {
+    ngx_http_upstream_main_conf_t* umcf =
+        static_cast<ngx_http_upstream_main_conf_t*>(
+            ngx_http_cycle_get_module_main_conf(
+                const_cast<ngx_cycle_t*>(ngx_cycle),
+                ngx_http_upstream_module));
+    if (umcf == NULL) {
+      return false;
+    }
+    ngx_http_upstream_srv_conf_t** uscfp =
+        static_cast<ngx_http_upstream_srv_conf_t**>(umcf->upstreams.elts);
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+      ngx_http_upstream_srv_conf_t* uscf = uscfp[i];
+      // Only explicit upstream{} blocks, not the implicit ones proxy_pass
+      // creates for literal hosts.  peer.data holds the round robin peers
+      // that all of nginx's balancers build on.
+      if ((uscf->flags & NGX_HTTP_UPSTREAM_CREATE) == 0 ||
+          uscf->peer.data == NULL) {
+        continue;
+      }
+      if (StringPiece(reinterpret_cast<char*>(uscf->host.data),
+                      uscf->host.len) == upstream_name) {
+        GoogleString key = host.as_string();
+        LowerString(&key);
+        upstreams_[key] = uscf;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  ngx_http_upstream_srv_conf_t* NgxUrlAsyncFetcher::FindUpstream(
+      StringPiece host) const {
+    if (upstreams_.empty()) {
+      return NULL;
+    }
+    GoogleString key = host.as_string();
+    LowerString(&key);
+    std::map<GoogleString, ngx_http_upstream_srv_conf_t*>::const_iterator
+        iter = upstreams_.find(key);
+    return iter == upstreams_.end() ? NULL : iter->second;
+  }
+
+  bool NgxUrlAsyncFetcher::AddUnixSocket(StringPiece host,
+                                         StringPiece path) {
+    NgxDnsCache::Address address;
+    if (!ParseUnixSocket(path, &address)) {
+      return false;
+    }
+    GoogleString key = host.as_string();
+    LowerString(&key);
+    unix_sockets_[key] = address;
+    return true;
+  }
+
+  bool NgxUrlAsyncFetcher::SetLoopbackUnixSocket(StringPiece path) {
+    NgxDnsCache::Address address;
+    if (!ParseUnixSocket(path, &address)) {
+      return false;
+    }
+    ngx_listening_t* ls =
+        static_cast<ngx_listening_t*>(ngx_cycle->listening.elts);
+    for (ngx_uint_t i = 0; i < ngx_cycle->listening.nelts; i++) {
+      if (ngx_cmp_sockaddr(ls[i].sockaddr, ls[i].socklen,
+                           reinterpret_cast<struct sockaddr*>(address.sockaddr),
+                           address.socklen, 0) == NGX_OK) {
+        loopback_unix_socket_ = address;
+        use_loopback_unix_socket_ = true;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool NgxUrlAsyncFetcher::IsOwnAddress(
+      const NgxDnsCache::Address& address) const {
+    const struct sockaddr* sa =
+        reinterpret_cast<const struct sockaddr*>(address.sockaddr);
+    ngx_listening_t* ls =
+        static_cast<ngx_listening_t*>(ngx_cycle->listening.elts);
+    for (ngx_uint_t i = 0; i < ngx_cycle->listening.nelts; i++) {
+      if (ls[i].sockaddr->sa_family != sa->sa_family) {
+        continue;
+      }
+      if (ngx_cmp_sockaddr(ls[i].sockaddr, ls[i].socklen,
+                           const_cast<struct sockaddr*>(sa), address.socklen,
+                           1 /* cmp_port */) == NGX_OK) {
+        return true;
+      }
+      if (IsWildcard(ls[i].sockaddr) && IsLoopback(sa) &&
+          SockaddrPort(ls[i].sockaddr) == SockaddrPort(sa)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool NgxUrlAsyncFetcher::FindUnixSocket(
+      StringPiece host, NgxDnsCache::Address* address) const {
+    if (unix_sockets_.empty()) {
+      return false;
+    }
+    GoogleString key = host.as_string();
+    LowerString(&key);
+    std::map<GoogleString, NgxDnsCache::Address>::const_iterator iter =
+        unix_sockets_.find(key);
+    if (iter == unix_sockets_.end()) {
+      return false;
+    }
+    *address = iter->second;
+    return true;
+  }
+
+  void NgxUrlAsyncFetcher::AddHttp2PriorKnowledgeHost(StringPiece host) {
+    GoogleString key = host.as_string();
+    LowerString(&key);
+    http2_prior_knowledge_hosts_.insert(key);
+  }
+
+  bool NgxUrlAsyncFetcher::Http2PriorKnowledge(StringPiece host) const {
+    // We don't tunnel through proxies.
+    if (http2_prior_knowledge_hosts_.empty() || proxy_.url.len != 0) {
+      return false;
+    }
+    GoogleString key = host.as_string();
+    LowerString(&key);
+    return http2_prior_knowledge_hosts_.find(key) !=
+        http2_prior_knowledge_hosts_.end();
+  }
+
+  void NgxUrlAsyncFetcher::SetKnownHttp2Origin(const GoogleString& origin,
+                                               bool http2) {
+    if (!http2) {
+      http2_origins_.erase(origin);
+      return;
+    }
+    if (http2_origins_.size() >= kMaxHttp2Origins &&
+        http2_origins_.find(origin) == http2_origins_.end()) {
+      // Forgetting costs a fetch or two that connect by themselves.
+      http2_origins_.clear();
+    }
+    http2_origins_.insert(origin);
+  }
+
+  NgxHttp2Session* NgxUrlAsyncFetcher::FindHttp2Session(
+      const GoogleString& key) const {
+    std::map<GoogleString, NgxHttp2Session*>::const_iterator iter =
+        http2_sessions_.find(key);
+    if (iter == http2_sessions_.end() || !iter->second->Accepts()) {
+      return NULL;
+    }
+    return iter->second;
+  }
+
+  NgxHttp2Session* NgxUrlAsyncFetcher::StartHttp2Session(NgxConnection* nc) {
+    NgxHttp2Session* session = new NgxHttp2Session(
+        this, nc, max_keepalive_requests_,
+        connection_pool_->idle_timeout_ms());
+    if (!session->Start()) {
+      return NULL;
+    }
+    open_http2_sessions_.insert(session);
+    // An older session to the peer that a retry went around keeps serving its
+    // streams, but takes no new ones.
+    http2_sessions_[session->key()] = session;
+    http2_session_count_->Add(1);
+    return session;
+  }
+
+  void NgxUrlAsyncFetcher::ForgetHttp2Session(NgxHttp2Session* session) {
+    std::map<GoogleString, NgxHttp2Session*>::iterator iter =
+        http2_sessions_.find(session->key());
+    if (iter != http2_sessions_.end() && iter->second == session) {
+      http2_sessions_.erase(iter);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::Http2SessionClosed(NgxHttp2Session* session) {
+    ForgetHttp2Session(session);
+    open_http2_sessions_.erase(session);
+  }
+
+  void NgxUrlAsyncFetcher::CloseHttp2Sessions() {
+    // Closing a session takes it out of open_http2_sessions_.
+    std::vector<NgxHttp2Session*> sessions(open_http2_sessions_.begin(),
+                                           open_http2_sessions_.end());
+    for (size_t i = 0; i < sessions.size(); ++i) {
+      sessions[i]->Close();
+    }
+  }
+
+  void NgxUrlAsyncFetcher::RecordConnectionUse(NgxConnection* nc) {
+    if (min_idle_connections_per_origin_ <= 0 ||
+        max_keepalive_requests_ <= 1 || shutdown_) {
+      return;
+    }
+    HotPeerMap::iterator iter = hot_peers_.find(nc->origin_key());
+    if (iter == hot_peers_.end()) {
+      if (hot_peers_.size() >= kMaxHotPeers) {
+        return;
+      }
+      iter = hot_peers_.insert(
+          std::make_pair(nc->origin_key(), HotPeer())).first;
+      HotPeer* peer = &iter->second;
+      nc->GetAddress(&peer->address);
+      peer->name.data =
+          reinterpret_cast<u_char*>(const_cast<char*>(iter->first.data()));
+      peer->name.len = iter->first.size();
+      peer->recent_uses = 0;
+    }
+    iter->second.recent_uses++;
+    if (!prewarm_event_.timer_set) {
+      prewarm_event_.log = log_;
+      ngx_add_timer(&prewarm_event_, kPrewarmIntervalMs);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::PrewarmTimerHandler(ngx_event_t* ev) {
+    NgxUrlAsyncFetcher* fetcher = static_cast<NgxUrlAsyncFetcher*>(ev->data);
+    NgxConnectionPool* pool = fetcher->connection_pool_.get();
+    HotPeerMap::iterator iter = fetcher->hot_peers_.begin();
+    while (iter != fetcher->hot_peers_.end()) {
+      const GoogleString& key = iter->first;
+      HotPeer* peer = &iter->second;
+      if (peer->recent_uses >= kHotPeerUses) {
+        int missing =
+            fetcher->min_idle_connections_per_origin_ - pool->NumIdle(key);
+        for (int i = 0; i < missing; ++i) {
+          ngx_peer_connection_t pc;
+          ngx_memzero(&pc, sizeof(pc));
+          pc.sockaddr = reinterpret_cast<struct sockaddr*>(
+              peer->address.sockaddr);
+          pc.socklen = peer->address.socklen;
+          pc.name = &peer->name;
+          pc.get = ngx_event_get_peer;
+          pc.log_error = NGX_ERROR_ERR;
+          pc.log = fetcher->log_;
+          pc.rcvbuf = -1;
+          if (!pool->Prewarm(&pc, key, fetcher->message_handler_,
+                             fetcher->max_keepalive_requests_,
+                             fetcher->fetch_timeout_)) {
+            break;
+          }
+          fetcher->prewarmed_count_->Add(1);
+        }
+      }
+      peer->recent_uses -= peer->recent_uses / 4;
+      if (peer->recent_uses < kHotPeerUses / 2) {
+        // Cooled off.  Its idle connections time out as usual.
+        fetcher->hot_peers_.erase(iter++);
+      } else {
+        ++iter;
+      }
+    }
+    if (!fetcher->hot_peers_.empty()) {
+      ngx_add_timer(ev, kPrewarmIntervalMs);
+    }
+  }
+
+  ngx_pool_t* NgxUrlAsyncFetcher::AcquireFetchPool() {
+    if (free_fetch_pools_.empty()) {
+      return ngx_create_pool(kFetchPoolSize, log_);
+    }
+    ngx_pool_t* pool = free_fetch_pools_.back();
+    free_fetch_pools_.pop_back();
+    return pool;
+  }
+
+  void NgxUrlAsyncFetcher::ReleaseFetchPool(ngx_pool_t* pool) {
+    // Fetches don't register cleanup handlers, which resetting wouldn't run.
+    // Resetting does free the large allocations, so a fetch with huge request
+    // headers doesn't leave its pool bloated.
+    if (shutdown_ || free_fetch_pools_.size() >= kMaxFreeFetchPools) {
+      ngx_destroy_pool(pool);
+      return;
+    }
+    ngx_reset_pool(pool);
+    free_fetch_pools_.push_back(pool);
+  }
+
+  int NgxUrlAsyncFetcher::PreferredFamily(const GoogleString& origin) const {
+    std::map<GoogleString, int>::const_iterator iter =
+        preferred_families_.find(origin);
+    if (iter != preferred_families_.end()) {
+      return iter->second;
+    }
+#if (NGX_HAVE_INET6)
+    return AF_INET6;
+#else
+    return AF_INET;
+#endif
+  }
+
+  void NgxUrlAsyncFetcher::SetPreferredFamily(const GoogleString& origin,
+                                              int family) {
+    if (preferred_families_.size() >= kMaxPreferredFamilies &&
+        preferred_families_.find(origin) == preferred_families_.end()) {
+      preferred_families_.clear();
+    }
+    preferred_families_[origin] = family;
+  }
+
+  bool NgxUrlAsyncFetcher::SupportsHttps() const {
+#if (NGX_SSL)
+    // We don't tunnel through proxies with CONNECT.
+    return (https_options_ & kEnableHttps) != 0 && proxy_.url.len == 0;
+#else
+    return false;
+#endif
+  }
+
+  bool NgxUrlAsyncFetcher::SetHttpsOptions(StringPiece options) {
+    uint32 bits = 0;
+    StringPieceVector values;
+    SplitStringPieceToVector(options, ",", &values, true /* omit empty */);
+    for (int i = 0, n = values.size(); i < n; ++i) {
+      StringPiece value = values[i];
+      TrimWhitespace(&value);
+      if (value == "enable") {
+        bits |= kEnableHttps;
+      } else if (value == "disable") {
+        bits &= ~kEnableHttps;
+      } else if (value == "allow_self_signed") {
+        bits |= kAllowSelfSigned;
+      } else if (value == "allow_unknown_certificate_authority") {
+        bits |= kAllowUnknownCertificateAuthority;
+      } else if (value == "allow_certificate_not_yet_valid") {
+        bits |= kAllowCertificateNotYetValid;
+      } else {
+        message_handler_->Message(kError, "Invalid HTTPS option: %s",
+                                  value.as_string().c_str());
+        return false;
+      }
+    }
+    https_options_ = bits;
+    return true;
+  }
+
+#if (NGX_SSL)
+  ngx_ssl_t* NgxUrlAsyncFetcher::GetSsl() {
+    if (ssl_ != NULL || ssl_init_failed_) {
+      return ssl_;
+    }
+    // Don't try again on every fetch when this fails.
+    ssl_init_failed_ = true;
+
+    ngx_ssl_t* ssl = static_cast<ngx_ssl_t*>(
+        ngx_pcalloc(pool_, sizeof(ngx_ssl_t)));
+    if (ssl == NULL) {
+      return NULL;
+    }
+    ssl->log = log_;
+    ngx_uint_t protocols = NGX_SSL_TLSv1 | NGX_SSL_TLSv1_1 | NGX_SSL_TLSv1_2;
+#ifdef NGX_SSL_TLSv1_3
+    protocols |= NGX_SSL_TLSv1_3;
+#endif
+    if (ngx_ssl_create(ssl, protocols, NULL) != NGX_OK) {
+      message_handler_->Message(
+          kError, "NgxUrlAsyncFetcher: creating the ssl context failed, "
+          "https fetching disabled.");
+      return NULL;
+    }
+
+    SSL_CTX_set_verify(ssl->ctx, SSL_VERIFY_PEER, SslVerifyCallback);
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    if (http2_) {
+      // The server picks, see NgxFetch::SpeaksHttp2().
+      static const unsigned char kAlpnProtocols[] = "\x02h2\x08http/1.1";
+      if (SSL_CTX_set_alpn_protos(ssl->ctx, kAlpnProtocols,
+                                  sizeof(kAlpnProtocols) - 1) != 0) {
+        message_handler_->Message(
+            kWarning, "NgxUrlAsyncFetcher: failed to offer HTTP/2 over "
+            "ALPN, fetching https over HTTP/1.");
+      }
+      // HTTP/2 sessions add frames to a buffer that has a write pending.
+      SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+#endif
+    int loaded;
+    if (ssl_certificates_dir_.empty() && ssl_certificates_file_.empty()) {
+      loaded = SSL_CTX_set_default_verify_paths(ssl->ctx);
+    } else {
+      loaded = SSL_CTX_load_verify_locations(
+          ssl->ctx,
+          ssl_certificates_file_.empty() ?
+              NULL : ssl_certificates_file_.c_str(),
+          ssl_certificates_dir_.empty() ?
+              NULL : ssl_certificates_dir_.c_str());
+    }
+    if (loaded != 1) {
+      message_handler_->Message(
+          kError, "NgxUrlAsyncFetcher: failed to load CA certificates from "
+          "[%s] [%s], https fetching disabled.",
+          ssl_certificates_file_.c_str(), ssl_certificates_dir_.c_str());
+      SSL_CTX_free(ssl->ctx);
+      return NULL;
+    }
+
+    ssl_init_failed_ = false;
+    ssl_ = ssl;
+    return ssl_;
+  }
+
+  bool NgxUrlAsyncFetcher::SslVerifyResultOk(long result) const {  // NOLINT
+    switch (result) {
+      case X509_V_OK:
+        return true;
+      case X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT:
+      case X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN:
+        return (https_options_ & kAllowSelfSigned) != 0;
+      case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+      case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+      case X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE:
+        return (https_options_ & kAllowUnknownCertificateAuthority) != 0;
+      case X509_V_ERR_CERT_NOT_YET_VALID:
+        return (https_options_ & kAllowCertificateNotYetValid) != 0;
+      default:
+        return false;
+    }
+  }
+
+  ngx_ssl_session_t* NgxUrlAsyncFetcher::GetSslSession(
+      const GoogleString& origin) const {
+    SslSessionMap::const_iterator iter = ssl_sessions_.find(origin);
+    return iter == ssl_sessions_.end() ? NULL : iter->second;
+  }
+
+  void NgxUrlAsyncFetcher::SaveSslSession(const GoogleString& origin,
+                                          ngx_connection_t* c) {
+    ngx_ssl_session_t* session = ngx_ssl_get_session(c);
+    if (session == NULL) {
+      return;
+    }
+    ngx_ssl_session_t*& saved = ssl_sessions_[origin];
+    if (saved != NULL) {
+      ngx_ssl_free_session(saved);
+    }
+    saved = session;
+  }
+#endif
+
   void NgxUrlAsyncFetcher::PrintActiveFetches(MessageHandler* handler) const {
     for (NgxFetchPool::const_iterator p = active_fetches_.begin(),
         e = active_fetches_.end(); p != e; ++p) {
@@ -299,4 +1483,149 @@ namespace net_instaweb {
       handler->Message(kInfo, "Active fetch: %s", fetch->str_url());
     }
   }
+
+  void NgxUrlAsyncFetcher::CancelOrphanedFetches(NgxRequestContext* request) {
+    if (!cancel_orphaned_fetches_) {
+      return;
+    }
+    std::vector<NgxFetch*> orphans;
+    {
+      ScopedMutex lock(mutex_);
+      for (NgxFetchPool::iterator p = active_fetches_.begin(),
+           e = active_fetches_.end(); p != e; ++p) {
+        if ((*p)->waiting_request() == request && !(*p)->has_followers()) {
+          orphans.push_back(*p);
+        }
+      }
+    }
+    // CallbackDone() removes the fetch from active_fetches_.
+    for (size_t i = 0; i < orphans.size(); ++i) {
+      orphaned_count_->Add(1);
+      orphans[i]->set_cancelled();
+      orphans[i]->CallbackDone(false);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::WriteFetches(Writer* writer,
+                                        MessageHandler* handler) {
+    int64 now_ms = timer_->NowMs();
+    std::vector<GoogleString> rows;
+    {
+      ScopedMutex lock(mutex_);
+      for (NgxFetchPool::iterator p = active_fetches_.begin(),
+           e = active_fetches_.end(); p != e; ++p) {
+        rows.push_back(FetchRow(*p, FetchState(*p), now_ms));
+      }
+      for (NgxFetchPool::iterator p = pending_fetches_.begin(),
+           e = pending_fetches_.end(); p != e; ++p) {
+        rows.push_back(FetchRow(*p, "pending", now_ms));
+      }
+    }
+    for (OriginQueueMap::const_iterator p = origin_queues_.begin(),
+         e = origin_queues_.end(); p != e; ++p) {
+      for (int i = 0; i < kNumPriorities; ++i) {
+        const std::deque<NgxFetch*>& waiting = p->second.waiting[i];
+        for (size_t j = 0; j < waiting.size(); ++j) {
+          rows.push_back(FetchRow(waiting[j], "queued", now_ms));
+        }
+      }
+    }
+    writer->Write(StrCat("<p>", IntegerToString(rows.size()),
+                         " native fetches in flight or queued</p>\n"
+                         "<table>\n<tr><th>State</th><th>Origin</th>"
+                         "<th>Url</th><th>Age ms</th><th>Bytes received</th>"
+                         "</tr>\n"),
+                  handler);
+    for (size_t i = 0; i < rows.size(); ++i) {
+      writer->Write(rows[i], handler);
+    }
+    writer->Write("</table>\n", handler);
+  }
+
+  void NgxUrlAsyncFetcher::WriteOriginStatus(Writer* writer,
+                                             MessageHandler* handler) const {
+    writer->Write("<table>\n<tr><th>Origin</th><th>In flight</th>"
+                  "<th>Queued</th></tr>\n", handler);
+    for (OriginQueueMap::const_iterator p = origin_queues_.begin(),
+         e = origin_queues_.end(); p != e; ++p) {
+      GoogleString escaped;
+      HtmlKeywords::Escape(p->first, &escaped);
+      writer->Write(StrCat("<tr><td>", escaped, "</td><td>",
+                           IntegerToString(p->second.active), "</td><td>",
+                           IntegerToString(
+                               static_cast<int>(p->second.num_waiting())),
+                           "</td></tr>\n"),
+                    handler);
+    }
+    writer->Write("</table>\n", handler);
+
+    if (!origin_stats_.empty()) {
+      GoogleString header = "<table>\n<tr><th>Origin</th><th>Fetches</th>"
+          "<th>Failed</th><th>Timed out</th><th>Keepalive reuse</th>"
+          "<th>Avg dns ms</th><th>Avg connect ms</th>"
+          "<th>Avg first byte ms</th><th>Avg total ms</th>"
+          "<th>Avg bytes</th><th>2xx</th><th>3xx</th><th>4xx</th>"
+          "<th>5xx</th>";
+      for (int i = 0; i < kNumLatencyBuckets - 1; ++i) {
+        StrAppend(&header, "<th>&lt;", Integer64ToString(kLatencyBucketsMs[i]),
+                  " ms</th>");
+      }
+      StrAppend(&header, "<th>&ge;",
+                Integer64ToString(kLatencyBucketsMs[kNumLatencyBuckets - 2]),
+                " ms</th></tr>\n");
+      writer->Write(header, handler);
+      for (OriginStatsMap::const_iterator p = origin_stats_.begin(),
+           e = origin_stats_.end(); p != e; ++p) {
+        const OriginStats& stats = p->second;
+        GoogleString escaped;
+        HtmlKeywords::Escape(p->first, &escaped);
+        GoogleString row = StrCat(
+            "<tr><td>", escaped, "</td><td>",
+            Integer64ToString(stats.fetches), "</td><td>",
+            Integer64ToString(stats.failures), "</td><td>",
+            Integer64ToString(stats.timeouts), "</td><td>");
+        StrAppend(&row, Integer64ToString(
+            100 * stats.reused_connections / stats.fetches), "%</td>");
+        for (int i = 0; i < kNumPhases; ++i) {
+          int64 count = stats.phase_count[i];
+          StrAppend(&row, "<td>", count == 0 ? "-" : Integer64ToString(
+              stats.phase_ms[i] / count), "</td>");
+        }
+        StrAppend(&row, "<td>",
+                  Integer64ToString(stats.bytes / stats.fetches), "</td>");
+        for (int i = 0; i < kNumStatusClasses; ++i) {
+          StrAppend(&row, "<td>", Integer64ToString(stats.status_classes[i]),
+                    "</td>");
+        }
+        for (int i = 0; i < kNumLatencyBuckets; ++i) {
+          StrAppend(&row, "<td>", Integer64ToString(stats.latency_buckets[i]),
+                    "</td>");
+        }
+        writer->Write(StrCat(row, "</tr>\n"), handler);
+      }
+      writer->Write("</table>\n", handler);
+    }
+
+    if (origin_health_.empty()) {
+      return;
+    }
+    writer->Write("<table>\n<tr><th>Origin</th><th>Circuit breaker</th>"
+                  "<th>Failures</th></tr>\n", handler);
+    for (OriginHealthMap::const_iterator p = origin_health_.begin(),
+         e = origin_health_.end(); p != e; ++p) {
+      const char* state = "closed";
+      if (p->second.state == kCircuitOpen) {
+        state = "open";
+      } else if (p->second.state == kCircuitHalfOpen) {
+        state = "half-open";
+      }
+      GoogleString escaped;
+      HtmlKeywords::Escape(p->first, &escaped);
+      writer->Write(StrCat("<tr><td>", escaped, "</td><td>", state,
+                           "</td><td>", IntegerToString(p->second.failures),
+                           "</td></tr>\n"),
+                    handler);
+    }
+    writer->Write("</table>\n", handler);
+  }
 }  // namespace net_instaweb
@@ -33,15 +33,21 @@
 extern "C" {
   #include <ngx_config.h>
   #include <ngx_core.h>
+  #include <ngx_http.h>
 }
 
+#include <deque>
+#include <map>
+#include <set>
 #include <vector>
 
+#include "ngx_dns_cache.h"
 #include "ngx_event_connection.h"
 
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/pool.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/thread_system.h"
 
@@ -49,21 +55,45 @@ extern "C" {
 namespace net_instaweb {
 
 class AsyncFetch;
+class Histogram;
 class MessageHandler;
 class Statistics;
+class NgxConnection;
+class NgxConnectionPool;
+class NgxDnsCache;
 class NgxFetch;
+class NgxHttp2Session;
+class NgxRequestContext;
+class NgxSharedInflight;
+class Timer;
+class UpDownCounter;
 class Variable;
+class Writer;
 
 class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
  public:
+  // When fetches have to wait for their origin, higher priority ones are
+  // started first.
+  enum FetchPriority {
+    // Needed to render a page, like css and javascript.
+    kCriticalPriority,
+    kNormalPriority,
+    // Nobody waits for these, e.g. cache freshening.  They are held back to
+    // leave room for the others, see ScheduleFetch().
+    kBackgroundPriority,
+    kNumPriorities,
+  };
+
   NgxUrlAsyncFetcher(
       const char* proxy, ngx_log_t* log, ngx_msec_t resolver_timeout,
       ngx_msec_t fetch_timeout, ngx_resolver_t* resolver,
       int max_keepalive_requests, ThreadSystem* thread_system,
-      MessageHandler* handler);
+      Statistics* statistics, Timer* timer, MessageHandler* handler);
 
   ~NgxUrlAsyncFetcher();
 
+  static void InitStats(Statistics* statistics);
+
   // It should be called in the module init_process callback function. Do some
   // intializations which can't be done in the master process
   bool Init(ngx_cycle_t* cycle);
@@ -74,7 +104,9 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   // the read handler in the main thread
   static void ReadCallback(const ps_event_data& data);
 
-  virtual bool SupportsHttps() const { return false; }
+  // Https is only available when nginx is built with ssl, it is enabled with
+  // FetchHttps, and no fetcher proxy is configured.
+  virtual bool SupportsHttps() const;
 
   virtual void Fetch(const GoogleString& url,
                      MessageHandler* message_handler,
@@ -82,11 +114,40 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
 
   bool StartFetch(NgxFetch* fetch);
 
+  // Starts the fetch right away when its origin has less than
+  // max_fetches_per_origin fetches in flight, or else appends it to the
+  // origin's queue for its priority.  As earlier fetches to the same origin
+  // complete, queued fetches are started highest priority first, and in
+  // arrival order within a priority.  Background fetches only get up to 3/4
+  // of the slots of an origin, so they can't hold up the others.
+  void ScheduleFetch(NgxFetch* fetch);
+
   // Remove the completed fetch from the active fetch set, and put it into a
   // completed fetch list to be cleaned up.
-  void FetchComplete(NgxFetch* fetch);
+  void FetchComplete(NgxFetch* fetch, bool success);
+  // Like FetchComplete(), for a fetch that got its response from another,
+  // see CoalesceFetch().
+  void FollowerComplete(NgxFetch* fetch);
   void PrintActiveFetches(MessageHandler* handler) const;
 
+  // Fails the fetches a client is waiting for in request, which has gone
+  // away, unless other fetches wait for them too.  Those in flight are
+  // cancelled right away, queued ones when it is their turn.  Must be called
+  // on the nginx thread.
+  void CancelOrphanedFetches(NgxRequestContext* request);
+
+  // Writes an html table with the number of in-flight and queued fetches per
+  // origin, one with the latency, size and outcome of the fetches to each
+  // origin, and one with the origins whose circuit breaker tripped.  Must be
+  // called on the nginx thread.
+  void WriteOriginStatus(Writer* writer, MessageHandler* handler) const;
+
+  // Writes an html table of the fetches that are in flight, waiting in their
+  // origin's queue, or not yet picked up by the nginx thread: their state,
+  // origin, age and the bytes received so far.  Must be called on the nginx
+  // thread.
+  void WriteFetches(Writer* writer, MessageHandler* handler);
+
   // Indicates that it should track the original content length for
   // fetched resources.
   bool track_original_content_length() {
@@ -118,11 +179,266 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   bool shutdown() const { return shutdown_; }
   void set_shutdown(bool s) { shutdown_ = s; }
 
+  // Limits the number of idle keepalive connections kept around per origin.
+  void set_max_idle_connections_per_origin(int x);
+  // How long an idle keepalive connection is kept before closing it.
+  void set_idle_connection_timeout_ms(ngx_msec_t x);
+  // Limits the number of concurrent fetches per origin, 0 means no limit.
+  void set_max_fetches_per_origin(int x) { max_fetches_per_origin_ = x; }
+  // Stops fetching from an origin for open_ms once failures fetches in a row
+  // failed or were slow, see AdmitFetch().  0 failures disables this.
+  void set_circuit_breaker(int failures, int open_ms) {
+    circuit_breaker_failures_ = failures;
+    circuit_breaker_open_ms_ = open_ms;
+  }
+  // How large the buffer responses are read into may grow.
+  void set_max_receive_buffer_size(int x) { max_receive_buffer_size_ = x; }
+  // Fetches a client waits for have to be done within deadline_ms of when
+  // nginx got the client's request, if that is sooner than the fetch timeout.
+  // 0 disables this.
+  void set_request_deadline_ms(int64 x) { request_deadline_ms_ = x; }
+  // Records the event handoff latency of one in x events, 0 records none.
+  void set_handoff_latency_sample_rate(int x);
+  // Keeps at least x idle connections open to each of the origins this worker
+  // fetched from a lot lately, so fetches to them don't wait for a connect
+  // after a quiet spell.  0 disables this.
+  void set_min_idle_connections_per_origin(int x) {
+    min_idle_connections_per_origin_ = x;
+  }
+  // Whether fetches are cancelled once the client waiting for them is gone.
+  void set_cancel_orphaned_fetches(bool x) { cancel_orphaned_fetches_ = x; }
+  // Fetches whose response turns out to be larger than x bytes are given up
+  // on right away, as they couldn't be cached anyway.  Negative disables this.
+  void set_max_response_bytes(int64 x) { max_response_bytes_ = x; }
+  // Coalesces fetches with those of other workers through shared, see
+  // NgxSharedInflight.  A fetch waits up to wait_ms for another worker that
+  // fetches the same, and responses are kept there for wait_ms after.
+  void set_shared_inflight(NgxSharedInflight* shared, int64 wait_ms) {
+    shared_inflight_ = shared;
+    shared_inflight_wait_ms_ = wait_ms;
+  }
+
+  // Sends fetches for host to the servers of the upstream{} block named
+  // upstream_name, picking them with its round robin state.  Returns false
+  // when there is no such block.
+  bool AddUpstream(StringPiece host, StringPiece upstream_name);
+  // Sends fetches for host to the unix domain socket at path, with or
+  // without a "unix:" prefix.  Returns false when path can't be used.
+  bool AddUnixSocket(StringPiece host, StringPiece path);
+  // Sends plain http fetches that this nginx would serve itself, e.g. the
+  // ones the loopback route fetcher points at the address a request came in
+  // on, to the unix domain socket at path instead.  That saves a tcp round
+  // trip over loopback per fetch.  nginx has to listen on path, in every
+  // server{} block that serves resources.  Returns false when it doesn't.
+  bool SetLoopbackUnixSocket(StringPiece path);
+
+  // Offers HTTP/2 to https origins over ALPN.  Fetches to an origin that
+  // takes it share a connection per address, see NgxHttp2Session.
+  void set_http2(bool x) { http2_ = x; }
+  // Talks HTTP/2 to host over plain http without asking first (h2c with
+  // prior knowledge).  Not through a fetcher proxy.
+  void AddHttp2PriorKnowledgeHost(StringPiece host);
+
+  // Takes the value of FetchHttps, e.g. "enable,allow_self_signed".  Returns
+  // false on an invalid value, leaving the options unchanged.
+  bool SetHttpsOptions(StringPiece options);
+  // Where the CA certificates to verify origins against are read from.  When
+  // neither is set, the OpenSSL default locations are used.
+  void set_ssl_certificates_dir(const GoogleString& x) {
+    ssl_certificates_dir_ = x;
+  }
+  void set_ssl_certificates_file(const GoogleString& x) {
+    ssl_certificates_file_ = x;
+  }
 
  private:
   static void TimeoutHandler(ngx_event_t* tev);
   static bool ParseUrl(ngx_url_t* url, ngx_pool_t* pool);
   friend class NgxFetch;
+  friend class NgxHttp2Session;
+
+  // Fetches in flight and waiting for a slot, for a single origin.
+  struct OriginQueue {
+    OriginQueue() : active(0), active_background(0) {}
+    size_t num_waiting() const {
+      size_t n = 0;
+      for (int i = 0; i < kNumPriorities; ++i) {
+        n += waiting[i].size();
+      }
+      return n;
+    }
+    int active;
+    // How many of active are background fetches.
+    int active_background;
+    std::deque<NgxFetch*> waiting[kNumPriorities];
+  };
+  typedef std::map<GoogleString, OriginQueue> OriginQueueMap;
+
+  // The circuit breaker of an origin.  It opens after a number of failed or
+  // slow fetches in a row, and fails all fetches to the origin while open.
+  // After a while it goes half-open and lets a single probe fetch through,
+  // which either closes it again or re-opens it.
+  enum CircuitState {
+    kCircuitClosed,
+    kCircuitOpen,
+    kCircuitHalfOpen,
+  };
+  struct OriginHealth {
+    OriginHealth()
+        : state(kCircuitClosed), failures(0), opened_ms(0),
+          probe_in_flight(false) {}
+    CircuitState state;
+    // Consecutive failures while closed.
+    int failures;
+    int64 opened_ms;
+    bool probe_in_flight;
+  };
+  typedef std::map<GoogleString, OriginHealth> OriginHealthMap;
+
+  // The phases of a fetch we time, all measured from when it was started:
+  // until the address to connect to was known, until connected, until the
+  // first response byte, and until done.
+  enum FetchPhase {
+    kDnsPhase,
+    kConnectPhase,
+    kFirstBytePhase,
+    kTotalPhase,
+    kNumPhases,
+  };
+  static const int kNumLatencyBuckets = 6;
+  // Responses with status 2xx to 5xx.
+  static const int kNumStatusClasses = 4;
+
+  // What the fetches to an origin took and got, in this worker.
+  struct OriginStats {
+    OriginStats();
+    int64 fetches;
+    int64 failures;
+    int64 timeouts;
+    int64 reused_connections;
+    int64 bytes;
+    int64 status_classes[kNumStatusClasses];
+    // Fetches that got to a phase, and the total time they took to get there.
+    int64 phase_count[kNumPhases];
+    int64 phase_ms[kNumPhases];
+    // The distribution of total fetch times, see kLatencyBucketsMs.
+    int64 latency_buckets[kNumLatencyBuckets];
+  };
+  typedef std::map<GoogleString, OriginStats> OriginStatsMap;
+
+  // Whether fetch may go to its origin, given the state of its breaker.
+  bool AdmitFetch(NgxFetch* fetch);
+  // Updates the breaker of the origin of a completed fetch.
+  void UpdateOriginHealth(NgxFetch* fetch, bool success);
+  void SetCircuitState(const GoogleString& origin, OriginHealth* health,
+                       CircuitState state);
+  // Fails a fetch that was never started.
+  void RejectFetch(NgxFetch* fetch);
+  // Forgets fetch as the one identical fetches can attach to.
+  void ForgetInflight(NgxFetch* fetch);
+
+  // Attaches fetch to an in-flight fetch with the same coalesce_key(), and
+  // returns true, or else records it as the one later fetches can attach to.
+  // Only deduplicates within this worker.
+  bool CoalesceFetch(NgxFetch* fetch);
+
+  // Whether queue has room for another fetch of the given priority.
+  bool HasOriginSlot(const OriginQueue& queue, FetchPriority priority) const;
+  void TakeOriginSlot(OriginQueue* queue, NgxFetch* fetch);
+  // Remembers the body sizes of responses that can be revalidated, and
+  // counts the bytes later 304 responses to them saved.
+  void UpdateRevalidationStats(NgxFetch* fetch);
+  // Adds the timings, size and outcome of a completed fetch to the shared
+  // statistics and to those of its origin.
+  void UpdateFetchStats(NgxFetch* fetch, bool success);
+
+  // Gives back the slot held by a completed fetch, and starts as many of the
+  // fetches queued for its origin as the limit permits.
+  void ReleaseOriginSlot(NgxFetch* fetch);
+
+  // The upstream{} block fetches for host go to, or NULL.
+  ngx_http_upstream_srv_conf_t* FindUpstream(StringPiece host) const;
+  // Fills address with the unix domain socket fetches for host go to, if any.
+  bool FindUnixSocket(StringPiece host, NgxDnsCache::Address* address) const;
+  // Whether nginx listens on address, which includes a port.  Addresses that
+  // only match a wildcard listen must be loopback addresses, as we can't tell
+  // whether other ones are local.
+  bool IsOwnAddress(const NgxDnsCache::Address& address) const;
+  // Fills address with the socket set by SetLoopbackUnixSocket(), if any.
+  bool LoopbackUnixSocket(NgxDnsCache::Address* address) const {
+    if (use_loopback_unix_socket_) {
+      *address = loopback_unix_socket_;
+    }
+    return use_loopback_unix_socket_;
+  }
+
+  // A peer this worker connected to lately, by connection pool key.
+  struct HotPeer {
+    NgxDnsCache::Address address;
+    // Points into the key of the peer in hot_peers_.
+    ngx_str_t name;
+    // Decays over time, see PrewarmTimerHandler().
+    int64 recent_uses;
+  };
+  typedef std::map<GoogleString, HotPeer> HotPeerMap;
+
+  // Counts a fetch using nc, for learning which peers are hot.
+  void RecordConnectionUse(NgxConnection* nc);
+  // Opens connections to hot peers that have less than
+  // min_idle_connections_per_origin_ idle ones, and decays their use counts.
+  static void PrewarmTimerHandler(ngx_event_t* ev);
+
+  // Whether fetches for host go out over HTTP/2 with prior knowledge.
+  bool Http2PriorKnowledge(StringPiece host) const;
+  // Whether the https origin picked HTTP/2 the last time we connected to it.
+  bool KnownHttp2Origin(const GoogleString& origin) const {
+    return http2_origins_.find(origin) != http2_origins_.end();
+  }
+  void SetKnownHttp2Origin(const GoogleString& origin, bool http2);
+  // An HTTP/2 session to the peer with connection pool key key that takes
+  // another stream, or NULL.
+  NgxHttp2Session* FindHttp2Session(const GoogleString& key) const;
+  // Starts an HTTP/2 session over nc, and makes it the one FindHttp2Session()
+  // returns for its peer.  Returns NULL when that failed right away, nc is
+  // closed then.
+  NgxHttp2Session* StartHttp2Session(NgxConnection* nc);
+  // Stops handing out session for new fetches.
+  void ForgetHttp2Session(NgxHttp2Session* session);
+  // Called by a session that closed.
+  void Http2SessionClosed(NgxHttp2Session* session);
+  // Closes all HTTP/2 sessions, on shutdown.
+  void CloseHttp2Sessions();
+
+  // A memory pool for a fetch, recycled from an earlier fetch when possible so
+  // that setting up a fetch usually doesn't have to allocate.
+  ngx_pool_t* AcquireFetchPool();
+  // Takes back the pool of a fetch that is done with it.
+  void ReleaseFetchPool(ngx_pool_t* pool);
+
+  // The address family to try first when connecting to origin: the one the
+  // last connection to it was made over, or else IPv6 when available.
+  int PreferredFamily(const GoogleString& origin) const;
+  void SetPreferredFamily(const GoogleString& origin, int family);
+
+  enum HttpsOption {
+    kEnableHttps = 1 << 0,
+    kAllowSelfSigned = 1 << 1,
+    kAllowUnknownCertificateAuthority = 1 << 2,
+    kAllowCertificateNotYetValid = 1 << 3,
+  };
+
+#if (NGX_SSL)
+  // Returns the client ssl context, creating it on first use, or NULL when it
+  // can't be set up.  Only used on the nginx thread, like the methods below.
+  ngx_ssl_t* GetSsl();
+  // Whether a certificate verification result is acceptable given the https
+  // options.
+  bool SslVerifyResultOk(long result) const;  // NOLINT
+  // The session to resume for origin, or NULL.
+  ngx_ssl_session_t* GetSslSession(const GoogleString& origin) const;
+  // Remembers the session of c for resumption by later connections to origin.
+  void SaveSslSession(const GoogleString& origin, ngx_connection_t* c);
+#endif
 
   NgxFetchPool active_fetches_;
   // Add the pending task to this list
@@ -144,10 +460,104 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   ngx_log_t* log_;
   ngx_resolver_t* resolver_;
   int max_keepalive_requests_;
+  int max_fetches_per_origin_;
+  int circuit_breaker_failures_;
+  int64 circuit_breaker_open_ms_;
+  int64 request_deadline_ms_;
+  int min_idle_connections_per_origin_;
+  bool cancel_orphaned_fetches_;
+  int64 max_response_bytes_;
+  size_t max_receive_buffer_size_;
   ngx_msec_t resolver_timeout_;
   ngx_msec_t fetch_timeout_;
 
+  Statistics* statistics_;
   NgxEventConnection* event_connection_;
+  // Idle keepalive connections of this worker.  Only used on the nginx thread.
+  scoped_ptr<NgxConnectionPool> connection_pool_;
+  // Addresses of the hosts we fetch from.  Only used on the nginx thread.
+  scoped_ptr<NgxDnsCache> dns_cache_;
+  // Only used on the nginx thread.
+  OriginQueueMap origin_queues_;
+  // Only used on the nginx thread.
+  std::map<GoogleString, int> preferred_families_;
+  // Origins that failed lately.  Only used on the nginx thread.
+  OriginHealthMap origin_health_;
+  // Only used on the nginx thread.
+  OriginStatsMap origin_stats_;
+  // Only used on the nginx thread, like prewarm_event_.
+  HotPeerMap hot_peers_;
+  ngx_event_t prewarm_event_;
+  // The body sizes of responses with an ETag or Last-Modified header, by
+  // url.  Only used on the nginx thread.
+  std::map<GoogleString, int64> body_sizes_;
+  // The urls in body_sizes_, in the order they were added.
+  std::deque<GoogleString> body_size_order_;
+  // The fetches others can attach to, by coalesce key.  Only used on the
+  // nginx thread.
+  std::map<GoogleString, NgxFetch*> inflight_;
+  // NULL unless fetches are coalesced across workers.
+  NgxSharedInflight* shared_inflight_;
+  int64 shared_inflight_wait_ms_;
+  // Set while ReleaseOriginSlot() starts queued fetches, which may complete
+  // synchronously and re-enter it.
+  bool dispatching_;
+  // Pools of finished fetches, ready for reuse.  Only used on the nginx
+  // thread.
+  std::vector<ngx_pool_t*> free_fetch_pools_;
+
+  std::map<GoogleString, ngx_http_upstream_srv_conf_t*> upstreams_;
+  std::map<GoogleString, NgxDnsCache::Address> unix_sockets_;
+  bool use_loopback_unix_socket_;
+  NgxDnsCache::Address loopback_unix_socket_;
+  bool http2_;
+  // Only used on the nginx thread, like the members below.
+  std::set<GoogleString> http2_prior_knowledge_hosts_;
+  // The https origins that picked HTTP/2 over ALPN.
+  std::set<GoogleString> http2_origins_;
+  // The sessions new fetches can go out on, by connection pool key.
+  std::map<GoogleString, NgxHttp2Session*> http2_sessions_;
+  // All sessions that are open, including those that no longer take fetches.
+  std::set<NgxHttp2Session*> open_http2_sessions_;
+  // Fetches waiting for another fetch to connect to their origin, so that
+  // they can share its HTTP/2 session, see NgxFetch::Connect().  By origin.
+  std::map<GoogleString, std::vector<NgxFetch*> > http2_waiters_;
+  uint32 https_options_;
+  GoogleString ssl_certificates_dir_;
+  GoogleString ssl_certificates_file_;
+#if (NGX_SSL)
+  typedef std::map<GoogleString, ngx_ssl_session_t*> SslSessionMap;
+  ngx_ssl_t* ssl_;
+  bool ssl_init_failed_;
+  SslSessionMap ssl_sessions_;
+#endif
+
+  Timer* timer_;
+  Variable* request_count_;
+  Variable* byte_count_variable_;
+  Variable* time_duration_ms_;
+  Variable* queue_time_ms_;
+  Variable* failure_count_;
+  UpDownCounter* queued_fetches_;
+  Variable* coalesced_count_;
+  Variable* shared_coalesced_count_;
+  Variable* not_modified_count_;
+  Variable* not_modified_bytes_saved_;
+  Variable* circuit_opened_count_;
+  Variable* circuit_rejected_count_;
+  UpDownCounter* circuit_open_origins_;
+  Histogram* phase_histograms_[kNumPhases];
+  Histogram* response_bytes_histogram_;
+  Variable* timeout_count_;
+  Variable* orphaned_count_;
+  Variable* prewarmed_count_;
+  Variable* prewarmed_used_count_;
+  Variable* keepalive_reused_count_;
+  Variable* stale_retry_count_;
+  Variable* oversized_count_;
+  Variable* http2_session_count_;
+  Variable* http2_stream_count_;
+  Variable* status_class_counts_[kNumStatusClasses];
 
   DISALLOW_COPY_AND_ASSIGN(NgxUrlAsyncFetcher);
 };
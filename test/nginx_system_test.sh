@@ -221,6 +221,7 @@ cat $PAGESPEED_CONF_TEMPLATE \
   | sed 's#@@IPRO_CACHE@@#'"$IPRO_CACHE/"'#' \
   | sed 's#@@SHM_CACHE@@#'"$SHM_CACHE/"'#' \
   | sed 's#@@SERVER_ROOT@@#'"$SERVER_ROOT"'#' \
+  | sed 's#@@TEST_TMP@@#'"$TEST_TMP"'#' \
   | sed 's#@@PRIMARY_PORT@@#'"$PRIMARY_PORT"'#' \
   | sed 's#@@SECONDARY_PORT@@#'"$SECONDARY_PORT"'#' \
   | sed 's#@@CONTROLLER@@#'"$CONTROLLER"'#' \
@@ -602,11 +603,477 @@ start_test statistics handler properly sets JSON content-type
 OUT=$($WGET_DUMP $STATISTICS_URL?json)
 check_from "$OUT" grep "Content-Type: application/javascript"
 
+start_test native fetcher admin page
+OUT=$($WGET_DUMP $PRIMARY_SERVER/pagespeed_admin/native_fetcher)
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  check_from "$OUT" fgrep -q "<th>Queued</th>"
+else
+  check_from "$OUT" fgrep -q "The native fetcher is not in use."
+fi
+
+start_test in-flight admin page
+OUT=$($WGET_DUMP $PRIMARY_SERVER/pagespeed_admin/inflight)
+check_from "$OUT" fgrep -q "<h3>Worker process"
+check_from "$OUT" fgrep -q "base fetches in flight"
+
 start_test scrape stats works
 
 # This needs to be before reload, when we clear the stats.
 check test $(scrape_stat image_rewrite_total_original_bytes) -ge 10000
 
+start_test OpenMetrics statistics
+OUT=$($WGET_DUMP $PRIMARY_SERVER/ngx_pagespeed_global_metrics)
+check_from "$OUT" fgrep -q \
+  "Content-Type: application/openmetrics-text; version=1.0.0"
+check_from "$OUT" fgrep -q \
+  "# TYPE pagespeed_image_rewrite_total_original_bytes counter"
+check_from "$OUT" fgrep -q "# TYPE pagespeed_event_handoff_latency_us histogram"
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  # The native fetcher hands fetches back to nginx through a pipe of its own,
+  # which the earlier tests have used plenty to have sampled some.
+  check_from "$OUT" grep -q \
+    "^pagespeed_native_fetch_event_handoff_latency_us_count [1-9]"
+fi
+check_from "$OUT" grep -q "^# EOF$"
+OUT=$($WGET_DUMP $PRIMARY_SERVER/ngx_pagespeed_metrics)
+check_from "$OUT" grep -q '^pagespeed_resource_404_count_total{vhost="[^"]*"} '
+
+start_test sharded statistics are summed when read
+COUNT_404=$(scrape_stat resource_404_count)
+URL=$EXAMPLE_ROOT/A.doesnotexist.css.pagespeed.cf.0.css
+# The 404 response makes wget exit with an error code, which we ignore.
+$WGET_DUMP $URL > /dev/null 2>&1 || true
+check test $(scrape_stat resource_404_count) -gt $COUNT_404
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher remembers failed dns lookups
+  # Origin fetches for dns-cache.example.com go to nxdomain.invalid.  The first
+  # fetch has to ask the resolver, the second one finds the failure cached.
+  MISSES=$(scrape_stat native_fetch_dns_cache_misses)
+  NEGATIVE_HITS=$(scrape_stat native_fetch_dns_cache_negative_hits)
+  URL=http://dns-cache.example.com/mod_pagespeed_example/styles
+  # The fetches fail, which makes wget exit with an error code.
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/yellow.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/blue.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+  check test $(scrape_stat native_fetch_dns_cache_misses) -gt $MISSES
+  check test $(scrape_stat native_fetch_dns_cache_negative_hits) \
+    -gt $NEGATIVE_HITS
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher sends fetches for a host to its upstream
+  # upstream-origin.example.com doesn't resolve, the fetch can only succeed
+  # through the servers of the test_origin upstream.
+  URL=http://upstream.example.com/mod_pagespeed_example/styles
+  URL+=/yellow.css.pagespeed.cf.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q "200 OK"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher fetches from IPv6 origins
+  REQUESTS=$(scrape_stat native_fetch_request_count)
+  URL=http://ipv6.example.com/mod_pagespeed_example/styles
+  URL+=/yellow.css.pagespeed.cf.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q "200 OK"
+  check test $(scrape_stat native_fetch_request_count) -gt $REQUESTS
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher shares identical fetches through shared memory
+  # Both vhosts fetch the same origin url with the same headers, the second
+  # fetch gets the response the first one left in shared memory.
+  COALESCED=$(scrape_stat native_fetch_shared_coalesced_count)
+  RESOURCE=mod_pagespeed_example/styles/yellow.css.pagespeed.cf.0.css
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    http://shared-fetch-a.example.com/$RESOURCE > /dev/null
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    http://shared-fetch-b.example.com/$RESOURCE > /dev/null
+  check test $(scrape_stat native_fetch_shared_coalesced_count) -gt $COALESCED
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher queues fetches over the per-origin limit
+  # slow-origin.example.com sends 10 bytes a second, so 40 fetches for its
+  # files keep all 32 connections the test config allows busy for a couple of
+  # seconds, and the rest of the fetches have to wait for them.
+  QUEUE_DIR="$SERVER_ROOT/fetch_queue"
+  mkdir -p "$QUEUE_DIR"
+  for i in {1..40}; do
+    echo ".queue$i { color: red; }" > "$QUEUE_DIR/queue$i.css"
+  done
+  QUEUE_TIME=$(scrape_stat native_fetch_queue_time_ms)
+  URL=http://fetch-queue.example.com/fetch_queue
+  PIDS=""
+  for i in {1..40}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/queue$i.css.pagespeed.cf.0.css > /dev/null 2>&1 &
+    PIDS+=" $!"
+  done
+  wait $PIDS || true
+  check test $(scrape_stat native_fetch_queue_time_ms) -ge \
+    $(($QUEUE_TIME + 1000))
+  # Everything that was queued got started.
+  check [ $(scrape_stat native_fetch_queued_count) -eq 0 ]
+  rm -rf "$QUEUE_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher stops fetching from a failing origin
+  # The test config opens the breaker after 5 failures in a row, and keeps it
+  # open for 5 seconds.
+  OPENED=$(scrape_stat native_fetch_circuit_breaker_opened_count)
+  REJECTED=$(scrape_stat native_fetch_circuit_breaker_rejected_count)
+  URL=http://circuit-breaker.example.com/mod_pagespeed_example/styles
+  # The fetches fail, which makes wget exit with an error code.
+  for i in {1..6}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/breaker$i.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+  done
+  check test $(scrape_stat native_fetch_circuit_breaker_opened_count) \
+    -gt $OPENED
+  check test $(scrape_stat native_fetch_circuit_breaker_rejected_count) \
+    -gt $REJECTED
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher fetches from unix socket origins
+  # unix-origin.example.com is only served on a unix socket, and the second
+  # fetch reuses the connection of the first.
+  REUSED=$(scrape_stat native_fetch_keepalive_reused_count)
+  URL=http://unix-socket.example.com/mod_pagespeed_example/styles
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/yellow.css.pagespeed.cf.0.css)
+  check_from "$OUT" fgrep -q "200 OK"
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/blue.css.pagespeed.cf.0.css)
+  check_from "$OUT" fgrep -q "200 OK"
+  check test $(scrape_stat native_fetch_keepalive_reused_count) -gt $REUSED
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher sends fetches for nginx itself over a unix socket
+  # Only loopback-socket.example.com listens on the socket, so it can only be
+  # set while this test runs.
+  LOOPBACK_DIR="$SERVER_ROOT/loopback_socket"
+  LOOPBACK_CONF_DIR="$TEST_TMP/loopback_socket"
+  LOOPBACK_LOG="$TEST_TMP/loopback_socket_access.log"
+  mkdir -p "$LOOPBACK_DIR" "$LOOPBACK_CONF_DIR"
+
+  # Requests new resources until the origin fetch for one comes in from
+  # address $2, which tells that a worker with the new config is serving.
+  function wait_for_loopback_fetch() {
+    local i
+    local url=http://loopback-socket.example.com/loopback_socket
+    for i in {1..100}; do
+      echo ".loopback$i { color: red; }" > "$LOOPBACK_DIR/$1$i.css"
+      http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+        $url/$1$i.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+      if grep -q "^$2 .*GET /loopback_socket/$1$i.css " "$LOOPBACK_LOG"; then
+        return 0
+      fi
+      sleep .1
+    done
+    return 1
+  }
+
+  echo "pagespeed NativeFetcherLoopbackUnixSocket $TEST_TMP/loopback.sock;" \
+    > "$LOOPBACK_CONF_DIR/loopback_socket.conf"
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+  check wait_for_loopback_fetch unix unix:
+
+  rm "$LOOPBACK_CONF_DIR/loopback_socket.conf"
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+  check wait_for_loopback_fetch tcp 127.0.0.1
+  rm -rf "$LOOPBACK_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetches keep working with recycled memory pools
+  # Finished fetches hand their pool on to the next ones.  Every resource
+  # has to come back with its own contents regardless.
+  POOL_DIR="$SERVER_ROOT/fetch_pool"
+  mkdir -p "$POOL_DIR"
+  REQUESTS=$(scrape_stat native_fetch_request_count)
+  URL=http://fetch-pool.example.com/fetch_pool
+  for i in $(seq -w 10 80); do
+    echo ".recycled$i { color: red; }" > "$POOL_DIR/pool$i.css"
+    OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/pool$i.css.pagespeed.cf.0.css)
+    check_from "$OUT" fgrep -q "recycled$i"
+  done
+  check test $(scrape_stat native_fetch_request_count) -ge \
+    $(($REQUESTS + 71))
+  rm -rf "$POOL_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetches end with the request that waits for them
+  # slow-origin.example.com takes 20 seconds to send these files, which is
+  # longer than both the 5 second request deadline and the 10 second fetch
+  # timeout of the test config.
+  SLOW_DIR="$SERVER_ROOT/fetch_queue"
+  mkdir -p "$SLOW_DIR"
+  for name in deadline orphan; do
+    head -c 200 /dev/zero | tr '\0' ' ' > "$SLOW_DIR/$name.css"
+  done
+  URL=http://fetch-queue.example.com/fetch_queue
+
+  # The fetch gives up at the deadline of the request.
+  TIMEOUTS=$(scrape_stat native_fetch_timeout_count)
+  START_SECONDS=$(date +%s)
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/deadline.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+  check [ $(($(date +%s) - $START_SECONDS)) -lt 9 ]
+  check test $(scrape_stat native_fetch_timeout_count) -gt $TIMEOUTS
+
+  # A client that stops waiting leaves its fetch to nobody, which cancels it.
+  ORPHANED=$(scrape_stat native_fetch_orphaned_count)
+  http_proxy=$SECONDARY_HOSTNAME $WGET -q --timeout=1 --tries=1 -O /dev/null \
+    $URL/orphan.css.pagespeed.cf.0.css || true
+  for i in {1..50}; do
+    if [ $(scrape_stat native_fetch_orphaned_count) -gt $ORPHANED ]; then
+      break
+    fi
+    sleep .1
+  done
+  check test $(scrape_stat native_fetch_orphaned_count) -gt $ORPHANED
+  rm -rf "$SLOW_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher keeps idle connections to busy origins
+  # Ten fetches in a row make 127.0.0.3 hot, and the next prewarm round, at
+  # most 5 seconds later, tops its idle connections up to the 2 the test
+  # config asks for.
+  PREWARM_DIR="$SERVER_ROOT/prewarm"
+  mkdir -p "$PREWARM_DIR"
+  for i in {1..11}; do
+    echo ".prewarm$i { color: red; }" > "$PREWARM_DIR/prewarm$i.css"
+  done
+  PREWARMED=$(scrape_stat native_fetch_prewarmed_connection_count)
+  USED=$(scrape_stat native_fetch_prewarmed_connection_used_count)
+  URL=http://prewarm.example.com/prewarm
+  for i in {1..10}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/prewarm$i.css.pagespeed.cf.0.css > /dev/null
+  done
+  for i in {1..120}; do
+    if [ $(scrape_stat native_fetch_prewarmed_connection_count) -gt \
+         $PREWARMED ]; then
+      break
+    fi
+    sleep .1
+  done
+  check test $(scrape_stat native_fetch_prewarmed_connection_count) \
+    -gt $PREWARMED
+
+  # The prewarmed connection went idle last, so the next fetch gets it.
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/prewarm11.css.pagespeed.cf.0.css > /dev/null
+  check test $(scrape_stat native_fetch_prewarmed_connection_used_count) \
+    -gt $USED
+  rm -rf "$PREWARM_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher gives up on responses too large to cache
+  # Rewriting the page fetches its 5k stylesheet, which is over the 1000
+  # bytes oversized.example.com can cache, so the fetch stops at the headers.
+  OVERSIZED_DIR="$SERVER_ROOT/oversized"
+  mkdir -p "$OVERSIZED_DIR"
+  head -c 5000 /dev/zero | tr '\0' ' ' > "$OVERSIZED_DIR/big.css"
+  echo ".big { color: red; }" >> "$OVERSIZED_DIR/big.css"
+  echo '<html><head><link rel="stylesheet" href="big.css"></head></html>' \
+    > "$OVERSIZED_DIR/index.html"
+  OVERSIZED=$(scrape_stat native_fetch_oversized_abort_count)
+  URL=http://oversized.example.com/oversized/index.html
+  for i in {1..50}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL > /dev/null
+    if [ $(scrape_stat native_fetch_oversized_abort_count) -gt \
+         $OVERSIZED ]; then
+      break
+    fi
+    sleep .1
+  done
+  check test $(scrape_stat native_fetch_oversized_abort_count) -gt $OVERSIZED
+  rm -rf "$OVERSIZED_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ] && \
+   $NGINX_EXECUTABLE -V 2>&1 | grep -q -- --with-http_v2_module; then
+  start_test native fetcher fetches over HTTP/2 with prior knowledge
+  # The origin only listens on 127.0.0.4 while this test runs, as nginx
+  # won't take its config without the http_v2 module.
+  HTTP2_DIR="$SERVER_ROOT/http2"
+  HTTP2_CONF_DIR="$TEST_TMP/http2"
+  HTTP2_LOG="$TEST_TMP/http2_access.log"
+  mkdir -p "$HTTP2_DIR" "$HTTP2_CONF_DIR"
+  for i in {1..103}; do
+    echo ".http2_$i { color: red; }" > "$HTTP2_DIR/http2_$i.css"
+  done
+  cat > "$HTTP2_CONF_DIR/http2.conf" <<EOF
+pagespeed NativeFetcherHttp2PriorKnowledge 127.0.0.4;
+server {
+  listen 127.0.0.4:$SECONDARY_PORT http2;
+  server_name http2-origin.example.com;
+  pagespeed FileCachePath "$FILE_CACHE";
+  pagespeed off;
+  access_log "$HTTP2_LOG" combined;
+}
+EOF
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+
+  # Fetches new resources until one reaches the origin over HTTP/2, which
+  # tells that a worker with the new config is serving.
+  URL=http://http2.example.com/http2
+  for i in {1..100}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/http2_$i.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+    if grep -q "GET /http2/http2_$i.css HTTP/2.0" "$HTTP2_LOG" 2> /dev/null
+    then
+      break
+    fi
+    sleep .1
+  done
+  check grep -q "GET /http2/http2_$i.css HTTP/2.0" "$HTTP2_LOG"
+
+  # The next fetches are streams of the session the last one opened.
+  STREAMS=$(scrape_stat native_fetch_http2_stream_count)
+  for i in {101..103}; do
+    OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/http2_$i.css.pagespeed.cf.0.css)
+    check_from "$OUT" fgrep -q ".http2_$i{color:red}"
+    check grep -q "GET /http2/http2_$i.css HTTP/2.0" "$HTTP2_LOG"
+  done
+  check test $(scrape_stat native_fetch_http2_session_count) -gt 0
+  check test $(scrape_stat native_fetch_http2_stream_count) -ge \
+    $((STREAMS + 3))
+
+  rm "$HTTP2_CONF_DIR/http2.conf"
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+  rm -rf "$HTTP2_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ] && \
+   $NGINX_EXECUTABLE -V 2>&1 | grep -q -- --with-http_ssl_module && \
+   command -v openssl > /dev/null; then
+  start_test native fetcher verifies and resumes TLS sessions
+  # The origin only listens while this test runs, as nginx won't take its
+  # config without the http_ssl module.  It closes every connection after
+  # the response, so each fetch has a handshake of its own.
+  TLS_DIR="$SERVER_ROOT/tls"
+  TLS_CONF_DIR="$TEST_TMP/tls"
+  TLS_LOG="$TEST_TMP/tls_access.log"
+  mkdir -p "$TLS_DIR" "$TLS_CONF_DIR"
+  for i in {1..101}; do
+    echo ".trusted_$i { color: red; }" > "$TLS_DIR/trusted_$i.css"
+  done
+  echo ".untrusted { color: red; }" > "$TLS_DIR/untrusted.css"
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+    -subj /CN=tls-origin.example.com -keyout "$TLS_CONF_DIR/origin.key" \
+    -out "$TLS_CONF_DIR/origin.crt" > /dev/null 2>&1
+  check test -s "$TLS_CONF_DIR/origin.crt"
+  cat > "$TLS_CONF_DIR/tls.conf" <<EOF
+log_format tls_origin '\$ssl_server_name \$ssl_session_reused "\$request"';
+pagespeed NativeFetcherUnixSocket tls-origin.example.com
+                                 $TEST_TMP/tls_origin.sock;
+server {
+  listen unix:$TEST_TMP/tls_origin.sock ssl;
+  server_name tls-origin.example.com;
+  ssl_certificate "$TLS_CONF_DIR/origin.crt";
+  ssl_certificate_key "$TLS_CONF_DIR/origin.key";
+  keepalive_timeout 0;
+  pagespeed FileCachePath "$FILE_CACHE";
+  pagespeed off;
+  access_log "$TLS_LOG" tls_origin;
+}
+EOF
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+
+  # Fetches new resources until one reaches the origin, which tells that a
+  # worker with the new config is serving.  The fetch named the origin in
+  # its SNI, and the worker now has a session to resume.
+  URL=http://tls-self-signed.example.com/tls
+  for i in {1..100}; do
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+      $URL/trusted_$i.css.pagespeed.cf.0.css > /dev/null 2>&1 || true
+    if grep -q "GET /tls/trusted_$i.css " "$TLS_LOG" 2> /dev/null; then
+      break
+    fi
+    sleep .1
+  done
+  check grep -q "^tls-origin.example.com .* \"GET /tls/trusted_$i.css " \
+    "$TLS_LOG"
+
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/trusted_101.css.pagespeed.cf.0.css)
+  check_from "$OUT" fgrep -q ".trusted_101{color:red}"
+  check grep -q "^tls-origin.example.com r \"GET /tls/trusted_101.css " \
+    "$TLS_LOG"
+
+  # Without allow_self_signed the fetcher hangs up after the handshake.
+  URL=http://tls.example.com/tls/untrusted.css.pagespeed.cf.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL 2>&1 || true)
+  check_not_from "$OUT" fgrep -q ".untrusted{color:red}"
+  check_not grep -q "GET /tls/untrusted.css " "$TLS_LOG"
+
+  rm "$TLS_CONF_DIR/tls.conf"
+  check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+  rm -rf "$TLS_DIR"
+fi
+
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test native fetcher counts revalidated resources
+  # The origin lets the stylesheet be cached for a second.  Once it is
+  # stale, rewriting it again fetches it with If-Modified-Since, which the
+  # origin answers with a 304.
+  REVALIDATE_DIR="$SERVER_ROOT/revalidate"
+  mkdir -p "$REVALIDATE_DIR"
+  echo ".revalidate { color: red; }" > "$REVALIDATE_DIR/revalidate.css"
+  NOT_MODIFIED=$(scrape_stat native_fetch_not_modified_count)
+  SAVED=$(scrape_stat native_fetch_not_modified_bytes_saved)
+  URL=http://revalidate.example.com/revalidate
+  URL+=/revalidate.css.pagespeed.cf.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q ".revalidate{color:red}"
+  for i in {1..50}; do
+    sleep .2
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL > /dev/null
+    if [ $(scrape_stat native_fetch_not_modified_count) -gt \
+         $NOT_MODIFIED ]; then
+      break
+    fi
+  done
+  check test $(scrape_stat native_fetch_not_modified_count) -gt $NOT_MODIFIED
+  check test $(scrape_stat native_fetch_not_modified_bytes_saved) -gt $SAVED
+  rm -rf "$REVALIDATE_DIR"
+fi
+
+start_test repeated messages are summarized
+# Each of these fetches fails, and warns about it.  The test config allows
+# 20 warnings of a kind a second, and counts the rest in a summary.
+SUMMARY="Suppressed [0-9]* similar messages"
+SUMMARIES=$(grep -c "$SUMMARY" "$ERROR_LOG" || true)
+URL=http://circuit-breaker.example.com/mod_pagespeed_example/styles
+PIDS=""
+for i in {1..40}; do
+  http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+    $URL/rate$i.css.pagespeed.cf.0.css > /dev/null 2>&1 &
+  PIDS+=" $!"
+done
+wait $PIDS || true
+for i in {1..50}; do
+  if [ $(grep -c "$SUMMARY" "$ERROR_LOG") -gt $SUMMARIES ]; then
+    break
+  fi
+  sleep .1
+done
+check [ $(grep -c "$SUMMARY" "$ERROR_LOG") -gt $SUMMARIES ]
+
 # Test that ngx_pagespeed keeps working after nginx gets a signal to reload the
 # configuration.  This is in the middle of tests so that significant work
 # happens both before and after.
@@ -1276,7 +1743,9 @@ OUT=$($WGET_DUMP -S $HEADERS $URL 2>&1)
 check_not_from "$OUT" fgrep "http://cdn1.example.com"
 check_not_from "$OUT" fgrep "http://cdn2.example.com"
 
-if [ "$NATIVE_FETCHER" != "on" ]; then
+# The native fetcher can only fetch https when nginx was built with ssl.
+if [ "$NATIVE_FETCHER" != "on" ] || \
+   $NGINX_EXECUTABLE -V 2>&1 | grep -q -- --with-http_ssl_module; then
   start_test Test that we can rewrite an HTTPS resource.
   fetch_until $TEST_ROOT/https_fetch/https_fetch.html \
    'grep -c /https_gstatic_dot_com/1.gif.pagespeed.ce' 1
@@ -1307,6 +1776,12 @@ OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP -O /dev/null -S $URL 2>&1)
 MATCHES=$(echo "$OUT" | grep -c "Server: nginx/") || true
 check [ $MATCHES -eq 1 ]
 
+start_test pagespeed variables tell what was done with a request.
+URL=http://variables.example.com/mod_pagespeed_example/
+URL+=combine_javascript2.js+combine_javascript1.js.pagespeed.jc.0.js
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP -O /dev/null -S $URL 2>&1)
+check_from "$OUT" fgrep -q "X-PageSpeed-Route: resource"
+
 start_test Override server header in html flow.
 URL=http://headers.example.com/mod_pagespeed_test/whitespace.html
 OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP -O /dev/null -S $URL 2>&1)
@@ -1456,6 +1931,15 @@ OUT=$(cat "$ERROR_LOG" \
     | grep -v "\\[warn\\].*A.blue.css.*but cannot access the original.*" \
     | grep -v "\\[warn\\].*Adding function to sequence.*" \
     | grep -v "\\[warn\\].*special-response.*foo.css.*but cannot access the original.*" \
+    | grep -v "\\[warn\\].*nxdomain.invalid.*" \
+    | grep -v "\\[error\\].*nxdomain.invalid.*" \
+    | grep -v "\\[warn\\].*127.0.0.1:1[/ ].*" \
+    | grep -v "\\[error\\].*connect() to 127.0.0.1:1 failed (111: Connection refused).*" \
+    | grep -v "\\[warn\\].*Suppressed [0-9]* similar messages.*" \
+    | grep -v "\\[warn\\].*tls-origin.example.com.*" \
+    | grep -v "\\[error\\].*tls-origin.example.com.*" \
+    | grep -v "\\[warn\\].*/tls/untrusted.css.*" \
+    | grep -v "\\[warn\\].*\"listen ... http2\" directive is deprecated.*" \
     || true)
 
 check [ -z "$OUT" ]